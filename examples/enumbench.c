@@ -0,0 +1,384 @@
+/*
+ * libusbx example program to benchmark enumeration of large topologies
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This program builds a synthetic sysfs/usbfs tree under a directory of
+ * your choice, then points each context at it with libusb_set_device_roots()
+ * and measures how long libusb_get_device_list() takes, and how many allocations it performs.
+ *
+ * The generated tree looks like:
+ *   <root>/sys/bus/usb/devices/usbB         root hub of bus B
+ *   <root>/sys/bus/usb/devices/B-P[.P...]   hubs and devices
+ *   <root>/dev/bus/usb/BBB/DDD              usbfs nodes (plain files)
+ * Every bus holds up to 127 devices, arranged as a tree of hubs with the
+ * requested fan-out.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#define MAX_DEVS_PER_BUS 127
+
+/* omit the sysfs descriptors files, forcing device initialization to go
+ * through usbfs */
+static int no_sysfs_descriptors = 0;
+
+/* libusb_set_enumeration_threads() setting */
+static int enum_threads = 0;
+
+/* libusb_set_descriptor_cache() setting */
+static const char *cache_path = NULL;
+/* roots of the tree */
+static char sysfs_path[1024];
+static char usbfs_path[1024];
+
+/* allocation counting, only available where the C library lets us wrap its
+ * allocator */
+#if defined(__GLIBC__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int counting = 0;
+static unsigned long alloc_count = 0;
+static unsigned long alloc_bytes = 0;
+
+void *malloc(size_t size)
+{
+	if (counting) {
+		alloc_count++;
+		alloc_bytes += size;
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (counting) {
+		alloc_count++;
+		alloc_bytes += nmemb * size;
+	}
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting) {
+		alloc_count++;
+		alloc_bytes += size;
+	}
+	return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+static int mkdir_p(const char *path)
+{
+	char tmp[1024];
+	char *p;
+
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	for (p = tmp + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = 0;
+		if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+static int write_file(const char *dir, const char *name, const void *data,
+	size_t len)
+{
+	char path[1024];
+	FILE *f;
+	size_t r;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	r = fwrite(data, 1, len, f);
+	fclose(f);
+	return r == len ? 0 : -1;
+}
+
+static int write_int(const char *dir, const char *name, int value)
+{
+	char buf[16];
+
+	snprintf(buf, sizeof(buf), "%d\n", value);
+	return write_file(dir, name, buf, strlen(buf));
+}
+
+/* device descriptor followed by one configuration with one interface and,
+ * for hubs, the status change endpoint */
+static size_t build_descriptors(unsigned char *buf, int bus, int devnum,
+	int is_hub)
+{
+	unsigned char *p = buf;
+	int total = 9 + 9 + (is_hub ? 7 : 0);
+
+	*p++ = 18; *p++ = LIBUSB_DT_DEVICE;
+	*p++ = 0x00; *p++ = 0x02;			/* bcdUSB 2.00 */
+	*p++ = is_hub ? LIBUSB_CLASS_HUB : 0;
+	*p++ = 0; *p++ = is_hub ? 1 : 0;
+	*p++ = 64;					/* bMaxPacketSize0 */
+	*p++ = 0x6b; *p++ = 0x1d;			/* idVendor */
+	*p++ = is_hub ? 0x02 : 0x04; *p++ = 0x00;	/* idProduct */
+	*p++ = devnum & 0xff; *p++ = bus & 0xff;	/* bcdDevice */
+	*p++ = 0; *p++ = 0; *p++ = 0;
+	*p++ = 1;					/* bNumConfigurations */
+
+	*p++ = 9; *p++ = LIBUSB_DT_CONFIG;
+	*p++ = total & 0xff; *p++ = total >> 8;
+	*p++ = 1; *p++ = 1; *p++ = 0; *p++ = 0xe0; *p++ = 0;
+
+	*p++ = 9; *p++ = LIBUSB_DT_INTERFACE;
+	*p++ = 0; *p++ = 0; *p++ = is_hub ? 1 : 0;
+	*p++ = is_hub ? LIBUSB_CLASS_HUB : LIBUSB_CLASS_VENDOR_SPEC;
+	*p++ = 0; *p++ = 0; *p++ = 0;
+
+	if (is_hub) {
+		*p++ = 7; *p++ = LIBUSB_DT_ENDPOINT;
+		*p++ = 0x81; *p++ = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		*p++ = 1; *p++ = 0; *p++ = 12;
+	}
+
+	return p - buf;
+}
+
+static int create_device(const char *root, int bus, int devnum,
+	const char *name, int is_hub)
+{
+	char dir[1024];
+	char name_buf[8];
+	unsigned char desc[64];
+	size_t len = build_descriptors(desc, bus, devnum, is_hub);
+
+	snprintf(dir, sizeof(dir), "%s/sys/bus/usb/devices/%s", root, name);
+	if (mkdir_p(dir) < 0)
+		return -1;
+	if (write_int(dir, "busnum", bus) < 0
+			|| write_int(dir, "devnum", devnum) < 0
+			|| write_int(dir, "speed", 480) < 0
+			|| write_int(dir, "bConfigurationValue", 1) < 0)
+		return -1;
+	if (!no_sysfs_descriptors
+			&& write_file(dir, "descriptors", desc, len) < 0)
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s/dev/bus/usb/%03d", root, bus);
+	if (mkdir_p(dir) < 0)
+		return -1;
+	snprintf(name_buf, sizeof(name_buf), "%03d", devnum);
+	return write_file(dir, name_buf, desc, len);
+}
+
+/* node 0 is the root hub; the parent of node i is node (i - 1) / fanout */
+static void node_name(char *buf, size_t len, int bus, int node, int fanout)
+{
+	int ports[MAX_DEVS_PER_BUS];
+	int depth = 0;
+	size_t off;
+
+	if (node == 0) {
+		snprintf(buf, len, "usb%d", bus);
+		return;
+	}
+
+	while (node > 0) {
+		ports[depth++] = (node - 1) % fanout + 1;
+		node = (node - 1) / fanout;
+	}
+
+	off = snprintf(buf, len, "%d-%d", bus, ports[--depth]);
+	while (depth > 0 && off < len)
+		off += snprintf(buf + off, len - off, ".%d", ports[--depth]);
+}
+
+static int generate(const char *root, int num_devs, int fanout)
+{
+	char name[64];
+	int bus = 0;
+
+	while (num_devs > 0) {
+		int n = num_devs < MAX_DEVS_PER_BUS ? num_devs : MAX_DEVS_PER_BUS;
+		int i;
+
+		bus++;
+		for (i = 0; i < n; i++) {
+			node_name(name, sizeof(name), bus, i, fanout);
+			if (create_device(root, bus, i + 1, name,
+					i * fanout + 1 < n) < 0)
+				return -1;
+		}
+		num_devs -= n;
+	}
+
+	printf("generated %d buses under %s\n", bus, root);
+	return 0;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* enumerate once on a fresh context (cold) and once more on the same
+ * context (warm, devices already known) */
+static int bench_once(double *cold, double *warm, unsigned long *cold_allocs,
+	ssize_t *cnt)
+{
+	libusb_context *ctx;
+	libusb_device **devs, **devs2;
+	double start;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r < 0)
+		return r;
+	r = libusb_set_device_roots(ctx, usbfs_path, sysfs_path);
+	if (r < 0) {
+		libusb_exit(ctx);
+		return r;
+	}
+	libusb_set_enumeration_threads(ctx, enum_threads);
+	libusb_set_descriptor_cache(ctx, cache_path);
+
+#if HAVE_ALLOC_COUNT
+	alloc_count = 0;
+	alloc_bytes = 0;
+	counting = 1;
+#endif
+	start = now_ms();
+	*cnt = libusb_get_device_list(ctx, &devs);
+	*cold = now_ms() - start;
+#if HAVE_ALLOC_COUNT
+	counting = 0;
+	*cold_allocs = alloc_count;
+#else
+	*cold_allocs = 0;
+#endif
+	if (*cnt < 0) {
+		libusb_exit(ctx);
+		return (int) *cnt;
+	}
+
+	/* keep the first list alive so that its devices are reused */
+	start = now_ms();
+	*cnt = libusb_get_device_list(ctx, &devs2);
+	*warm = now_ms() - start;
+	if (*cnt >= 0)
+		libusb_free_device_list(devs2, 1);
+
+	libusb_free_device_list(devs, 1);
+	libusb_exit(ctx);
+	return *cnt < 0 ? (int) *cnt : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-g] [-D] [-n devices] [-f fanout]"
+		" [-i iterations] [-t threads] [-c cache] <root>\n", prog);
+	fprintf(stderr, "  -g  generate a synthetic tree under <root> first\n");
+	fprintf(stderr, "  -D  generate without sysfs descriptors files\n");
+	fprintf(stderr, "  -t  number of enumeration threads\n");
+	fprintf(stderr, "  -c  descriptor cache file to use\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *root;
+	int gen = 0, num_devs = 2000, fanout = 4, iterations = 10;
+	double cold = 0, warm = 0, cold_sum = 0, warm_sum = 0, cold_min = 0;
+	unsigned long allocs = 0;
+	ssize_t cnt = 0;
+	int i, opt, r;
+
+	while ((opt = getopt(argc, argv, "gDn:f:i:t:c:")) != -1) {
+		switch (opt) {
+		case 'g': gen = 1; break;
+		case 'D': no_sysfs_descriptors = 1; break;
+		case 't': enum_threads = atoi(optarg); break;
+		case 'c': cache_path = optarg; break;
+		case 'n': num_devs = atoi(optarg); break;
+		case 'f': fanout = atoi(optarg); break;
+		case 'i': iterations = atoi(optarg); break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc - 1 || num_devs < 1 || fanout < 1 || iterations < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	root = argv[optind];
+
+	if (gen && generate(root, num_devs, fanout) < 0) {
+		fprintf(stderr, "failed to generate tree under %s\n", root);
+		return 1;
+	}
+
+	snprintf(sysfs_path, sizeof(sysfs_path), "%s/sys/bus/usb/devices", root);
+	snprintf(usbfs_path, sizeof(usbfs_path), "%s/dev/bus/usb", root);
+
+	for (i = 0; i < iterations; i++) {
+		r = bench_once(&cold, &warm, &allocs, &cnt);
+		if (r < 0) {
+			fprintf(stderr, "enumeration failed: %s\n", libusb_error_name(r));
+			return 1;
+		}
+		cold_sum += cold;
+		warm_sum += warm;
+		if (i == 0 || cold < cold_min)
+			cold_min = cold;
+	}
+
+	printf("devices:     %d\n", (int) cnt);
+	printf("cold:        %.3f ms avg, %.3f ms min\n", cold_sum / iterations,
+		cold_min);
+	printf("warm:        %.3f ms avg\n", warm_sum / iterations);
+#if HAVE_ALLOC_COUNT
+	printf("allocations: %lu per cold enumeration (%.1f per device, "
+		"%lu bytes)\n", allocs, cnt ? (double) allocs / cnt : 0.0,
+		alloc_bytes);
+#else
+	printf("allocations: not available on this platform\n");
+#endif
+
+	return 0;
+}
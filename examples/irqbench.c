@@ -0,0 +1,371 @@
+/*
+ * libusbx example program to measure interrupt latency under bulk load
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This program keeps a bulk IN endpoint busy with a queue of transfers,
+ * whose callbacks spend a configurable time processing the data, while an
+ * interrupt IN endpoint (of the same device or another one) is polled with
+ * one transfer at a time. For each interrupt completion it records the time
+ * from the reap of the URB to the invocation of the callback, which is what
+ * the event loop adds, and from the submission to the callback.
+ *
+ * The measurement runs twice: with the interrupt endpoint at normal
+ * priority, then at high priority (libusb_set_endpoint_priority()), and
+ * reports latency percentiles and the bulk throughput of each run, the
+ * latter to show that bulk is not starved.
+ *
+ * With -S, it runs against the simulated device of usbsim.c, built under
+ * the given directory, whose bulk IN endpoint moves 400 MB/s and whose
+ * interrupt IN endpoint completes every 125 us.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+#include "usbsim.h"
+
+struct bench {
+	libusb_device_handle *bulk_handle;
+	libusb_device_handle *intr_handle;
+	unsigned char bulk_ep;
+	unsigned char intr_ep;
+	int bulk_size;
+	int work_us;
+
+	/* interrupt latencies of the current run, in microseconds */
+	double *reap_lat;
+	double *submit_lat;
+	int samples;
+	int max_samples;
+
+	unsigned long long bulk_bytes;
+	int bulk_inflight;
+	int intr_inflight;
+	int stopping;
+	int error;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/* stand in for the processing an application does on bulk data */
+static void spin_us(int us)
+{
+	double end = now_us() + us;
+
+	while (now_us() < end)
+		;
+}
+
+static void LIBUSB_CALL bulk_cb(struct libusb_transfer *transfer)
+{
+	struct bench *b = transfer->user_data;
+
+	b->bulk_inflight--;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !b->error)
+			b->error = LIBUSB_ERROR_IO;
+		return;
+	}
+	b->bulk_bytes += transfer->actual_length;
+	spin_us(b->work_us);
+	if (b->stopping)
+		return;
+	if (libusb_submit_transfer(transfer) == 0)
+		b->bulk_inflight++;
+}
+
+static void LIBUSB_CALL intr_cb(struct libusb_transfer *transfer)
+{
+	struct bench *b = transfer->user_data;
+	uint64_t submit = libusb_get_transfer_submit_time(transfer);
+	uint64_t reap = libusb_get_transfer_reap_time(transfer);
+	uint64_t callback = libusb_get_transfer_callback_time(transfer);
+
+	b->intr_inflight = 0;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !b->error)
+			b->error = LIBUSB_ERROR_IO;
+		b->stopping = 1;
+		return;
+	}
+	if (b->samples < b->max_samples) {
+		b->reap_lat[b->samples] = reap ? (callback - reap) / 1000.0 : 0;
+		b->submit_lat[b->samples] = (callback - submit) / 1000.0;
+		b->samples++;
+	}
+	if (b->samples >= b->max_samples) {
+		b->stopping = 1;
+		return;
+	}
+	if (libusb_submit_transfer(transfer) == 0)
+		b->intr_inflight = 1;
+	else
+		b->stopping = 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, double *lat, int n)
+{
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	printf("  %-18s p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", what,
+		lat[n / 2], lat[n * 99 / 100], lat[n - 1]);
+}
+
+static int run(struct bench *b, int priority, int queue_depth)
+{
+	struct libusb_transfer **bulk;
+	struct libusb_transfer *intr;
+	unsigned char intr_buf[1024];
+	unsigned char *buf;
+	double start, elapsed = 0;
+	int i, r;
+
+	r = libusb_set_endpoint_priority(b->intr_handle, b->intr_ep, priority);
+	if (r < 0)
+		return r;
+
+	b->samples = 0;
+	b->bulk_bytes = 0;
+	b->bulk_inflight = 0;
+	b->intr_inflight = 0;
+	b->stopping = 0;
+	b->error = 0;
+
+	bulk = calloc(queue_depth, sizeof(*bulk));
+	intr = libusb_alloc_transfer(0);
+	if (!bulk || !intr) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	start = now_us();
+	for (i = 0; i < queue_depth; i++) {
+		bulk[i] = libusb_alloc_transfer(0);
+		buf = malloc(b->bulk_size);
+		if (!bulk[i] || !buf) {
+			free(buf);
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(bulk[i], b->bulk_handle, b->bulk_ep,
+			buf, b->bulk_size, bulk_cb, b, 0);
+		bulk[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		r = libusb_submit_transfer(bulk[i]);
+		if (r < 0)
+			goto out;
+		b->bulk_inflight++;
+	}
+
+	libusb_fill_interrupt_transfer(intr, b->intr_handle, b->intr_ep,
+		intr_buf, sizeof(intr_buf), intr_cb, b, 0);
+	r = libusb_submit_transfer(intr);
+	if (r < 0)
+		goto out;
+	b->intr_inflight = 1;
+
+	while (!b->stopping)
+		libusb_handle_events(NULL);
+	elapsed = now_us() - start;
+
+out:
+	/* whatever happened, nothing may be left in flight */
+	b->stopping = 1;
+	if (bulk) {
+		for (i = 0; i < queue_depth; i++) {
+			if (bulk[i])
+				libusb_cancel_transfer(bulk[i]);
+		}
+	}
+	if (b->intr_inflight)
+		libusb_cancel_transfer(intr);
+	while (b->bulk_inflight > 0 || b->intr_inflight)
+		libusb_handle_events(NULL);
+	if (bulk) {
+		for (i = 0; i < queue_depth; i++)
+			libusb_free_transfer(bulk[i]);
+	}
+	libusb_free_transfer(intr);
+	free(bulk);
+
+	if (r < 0)
+		return r;
+	if (b->error)
+		return b->error;
+
+	printf("%s priority: %d interrupt samples, bulk %.1f MB/s\n",
+		priority == LIBUSB_PRIORITY_HIGH ? "high" : "normal", b->samples,
+		b->bulk_bytes / elapsed);
+	report("reap to callback", b->reap_lat, b->samples);
+	report("submit to callback", b->submit_lat, b->samples);
+	return 0;
+}
+
+static libusb_device_handle *open_device(const char *id, int iface)
+{
+	libusb_device_handle *handle;
+	unsigned int vid, pid;
+
+	if (sscanf(id, "%x:%x", &vid, &pid) != 2)
+		return NULL;
+	handle = libusb_open_device_with_vid_pid(NULL, (uint16_t) vid,
+		(uint16_t) pid);
+	if (handle && libusb_claim_interface(handle, iface) < 0) {
+		libusb_close(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-D vid:pid] [-I iface] [-n depth] [-s size]"
+		" [-w work_us] [-c samples] vid:pid iface bulk_ep intr_ep\n", prog);
+	fprintf(stderr, "       %s [-n depth] [-s size] [-w work_us]"
+		" [-c samples] -S dir\n", prog);
+	fprintf(stderr, "  -D  device of the interrupt endpoint, if not the"
+		" bulk one\n");
+	fprintf(stderr, "  -I  interface of the interrupt endpoint on that"
+		" device\n");
+	fprintf(stderr, "  -n  bulk transfers in flight (default 16)\n");
+	fprintf(stderr, "  -s  bulk transfer size (default 16384)\n");
+	fprintf(stderr, "  -w  microseconds spent in each bulk callback"
+		" (default 20)\n");
+	fprintf(stderr, "  -c  interrupt samples per run (default 1000)\n");
+	fprintf(stderr, "  -S  build and use a simulated device under dir\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	const char *intr_dev = NULL;
+	const char *sim_dir = NULL;
+	char sim_id[16];
+	const char *bulk_dev;
+	int bulk_iface;
+	int intr_iface = 0, queue_depth = 16;
+	int opt, r;
+
+	memset(&b, 0, sizeof(b));
+	b.bulk_size = 16384;
+	b.work_us = 20;
+	b.max_samples = 1000;
+
+	while ((opt = getopt(argc, argv, "D:I:n:s:w:c:S:")) != -1) {
+		switch (opt) {
+		case 'D': intr_dev = optarg; break;
+		case 'I': intr_iface = atoi(optarg); break;
+		case 'n': queue_depth = atoi(optarg); break;
+		case 's': b.bulk_size = atoi(optarg); break;
+		case 'w': b.work_us = atoi(optarg); break;
+		case 'c': b.max_samples = atoi(optarg); break;
+		case 'S': sim_dir = optarg; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc - (sim_dir ? 0 : 4) || (sim_dir && intr_dev)
+			|| queue_depth < 1 || b.bulk_size < 1 || b.work_us < 0
+			|| b.max_samples < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (sim_dir) {
+		snprintf(sim_id, sizeof(sim_id), "%04x:%04x", USBSIM_VID,
+			USBSIM_PID);
+		bulk_dev = sim_id;
+		bulk_iface = USBSIM_INTERFACE;
+		b.bulk_ep = USBSIM_BULK_IN;
+		b.intr_ep = USBSIM_INTR_IN;
+	} else {
+		bulk_dev = argv[optind];
+		bulk_iface = atoi(argv[optind + 1]);
+		b.bulk_ep = (unsigned char) strtol(argv[optind + 2], NULL, 16);
+		b.intr_ep = (unsigned char) strtol(argv[optind + 3], NULL, 16);
+	}
+
+	b.reap_lat = calloc(b.max_samples, sizeof(double));
+	b.submit_lat = calloc(b.max_samples, sizeof(double));
+	if (!b.reap_lat || !b.submit_lat) {
+		free(b.reap_lat);
+		free(b.submit_lat);
+		return 1;
+	}
+
+	r = libusb_init(NULL);
+	if (r < 0) {
+		free(b.reap_lat);
+		free(b.submit_lat);
+		return 1;
+	}
+	if (sim_dir && usbsim_create(NULL, sim_dir) < 0) {
+		fprintf(stderr, "could not create the simulated device under %s\n",
+			sim_dir);
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	b.bulk_handle = open_device(bulk_dev, bulk_iface);
+	if (!b.bulk_handle) {
+		fprintf(stderr, "could not open and claim %s\n", bulk_dev);
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+	if (intr_dev) {
+		b.intr_handle = open_device(intr_dev, intr_iface);
+		if (!b.intr_handle) {
+			fprintf(stderr, "could not open and claim %s\n", intr_dev);
+			r = LIBUSB_ERROR_NOT_FOUND;
+			goto out;
+		}
+	} else {
+		b.intr_handle = b.bulk_handle;
+	}
+
+	printf("bulk %02x: %d x %d bytes, %d us per callback; interrupt %02x\n",
+		b.bulk_ep, queue_depth, b.bulk_size, b.work_us, b.intr_ep);
+	r = run(&b, LIBUSB_PRIORITY_NORMAL, queue_depth);
+	if (r == 0)
+		r = run(&b, LIBUSB_PRIORITY_HIGH, queue_depth);
+	if (r < 0)
+		fprintf(stderr, "run failed: %s\n", libusb_error_name(r));
+
+out:
+	if (b.intr_handle && b.intr_handle != b.bulk_handle)
+		libusb_close(b.intr_handle);
+	if (b.bulk_handle)
+		libusb_close(b.bulk_handle);
+	libusb_exit(NULL);
+	free(b.reap_lat);
+	free(b.submit_lat);
+	return r < 0;
+}
@@ -0,0 +1,701 @@
+/*
+ * libusbx example program to replay a transfer trace through a simulated
+ * device
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This program reads a trace written by libusb_trace_dump() and replays
+ * the recorded transfers through libusbx, against an in-process simulated
+ * backend instead of real hardware. Each transfer is submitted at the time
+ * it was originally submitted, and the simulated device completes it after
+ * the originally observed delay, with the original status and length.
+ *
+ * Since the device side is simulated, what is measured is libusbx's own
+ * cost: CPU time of the submitting/event handling thread per transfer, time
+ * spent in libusb_submit_transfer(), and the latency between the device
+ * completing a transfer and its callback being invoked.
+ *
+ * With -f, recorded timings are ignored: transfers complete immediately and
+ * are submitted as fast as possible, up to -q at a time, which measures
+ * throughput.
+ *
+ * The simulated backend replaces the OS backend through
+ * usbi_set_test_backend(), so this program uses the library's internal
+ * header and links against its test build, libusb-1.0-test.la.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusbi.h"
+
+struct replay_op {
+	/* from the trace, in ns relative to the first submission */
+	uint64_t submit_at;
+	uint64_t delay;
+	uint8_t endpoint;
+	uint8_t type;
+	uint32_t length;
+	uint32_t actual_length;
+	int status;
+
+	/* measured during replay, in monotonic ns */
+	uint64_t submitted;
+	uint64_t submit_cost;
+	uint64_t device_done;
+	uint64_t delivered;
+
+	/* device queues */
+	uint64_t due;
+	struct usbi_transfer *itransfer;
+	struct replay_op *next;
+};
+
+static int fast = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* simulated device:
+ * submitted transfers wait on the pending list, sorted by due time, until
+ * the device thread completes them; completed transfers are moved to the
+ * done list and a byte is written to the pipe, which the backend polls. */
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int stop;
+	int pipe[2];
+	struct replay_op *pending;
+	struct replay_op *done;
+	struct replay_op **done_tail;
+} sim;
+
+static void *sim_device_thread(void *arg)
+{
+	unsigned char dummy = 1;
+
+	(void) arg;
+	pthread_mutex_lock(&sim.lock);
+	while (!sim.stop) {
+		struct replay_op *op = sim.pending;
+		uint64_t now;
+
+		if (!op) {
+			pthread_cond_wait(&sim.cond, &sim.lock);
+			continue;
+		}
+
+		now = now_ns();
+		if (op->due > now) {
+			struct timespec ts;
+			ts.tv_sec = op->due / 1000000000;
+			ts.tv_nsec = op->due % 1000000000;
+			pthread_cond_timedwait(&sim.cond, &sim.lock, &ts);
+			continue;
+		}
+
+		sim.pending = op->next;
+		op->next = NULL;
+		op->device_done = now;
+		*sim.done_tail = op;
+		sim.done_tail = &op->next;
+		if (write(sim.pipe[1], &dummy, 1) != 1)
+			perror("write");
+	}
+	pthread_mutex_unlock(&sim.lock);
+
+	return NULL;
+}
+
+static int sim_start(void)
+{
+	pthread_condattr_t attr;
+
+	if (pipe(sim.pipe) < 0)
+		return -1;
+	pthread_mutex_init(&sim.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	sim.done_tail = &sim.done;
+	return pthread_create(&sim.thread, NULL, sim_device_thread, NULL);
+}
+
+static void sim_stop(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.stop = 1;
+	pthread_cond_signal(&sim.cond);
+	pthread_mutex_unlock(&sim.lock);
+	pthread_join(sim.thread, NULL);
+	close(sim.pipe[0]);
+	close(sim.pipe[1]);
+}
+
+/* simulated backend */
+
+static const unsigned char sim_device_desc[DEVICE_DESC_LENGTH] = {
+	0x12, LIBUSB_DT_DEVICE, 0x00, 0x02, 0xff, 0x00, 0x00, 0x40,
+	0x6b, 0x1d, 0x04, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char sim_config_desc[] = {
+	0x09, LIBUSB_DT_CONFIG, 0x09, 0x00, 0x00, 0x01, 0x00, 0x80, 0x32
+};
+
+static int sim_get_device_list(struct libusb_context *ctx,
+	struct discovered_devs **discdevs)
+{
+	struct discovered_devs *ddd;
+	struct libusb_device *dev;
+	unsigned long session_id = 1;
+	int r = 0;
+
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (!dev) {
+		dev = usbi_alloc_device(ctx, session_id);
+		if (!dev)
+			return LIBUSB_ERROR_NO_MEM;
+		dev->bus_number = 1;
+		dev->device_address = 1;
+		r = usbi_sanitize_device(dev);
+	}
+	if (r == 0) {
+		ddd = discovered_devs_append(*discdevs, dev);
+		if (!ddd)
+			r = LIBUSB_ERROR_NO_MEM;
+		else
+			*discdevs = ddd;
+	}
+	libusb_unref_device(dev);
+	return r;
+}
+
+static int sim_open(struct libusb_device_handle *handle)
+{
+	return usbi_add_pollfd(HANDLE_CTX(handle), sim.pipe[0], POLLIN);
+}
+
+static void sim_close(struct libusb_device_handle *handle)
+{
+	usbi_remove_pollfd(HANDLE_CTX(handle), sim.pipe[0]);
+}
+
+static int sim_get_device_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, int *host_endian)
+{
+	(void) dev;
+	*host_endian = 0;
+	memcpy(buffer, sim_device_desc, DEVICE_DESC_LENGTH);
+	return 0;
+}
+
+static int sim_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, unsigned char *buffer, size_t len,
+	int *host_endian)
+{
+	(void) dev;
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	*host_endian = 0;
+	memcpy(buffer, sim_config_desc, MIN(len, sizeof(sim_config_desc)));
+	return 0;
+}
+
+static int sim_get_active_config_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, size_t len, int *host_endian)
+{
+	return sim_get_config_descriptor(dev, 0, buffer, len, host_endian);
+}
+
+static int sim_get_configuration(struct libusb_device_handle *handle,
+	int *config)
+{
+	(void) handle;
+	*config = 1;
+	return 0;
+}
+
+static int sim_handle_op(struct libusb_device_handle *handle, int arg)
+{
+	(void) handle;
+	(void) arg;
+	return 0;
+}
+
+static int sim_set_interface_altsetting(struct libusb_device_handle *handle,
+	int interface_number, int altsetting)
+{
+	(void) handle;
+	(void) interface_number;
+	(void) altsetting;
+	return 0;
+}
+
+static int sim_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	(void) handle;
+	(void) endpoint;
+	return 0;
+}
+
+static int sim_reset_device(struct libusb_device_handle *handle)
+{
+	(void) handle;
+	return 0;
+}
+
+static int sim_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct replay_op *op = transfer->user_data;
+	struct replay_op **pp;
+
+	op->itransfer = itransfer;
+	op->due = now_ns() + (fast ? 0 : op->delay);
+
+	pthread_mutex_lock(&sim.lock);
+	for (pp = &sim.pending; *pp && (*pp)->due <= op->due; pp = &(*pp)->next)
+		;
+	op->next = *pp;
+	*pp = op;
+	pthread_cond_signal(&sim.cond);
+	pthread_mutex_unlock(&sim.lock);
+	return 0;
+}
+
+static int sim_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	(void) itransfer;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static void sim_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	(void) itransfer;
+}
+
+static int sim_handle_events(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
+{
+	struct replay_op *op, *done;
+	unsigned char dummy;
+	POLL_NFDS_TYPE i;
+
+	(void) ctx;
+	(void) num_ready;
+	for (i = 0; i < nfds; i++)
+		if (fds[i].fd == sim.pipe[0] && fds[i].revents)
+			break;
+	if (i == nfds)
+		return 0;
+
+	pthread_mutex_lock(&sim.lock);
+	done = sim.done;
+	sim.done = NULL;
+	sim.done_tail = &sim.done;
+	for (op = done; op; op = op->next)
+		if (read(sim.pipe[0], &dummy, 1) != 1)
+			perror("read");
+	pthread_mutex_unlock(&sim.lock);
+
+	while (done) {
+		op = done;
+		done = op->next;
+		op->itransfer->transferred = op->actual_length;
+		usbi_handle_transfer_completion(op->itransfer, op->status);
+	}
+
+	return 0;
+}
+
+static int sim_clock_gettime(int clkid, struct timespec *tp)
+{
+	switch (clkid) {
+	case USBI_CLOCK_MONOTONIC:
+		return clock_gettime(CLOCK_MONOTONIC, tp);
+	case USBI_CLOCK_REALTIME:
+		return clock_gettime(CLOCK_REALTIME, tp);
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static clockid_t sim_get_timerfd_clockid(void)
+{
+	return CLOCK_MONOTONIC;
+}
+#endif
+
+static const struct usbi_os_backend sim_backend = {
+	.name = "Simulated device",
+	.get_device_list = sim_get_device_list,
+	.open = sim_open,
+	.close = sim_close,
+	.get_device_descriptor = sim_get_device_descriptor,
+	.get_active_config_descriptor = sim_get_active_config_descriptor,
+	.get_config_descriptor = sim_get_config_descriptor,
+	.get_configuration = sim_get_configuration,
+	.set_configuration = sim_handle_op,
+	.claim_interface = sim_handle_op,
+	.release_interface = sim_handle_op,
+	.set_interface_altsetting = sim_set_interface_altsetting,
+	.clear_halt = sim_clear_halt,
+	.reset_device = sim_reset_device,
+	.submit_transfer = sim_submit_transfer,
+	.cancel_transfer = sim_cancel_transfer,
+	.clear_transfer_priv = sim_clear_transfer_priv,
+	.handle_events = sim_handle_events,
+	.clock_gettime = sim_clock_gettime,
+#ifdef USBI_TIMERFD_AVAILABLE
+	.get_timerfd_clockid = sim_get_timerfd_clockid,
+#endif
+};
+
+/* trace loading */
+
+static int compare_by_transfer(const void *a, const void *b)
+{
+	const struct libusb_trace_event *ea = a;
+	const struct libusb_trace_event *eb = b;
+
+	if (ea->transfer != eb->transfer)
+		return ea->transfer < eb->transfer ? -1 : 1;
+	if (ea->timestamp != eb->timestamp)
+		return ea->timestamp < eb->timestamp ? -1 : 1;
+	return 0;
+}
+
+static int compare_by_submit(const void *a, const void *b)
+{
+	const struct replay_op *oa = a;
+	const struct replay_op *ob = b;
+
+	if (oa->submit_at != ob->submit_at)
+		return oa->submit_at < ob->submit_at ? -1 : 1;
+	return 0;
+}
+
+/* pair each successful submission with the completion that follows it */
+static struct replay_op *load_trace(const char *path, size_t *num_ops)
+{
+	struct libusb_trace_header header;
+	struct libusb_trace_event *events;
+	struct replay_op *ops;
+	const struct libusb_trace_event *submit = NULL;
+	uint64_t first = UINT64_MAX;
+	size_t i, n = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1
+			|| memcmp(header.magic, LIBUSB_TRACE_MAGIC, sizeof(header.magic))
+			|| header.version != LIBUSB_TRACE_VERSION
+			|| header.event_size != sizeof(struct libusb_trace_event)) {
+		fprintf(stderr, "%s: not a libusbx trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	events = malloc((header.num_events + 1) * sizeof(*events));
+	ops = malloc((header.num_events + 1) * sizeof(*ops));
+	if (!events || !ops) {
+		fprintf(stderr, "out of memory\n");
+		goto err;
+	}
+	if (fread(events, sizeof(*events), header.num_events, f)
+			!= header.num_events) {
+		fprintf(stderr, "%s: truncated trace\n", path);
+		goto err;
+	}
+	fclose(f);
+	f = NULL;
+
+	qsort(events, header.num_events, sizeof(*events), compare_by_transfer);
+	for (i = 0; i < header.num_events; i++) {
+		const struct libusb_trace_event *e = &events[i];
+
+		if (submit && submit->transfer != e->transfer)
+			submit = NULL;
+
+		if (e->type == LIBUSB_TRACE_SUBMIT) {
+			submit = e->status == 0 ? e : NULL;
+		} else if (e->type == LIBUSB_TRACE_SUBMIT_ERROR) {
+			submit = NULL;
+		} else if (e->type == LIBUSB_TRACE_COMPLETE && submit) {
+			struct replay_op *op = &ops[n++];
+
+			memset(op, 0, sizeof(*op));
+			op->submit_at = submit->timestamp;
+			op->delay = e->timestamp - submit->timestamp;
+			op->endpoint = submit->endpoint;
+			op->type = submit->transfer_type;
+			op->length = submit->length;
+			op->actual_length = MIN(e->length, submit->length);
+			op->status = e->status;
+			if (op->submit_at < first)
+				first = op->submit_at;
+			submit = NULL;
+		}
+	}
+	free(events);
+
+	for (i = 0; i < n; i++)
+		ops[i].submit_at -= first;
+	qsort(ops, n, sizeof(*ops), compare_by_submit);
+
+	*num_ops = n;
+	return ops;
+
+err:
+	if (f)
+		fclose(f);
+	free(events);
+	free(ops);
+	return NULL;
+}
+
+/* replay */
+
+static int in_flight = 0;
+
+static void LIBUSB_CALL replay_cb(struct libusb_transfer *transfer)
+{
+	struct replay_op *op = transfer->user_data;
+
+	op->delivered = now_ns();
+	in_flight--;
+	libusb_free_transfer(transfer);
+}
+
+static int submit_op(libusb_device_handle *handle, struct replay_op *op)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	uint64_t t;
+	int r;
+
+	transfer = libusb_alloc_transfer(0);
+	buffer = calloc(1, op->length ? op->length : 1);
+	if (!transfer || !buffer) {
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	transfer->dev_handle = handle;
+	transfer->endpoint = op->endpoint;
+	transfer->type = op->type;
+	transfer->timeout = 0;
+	transfer->buffer = buffer;
+	transfer->length = op->length;
+	transfer->user_data = op;
+	transfer->callback = replay_cb;
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	t = now_ns();
+	r = libusb_submit_transfer(transfer);
+	op->submitted = t;
+	op->submit_cost = now_ns() - t;
+	if (r < 0) {
+		libusb_free_transfer(transfer);
+		return r;
+	}
+	in_flight++;
+	return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *) a;
+	uint64_t ub = *(const uint64_t *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static void print_stats(const char *name, uint64_t *v, size_t n)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	if (n == 0)
+		return;
+	qsort(v, n, sizeof(*v), compare_u64);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	printf("%-16s avg %8.2f  p50 %8.2f  p99 %8.2f  max %8.2f us\n", name,
+		sum / 1000.0 / n, v[n / 2] / 1000.0, v[n * 99 / 100] / 1000.0,
+		v[n - 1] / 1000.0);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-f] [-q depth] trace-file\n"
+		"  -f        ignore recorded timings, replay as fast as possible\n"
+		"  -q depth  maximum transfers in flight with -f (default 32)\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_context *ctx;
+	libusb_device **list;
+	libusb_device_handle *handle;
+	struct replay_op *ops;
+	uint64_t *samples;
+	uint64_t start, end, cpu;
+	size_t num_ops, i, next = 0;
+	int depth = 32;
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "fq:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || depth < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ops = load_trace(argv[optind], &num_ops);
+	if (!ops)
+		return 1;
+	if (num_ops == 0) {
+		fprintf(stderr, "no completed transfers in trace\n");
+		return 1;
+	}
+	samples = malloc(num_ops * sizeof(*samples));
+	if (!samples || sim_start() != 0) {
+		fprintf(stderr, "setup failed\n");
+		return 1;
+	}
+
+	usbi_set_test_backend(&sim_backend);
+	r = libusb_init(&ctx);
+	if (r < 0)
+		return 1;
+	if (libusb_get_device_list(ctx, &list) < 1
+			|| libusb_open(list[0], &handle) < 0) {
+		fprintf(stderr, "simulated device setup failed\n");
+		return 1;
+	}
+	libusb_free_device_list(list, 1);
+
+	printf("replaying %lu transfers%s\n", (unsigned long) num_ops,
+		fast ? " as fast as possible" : "");
+
+	start = now_ns();
+	cpu = thread_cpu_ns();
+	while (next < num_ops || in_flight) {
+		struct timeval tv = { 1, 0 };
+
+		if (next < num_ops) {
+			if (fast) {
+				if (in_flight < depth) {
+					r = submit_op(handle, &ops[next++]);
+					if (r < 0)
+						break;
+					continue;
+				}
+			} else {
+				uint64_t due = start + ops[next].submit_at;
+				uint64_t now = now_ns();
+
+				if (now >= due) {
+					r = submit_op(handle, &ops[next++]);
+					if (r < 0)
+						break;
+					continue;
+				}
+				tv.tv_sec = (due - now) / 1000000000;
+				tv.tv_usec = (due - now) % 1000000000 / 1000;
+			}
+		}
+
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r < 0)
+			break;
+	}
+	cpu = thread_cpu_ns() - cpu;
+	end = now_ns();
+
+	if (r < 0) {
+		fprintf(stderr, "replay failed: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	printf("wall time        %.3f ms\n", (end - start) / 1e6);
+	printf("cpu per transfer %.2f us (submitting and event handling "
+		"thread)\n", cpu / 1000.0 / num_ops);
+	for (i = 0; i < num_ops; i++)
+		samples[i] = ops[i].submit_cost;
+	print_stats("submit", samples, num_ops);
+	for (i = 0; i < num_ops; i++)
+		samples[i] = ops[i].delivered - ops[i].device_done;
+	print_stats("completion", samples, num_ops);
+	if (!fast) {
+		for (i = 0; i < num_ops; i++)
+			samples[i] = ops[i].submitted - (start + ops[i].submit_at);
+		print_stats("submit lateness", samples, num_ops);
+	}
+
+	libusb_close(handle);
+	libusb_exit(ctx);
+	sim_stop();
+	free(samples);
+	free(ops);
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * libusbx example program to exercise bulk streams
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This program allocates streams on a bulk IN and a bulk OUT endpoint with
+ * libusb_alloc_streams(), submits transfers on every stream of both, checks
+ * that each completes in full on the stream it was submitted to, checks
+ * that a transfer on a stream beyond those allocated is rejected, and frees
+ * the streams with libusb_free_streams(). It exits with status 0 if all of
+ * this worked.
+ *
+ * With -S, it runs against the simulated device of usbsim.c, built under
+ * the given directory, which completes the streams out of order and fills
+ * IN data with the stream ID, which is then checked as well. Otherwise it
+ * needs a SuperSpeed device with streams capable endpoints.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+#include "usbsim.h"
+
+struct streams_test {
+	int simulated;
+	int pending;
+	int completed;
+	int failed;
+};
+
+struct stream_transfer {
+	struct streams_test *t;
+	uint32_t stream_id;
+};
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_transfer *st = transfer->user_data;
+	struct streams_test *t = st->t;
+	uint32_t stream_id = st->stream_id;
+	int i;
+
+	t->pending--;
+	t->completed++;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED
+			|| transfer->actual_length != transfer->length
+			|| libusb_transfer_get_stream_id(transfer) != stream_id) {
+		t->failed++;
+		return;
+	}
+	if (!t->simulated || !(transfer->endpoint & LIBUSB_ENDPOINT_IN))
+		return;
+	for (i = 0; i < transfer->actual_length; i++) {
+		if (transfer->buffer[i] != (unsigned char) stream_id) {
+			t->failed++;
+			return;
+		}
+	}
+}
+
+static struct libusb_transfer *submit(struct streams_test *t,
+	libusb_device_handle *handle, unsigned char endpoint,
+	uint32_t stream_id, int size, int *r)
+{
+	struct libusb_transfer *transfer;
+	struct stream_transfer *st;
+	unsigned char *buf;
+
+	transfer = libusb_alloc_transfer(0);
+	st = malloc(sizeof(*st));
+	buf = calloc(1, size);
+	if (!transfer || !st || !buf) {
+		libusb_free_transfer(transfer);
+		free(st);
+		free(buf);
+		*r = LIBUSB_ERROR_NO_MEM;
+		return NULL;
+	}
+	st->t = t;
+	st->stream_id = stream_id;
+	libusb_fill_bulk_stream_transfer(transfer, handle, endpoint, stream_id,
+		buf, size, transfer_cb, st, 0);
+	*r = libusb_submit_transfer(transfer);
+	if (*r == 0)
+		t->pending++;
+	return transfer;
+}
+
+static void free_transfer(struct libusb_transfer *transfer)
+{
+	if (!transfer)
+		return;
+	free(transfer->user_data);
+	free(transfer->buffer);
+	libusb_free_transfer(transfer);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n streams] [-s size] -S dir\n", prog);
+	fprintf(stderr, "       %s [-n streams] [-s size] vid:pid iface in_ep"
+		" out_ep\n", prog);
+	fprintf(stderr, "  -n  streams to allocate (default 16)\n");
+	fprintf(stderr, "  -s  transfer size (default 16384)\n");
+	fprintf(stderr, "  -S  build and use a simulated device under dir\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct streams_test t;
+	struct libusb_transfer **transfers = NULL;
+	struct libusb_transfer *extra = NULL;
+	libusb_device_handle *handle = NULL;
+	const char *sim_dir = NULL;
+	unsigned char eps[2] = { USBSIM_BULK_IN, USBSIM_BULK_OUT };
+	unsigned int vid = USBSIM_VID, pid = USBSIM_PID;
+	int iface = USBSIM_INTERFACE;
+	int num_streams = 16, size = 16384;
+	int allocated = 0, num_transfers = 0;
+	int opt, i, r;
+
+	while ((opt = getopt(argc, argv, "n:s:S:")) != -1) {
+		switch (opt) {
+		case 'n': num_streams = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'S': sim_dir = optarg; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (num_streams < 1 || size < 1
+			|| optind != argc - (sim_dir ? 0 : 4)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!sim_dir) {
+		if (sscanf(argv[optind], "%x:%x", &vid, &pid) != 2) {
+			usage(argv[0]);
+			return 1;
+		}
+		iface = atoi(argv[optind + 1]);
+		eps[0] = (unsigned char) strtol(argv[optind + 2], NULL, 16);
+		eps[1] = (unsigned char) strtol(argv[optind + 3], NULL, 16);
+	}
+
+	memset(&t, 0, sizeof(t));
+	t.simulated = (sim_dir != NULL);
+
+	r = libusb_init(NULL);
+	if (r < 0)
+		return 1;
+	if (sim_dir && usbsim_create(NULL, sim_dir) < 0) {
+		fprintf(stderr, "could not create the simulated device under %s\n",
+			sim_dir);
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	handle = libusb_open_device_with_vid_pid(NULL, (uint16_t) vid,
+		(uint16_t) pid);
+	if (!handle) {
+		fprintf(stderr, "could not open %04x:%04x\n", vid, pid);
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+	r = libusb_claim_interface(handle, iface);
+	if (r < 0)
+		goto out;
+
+	r = libusb_alloc_streams(handle, (uint32_t) num_streams, eps, 2);
+	if (r < 0)
+		goto out;
+	allocated = r;
+	printf("allocated %d of %d streams on %02x and %02x\n", allocated,
+		num_streams, eps[0], eps[1]);
+	if (allocated == 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	/* two transfers per stream and endpoint, so that each stream has
+	 * transfers queued behind one another */
+	transfers = calloc(4 * allocated, sizeof(*transfers));
+	if (!transfers) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+	for (i = 0; i < 4 * allocated; i++) {
+		transfers[i] = submit(&t, handle, eps[i % 2],
+			(uint32_t) (i / 2 % allocated + 1), size, &r);
+		num_transfers++;
+		if (r < 0) {
+			fprintf(stderr, "submit on stream %d failed: %s\n",
+				i / 2 % allocated + 1, libusb_error_name(r));
+			goto cancel;
+		}
+	}
+
+	extra = submit(&t, handle, eps[0], (uint32_t) allocated + 1, size, &r);
+	if (r == 0) {
+		fprintf(stderr, "submit on stream %d, beyond those allocated,"
+			" succeeded\n", allocated + 1);
+		t.failed++;
+	}
+	r = 0;
+
+cancel:
+	if (r < 0) {
+		for (i = 0; i < num_transfers; i++) {
+			if (transfers[i])
+				libusb_cancel_transfer(transfers[i]);
+		}
+	}
+	while (t.pending > 0)
+		libusb_handle_events(NULL);
+	if (r == 0) {
+		printf("%d transfers completed, %d failed\n", t.completed,
+			t.failed);
+		if (t.failed)
+			r = LIBUSB_ERROR_OTHER;
+	}
+
+out:
+	if (r < 0 && r != LIBUSB_ERROR_OTHER)
+		fprintf(stderr, "error: %s\n", libusb_error_name(r));
+	if (allocated > 0) {
+		i = libusb_free_streams(handle, eps, 2);
+		if (i < 0) {
+			fprintf(stderr, "freeing streams failed: %s\n",
+				libusb_error_name(i));
+			r = i;
+		}
+	}
+	for (i = 0; i < num_transfers; i++)
+		free_transfer(transfers[i]);
+	free_transfer(extra);
+	free(transfers);
+	if (handle) {
+		libusb_release_interface(handle, iface);
+		libusb_close(handle);
+	}
+	libusb_exit(NULL);
+	return r < 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * Simulated SuperSpeed device for the libusbx example programs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The device lives in a synthetic sysfs/usbfs tree, as generated by
+ * enumbench, and its usbfs node is a plain file. The program linking this
+ * file defines ioctl(), which takes precedence over the C library's for
+ * libusbx too, and answers the usbfs requests made on that node:
+ *
+ * - URBs complete after a simulated bus time: 2.5 ns per byte on a bulk
+ *   endpoint, one 125 us service interval on the interrupt endpoint, and
+ *   100 us for control transfers. The URBs of an endpoint take their turn.
+ * - Among the URBs whose time has come, the next one reaped is picked at
+ *   random, as a UAS device completes the commands of different streams
+ *   out of order, except that the URBs of one stream complete in order.
+ * - URBs on a stream ID which was not allocated are rejected with EINVAL.
+ * - IN data is filled with the low byte of the URB's stream ID.
+ *
+ * As the node is a plain file, poll() always reports it ready, so the
+ * event loop spins while transfers are in flight.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+#include "os/linux_usbfs.h"
+#include "usbsim.h"
+
+#define BUS	1
+#define DEVNUM	2
+
+struct sim_urb {
+	struct usbfs_urb *urb;
+	uint64_t ready_ns;
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sim_active = 0;
+static dev_t sim_dev;
+static ino_t sim_ino;
+static struct sim_urb *pending = NULL;
+static int num_pending = 0;
+static int max_pending = 0;
+static unsigned int streams[32];
+static uint64_t ep_busy_until[32];
+static unsigned int seed = 1;
+
+static int mkdir_p(const char *path)
+{
+	char tmp[1024];
+	char *p;
+
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	for (p = tmp + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = 0;
+		if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+static int write_file(const char *dir, const char *name, const void *data,
+	size_t len)
+{
+	char path[1024];
+	FILE *f;
+	size_t r;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	r = fwrite(data, 1, len, f);
+	fclose(f);
+	return r == len ? 0 : -1;
+}
+
+static int write_int(const char *dir, const char *name, int value)
+{
+	char buf[16];
+
+	snprintf(buf, sizeof(buf), "%d\n", value);
+	return write_file(dir, name, buf, strlen(buf));
+}
+
+static unsigned char *put_endpoint(unsigned char *p, unsigned char address,
+	unsigned char type, int max_packet, unsigned char interval,
+	unsigned char comp_attributes, int bytes_per_interval)
+{
+	*p++ = 7; *p++ = LIBUSB_DT_ENDPOINT;
+	*p++ = address; *p++ = type;
+	*p++ = max_packet & 0xff; *p++ = max_packet >> 8;
+	*p++ = interval;
+
+	*p++ = 6; *p++ = LIBUSB_DT_SS_ENDPOINT_COMPANION;
+	*p++ = type == LIBUSB_TRANSFER_TYPE_BULK ? 15 : 0;	/* bMaxBurst */
+	*p++ = comp_attributes;
+	*p++ = bytes_per_interval & 0xff; *p++ = bytes_per_interval >> 8;
+	return p;
+}
+
+/* device descriptor followed by one configuration with one interface */
+static size_t build_descriptors(unsigned char *buf)
+{
+	unsigned char *p = buf;
+	unsigned char *config;
+	int total;
+	int max_streams_exp = 0;
+
+	while ((1 << max_streams_exp) < USBSIM_MAX_STREAMS)
+		max_streams_exp++;
+
+	*p++ = 18; *p++ = LIBUSB_DT_DEVICE;
+	*p++ = 0x00; *p++ = 0x03;			/* bcdUSB 3.00 */
+	*p++ = 0; *p++ = 0; *p++ = 0;
+	*p++ = 9;					/* bMaxPacketSize0 */
+	*p++ = USBSIM_VID & 0xff; *p++ = USBSIM_VID >> 8;
+	*p++ = USBSIM_PID & 0xff; *p++ = USBSIM_PID >> 8;
+	*p++ = 0x00; *p++ = 0x01;			/* bcdDevice */
+	*p++ = 0; *p++ = 0; *p++ = 0;
+	*p++ = 1;					/* bNumConfigurations */
+
+	config = p;
+	*p++ = 9; *p++ = LIBUSB_DT_CONFIG;
+	*p++ = 0; *p++ = 0;				/* wTotalLength */
+	*p++ = 1; *p++ = 1; *p++ = 0; *p++ = 0x80; *p++ = 50;
+
+	*p++ = 9; *p++ = LIBUSB_DT_INTERFACE;
+	*p++ = USBSIM_INTERFACE; *p++ = 0; *p++ = 3;
+	*p++ = LIBUSB_CLASS_VENDOR_SPEC;
+	*p++ = 0; *p++ = 0; *p++ = 0;
+
+	p = put_endpoint(p, USBSIM_BULK_IN, LIBUSB_TRANSFER_TYPE_BULK, 1024, 0,
+		max_streams_exp, 0);
+	p = put_endpoint(p, USBSIM_BULK_OUT, LIBUSB_TRANSFER_TYPE_BULK, 1024, 0,
+		max_streams_exp, 0);
+	p = put_endpoint(p, USBSIM_INTR_IN, LIBUSB_TRANSFER_TYPE_INTERRUPT, 64,
+		1, 0, 64);
+
+	total = (int) (p - config);
+	config[2] = total & 0xff;
+	config[3] = total >> 8;
+	return p - buf;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* called with sim_lock held */
+static int submit_urb(struct usbfs_urb *urb)
+{
+	unsigned int ep = (urb->endpoint & 0x0f) | ((urb->endpoint & 0x80) >> 3);
+	uint64_t start = now_ns();
+	uint64_t duration;
+	struct sim_urb *p;
+
+	if (urb->type == USBFS_URB_TYPE_BULK && urb->stream_id > streams[ep])
+		return EINVAL;
+
+	if (num_pending == max_pending) {
+		p = realloc(pending, (max_pending + 64) * sizeof(*pending));
+		if (!p)
+			return ENOMEM;
+		pending = p;
+		max_pending += 64;
+	}
+
+	switch (urb->type) {
+	case USBFS_URB_TYPE_BULK:
+		duration = (uint64_t) urb->buffer_length * 5 / 2;
+		break;
+	case USBFS_URB_TYPE_INTERRUPT:
+		duration = 125000;
+		break;
+	default:
+		duration = 100000;
+		break;
+	}
+	if (ep_busy_until[ep] > start)
+		start = ep_busy_until[ep];
+	ep_busy_until[ep] = start + duration;
+
+	urb->status = 0;
+	pending[num_pending].urb = urb;
+	pending[num_pending].ready_ns = start + duration;
+	num_pending++;
+	return 0;
+}
+
+/* called with sim_lock held */
+static struct usbfs_urb *reap_urb(void)
+{
+	struct usbfs_urb *urb;
+	uint64_t now = now_ns();
+	int ready = 0;
+	int pick;
+	int i, j;
+
+	for (i = 0; i < num_pending; i++) {
+		if (pending[i].ready_ns <= now)
+			ready++;
+	}
+	if (!ready)
+		return NULL;
+
+	pick = rand_r(&seed) % ready;
+	for (i = 0; i < num_pending; i++) {
+		if (pending[i].ready_ns <= now && pick-- == 0)
+			break;
+	}
+
+	/* an earlier URB of the same stream goes first; it was submitted on
+	 * the same endpoint before, so its time has come too */
+	urb = pending[i].urb;
+	for (j = 0; j < i; j++) {
+		if (pending[j].urb->endpoint == urb->endpoint
+				&& pending[j].urb->stream_id == urb->stream_id) {
+			i = j;
+			break;
+		}
+	}
+
+	urb = pending[i].urb;
+	memmove(&pending[i], &pending[i + 1],
+		(num_pending - i - 1) * sizeof(*pending));
+	num_pending--;
+
+	if (urb->status != -ENOENT) {
+		urb->status = 0;
+		urb->actual_length = urb->buffer_length;
+		if (urb->type == USBFS_URB_TYPE_BULK && (urb->endpoint & 0x80))
+			memset(urb->buffer, (int) (urb->stream_id & 0xff),
+				urb->buffer_length);
+	}
+	return urb;
+}
+
+/* called with sim_lock held */
+static int discard_urb(struct usbfs_urb *urb)
+{
+	int i;
+
+	for (i = 0; i < num_pending; i++) {
+		if (pending[i].urb == urb) {
+			urb->status = -ENOENT;
+			urb->actual_length = 0;
+			pending[i].ready_ns = 0;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+/* called with sim_lock held */
+static int set_streams(struct usbfs_streams *s, unsigned int num_streams)
+{
+	unsigned int i, ep;
+
+	for (i = 0; i < s->num_eps; i++) {
+		ep = (s->eps[i] & 0x0f) | ((s->eps[i] & 0x80) >> 3);
+		streams[ep] = num_streams;
+	}
+	return (int) num_streams;
+}
+
+static int is_sim_node(int fd)
+{
+	struct stat st;
+
+	return sim_active && fstat(fd, &st) == 0 && st.st_dev == sim_dev
+		&& st.st_ino == sim_ino;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct usbfs_urb *urb;
+	va_list ap;
+	void *arg;
+	int r = 0;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!is_sim_node(fd))
+		return (int) syscall(SYS_ioctl, fd, request, arg);
+
+	pthread_mutex_lock(&sim_lock);
+	switch (request) {
+	case IOCTL_USBFS_SUBMITURB:
+		r = submit_urb(arg);
+		break;
+	case IOCTL_USBFS_REAPURB:
+	case IOCTL_USBFS_REAPURBNDELAY:
+		urb = reap_urb();
+		if (urb)
+			*(void **) arg = urb;
+		else
+			r = EAGAIN;
+		break;
+	case IOCTL_USBFS_DISCARDURB:
+		r = discard_urb(arg);
+		break;
+	case IOCTL_USBFS_ALLOC_STREAMS: {
+		struct usbfs_streams *s = arg;
+
+		r = set_streams(s, s->num_streams < USBSIM_MAX_STREAMS
+			? s->num_streams : USBSIM_MAX_STREAMS);
+		pthread_mutex_unlock(&sim_lock);
+		return r;
+	}
+	case IOCTL_USBFS_FREE_STREAMS:
+		set_streams(arg, 0);
+		break;
+	case IOCTL_USBFS_GETDRIVER:
+		r = ENODATA;
+		break;
+	case IOCTL_USBFS_CLAIMINTF:
+	case IOCTL_USBFS_RELEASEINTF:
+	case IOCTL_USBFS_SETINTF:
+	case IOCTL_USBFS_SETCONFIG:
+	case IOCTL_USBFS_CLEAR_HALT:
+	case IOCTL_USBFS_RESET:
+		break;
+	default:
+		r = ENOTTY;
+		break;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	if (r) {
+		errno = r;
+		return -1;
+	}
+	return 0;
+}
+
+int usbsim_create(libusb_context *ctx, const char *root)
+{
+	char dir[1024];
+	char sysfs[1024];
+	char node[1040];
+	unsigned char desc[128];
+	size_t len = build_descriptors(desc);
+	struct stat st;
+
+	snprintf(dir, sizeof(dir), "%s/sys/bus/usb/devices/%d-1", root, BUS);
+	if (mkdir_p(dir) < 0)
+		return -1;
+	if (write_int(dir, "busnum", BUS) < 0
+			|| write_int(dir, "devnum", DEVNUM) < 0
+			|| write_int(dir, "speed", 5000) < 0
+			|| write_int(dir, "bConfigurationValue", 1) < 0
+			|| write_file(dir, "descriptors", desc, len) < 0)
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s/dev/bus/usb/%03d", root, BUS);
+	if (mkdir_p(dir) < 0)
+		return -1;
+	snprintf(node, sizeof(node), "%03d", DEVNUM);
+	if (write_file(dir, node, desc, len) < 0)
+		return -1;
+	snprintf(node, sizeof(node), "%s/%03d", dir, DEVNUM);
+	if (stat(node, &st) < 0)
+		return -1;
+
+	snprintf(sysfs, sizeof(sysfs), "%s/sys/bus/usb/devices", root);
+	snprintf(dir, sizeof(dir), "%s/dev/bus/usb", root);
+	if (libusb_set_device_roots(ctx, dir, sysfs) < 0)
+		return -1;
+
+	pthread_mutex_lock(&sim_lock);
+	sim_dev = st.st_dev;
+	sim_ino = st.st_ino;
+	sim_active = 1;
+	pthread_mutex_unlock(&sim_lock);
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Simulated SuperSpeed device for the libusbx example programs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef USBSIM_H
+#define USBSIM_H
+
+#include <libusb.h>
+
+/* identity and endpoints of the simulated device */
+#define USBSIM_VID		0x1d6b
+#define USBSIM_PID		0x0105
+#define USBSIM_INTERFACE	0
+#define USBSIM_BULK_IN		0x81
+#define USBSIM_BULK_OUT		0x02
+#define USBSIM_INTR_IN		0x83
+/* streams per bulk endpoint, as advertised by the companion descriptors */
+#define USBSIM_MAX_STREAMS	16
+
+/* Create a sysfs/usbfs tree holding the simulated device under root, point
+ * ctx at it, and start answering the usbfs requests made on its device
+ * node. Call before ctx discovers any devices. Returns 0 on success, -1 on
+ * failure. */
+int usbsim_create(libusb_context *ctx, const char *root);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * Transfer buffer allocation for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD)
+#include <sys/mman.h>
+#include <unistd.h>
+#define BUFFER_MMAP	1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+#else
+#define BUFFER_MMAP	0
+#endif
+#ifdef OS_LINUX
+#include <sys/syscall.h>
+#endif
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
+#include "libusbi.h"
+
+/**
+ * @defgroup buffers Transfer buffers
+ * At high aggregate data rates, TLB misses and memory traffic between
+ * sockets on transfer buffers become visible. libusb_alloc_buffer()
+ * allocates transfer buffers which can be backed by huge pages, and placed
+ * on the NUMA node of the host controller that the device is attached to.
+ *
+ * Buffers freed with libusb_free_buffer() are kept by the context and
+ * handed out again to later allocations with the same size and flags, so
+ * that streaming code which allocates and frees its buffers at each start
+ * and stop does not pay for mapping, faulting in and binding memory each
+ * time. The context unmaps them when it is destroyed.
+ *
+ * The flags are hints: a buffer is still returned if huge pages are
+ * unavailable or the controller's NUMA node is unknown. Buffers are always
+ * aligned to at least the page size, which also suits O_DIRECT I/O.
+ */
+
+/* most memory kept in a context's pool of freed buffers */
+#define BUFFER_POOL_MAX		(256 * 1024 * 1024)
+#define BUFFER_DEFAULT_HUGE_PAGE	(2 * 1024 * 1024)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED		1
+#endif
+
+struct usbi_buffer {
+	struct list_head list;
+	unsigned char *addr;
+	/* size of the mapping, the requested length rounded up */
+	size_t size;
+	int flags;
+	/* NUMA node the buffer was bound to, or -1 */
+	int node;
+};
+
+static size_t round_up(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+#if BUFFER_MMAP
+
+static size_t page_size(void)
+{
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static size_t huge_page_size(void)
+{
+	static size_t size;
+	char line[128];
+	unsigned long kb;
+	FILE *f;
+
+	if (size)
+		return size;
+	size = BUFFER_DEFAULT_HUGE_PAGE;
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return size;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+			size = (size_t) kb * 1024;
+			break;
+		}
+	}
+	fclose(f);
+	return size;
+}
+
+/* transparent huge pages need a suitably aligned range: over-allocate,
+ * then trim the ends */
+static void *map_aligned(size_t size, size_t alignment)
+{
+	unsigned char *addr;
+	size_t head;
+
+	addr = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	head = (alignment - (uintptr_t) addr % alignment) % alignment;
+	if (head)
+		munmap(addr, head);
+	munmap(addr + head + size, alignment - head);
+	return addr + head;
+}
+
+static void bind_to_node(struct libusb_context *ctx, void *addr, size_t size,
+	int node)
+{
+#if defined(OS_LINUX) && defined(__NR_mbind)
+	unsigned long mask[4] = { 0 };
+
+	if (node >= (int) (sizeof(mask) * 8))
+		return;
+	mask[node / (sizeof(mask[0]) * 8)] |= 1UL << (node % (sizeof(mask[0]) * 8));
+	/* preferred rather than bound, so that allocation falls back to other
+	 * nodes instead of failing when the node runs out of memory */
+	if (syscall(__NR_mbind, addr, size, MPOL_PREFERRED, mask,
+			sizeof(mask) * 8, 0) != 0)
+		usbi_dbg_ctx(ctx, "mbind to node %d failed errno=%d", node,
+			errno);
+#else
+	(void) ctx;
+	(void) addr;
+	(void) size;
+	(void) node;
+#endif
+}
+
+static int map_buffer(struct libusb_context *ctx, struct usbi_buffer *buf,
+	size_t length)
+{
+	void *addr = NULL;
+
+	if (buf->flags & LIBUSB_BUFFER_HUGEPAGES) {
+		buf->size = round_up(length, huge_page_size());
+#ifdef MAP_HUGETLB
+		addr = mmap(NULL, buf->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr == MAP_FAILED) {
+			usbi_dbg_ctx(ctx, "no hugetlb pages, errno=%d", errno);
+			addr = NULL;
+		}
+#endif
+		if (!addr) {
+			addr = map_aligned(buf->size, huge_page_size());
+#ifdef MADV_HUGEPAGE
+			if (addr)
+				madvise(addr, buf->size, MADV_HUGEPAGE);
+#endif
+		}
+	} else {
+		buf->size = round_up(length, page_size());
+		addr = mmap(NULL, buf->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED)
+			addr = NULL;
+	}
+	if (!addr)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* bind before the pages are first touched, which is when they are
+	 * allocated */
+	if (buf->node >= 0)
+		bind_to_node(ctx, addr, buf->size, buf->node);
+	buf->addr = addr;
+	return 0;
+}
+
+static void unmap_buffer(struct usbi_buffer *buf)
+{
+	munmap(buf->addr, buf->size);
+}
+
+#else
+
+/* the smallest page size of the platforms without mmap. buffers are
+ * still page aligned there, as promised above */
+#define BUFFER_PAGE_SIZE	4096
+
+static int map_buffer(struct libusb_context *ctx, struct usbi_buffer *buf,
+	size_t length)
+{
+	(void) ctx;
+	buf->size = round_up(length, BUFFER_PAGE_SIZE);
+#if defined(OS_WINDOWS) || defined(OS_WINCE)
+	/* page granular, and available on CE, unlike _aligned_malloc() */
+	buf->addr = VirtualAlloc(NULL, buf->size, MEM_COMMIT | MEM_RESERVE,
+		PAGE_READWRITE);
+#else
+	if (posix_memalign((void **) &buf->addr, BUFFER_PAGE_SIZE,
+			buf->size) != 0)
+		buf->addr = NULL;
+#endif
+	return buf->addr ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+static void unmap_buffer(struct usbi_buffer *buf)
+{
+#if defined(OS_WINDOWS) || defined(OS_WINCE)
+	VirtualFree(buf->addr, 0, MEM_RELEASE);
+#else
+	free(buf->addr);
+#endif
+}
+
+#endif /* BUFFER_MMAP */
+
+void usbi_buffers_init(struct libusb_context *ctx)
+{
+	usbi_mutex_init(&ctx->buffers_lock, NULL);
+	list_init(&ctx->buffers);
+	list_init(&ctx->buffer_pool);
+}
+
+void usbi_buffers_exit(struct libusb_context *ctx)
+{
+	struct usbi_buffer *buf, *tmp;
+
+	list_for_each_entry_safe(buf, tmp, &ctx->buffer_pool, list,
+			struct usbi_buffer) {
+		unmap_buffer(buf);
+		free(buf);
+	}
+	/* the application may still be using these, so leave them mapped */
+	if (!list_empty(&ctx->buffers))
+		usbi_warn(ctx, "application left some transfer buffers allocated");
+	list_for_each_entry_safe(buf, tmp, &ctx->buffers, list,
+			struct usbi_buffer)
+		free(buf);
+	usbi_mutex_destroy(&ctx->buffers_lock);
+}
+
+/** \ingroup buffers
+ * Allocate a transfer buffer. Free it with libusb_free_buffer().
+ *
+ * \param ctx the context to allocate from, or NULL for the default context
+ * \param dev the device the buffer will be used with, or NULL. Only used
+ * with LIBUSB_BUFFER_NUMA_LOCAL.
+ * \param length the length of the buffer in bytes
+ * \param flags a bitwise OR of \ref libusb_buffer_flags
+ * \returns the buffer, or NULL if it could not be allocated
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_alloc_buffer(libusb_context *ctx,
+	libusb_device *dev, size_t length, int flags)
+{
+	struct usbi_buffer *buf;
+	size_t size;
+	int node = -1;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!length)
+		return NULL;
+
+	if ((flags & LIBUSB_BUFFER_NUMA_LOCAL) && dev
+			&& usbi_backend->get_numa_node) {
+		node = usbi_backend->get_numa_node(dev);
+		if (node < 0)
+			node = -1;
+	}
+
+#if BUFFER_MMAP
+	size = round_up(length, (flags & LIBUSB_BUFFER_HUGEPAGES)
+		? huge_page_size() : page_size());
+#else
+	size = round_up(length, BUFFER_PAGE_SIZE);
+#endif
+
+	usbi_mutex_lock(&ctx->buffers_lock);
+	list_for_each_entry(buf, &ctx->buffer_pool, list, struct usbi_buffer) {
+		if (buf->size == size && buf->flags == flags && buf->node == node) {
+			list_del(&buf->list);
+			ctx->buffer_pool_bytes -= buf->size;
+			list_add(&buf->list, &ctx->buffers);
+			usbi_mutex_unlock(&ctx->buffers_lock);
+			return buf->addr;
+		}
+	}
+	usbi_mutex_unlock(&ctx->buffers_lock);
+
+	buf = calloc(1, sizeof(*buf));
+	if (!buf)
+		return NULL;
+	buf->flags = flags;
+	buf->node = node;
+	if (map_buffer(ctx, buf, length) != 0) {
+		free(buf);
+		return NULL;
+	}
+	usbi_dbg_ctx(ctx, "%lu byte buffer at %p, flags %x, node %d",
+		(unsigned long) buf->size, buf->addr, flags, node);
+
+	usbi_mutex_lock(&ctx->buffers_lock);
+	list_add(&buf->list, &ctx->buffers);
+	usbi_mutex_unlock(&ctx->buffers_lock);
+	return buf->addr;
+}
+
+/** \ingroup buffers
+ * Free a buffer allocated with libusb_alloc_buffer(). The buffer is kept for
+ * reuse by later allocations, up to a limit on the memory kept by the
+ * context.
+ *
+ * \param ctx the context the buffer was allocated from, or NULL for the
+ * default context
+ * \param buffer the buffer, or NULL
+ */
+void API_EXPORTED libusb_free_buffer(libusb_context *ctx,
+	unsigned char *buffer)
+{
+	struct usbi_buffer *buf;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!buffer)
+		return;
+
+	usbi_mutex_lock(&ctx->buffers_lock);
+	list_for_each_entry(buf, &ctx->buffers, list, struct usbi_buffer) {
+		if (buf->addr != buffer)
+			continue;
+		list_del(&buf->list);
+		if (ctx->buffer_pool_bytes + buf->size <= BUFFER_POOL_MAX) {
+			list_add(&buf->list, &ctx->buffer_pool);
+			ctx->buffer_pool_bytes += buf->size;
+			buf = NULL;
+		}
+		usbi_mutex_unlock(&ctx->buffers_lock);
+		if (buf) {
+			unmap_buffer(buf);
+			free(buf);
+		}
+		return;
+	}
+	usbi_mutex_unlock(&ctx->buffers_lock);
+	usbi_warn(ctx, "%p was not allocated by libusb_alloc_buffer", buffer);
+}
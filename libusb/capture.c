@@ -0,0 +1,580 @@
+/*
+ * usbmon-compatible packet capture for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef OS_WINDOWS
+#include <windows.h>
+#endif
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
+#include "libusbi.h"
+
+/**
+ * @defgroup capture Packet capture
+ * libusbx can capture the transfers of a context to a pcap file in the
+ * format of the Linux usbmon interface (link type
+ * LINKTYPE_USB_LINUX_MMAPPED), which Wireshark and tcpdump understand. This
+ * does not need root privileges or any kernel support.
+ *
+ * A submission record ('S', or 'E' if submission failed) is written for
+ * every transfer passed to libusb_submit_transfer(), and a completion
+ * record ('C') when the transfer completes. Outgoing data is captured at
+ * submission and incoming data at completion, up to the snap length.
+ * Isochronous transfers are recorded without data.
+ *
+ * Records are queued on a bounded lock-free queue and written out by a
+ * background thread, so capturing never blocks the I/O path: if the queue
+ * is full, the record is dropped and counted instead. The writer sleeps
+ * while the queue is empty; a producer only takes a lock to wake it up.
+ */
+
+/* the queue needs compare-and-swap */
+#define CAPTURE_SUPPORTED	USBI_ATOMICS_SUPPORTED
+
+#define PCAP_MAGIC			0xa1b2c3d4
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+/* usbmon transfer types */
+#define USBMON_ISO			0
+#define USBMON_INTERRUPT		1
+#define USBMON_CONTROL			2
+#define USBMON_BULK			3
+
+#define CAPTURE_DEFAULT_SNAPLEN		4096
+#define CAPTURE_DEFAULT_QUEUE		1024
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* the 64 byte header of the usbmon mmap interface */
+struct usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+/* a queue slot: sequence number, then a usbmon packet and its data */
+struct capture_slot {
+	size_t seq;
+	uint32_t orig_len;
+	struct usbmon_packet packet;
+	unsigned char data[0];
+};
+
+/* lives for as long as the context, so that the I/O path can safely look at
+ * it while capture is being started or stopped */
+struct usbi_capture {
+	struct libusb_context *ctx;
+
+	/* set while capture is running. producers count themselves in before
+	 * looking at it, and the queue is only freed once none are left */
+	int active;
+	int producers;
+
+	FILE *file;
+	uint32_t snaplen;
+	usbi_thread_t writer;
+	int writer_stop;
+	unsigned int dropped;
+
+	/* the writer waits on writer_cond while the queue is empty, with
+	 * writer_waiting set so that producers know to signal it */
+	usbi_mutex_t writer_lock;
+	usbi_cond_t writer_cond;
+	int writer_waiting;
+
+	/* bounded multi-producer, single-consumer queue */
+	unsigned char *slots;
+	size_t slot_size;
+	size_t mask;
+	size_t enqueue_pos;
+	size_t dequeue_pos;
+};
+
+#if CAPTURE_SUPPORTED
+
+static struct capture_slot *get_slot(struct usbi_capture *cap, size_t pos)
+{
+	return (struct capture_slot *)
+		(cap->slots + (pos & cap->mask) * cap->slot_size);
+}
+
+static void capture_sleep(void)
+{
+#ifdef OS_WINDOWS
+	Sleep(1);
+#else
+	struct timespec ts = { 0, 1000000 };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/* wait until the slot at pos is filled in or the writer is told to stop */
+static void capture_wait(struct usbi_capture *cap, struct capture_slot *slot,
+	size_t pos)
+{
+	usbi_mutex_lock(&cap->writer_lock);
+	/* pairs with the fence in capture_record(): either the producer sees
+	 * writer_waiting set, or this sees its slot filled in */
+	usbi_atomic_store_seq_cst(&cap->writer_waiting, 1);
+	while (usbi_atomic_load_seq_cst(&slot->seq) != pos + 1
+			&& !usbi_atomic_load_acquire(&cap->writer_stop))
+		usbi_cond_wait(&cap->writer_cond, &cap->writer_lock);
+	usbi_atomic_store(&cap->writer_waiting, 0);
+	usbi_mutex_unlock(&cap->writer_lock);
+}
+
+static void *capture_writer(void *arg)
+{
+	struct usbi_capture *cap = arg;
+	int unflushed = 0;
+
+	usbi_sched_thread_start(cap->ctx, "capture");
+	for (;;) {
+		size_t pos = cap->dequeue_pos;
+		struct capture_slot *slot = get_slot(cap, pos);
+		struct pcap_record_header rec;
+		uint32_t len;
+
+		if (usbi_atomic_load_acquire(&slot->seq) != pos + 1) {
+			/* queue empty */
+			if (unflushed) {
+				fflush(cap->file);
+				unflushed = 0;
+			}
+			if (usbi_atomic_load_acquire(&cap->writer_stop))
+				break;
+			capture_wait(cap, slot, pos);
+			continue;
+		}
+
+		len = sizeof(slot->packet) + slot->packet.len_cap;
+		rec.ts_sec = (uint32_t) slot->packet.ts_sec;
+		rec.ts_usec = (uint32_t) slot->packet.ts_usec;
+		rec.incl_len = len;
+		rec.orig_len = slot->orig_len;
+		if (fwrite(&rec, sizeof(rec), 1, cap->file) != 1
+				|| fwrite(&slot->packet, len, 1, cap->file) != 1)
+			usbi_warn(NULL, "capture write failed, errno=%d", errno);
+		unflushed = 1;
+
+		usbi_atomic_store_release(&slot->seq, pos + cap->mask + 1);
+		cap->dequeue_pos = pos + 1;
+	}
+
+	usbi_sched_thread_stop(cap->ctx);
+	return NULL;
+}
+
+static uint8_t usbmon_xfer_type(uint8_t type)
+{
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		return USBMON_CONTROL;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return USBMON_ISO;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		return USBMON_INTERRUPT;
+	default:
+		return USBMON_BULK;
+	}
+}
+
+static int32_t usbmon_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return -ETIMEDOUT;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return -ENOENT;
+	case LIBUSB_TRANSFER_STALL:
+		return -EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return -EOVERFLOW;
+	default:
+		return -EPROTO;
+	}
+}
+
+/* errno equivalents of submission errors */
+static int32_t usbmon_submit_error(int r)
+{
+	switch (r) {
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_ERROR_BUSY:
+		return -EBUSY;
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return -EINVAL;
+	case LIBUSB_ERROR_NO_MEM:
+		return -ENOMEM;
+	default:
+		return -EIO;
+	}
+}
+
+static void capture_record(struct usbi_capture *cap,
+	struct usbi_transfer *itransfer, char event, int32_t status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device *dev = transfer->dev_handle->dev;
+	struct usbmon_packet *pkt;
+	struct capture_slot *slot;
+	struct timespec ts;
+	unsigned char *data = transfer->buffer;
+	uint32_t length = transfer->length;
+	uint32_t data_len = 0;
+	uint8_t epnum = transfer->endpoint;
+	int is_control = transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL;
+	int is_in;
+	size_t pos;
+
+	if (is_control) {
+		epnum = transfer->buffer[0] & LIBUSB_ENDPOINT_DIR_MASK;
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+		length -= LIBUSB_CONTROL_SETUP_SIZE;
+	}
+	is_in = (epnum & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+
+	/* claim a slot, or drop the record if the queue is full */
+	pos = usbi_atomic_load(&cap->enqueue_pos);
+	for (;;) {
+		intptr_t diff;
+
+		slot = get_slot(cap, pos);
+		diff = (intptr_t) usbi_atomic_load_acquire(&slot->seq)
+			- (intptr_t) pos;
+		if (diff == 0) {
+			if (usbi_atomic_cas(&cap->enqueue_pos, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			usbi_atomic_add(&cap->dropped, 1);
+			return;
+		} else {
+			pos = usbi_atomic_load(&cap->enqueue_pos);
+		}
+	}
+
+	usbi_backend->clock_gettime(USBI_CLOCK_REALTIME, &ts);
+
+	pkt = &slot->packet;
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->id = (uint64_t) (uintptr_t) transfer;
+	pkt->type = (uint8_t) event;
+	pkt->xfer_type = usbmon_xfer_type(transfer->type);
+	pkt->epnum = epnum;
+	pkt->devnum = dev->device_address;
+	pkt->busnum = dev->bus_number;
+	pkt->ts_sec = ts.tv_sec;
+	pkt->ts_usec = (int32_t) (ts.tv_nsec / 1000);
+	pkt->status = status;
+	pkt->length = length;
+	pkt->flag_setup = '-';
+	pkt->flag_data = is_in ? '<' : '>';
+
+	if (event == 'S' && is_control) {
+		pkt->flag_setup = 0;
+		memcpy(pkt->setup, transfer->buffer, LIBUSB_CONTROL_SETUP_SIZE);
+	}
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		if (event == 'S' && !is_in)
+			data_len = length;
+		else if (event == 'C' && is_in)
+			data_len = (uint32_t) transfer->actual_length;
+		if (data_len) {
+			pkt->flag_data = 0;
+			if (event == 'C')
+				pkt->length = data_len;
+		}
+	}
+	slot->orig_len = (uint32_t) sizeof(*pkt) + data_len;
+	if (data_len > cap->snaplen)
+		data_len = cap->snaplen;
+	pkt->len_cap = data_len;
+	if (data_len)
+		memcpy(slot->data, data, data_len);
+
+	usbi_atomic_store_release(&slot->seq, pos + 1);
+
+	/* wake the writer if it went to sleep on an empty queue */
+	usbi_atomic_fence();
+	if (usbi_atomic_load(&cap->writer_waiting)) {
+		usbi_mutex_lock(&cap->writer_lock);
+		usbi_cond_signal(&cap->writer_cond);
+		usbi_mutex_unlock(&cap->writer_lock);
+	}
+}
+
+/* called from the I/O path. event is 'S', 'E' or 'C'; status is the
+ * libusb_submit_transfer() result or the transfer status respectively */
+void usbi_capture_transfer(struct usbi_capture *cap,
+	struct usbi_transfer *itransfer, char event, int status)
+{
+	usbi_atomic_add(&cap->producers, 1);
+	if (usbi_atomic_load_seq_cst(&cap->active)) {
+		int32_t usbmon;
+
+		if (event == 'S')
+			usbmon = -EINPROGRESS;
+		else if (event == 'E')
+			usbmon = usbmon_submit_error(status);
+		else
+			usbmon = usbmon_status(status);
+		capture_record(cap, itransfer, event, usbmon);
+	}
+	usbi_atomic_add(&cap->producers, -1);
+}
+
+static void capture_stop(struct usbi_capture *cap)
+{
+	usbi_atomic_store_seq_cst(&cap->active, 0);
+	while (usbi_atomic_load_seq_cst(&cap->producers))
+		capture_sleep();
+
+	usbi_mutex_lock(&cap->writer_lock);
+	usbi_atomic_store_release(&cap->writer_stop, 1);
+	usbi_cond_signal(&cap->writer_cond);
+	usbi_mutex_unlock(&cap->writer_lock);
+	usbi_thread_join(cap->writer);
+	fclose(cap->file);
+	free(cap->slots);
+	cap->file = NULL;
+	cap->slots = NULL;
+}
+
+#else
+
+void usbi_capture_transfer(struct usbi_capture *cap,
+	struct usbi_transfer *itransfer, char event, int status)
+{
+	(void) cap;
+	(void) itransfer;
+	(void) event;
+	(void) status;
+}
+
+#endif /* CAPTURE_SUPPORTED */
+
+/** \ingroup capture
+ * Start capturing the transfers of a context to a pcap file.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param path the file to write, which is replaced if it exists
+ * \param snaplen maximum number of data bytes captured per record, or 0 for
+ * the default (4096)
+ * \param queue_entries number of records that may be waiting to be
+ * written (rounded up to a power of two), or 0 for the default (1024).
+ * Records beyond this are dropped.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if a capture is already running
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns LIBUSB_ERROR_IO if the file could not be created
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if capture is not available on this
+ * platform
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_capture_start(libusb_context *ctx, const char *path,
+	int snaplen, int queue_entries)
+{
+#if CAPTURE_SUPPORTED
+	struct usbi_capture *cap;
+	struct pcap_file_header header;
+	size_t entries = 2;
+	size_t i;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+
+	if (!path || snaplen < 0 || snaplen > 0x1000000 || queue_entries < 0
+			|| queue_entries > (1 << 20))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (snaplen == 0)
+		snaplen = CAPTURE_DEFAULT_SNAPLEN;
+	if (queue_entries == 0)
+		queue_entries = CAPTURE_DEFAULT_QUEUE;
+	while (entries < (size_t) queue_entries)
+		entries <<= 1;
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	cap = ctx->capture;
+	if (!cap) {
+		cap = calloc(1, sizeof(*cap));
+		if (!cap) {
+			usbi_mutex_unlock(&ctx->capture_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		usbi_mutex_init(&cap->writer_lock, NULL);
+		usbi_cond_init(&cap->writer_cond, NULL);
+	} else if (cap->file) {
+		usbi_mutex_unlock(&ctx->capture_lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	cap->ctx = ctx;
+	cap->snaplen = (uint32_t) snaplen;
+	cap->slot_size = (sizeof(struct capture_slot) + snaplen + 7) & ~7;
+	cap->mask = entries - 1;
+	cap->enqueue_pos = 0;
+	cap->dequeue_pos = 0;
+	cap->dropped = 0;
+	cap->writer_stop = 0;
+	cap->slots = malloc(entries * cap->slot_size);
+	if (!cap->slots) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err;
+	}
+	for (i = 0; i < entries; i++)
+		get_slot(cap, i)->seq = i;
+
+	cap->file = fopen(path, "wb");
+	if (!cap->file) {
+		usbi_err(ctx, "can't create capture file %s, errno=%d", path, errno);
+		r = LIBUSB_ERROR_IO;
+		goto err_free_slots;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PCAP_MAGIC;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.snaplen = (uint32_t) (sizeof(struct usbmon_packet) + snaplen);
+	header.linktype = LINKTYPE_USB_LINUX_MMAPPED;
+	if (fwrite(&header, sizeof(header), 1, cap->file) != 1) {
+		r = LIBUSB_ERROR_IO;
+		goto err_close;
+	}
+
+	r = usbi_thread_create(&cap->writer, capture_writer, cap);
+	if (r != 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err_close;
+	}
+
+	ctx->capture = cap;
+	usbi_atomic_store_release(&cap->active, 1);
+	usbi_mutex_unlock(&ctx->capture_lock);
+	return 0;
+
+err_close:
+	fclose(cap->file);
+	cap->file = NULL;
+err_free_slots:
+	free(cap->slots);
+	cap->slots = NULL;
+err:
+	if (!ctx->capture) {
+		usbi_mutex_destroy(&cap->writer_lock);
+		usbi_cond_destroy(&cap->writer_cond);
+		free(cap);
+	}
+	usbi_mutex_unlock(&ctx->capture_lock);
+	return r;
+#else
+	(void) ctx;
+	(void) path;
+	(void) snaplen;
+	(void) queue_entries;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup capture
+ * Stop a capture started with libusb_capture_start(). Records still queued
+ * are written out and the file is closed before this function returns.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the number of records dropped because the queue was full
+ * \returns LIBUSB_ERROR_NOT_FOUND if no capture is running
+ */
+int API_EXPORTED libusb_capture_stop(libusb_context *ctx)
+{
+#if CAPTURE_SUPPORTED
+	struct usbi_capture *cap;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	cap = ctx->capture;
+	if (cap && cap->file) {
+		capture_stop(cap);
+		r = (int) cap->dropped;
+	}
+	usbi_mutex_unlock(&ctx->capture_lock);
+	return r;
+#else
+	(void) ctx;
+	return LIBUSB_ERROR_NOT_FOUND;
+#endif
+}
+
+/* stop any running capture and free its state, on context teardown */
+void usbi_capture_exit(struct libusb_context *ctx)
+{
+	libusb_capture_stop(ctx);
+#if CAPTURE_SUPPORTED
+	if (ctx->capture) {
+		usbi_mutex_destroy(&ctx->capture->writer_lock);
+		usbi_cond_destroy(&ctx->capture->writer_cond);
+	}
+#endif
+	free(ctx->capture);
+	ctx->capture = NULL;
+	usbi_mutex_destroy(&ctx->capture_lock);
+}
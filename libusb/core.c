@@ -34,19 +34,28 @@
 #include "libusbi.h"
 
 #if defined(OS_LINUX)
-const struct usbi_os_backend * const usbi_backend = &linux_usbfs_backend;
+const struct usbi_os_backend * USBI_BACKEND_CONST usbi_backend = &linux_usbfs_backend;
 #elif defined(OS_DARWIN)
-const struct usbi_os_backend * const usbi_backend = &darwin_backend;
+const struct usbi_os_backend * USBI_BACKEND_CONST usbi_backend = &darwin_backend;
 #elif defined(OS_OPENBSD)
-const struct usbi_os_backend * const usbi_backend = &openbsd_backend;
+const struct usbi_os_backend * USBI_BACKEND_CONST usbi_backend = &openbsd_backend;
 #elif defined(OS_WINDOWS)
-const struct usbi_os_backend * const usbi_backend = &windows_backend;
+const struct usbi_os_backend * USBI_BACKEND_CONST usbi_backend = &windows_backend;
 #elif defined(OS_WINCE)
-const struct usbi_os_backend * const usbi_backend = &wince_backend;
+const struct usbi_os_backend * USBI_BACKEND_CONST usbi_backend = &wince_backend;
 #else
 #error "Unsupported OS"
 #endif
 
+#ifdef USBI_TEST_BACKEND
+/* only in the test build of the library, see libusb/Makefile.am. must be
+ * called before the first libusb_init() */
+void usbi_set_test_backend(const struct usbi_os_backend *backend)
+{
+	usbi_backend = backend;
+}
+#endif
+
 #ifdef OS_WINCE
 // Workaround for WinCE not supporting getenv
 #define getenv(x) NULL
@@ -58,7 +67,6 @@ const struct libusb_version libusb_version_internal =
 	  LIBUSB_RC, "unused - please use the nano" };
 static int default_context_refcnt = 0;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
-static struct timeval timestamp_origin = { 0, 0 };
 
 /**
  * \mainpage libusbx-1.0 API Reference
@@ -477,7 +485,7 @@ struct discovered_devs *discovered_devs_append(
 	}
 
 	/* exceeded capacity, need to grow */
-	usbi_dbg("need to increase capacity");
+	usbi_dbg_ctx(DEVICE_CTX(dev), "need to increase capacity");
 	capacity = discdevs->capacity + DISCOVERED_DEVICES_SIZE_STEP;
 	discdevs = usbi_reallocf(discdevs,
 		sizeof(*discdevs) + (sizeof(void *) * capacity));
@@ -522,6 +530,9 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	dev->refcnt = 1;
 	dev->session_data = session_id;
 	dev->speed = LIBUSB_SPEED_UNKNOWN;
+	list_init(&dev->string_cache);
+	dev->string_langid = -1;
+	dev->pm_suspended_time_ms = (uint64_t) -1;
 	memset(&dev->os_priv, 0, priv_size);
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
@@ -549,7 +560,8 @@ int usbi_sanitize_device(struct libusb_device *dev)
 		usbi_err(DEVICE_CTX(dev), "too many configurations");
 		return LIBUSB_ERROR_IO;
 	} else if (0 == num_configurations)
-		usbi_dbg("zero configurations, maybe an unauthorized device");
+		usbi_dbg_ctx(DEVICE_CTX(dev),
+			"zero configurations, maybe an unauthorized device");
 
 	dev->num_configurations = num_configurations;
 	return 0;
@@ -603,7 +615,7 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	int r = 0;
 	ssize_t i, len;
 	USBI_GET_CONTEXT(ctx);
-	usbi_dbg("");
+	usbi_dbg_ctx(ctx, "");
 
 	if (!discdevs)
 		return LIBUSB_ERROR_NO_MEM;
@@ -777,6 +789,17 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
 	return NULL;
 }
 
+static int endpoint_granularity(const struct usbi_endpoint_info *info)
+{
+	if (info->ss && info->type != LIBUSB_TRANSFER_TYPE_BULK
+			&& info->bytes_per_interval)
+		return info->bytes_per_interval;
+	if (info->ss)
+		return info->max_packet_size * (info->max_burst + 1)
+			* (info->mult + 1);
+	return info->max_packet_size * info->transactions;
+}
+
 /** \ingroup dev
  * Convenience function to retrieve the wMaxPacketSize value for a particular
  * endpoint in the active device configuration.
@@ -827,7 +850,10 @@ int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
  * If acting on an isochronous or interrupt endpoint, this function will
  * multiply the value found in bits 0:10 by the number of transactions per
  * microframe (determined by bits 11:12). Otherwise, this function just
- * returns the numeric value found in bits 0:10.
+ * returns the numeric value found in bits 0:10. For the isochronous and
+ * interrupt endpoints of SuperSpeed devices, the bytes per service interval
+ * given by the endpoint companion are returned, as with
+ * libusb_get_endpoint_granularity().
  *
  * This function is useful for setting up isochronous transfers, for example
  * you might pass the return value from this function to
@@ -845,34 +871,216 @@ int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
-	enum libusb_transfer_type ep_type;
-	uint16_t val;
+	struct usbi_endpoint_info info;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
+	r = usbi_get_endpoint_info(dev, endpoint, &info);
+	if (r == LIBUSB_ERROR_NOT_FOUND)
+		return r;
 	if (r < 0) {
 		usbi_err(DEVICE_CTX(dev),
 			"could not retrieve active config descriptor");
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ep = find_endpoint(config, endpoint);
-	if (!ep)
-		return LIBUSB_ERROR_NOT_FOUND;
+	if (info.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			|| info.type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return endpoint_granularity(&info);
+	return info.max_packet_size;
+}
 
-	val = ep->wMaxPacketSize;
-	ep_type = ep->bmAttributes & 0x3;
-	libusb_free_config_descriptor(config);
+/** \ingroup dev
+ * Get the recommended granularity of transfer sizes for an endpoint in the
+ * active configuration: transfers sized to a multiple of it fill whole
+ * packets, and on SuperSpeed devices whole bursts.
+ *
+ * - For bulk endpoints, this is the maximum packet size, multiplied on
+ *   SuperSpeed devices by the number of packets per burst (bMaxBurst + 1 from
+ *   the endpoint companion).
+ * - For isochronous and interrupt endpoints, this is the number of bytes the
+ *   endpoint can transfer each service interval: the maximum packet size
+ *   times the transactions per microframe on high speed devices, and the
+ *   bytes per interval from the endpoint companion on SuperSpeed devices,
+ *   which also accounts for bMaxBurst and Mult.
+ *
+ * The endpoint descriptors of the active configuration are parsed once and
+ * cached, so this function does not involve any requests being sent to the
+ * device, and is cheap to call repeatedly.
+ *
+ * \param dev a device
+ * \param endpoint address of the endpoint in question
+ * \returns the granularity in bytes, or 0 for endpoints with no bandwidth in
+ * the first altsetting which uses them
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_get_ss_endpoint_companion_descriptor()
+ */
+int API_EXPORTED libusb_get_endpoint_granularity(libusb_device *dev,
+	unsigned char endpoint)
+{
+	struct usbi_endpoint_info info;
+	int r;
+
+	r = usbi_get_endpoint_info(dev, endpoint, &info);
+	if (r < 0)
+		return r;
+	return endpoint_granularity(&info);
+}
+
+/* returns the libusb_transfer_type of an endpoint in the active
+ * configuration, or a LIBUSB_ERROR code */
+int usbi_get_endpoint_type(libusb_device *dev, unsigned char endpoint)
+{
+	struct usbi_endpoint_info info;
+	int r;
+
+	r = usbi_get_endpoint_info(dev, endpoint, &info);
+	if (r == LIBUSB_ERROR_NOT_FOUND)
+		return r;
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	return info.type;
+}
+
+/** \ingroup dev
+ * Get the runtime power management state of a device.
+ *
+ * Where the operating system suspends idle devices (autosuspend), the first
+ * transfer after a quiet period waits for the device to resume, which can
+ * take tens of milliseconds. Operating systems do not count resumes, so the
+ * suspends_seen field is only an estimate, to correlate with latency
+ * outliers: each call that finds the device's suspended time grown since
+ * the previous call counts one suspend period, however many there were in
+ * between. Poll this regularly for a closer estimate.
+ *
+ * \param dev the device
+ * \param state output location for the state
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without runtime power
+ * management
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_power_state(libusb_device *dev,
+	struct libusb_power_state *state)
+{
+	int r;
+
+	if (!usbi_backend->get_power_state)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	memset(state, 0, sizeof(*state));
+	r = usbi_backend->get_power_state(dev, state);
+	if (r < 0)
+		return r;
 
-	r = val & 0x07ff;
-	if (ep_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
-			|| ep_type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
-		r *= (1 + ((val >> 11) & 3));
+	usbi_mutex_lock(&dev->lock);
+	if (state->suspended_time_ms > dev->pm_suspended_time_ms
+			&& dev->pm_suspended_time_ms != (uint64_t) -1)
+		dev->pm_suspends_seen++;
+	if (dev->pm_suspended_time_ms == (uint64_t) -1
+			|| state->suspended_time_ms > dev->pm_suspended_time_ms)
+		dev->pm_suspended_time_ms = state->suspended_time_ms;
+	state->suspends_seen = dev->pm_suspends_seen;
+	state->awake_handles = dev->pm_awake_handles;
+	usbi_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/** \ingroup dev
+ * Set the runtime power management policy of a device. This usually needs
+ * elevated privileges. The policy set here is kept when the last handle
+ * keeping the device awake closes, see libusb_set_keep_awake().
+ *
+ * \param dev the device
+ * \param enable 1 to let the operating system suspend the device when idle,
+ * 0 to keep it awake
+ * \param delay_ms idle time before the device is suspended, in
+ * milliseconds, or -1 to leave it unchanged
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_ACCESS if the process may not change the policy
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without runtime power
+ * management
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_autosuspend(libusb_device *dev, int enable,
+	int delay_ms)
+{
+	int r;
+
+	if (!usbi_backend->set_autosuspend)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_mutex_lock(&dev->lock);
+	r = usbi_backend->set_autosuspend(dev, enable ? 1 : 0, delay_ms);
+	/* the application now owns the policy */
+	if (r == 0)
+		dev->pm_restore_autosuspend = 0;
+	usbi_mutex_unlock(&dev->lock);
 	return r;
 }
 
+/** \ingroup dev
+ * Keep devices awake while they are open. With this enabled, libusb_open()
+ * disables autosuspend on a device whose policy allows it, and the last
+ * libusb_close() of a handle opened that way restores the policy, unless
+ * libusb_set_autosuspend() was called in the meantime. Applies to handles
+ * opened after the call. This usually needs elevated privileges;
+ * devices whose policy cannot be changed are opened all the same.
+ *
+ * \param ctx the context, or NULL for the default context
+ * \param enable 1 to keep devices awake while open, 0 to stop doing so
+ */
+void API_EXPORTED libusb_set_keep_awake(libusb_context *ctx, int enable)
+{
+	USBI_GET_CONTEXT(ctx);
+	ctx->keep_awake = enable ? 1 : 0;
+}
+
+/* with keep_awake, hold a device awake for as long as a handle is open */
+static void pin_awake(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	struct libusb_power_state state;
+	int r;
+
+	if (!DEVICE_CTX(dev)->keep_awake || !usbi_backend->get_power_state
+			|| !usbi_backend->set_autosuspend)
+		return;
+
+	usbi_mutex_lock(&dev->lock);
+	dev_handle->pinned_awake = 1;
+	if (dev->pm_awake_handles++ == 0) {
+		memset(&state, 0, sizeof(state));
+		if (usbi_backend->get_power_state(dev, &state) == 0
+				&& state.autosuspend) {
+			r = usbi_backend->set_autosuspend(dev, 0, -1);
+			if (r == 0)
+				dev->pm_restore_autosuspend = 1;
+			else
+				usbi_dbg_ctx(DEVICE_CTX(dev),
+					"can't disable autosuspend: %d", r);
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+}
+
+static void unpin_awake(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_device *dev = dev_handle->dev;
+
+	if (!dev_handle->pinned_awake)
+		return;
+
+	usbi_mutex_lock(&dev->lock);
+	if (--dev->pm_awake_handles == 0 && dev->pm_restore_autosuspend) {
+		dev->pm_restore_autosuspend = 0;
+		usbi_backend->set_autosuspend(dev, 1, -1);
+	}
+	usbi_mutex_unlock(&dev->lock);
+}
+
 /** \ingroup dev
  * Increment the reference count of a device.
  * \param dev the device to reference
@@ -904,10 +1112,12 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 	usbi_mutex_unlock(&dev->lock);
 
 	if (refcnt == 0) {
-		usbi_dbg("destroy device %d.%d", dev->bus_number, dev->device_address);
+		usbi_dbg_ctx(DEVICE_CTX(dev), "destroy device %d.%d",
+			dev->bus_number, dev->device_address);
 
 		if (usbi_backend->destroy_device)
 			usbi_backend->destroy_device(dev);
+		usbi_clear_descriptor_cache(dev);
 
 		usbi_mutex_lock(&dev->ctx->usb_devs_lock);
 		list_del(&dev->list);
@@ -988,7 +1198,8 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	struct libusb_device_handle *_handle;
 	size_t priv_size = usbi_backend->device_handle_priv_size;
 	int r;
-	usbi_dbg("open %d.%d", dev->bus_number, dev->device_address);
+	usbi_dbg_ctx(DEVICE_CTX(dev), "open %d.%d", dev->bus_number,
+		dev->device_address);
 
 	_handle = malloc(sizeof(*_handle) + priv_size);
 	if (!_handle)
@@ -1002,17 +1213,24 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 
 	_handle->dev = libusb_ref_device(dev);
 	_handle->claimed_interfaces = 0;
+	_handle->pinned_awake = 0;
+	_handle->priority = LIBUSB_PRIORITY_NORMAL;
+	memset((void *) _handle->ep_priority, 0, sizeof(_handle->ep_priority));
+	_handle->high_priority = 0;
 	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
 	if (r < 0) {
-		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
+		usbi_dbg_ctx(DEVICE_CTX(dev), "open %d.%d returns %d",
+			dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
 		usbi_mutex_destroy(&_handle->lock);
 		free(_handle);
 		return r;
 	}
 
+	pin_awake(_handle);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_add(&_handle->list, &ctx->open_devs);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
@@ -1122,8 +1340,8 @@ static void do_close(struct libusb_context *ctx,
 		 * just making sure that we don't attempt to process the transfer after
 		 * the device handle is invalid
 		 */
-		usbi_dbg("Removed transfer %p from the in-flight list because device handle %p closed",
-			 transfer, dev_handle);
+		usbi_dbg_ctx(ctx, "Removed transfer %p from the in-flight list "
+			"because device handle %p closed", transfer, dev_handle);
 	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
@@ -1134,6 +1352,7 @@ static void do_close(struct libusb_context *ctx,
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend->close(dev_handle);
+	unpin_awake(dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
@@ -1158,7 +1377,7 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	if (!dev_handle)
 		return;
-	usbi_dbg("");
+	usbi_dbg_ctx(HANDLE_CTX(dev_handle), "");
 
 	ctx = HANDLE_CTX(dev_handle);
 
@@ -1242,13 +1461,13 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 {
 	int r = LIBUSB_ERROR_NOT_SUPPORTED;
 
-	usbi_dbg("");
+	usbi_dbg_ctx(HANDLE_CTX(dev), "");
 	if (usbi_backend->get_configuration)
 		r = usbi_backend->get_configuration(dev, config);
 
 	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
 		uint8_t tmp = 0;
-		usbi_dbg("falling back to control message");
+		usbi_dbg_ctx(HANDLE_CTX(dev), "falling back to control message");
 		r = libusb_control_transfer(dev, LIBUSB_ENDPOINT_IN,
 			LIBUSB_REQUEST_GET_CONFIGURATION, 0, 0, &tmp, 1, 1000);
 		if (r == 0) {
@@ -1258,12 +1477,13 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 			r = 0;
 			*config = tmp;
 		} else {
-			usbi_dbg("control failed, error %d", r);
+			usbi_dbg_ctx(HANDLE_CTX(dev), "control failed, error %d",
+				r);
 		}
 	}
 
 	if (r == 0)
-		usbi_dbg("active config %d", *config);
+		usbi_dbg_ctx(HANDLE_CTX(dev), "active config %d", *config);
 
 	return r;
 }
@@ -1309,8 +1529,16 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev,
 	int configuration)
 {
-	usbi_dbg("configuration %d", configuration);
-	return usbi_backend->set_configuration(dev, configuration);
+	int r;
+
+	usbi_dbg_ctx(HANDLE_CTX(dev), "configuration %d", configuration);
+	r = usbi_backend->set_configuration(dev, configuration);
+
+	/* the endpoints are those of the new configuration */
+	usbi_mutex_lock(&dev->dev->lock);
+	dev->dev->ep_info_valid = 0;
+	usbi_mutex_unlock(&dev->dev->lock);
+	return r;
 }
 
 /** \ingroup dev
@@ -1342,7 +1570,7 @@ int API_EXPORTED libusb_claim_interface(libusb_device_handle *dev,
 {
 	int r = 0;
 
-	usbi_dbg("interface %d", interface_number);
+	usbi_dbg_ctx(HANDLE_CTX(dev), "interface %d", interface_number);
 	if (interface_number >= USB_MAXINTERFACES)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
@@ -1379,7 +1607,7 @@ int API_EXPORTED libusb_release_interface(libusb_device_handle *dev,
 {
 	int r;
 
-	usbi_dbg("interface %d", interface_number);
+	usbi_dbg_ctx(HANDLE_CTX(dev), "interface %d", interface_number);
 	if (interface_number >= USB_MAXINTERFACES)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
@@ -1422,7 +1650,7 @@ out:
 int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev,
 	int interface_number, int alternate_setting)
 {
-	usbi_dbg("interface %d altsetting %d",
+	usbi_dbg_ctx(HANDLE_CTX(dev), "interface %d altsetting %d",
 		interface_number, alternate_setting);
 	if (interface_number >= USB_MAXINTERFACES)
 		return LIBUSB_ERROR_INVALID_PARAM;
@@ -1438,6 +1666,391 @@ int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev,
 		alternate_setting);
 }
 
+/* asynchronous device operations:
+ * libusb_open_async() and friends queue the corresponding blocking call for
+ * an internal worker pool, started on first use and grown on demand up to
+ * USBI_MAX_DEVICE_OP_THREADS threads. Operations on the same device are run
+ * one at a time, in submission order; operations on different devices run
+ * in parallel. Each finished operation is moved to the done list and a byte
+ * is written to device_ops_pipe, whose read end is one of the context's poll
+ * fds, so that the callback is invoked from the event handling thread like
+ * any transfer callback. device_ops_pipe is only read or written under
+ * device_ops_lock, which is taken before pollfds_lock where both are
+ * needed. */
+
+enum usbi_device_op_type {
+	USBI_DEVICE_OP_OPEN,
+	USBI_DEVICE_OP_CLAIM_INTERFACE,
+	USBI_DEVICE_OP_SET_CONFIGURATION,
+	USBI_DEVICE_OP_SET_INTERFACE_ALT_SETTING,
+};
+
+struct usbi_device_op {
+	struct list_head list;
+	enum usbi_device_op_type type;
+	/* device is referenced while the operation is outstanding */
+	struct libusb_device *dev;
+	struct libusb_device_handle *dev_handle;
+	int arg1;
+	int arg2;
+	int running;
+	int result;
+	libusb_device_op_cb_fn cb;
+	void *user_data;
+};
+
+void usbi_device_ops_init(struct libusb_context *ctx)
+{
+	usbi_mutex_init(&ctx->device_ops_lock, NULL);
+	usbi_cond_init(&ctx->device_ops_cond, NULL);
+	list_init(&ctx->device_ops);
+	list_init(&ctx->device_ops_done);
+	ctx->device_ops_pipe[0] = -1;
+	ctx->device_ops_pipe[1] = -1;
+	ctx->device_ops_threads = 0;
+	ctx->device_ops_idle = 0;
+	ctx->device_ops_exit = 0;
+}
+
+/* first queued operation whose device has no operation running. called with
+ * device_ops_lock held */
+static struct usbi_device_op *next_device_op(struct libusb_context *ctx)
+{
+	struct usbi_device_op *op, *other;
+
+	list_for_each_entry(op, &ctx->device_ops, list, struct usbi_device_op) {
+		int busy = 0;
+
+		if (op->running)
+			continue;
+		list_for_each_entry(other, &ctx->device_ops, list,
+				struct usbi_device_op) {
+			if (other == op)
+				break;
+			/* an earlier operation on the same device, running or not */
+			if (other->dev == op->dev) {
+				busy = 1;
+				break;
+			}
+		}
+		if (!busy)
+			return op;
+	}
+
+	return NULL;
+}
+
+static void run_device_op(struct usbi_device_op *op)
+{
+	switch (op->type) {
+	case USBI_DEVICE_OP_OPEN:
+		op->result = libusb_open(op->dev, &op->dev_handle);
+		if (op->result < 0)
+			op->dev_handle = NULL;
+		break;
+	case USBI_DEVICE_OP_CLAIM_INTERFACE:
+		op->result = libusb_claim_interface(op->dev_handle, op->arg1);
+		break;
+	case USBI_DEVICE_OP_SET_CONFIGURATION:
+		op->result = libusb_set_configuration(op->dev_handle, op->arg1);
+		break;
+	case USBI_DEVICE_OP_SET_INTERFACE_ALT_SETTING:
+		op->result = libusb_set_interface_alt_setting(op->dev_handle,
+			op->arg1, op->arg2);
+		break;
+	}
+}
+
+static void *device_op_worker(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct usbi_device_op *op;
+	unsigned char dummy = 1;
+
+	usbi_sched_thread_start(ctx, "device ops");
+	usbi_mutex_lock(&ctx->device_ops_lock);
+	while (!ctx->device_ops_exit) {
+		op = next_device_op(ctx);
+		if (!op) {
+			ctx->device_ops_idle++;
+			usbi_cond_wait(&ctx->device_ops_cond, &ctx->device_ops_lock);
+			ctx->device_ops_idle--;
+			continue;
+		}
+
+		op->running = 1;
+		usbi_mutex_unlock(&ctx->device_ops_lock);
+
+		run_device_op(op);
+
+		usbi_mutex_lock(&ctx->device_ops_lock);
+		list_del(&op->list);
+		list_add_tail(&op->list, &ctx->device_ops_done);
+		if (usbi_write(ctx->device_ops_pipe[1], &dummy, sizeof(dummy))
+				!= sizeof(dummy))
+			usbi_warn(ctx, "device op completion signalling failed");
+
+		/* the next operation on this device may now be runnable */
+		usbi_cond_broadcast(&ctx->device_ops_cond);
+	}
+	usbi_mutex_unlock(&ctx->device_ops_lock);
+	usbi_sched_thread_stop(ctx);
+
+	return NULL;
+}
+
+static int queue_device_op(struct libusb_context *ctx,
+	struct usbi_device_op *op)
+{
+	int new_pollfd = 0;
+	int r;
+
+	usbi_mutex_lock(&ctx->device_ops_lock);
+	if (ctx->device_ops_pipe[0] < 0) {
+		r = usbi_pipe(ctx->device_ops_pipe);
+		if (r < 0) {
+			usbi_mutex_unlock(&ctx->device_ops_lock);
+			return LIBUSB_ERROR_OTHER;
+		}
+		r = usbi_add_pollfd(ctx, ctx->device_ops_pipe[0], POLLIN);
+		if (r < 0) {
+			usbi_close(ctx->device_ops_pipe[0]);
+			usbi_close(ctx->device_ops_pipe[1]);
+			ctx->device_ops_pipe[0] = ctx->device_ops_pipe[1] = -1;
+			usbi_mutex_unlock(&ctx->device_ops_lock);
+			return r;
+		}
+		new_pollfd = 1;
+	}
+
+	if (ctx->device_ops_idle == 0
+			&& ctx->device_ops_threads < USBI_MAX_DEVICE_OP_THREADS) {
+		r = usbi_thread_create(
+			&ctx->device_ops_thread[ctx->device_ops_threads],
+			device_op_worker, ctx);
+		if (r == 0) {
+			ctx->device_ops_threads++;
+		} else if (ctx->device_ops_threads == 0) {
+			usbi_err(ctx, "failed to create device op thread, error %d", r);
+			usbi_mutex_unlock(&ctx->device_ops_lock);
+			if (new_pollfd)
+				usbi_fd_notification(ctx);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+
+	libusb_ref_device(op->dev);
+	list_add_tail(&op->list, &ctx->device_ops);
+	usbi_cond_signal(&ctx->device_ops_cond);
+	usbi_mutex_unlock(&ctx->device_ops_lock);
+
+	/* the new fd must be picked up by any thread already in poll(). this
+	 * takes the events lock, so can't be done under device_ops_lock */
+	if (new_pollfd)
+		usbi_fd_notification(ctx);
+	return 0;
+}
+
+/* invoke the callbacks of finished operations. called by the event handler
+ * when the device ops pipe is readable */
+void usbi_handle_device_op_completions(struct libusb_context *ctx)
+{
+	struct list_head done;
+	struct usbi_device_op *op, *tmp;
+	unsigned char dummy;
+
+	list_init(&done);
+
+	usbi_mutex_lock(&ctx->device_ops_lock);
+	list_for_each_entry_safe(op, tmp, &ctx->device_ops_done, list,
+			struct usbi_device_op) {
+		/* one byte was written for each finished operation */
+		if (usbi_read(ctx->device_ops_pipe[0], &dummy, sizeof(dummy))
+				!= sizeof(dummy))
+			usbi_warn(ctx, "device op completion read failed");
+		list_del(&op->list);
+		list_add_tail(&op->list, &done);
+	}
+	usbi_mutex_unlock(&ctx->device_ops_lock);
+
+	list_for_each_entry_safe(op, tmp, &done, list, struct usbi_device_op) {
+		list_del(&op->list);
+		usbi_dbg_ctx(ctx, "device op %d completed with %d", op->type,
+			op->result);
+		if (op->cb)
+			op->cb(op->dev_handle, op->result, op->user_data);
+		libusb_unref_device(op->dev);
+		free(op);
+	}
+}
+
+void usbi_device_ops_exit(struct libusb_context *ctx)
+{
+	struct usbi_device_op *op, *tmp;
+	int i;
+
+	usbi_mutex_lock(&ctx->device_ops_lock);
+	ctx->device_ops_exit = 1;
+	usbi_cond_broadcast(&ctx->device_ops_cond);
+	usbi_mutex_unlock(&ctx->device_ops_lock);
+
+	for (i = 0; i < ctx->device_ops_threads; i++)
+		usbi_thread_join(ctx->device_ops_thread[i]);
+
+	/* operations that never ran, or whose callback was never delivered */
+	list_for_each_entry_safe(op, tmp, &ctx->device_ops, list,
+			struct usbi_device_op) {
+		list_del(&op->list);
+		libusb_unref_device(op->dev);
+		free(op);
+	}
+	list_for_each_entry_safe(op, tmp, &ctx->device_ops_done, list,
+			struct usbi_device_op) {
+		list_del(&op->list);
+		/* nobody ever got to see the handle of a finished open */
+		if (op->type == USBI_DEVICE_OP_OPEN && op->dev_handle)
+			libusb_close(op->dev_handle);
+		libusb_unref_device(op->dev);
+		free(op);
+	}
+
+	if (ctx->device_ops_pipe[0] >= 0) {
+		usbi_remove_pollfd(ctx, ctx->device_ops_pipe[0]);
+		usbi_close(ctx->device_ops_pipe[0]);
+		usbi_close(ctx->device_ops_pipe[1]);
+	}
+	usbi_mutex_destroy(&ctx->device_ops_lock);
+	usbi_cond_destroy(&ctx->device_ops_cond);
+}
+
+static int submit_device_op(struct libusb_context *ctx,
+	enum usbi_device_op_type type, struct libusb_device *dev,
+	struct libusb_device_handle *dev_handle, int arg1, int arg2,
+	libusb_device_op_cb_fn cb, void *user_data)
+{
+	struct usbi_device_op *op;
+	int r;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return LIBUSB_ERROR_NO_MEM;
+
+	op->type = type;
+	op->dev = dev;
+	op->dev_handle = dev_handle;
+	op->arg1 = arg1;
+	op->arg2 = arg2;
+	op->cb = cb;
+	op->user_data = user_data;
+
+	r = queue_device_op(ctx, op);
+	if (r < 0)
+		free(op);
+	return r;
+}
+
+/** \ingroup dev
+ * Asynchronously open a device.
+ *
+ * libusb_open() is run on an internal worker thread, and cb is invoked
+ * from the event handling thread (during libusb_handle_events() and
+ * friends) once it has finished, with the new handle or NULL. Operations on
+ * different devices run in parallel, so a slow device does not hold up
+ * bringing up the others; operations on the same device (including those
+ * queued with libusb_claim_interface_async(),
+ * libusb_set_configuration_async() and
+ * libusb_set_interface_alt_setting_async()) are run in submission order.
+ *
+ * This is a non-blocking function.
+ *
+ * \param dev the device to open
+ * \param cb function to call on completion. Its result argument is as
+ * libusb_open() would return.
+ * \param user_data user data to pass to cb
+ * \returns 0 if the operation was queued
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_open_async(libusb_device *dev,
+	libusb_device_op_cb_fn cb, void *user_data)
+{
+	return submit_device_op(DEVICE_CTX(dev), USBI_DEVICE_OP_OPEN, dev, NULL,
+		0, 0, cb, user_data);
+}
+
+/** \ingroup dev
+ * Asynchronously claim an interface. Runs libusb_claim_interface() on an
+ * internal worker thread; see libusb_open_async() for details.
+ *
+ * The handle must stay open until cb has been invoked.
+ *
+ * This is a non-blocking function.
+ *
+ * \param dev a device handle
+ * \param interface_number the <tt>bInterfaceNumber</tt> of the interface
+ * you wish to claim
+ * \param cb function to call on completion
+ * \param user_data user data to pass to cb
+ * \returns 0 if the operation was queued, or a LIBUSB_ERROR code
+ */
+int API_EXPORTED libusb_claim_interface_async(libusb_device_handle *dev,
+	int interface_number, libusb_device_op_cb_fn cb, void *user_data)
+{
+	return submit_device_op(HANDLE_CTX(dev), USBI_DEVICE_OP_CLAIM_INTERFACE,
+		dev->dev, dev, interface_number, 0, cb, user_data);
+}
+
+/** \ingroup dev
+ * Asynchronously set the active configuration. Runs
+ * libusb_set_configuration() on an internal worker thread; see
+ * libusb_open_async() for details.
+ *
+ * The handle must stay open until cb has been invoked.
+ *
+ * This is a non-blocking function.
+ *
+ * \param dev a device handle
+ * \param configuration the <tt>bConfigurationValue</tt> of the configuration
+ * you wish to activate, or -1 if you wish to put the device in unconfigured
+ * state
+ * \param cb function to call on completion
+ * \param user_data user data to pass to cb
+ * \returns 0 if the operation was queued, or a LIBUSB_ERROR code
+ */
+int API_EXPORTED libusb_set_configuration_async(libusb_device_handle *dev,
+	int configuration, libusb_device_op_cb_fn cb, void *user_data)
+{
+	return submit_device_op(HANDLE_CTX(dev), USBI_DEVICE_OP_SET_CONFIGURATION,
+		dev->dev, dev, configuration, 0, cb, user_data);
+}
+
+/** \ingroup dev
+ * Asynchronously activate an alternate setting for an interface. Runs
+ * libusb_set_interface_alt_setting() on an internal worker thread; see
+ * libusb_open_async() for details.
+ *
+ * The handle must stay open until cb has been invoked.
+ *
+ * This is a non-blocking function.
+ *
+ * \param dev a device handle
+ * \param interface_number the <tt>bInterfaceNumber</tt> of the
+ * previously-claimed interface
+ * \param alternate_setting the <tt>bAlternateSetting</tt> of the alternate
+ * setting to activate
+ * \param cb function to call on completion
+ * \param user_data user data to pass to cb
+ * \returns 0 if the operation was queued, or a LIBUSB_ERROR code
+ */
+int API_EXPORTED libusb_set_interface_alt_setting_async(
+	libusb_device_handle *dev, int interface_number, int alternate_setting,
+	libusb_device_op_cb_fn cb, void *user_data)
+{
+	return submit_device_op(HANDLE_CTX(dev),
+		USBI_DEVICE_OP_SET_INTERFACE_ALT_SETTING, dev->dev, dev,
+		interface_number, alternate_setting, cb, user_data);
+}
+
 /** \ingroup dev
  * Clear the halt/stall condition for an endpoint. Endpoints with halt status
  * are unable to receive or transmit data until the halt condition is stalled.
@@ -1457,10 +2070,167 @@ int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev,
 int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev,
 	unsigned char endpoint)
 {
-	usbi_dbg("endpoint %x", endpoint);
+	usbi_dbg_ctx(HANDLE_CTX(dev), "endpoint %x", endpoint);
 	return usbi_backend->clear_halt(dev, endpoint);
 }
 
+/** \ingroup dev
+ * Allocate bulk streams on a set of SuperSpeed bulk endpoints. With streams,
+ * a device can service many outstanding commands in parallel on one
+ * endpoint pair, as storage devices using UAS do: each command's data
+ * moves on its own stream, in whatever order the device completes them.
+ *
+ * Streams are allocated together on all the endpoints which take part in
+ * them, typically a bulk IN and a bulk OUT endpoint, whose interfaces must
+ * be claimed. Submit transfers to a stream with
+ * libusb_fill_bulk_stream_transfer(), or with libusb_transfer_set_stream_id()
+ * on a transfer of type LIBUSB_TRANSFER_TYPE_BULK_STREAM. Stream IDs are 1
+ * up to the number of streams allocated.
+ *
+ * The number of streams an endpoint supports is given by MaxStreams in its
+ * SuperSpeed endpoint companion, see
+ * libusb_get_ss_endpoint_companion_descriptor(). The host controller may
+ * support fewer.
+ *
+ * This is a blocking function.
+ *
+ * \param dev a device handle
+ * \param num_streams the number of streams to allocate on each endpoint
+ * \param endpoints the endpoints to allocate streams on
+ * \param num_endpoints the number of endpoints
+ * \returns the number of streams allocated, which may be fewer than
+ * num_streams
+ * \returns LIBUSB_ERROR_INVALID_PARAM if an endpoint does not support
+ * streams
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support
+ * streams
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_alloc_streams(libusb_device_handle *dev,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	usbi_dbg_ctx(HANDLE_CTX(dev), "streams %u eps %d",
+		(unsigned) num_streams, num_endpoints);
+
+	if (!num_streams || !endpoints || num_endpoints <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend->alloc_streams)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->alloc_streams(dev, num_streams, endpoints,
+		num_endpoints);
+}
+
+/** \ingroup dev
+ * Free the bulk streams allocated with libusb_alloc_streams(). Streams are
+ * also freed when the interfaces of their endpoints are released.
+ *
+ * This is a blocking function.
+ *
+ * \param dev a device handle
+ * \param endpoints the endpoints to free streams on
+ * \param num_endpoints the number of endpoints
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support
+ * streams
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_free_streams(libusb_device_handle *dev,
+	unsigned char *endpoints, int num_endpoints)
+{
+	usbi_dbg_ctx(HANDLE_CTX(dev), "eps %d", num_endpoints);
+
+	if (!endpoints || num_endpoints <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend->free_streams)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->free_streams(dev, endpoints, num_endpoints);
+}
+
+static void update_high_priority(libusb_device_handle *dev)
+{
+	int high = dev->priority == LIBUSB_PRIORITY_HIGH;
+	int i;
+
+	for (i = 0; i < 32 && !high; i++)
+		high = dev->ep_priority[i] == LIBUSB_PRIORITY_HIGH + 1;
+	usbi_atomic_store(&dev->high_priority, high);
+}
+
+/** \ingroup dev
+ * Set the priority with which the completions of a device's transfers are
+ * dispatched. When an event handling pass finds completions of both
+ * classes, for this device or others, those of high priority have their
+ * callbacks invoked first, so that time-critical status on an interrupt or
+ * control endpoint is not held up behind a flood of bulk completions.
+ *
+ * Normal priority completions are not starved: they get at least one
+ * dispatch for every few high priority ones, and all completions reaped in
+ * a pass are dispatched before it returns.
+ *
+ * Priorities set on endpoints with libusb_set_endpoint_priority() override
+ * the priority of the handle. Only backends which reap completions
+ * themselves (Linux) honour priorities; others dispatch in their own order.
+ *
+ * \param dev a device handle
+ * \param priority a \ref libusb_priority class
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the priority is not a class
+ */
+int API_EXPORTED libusb_set_handle_priority(libusb_device_handle *dev,
+	int priority)
+{
+	if (priority != LIBUSB_PRIORITY_NORMAL && priority != LIBUSB_PRIORITY_HIGH)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&dev->lock);
+	usbi_atomic_store(&dev->priority, priority);
+	update_high_priority(dev);
+	usbi_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/** \ingroup dev
+ * Set the priority with which the completions of the transfers on one
+ * endpoint are dispatched, overriding the priority of the handle. See
+ * libusb_set_handle_priority(). Endpoint 0 covers control transfers.
+ *
+ * The priority applies to transfers submitted after the call.
+ *
+ * \param dev a device handle
+ * \param endpoint address of the endpoint in question
+ * \param priority a \ref libusb_priority class
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the priority is not a class
+ */
+int API_EXPORTED libusb_set_endpoint_priority(libusb_device_handle *dev,
+	unsigned char endpoint, int priority)
+{
+	if (priority != LIBUSB_PRIORITY_NORMAL && priority != LIBUSB_PRIORITY_HIGH)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&dev->lock);
+	usbi_atomic_store(&dev->ep_priority[USBI_EP_INDEX(endpoint)],
+		priority + 1);
+	update_high_priority(dev);
+	usbi_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/* the dispatch priority of a transfer, read by backends when it is
+ * submitted. this is on the submission path, so it does not take the lock:
+ * a transfer submitted while the priority changes may get either */
+int usbi_get_transfer_priority(struct libusb_transfer *transfer)
+{
+	libusb_device_handle *dev = transfer->dev_handle;
+	int priority;
+
+	priority = usbi_atomic_load(
+		&dev->ep_priority[USBI_EP_INDEX(transfer->endpoint)]);
+	return priority ? priority - 1 : usbi_atomic_load(&dev->priority);
+}
+
 /** \ingroup dev
  * Perform a USB port reset to reinitialize a device. The system will attempt
  * to restore the previous configuration and alternate settings after the
@@ -1482,8 +2252,14 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 {
-	usbi_dbg("");
-	return usbi_backend->reset_device(dev);
+	int r;
+
+	usbi_dbg_ctx(HANDLE_CTX(dev), "");
+	r = usbi_backend->reset_device(dev);
+
+	/* the device may come back with different descriptors */
+	usbi_clear_descriptor_cache(dev->dev);
+	return r;
 }
 
 /** \ingroup dev
@@ -1506,7 +2282,7 @@ int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 int API_EXPORTED libusb_kernel_driver_active(libusb_device_handle *dev,
 	int interface_number)
 {
-	usbi_dbg("interface %d", interface_number);
+	usbi_dbg_ctx(HANDLE_CTX(dev), "interface %d", interface_number);
 	if (usbi_backend->kernel_driver_active)
 		return usbi_backend->kernel_driver_active(dev, interface_number);
 	else
@@ -1533,7 +2309,7 @@ int API_EXPORTED libusb_kernel_driver_active(libusb_device_handle *dev,
 int API_EXPORTED libusb_detach_kernel_driver(libusb_device_handle *dev,
 	int interface_number)
 {
-	usbi_dbg("interface %d", interface_number);
+	usbi_dbg_ctx(HANDLE_CTX(dev), "interface %d", interface_number);
 	if (usbi_backend->detach_kernel_driver)
 		return usbi_backend->detach_kernel_driver(dev, interface_number);
 	else
@@ -1563,7 +2339,7 @@ int API_EXPORTED libusb_detach_kernel_driver(libusb_device_handle *dev,
 int API_EXPORTED libusb_attach_kernel_driver(libusb_device_handle *dev,
 	int interface_number)
 {
-	usbi_dbg("interface %d", interface_number);
+	usbi_dbg_ctx(HANDLE_CTX(dev), "interface %d", interface_number);
 	if (usbi_backend->attach_kernel_driver)
 		return usbi_backend->attach_kernel_driver(dev, interface_number);
 	else
@@ -1592,14 +2368,134 @@ int API_EXPORTED libusb_attach_kernel_driver(libusb_device_handle *dev,
  * If libusbx was compiled with verbose debug message logging, this function
  * does nothing: you'll always get messages from all levels.
  *
+ * This sets the verbosity of all \ref libusb_log_category "log categories";
+ * see libusb_set_log_level() to set them individually, and
+ * libusb_set_log_cb() to receive messages instead of having them printed.
+ *
  * \param ctx the context to operate on, or NULL for the default context
  * \param level debug level to set
  */
 void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 {
 	USBI_GET_CONTEXT(ctx);
-	if (!ctx->debug_fixed)
+	if (!ctx->debug_fixed) {
 		ctx->debug = level;
+		usbi_log_set_levels(ctx, level);
+	}
+}
+
+/** \ingroup lib
+ * Set the number of threads that may be used to initialize newly discovered
+ * devices during libusb_get_device_list().
+ *
+ * Initializing a device can involve I/O to it (for example on Linux systems
+ * without sysfs descriptors), which may take several milliseconds on slow
+ * devices. With more than one thread, this work is spread over a bounded
+ * pool of short-lived threads and the enumeration latency approaches that
+ * of the slowest device. The order of the returned device list is the same
+ * as with sequential enumeration.
+ *
+ * Only the Linux backend currently honours this setting.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_threads maximum number of threads to use. 0 or 1 (the
+ * default) initializes devices sequentially in the calling thread.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_threads is negative
+ */
+int API_EXPORTED libusb_set_enumeration_threads(libusb_context *ctx,
+	int num_threads)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (num_threads < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ctx->enum_threads = num_threads;
+	return 0;
+}
+
+/** \ingroup lib
+ * Enable a persistent cache of device descriptors, stored in a file.
+ *
+ * On systems where descriptors cannot be obtained without talking to the
+ * devices, enumeration has to read the device and configuration descriptors
+ * of every newly seen device. With a cache file, these are recorded during
+ * libusb_get_device_list() and reused by later processes, as long as the
+ * cache can confirm that the device has not changed since. Entries for
+ * devices that are no longer present are dropped when the cache is written
+ * back after the next complete enumeration.
+ *
+ * Only the Linux backend currently uses the cache, and only on kernels
+ * whose sysfs lacks the descriptors file. This function must not be called
+ * while another thread is enumerating devices on the same context.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param path file to keep the cache in, which is created if necessary, or
+ * NULL to disable the cache
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_set_descriptor_cache(libusb_context *ctx,
+	const char *path)
+{
+	char *copy = NULL;
+
+	USBI_GET_CONTEXT(ctx);
+	if (path) {
+		copy = malloc(strlen(path) + 1);
+		if (!copy)
+			return LIBUSB_ERROR_NO_MEM;
+		strcpy(copy, path);
+	}
+
+	free(ctx->desc_cache_path);
+	ctx->desc_cache_path = copy;
+	return 0;
+}
+
+/** \ingroup lib
+ * Set the directories a context enumerates and opens devices from.
+ *
+ * On Linux, devices are found through sysfs and usbfs, which a context
+ * looks for in their usual places when it is initialized, unless the
+ * LIBUSB_SYSFS_PATH and LIBUSB_USBFS_PATH environment variables say
+ * otherwise. This function points one context at other directories, for
+ * example a synthetic tree used for testing, without affecting other
+ * contexts or having to change the environment.
+ *
+ * This function must be called before the context has discovered any
+ * devices, i.e. before the first libusb_get_device_list() or
+ * libusb_open_device_with_vid_pid() on it. Only the Linux backend
+ * currently supports it.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param usbfs_path the directory holding the usbfs bus directories (as
+ * /dev/bus/usb does), or NULL for the environment variable or default
+ * \param sysfs_path the directory holding the sysfs device entries (as
+ * /sys/bus/usb/devices does), or NULL for the environment variable or
+ * default
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if usbfs_path does not hold a usbfs tree
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a path is too long
+ * \returns LIBUSB_ERROR_BUSY if the context has already discovered devices
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms other than Linux
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_device_roots(libusb_context *ctx,
+	const char *usbfs_path, const char *sysfs_path)
+{
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!usbi_backend->set_device_roots)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	if (!list_empty(&ctx->usb_devs))
+		r = LIBUSB_ERROR_BUSY;
+	else
+		r = usbi_backend->set_device_roots(ctx, usbfs_path, sysfs_path);
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	return r;
 }
 
 /** \ingroup lib
@@ -1619,31 +2515,25 @@ int API_EXPORTED libusb_init(libusb_context **context)
 {
 	char *dbg = getenv("LIBUSB_DEBUG");
 	struct libusb_context *ctx;
+	size_t priv_size = usbi_backend->context_priv_size;
 	int r = 0;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
-	if (!timestamp_origin.tv_sec) {
-		usbi_gettimeofday(&timestamp_origin, NULL);
-	}
-
 	if (!context && usbi_default_context) {
-		usbi_dbg("reusing default context");
+		usbi_dbg_ctx(usbi_default_context, "reusing default context");
 		default_context_refcnt++;
 		usbi_mutex_static_unlock(&default_context_lock);
 		return 0;
 	}
 
-	ctx = malloc(sizeof(*ctx));
+	ctx = malloc(sizeof(*ctx) + priv_size);
 	if (!ctx) {
 		r = LIBUSB_ERROR_NO_MEM;
 		goto err_unlock;
 	}
-	memset(ctx, 0, sizeof(*ctx));
-
-#ifdef ENABLE_DEBUG_LOGGING
-	ctx->debug = LOG_LEVEL_DEBUG;
-#endif
+	memset(ctx, 0, sizeof(*ctx) + priv_size);
+	usbi_sched_init(ctx);
 
 	if (dbg) {
 		ctx->debug = atoi(dbg);
@@ -1651,14 +2541,22 @@ int API_EXPORTED libusb_init(libusb_context **context)
 			ctx->debug_fixed = 1;
 	}
 
+#ifdef ENABLE_DEBUG_LOGGING
+	/* verbose debug builds always log everything */
+	ctx->debug = LOG_LEVEL_DEBUG;
+	ctx->debug_fixed = 1;
+#endif
+	usbi_log_init(ctx);
+
 	/* default context should be initialized before calling usbi_dbg */
 	if (!usbi_default_context) {
 		usbi_default_context = ctx;
-		usbi_dbg("created default context");
+		usbi_dbg_ctx(ctx, "created default context");
 	}
 
-	usbi_dbg("libusbx v%d.%d.%d.%d", libusb_version_internal.major, libusb_version_internal.minor,
-		libusb_version_internal.micro, libusb_version_internal.nano);
+	usbi_dbg_ctx(ctx, "libusbx v%d.%d.%d.%d", libusb_version_internal.major,
+		libusb_version_internal.minor, libusb_version_internal.micro,
+		libusb_version_internal.nano);
 
 	if (usbi_backend->init) {
 		r = usbi_backend->init(ctx);
@@ -1677,11 +2575,14 @@ int API_EXPORTED libusb_init(libusb_context **context)
 			usbi_backend->exit();
 		goto err_destroy_mutex;
 	}
+	usbi_device_ops_init(ctx);
+	usbi_mutex_init(&ctx->capture_lock, NULL);
+	usbi_buffers_init(ctx);
 
 	if (context) {
 		*context = ctx;
 	} else if (!usbi_default_context) {
-		usbi_dbg("created default context");
+		usbi_dbg_ctx(ctx, "created default context");
 		usbi_default_context = ctx;
 		default_context_refcnt++;
 	}
@@ -1693,6 +2594,8 @@ err_destroy_mutex:
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 err_free_ctx:
+	usbi_log_exit(ctx);
+	usbi_sched_exit(ctx);
 	free(ctx);
 err_unlock:
 	usbi_mutex_static_unlock(&default_context_lock);
@@ -1706,35 +2609,49 @@ err_unlock:
  */
 void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 {
-	usbi_dbg("");
 	USBI_GET_CONTEXT(ctx);
+	usbi_dbg_ctx(ctx, "");
 
 	/* if working with default context, only actually do the deinitialization
 	 * if we're the last user */
 	if (ctx == usbi_default_context) {
 		usbi_mutex_static_lock(&default_context_lock);
 		if (--default_context_refcnt > 0) {
-			usbi_dbg("not destroying default context");
+			usbi_dbg_ctx(ctx, "not destroying default context");
 			usbi_mutex_static_unlock(&default_context_lock);
 			return;
 		}
-		usbi_dbg("destroying default context");
+		usbi_dbg_ctx(ctx, "destroying default context");
 		usbi_default_context = NULL;
 		usbi_mutex_static_unlock(&default_context_lock);
 	}
 
+	/* closes the handles of asynchronous opens that were never delivered,
+	 * so must come before the check below */
+	usbi_device_ops_exit(ctx);
+
 	/* a little sanity check. doesn't bother with open_devs locking because
 	 * unless there is an application bug, nobody will be accessing this. */
 	if (!list_empty(&ctx->open_devs))
 		usbi_warn(ctx, "application left some devices open");
 
+	usbi_capture_exit(ctx);
+	usbi_buffers_exit(ctx);
 	usbi_io_exit(ctx);
 	if (usbi_backend->exit)
 		usbi_backend->exit();
 
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
+	usbi_log_exit(ctx);
+	usbi_sched_exit(ctx);
+	free(ctx->desc_cache_path);
 	free(ctx);
+
+#ifdef USBI_LOCK_PROFILING
+	if (getenv("LIBUSB_LOCK_STATS"))
+		usbi_lock_stats_dump();
+#endif
 }
 
 /** \ingroup misc
@@ -1753,6 +2670,35 @@ int API_EXPORTED libusb_has_capability(uint32_t capability)
 	return 0;
 }
 
+/** \ingroup misc
+ * Retrieve contention statistics for the library's internal locks.
+ *
+ * Statistics are only collected when libusbx was configured with
+ * --enable-lock-profiling, which makes every lock operation measurably
+ * slower; such builds also print the statistics to stderr from
+ * libusb_exit() if the LIBUSB_LOCK_STATS environment variable is set.
+ * Statistics are process-wide and cumulative: they cover all contexts.
+ * There is one entry for each call site that takes a lock.
+ *
+ * \param stats array to fill in
+ * \param max_stats number of elements in stats
+ * \returns the number of elements filled in
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if lock profiling was not built in
+ */
+int API_EXPORTED libusb_get_lock_stats(struct libusb_lock_stats *stats,
+	int max_stats)
+{
+#ifdef USBI_LOCK_PROFILING
+	if (!stats || max_stats < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	return usbi_lock_stats_get(stats, max_stats);
+#else
+	(void) stats;
+	(void) max_stats;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 /* this is defined in libusbi.h if needed */
 #ifdef LIBUSB_GETTIMEOFDAY_WIN32
 /*
@@ -1805,86 +2751,6 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp)
 }
 #endif
 
-void usbi_log_v(struct libusb_context *ctx, enum usbi_log_level level,
-	const char *function, const char *format, va_list args)
-{
-	const char *prefix = "";
-	struct timeval now;
-	int global_debug;
-	static int has_debug_header_been_displayed = 0;
-
-#ifdef ENABLE_DEBUG_LOGGING
-	global_debug = 1;
-#else
-	USBI_GET_CONTEXT(ctx);
-	if (ctx == NULL)
-		return;
-	global_debug = (ctx->debug == LOG_LEVEL_DEBUG);
-	if (!ctx->debug)
-		return;
-	if (level == LOG_LEVEL_WARNING && ctx->debug < LOG_LEVEL_WARNING)
-		return;
-	if (level == LOG_LEVEL_INFO && ctx->debug < LOG_LEVEL_INFO)
-		return;
-	if (level == LOG_LEVEL_DEBUG && ctx->debug < LOG_LEVEL_DEBUG)
-		return;
-#endif
-
-	usbi_gettimeofday(&now, NULL);
-	if ((global_debug) && (!has_debug_header_been_displayed)) {
-		has_debug_header_been_displayed = 1;
-		fprintf(stderr, "[timestamp] [threadID] facility level [function call] <message>\n");
-		fprintf(stderr, "--------------------------------------------------------------------------------\n");
-	}
-	if (now.tv_usec < timestamp_origin.tv_usec) {
-		now.tv_sec--;
-		now.tv_usec += 1000000;
-	}
-	now.tv_sec -= timestamp_origin.tv_sec;
-	now.tv_usec -= timestamp_origin.tv_usec;
-
-	switch (level) {
-	case LOG_LEVEL_INFO:
-		prefix = "info";
-		break;
-	case LOG_LEVEL_WARNING:
-		prefix = "warning";
-		break;
-	case LOG_LEVEL_ERROR:
-		prefix = "error";
-		break;
-	case LOG_LEVEL_DEBUG:
-		prefix = "debug";
-		break;
-	case LOG_LEVEL_NONE:
-		break;
-	default:
-		prefix = "unknown";
-		break;
-	}
-
-	if (global_debug) {
-		fprintf(stderr, "[%2d.%06d] [%08x] libusbx: %s [%s] ",
-			(int)now.tv_sec, (int)now.tv_usec, usbi_get_tid(), prefix, function);
-	} else {
-		fprintf(stderr, "libusbx: %s [%s] ", prefix, function);
-	}
-
-	vfprintf(stderr, format, args);
-
-	fprintf(stderr, "\n");
-}
-
-void usbi_log(struct libusb_context *ctx, enum usbi_log_level level,
-	const char *function, const char *format, ...)
-{
-	va_list args;
-
-	va_start (args, format);
-	usbi_log_v(ctx, level, function, format, args);
-	va_end (args);
-}
-
 /** \ingroup misc
  * Returns a constant NULL-terminated string with the ASCII name of a libusb
  * error code. The caller must not free() the returned string.
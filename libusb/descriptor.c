@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_DESCRIPTOR
 #include "libusbi.h"
 
 #define DESC_HEADER_LENGTH		2
@@ -127,7 +128,8 @@ static int parse_endpoint(struct libusb_context *ctx,
 				(header.bDescriptorType == LIBUSB_DT_DEVICE))
 			break;
 
-		usbi_dbg("skipping descriptor %x", header.bDescriptorType);
+		usbi_dbg_ctx(ctx, "skipping descriptor %x",
+			header.bDescriptorType);
 		buffer += header.bLength;
 		size -= header.bLength;
 		parsed += header.bLength;
@@ -386,7 +388,8 @@ static int parse_configuration(struct libusb_context *ctx,
 					(header.bDescriptorType == LIBUSB_DT_DEVICE))
 				break;
 
-			usbi_dbg("skipping descriptor 0x%x\n", header.bDescriptorType);
+			usbi_dbg_ctx(ctx, "skipping descriptor 0x%x\n",
+				header.bDescriptorType);
 			buffer += header.bLength;
 			size -= header.bLength;
 		}
@@ -439,7 +442,7 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
 	int host_endian = 0;
 	int r;
 
-	usbi_dbg("");
+	usbi_dbg_ctx(DEVICE_CTX(dev), "");
 	r = usbi_backend->get_device_descriptor(dev, raw_desc, &host_endian);
 	if (r < 0)
 		return r;
@@ -477,7 +480,7 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	int host_endian = 0;
 	int r;
 
-	usbi_dbg("");
+	usbi_dbg_ctx(DEVICE_CTX(dev), "");
 	if (!_config)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -542,7 +545,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	int host_endian = 0;
 	int r;
 
-	usbi_dbg("index %d", config_index);
+	usbi_dbg_ctx(DEVICE_CTX(dev), "index %d", config_index);
 	if (config_index >= dev->num_configurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
@@ -597,7 +600,7 @@ int usbi_get_config_index_by_value(struct libusb_device *dev,
 {
 	uint8_t i;
 
-	usbi_dbg("value %d", bConfigurationValue);
+	usbi_dbg_ctx(DEVICE_CTX(dev), "value %d", bConfigurationValue);
 	for (i = 0; i < dev->num_configurations; i++) {
 		unsigned char tmp[6];
 		int host_endian;
@@ -663,38 +666,483 @@ void API_EXPORTED libusb_free_config_descriptor(
 	free(config);
 }
 
+/* the SuperSpeed endpoint companion among the descriptors following an
+ * endpoint descriptor, or NULL */
+static const unsigned char *find_ss_companion(
+	const struct libusb_endpoint_descriptor *endpoint)
+{
+	const unsigned char *buffer = endpoint->extra;
+	int size = endpoint->extra_length;
+
+	while (size >= DESC_HEADER_LENGTH) {
+		if (buffer[0] < DESC_HEADER_LENGTH || buffer[0] > size)
+			return NULL;
+		if (buffer[1] == LIBUSB_DT_SS_ENDPOINT_COMPANION)
+			return buffer;
+		size -= buffer[0];
+		buffer += buffer[0];
+	}
+	return NULL;
+}
+
 /** \ingroup desc
- * Retrieve a string descriptor in C style ASCII.
+ * Get the SuperSpeed Endpoint Companion descriptor of an endpoint. Endpoints
+ * of devices running at SuperSpeed have one, which libusbx keeps among the
+ * extra descriptors of the endpoint.
  *
- * Wrapper around libusb_get_string_descriptor(). Uses the first language
- * supported by the device.
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param endpoint an endpoint descriptor from a configuration descriptor
+ * \param ep_comp output location for the companion descriptor. Only valid if
+ * 0 was returned. Must be freed with
+ * libusb_free_ss_endpoint_companion_descriptor() after use.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint has no companion
+ * \returns another LIBUSB_ERROR code on error
+ * \see libusb_get_endpoint_granularity()
+ */
+int API_EXPORTED libusb_get_ss_endpoint_companion_descriptor(
+	libusb_context *ctx, const struct libusb_endpoint_descriptor *endpoint,
+	struct libusb_ss_endpoint_companion_descriptor **ep_comp)
+{
+	struct libusb_ss_endpoint_companion_descriptor *_ep_comp;
+	const unsigned char *buffer;
+
+	USBI_GET_CONTEXT(ctx);
+	buffer = find_ss_companion(endpoint);
+	if (!buffer)
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (buffer[0] < LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE) {
+		usbi_err(ctx, "invalid endpoint companion length %d", buffer[0]);
+		return LIBUSB_ERROR_IO;
+	}
+
+	_ep_comp = malloc(sizeof(*_ep_comp));
+	if (!_ep_comp)
+		return LIBUSB_ERROR_NO_MEM;
+	usbi_parse_descriptor((unsigned char *) buffer, "bbbbw", _ep_comp, 0);
+	*ep_comp = _ep_comp;
+	return 0;
+}
+
+/** \ingroup desc
+ * Free a companion descriptor obtained from
+ * libusb_get_ss_endpoint_companion_descriptor(). It is safe to call this
+ * function with a NULL ep_comp parameter, in which case the function simply
+ * returns.
  *
- * \param dev a device handle
- * \param desc_index the index of the descriptor to retrieve
- * \param data output buffer for ASCII string descriptor
- * \param length size of data buffer
- * \returns number of bytes returned in data, or LIBUSB_ERROR code on failure
+ * \param ep_comp the companion descriptor to free
  */
-int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
-	uint8_t desc_index, unsigned char *data, int length)
+void API_EXPORTED libusb_free_ss_endpoint_companion_descriptor(
+	struct libusb_ss_endpoint_companion_descriptor *ep_comp)
 {
+	free(ep_comp);
+}
+
+static void fill_endpoint_info(struct usbi_endpoint_info *info,
+	const struct libusb_endpoint_descriptor *ep)
+{
+	const unsigned char *comp = find_ss_companion(ep);
+
+	info->present = 1;
+	info->type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+	info->max_packet_size = ep->wMaxPacketSize & 0x07ff;
+	info->transactions = 1;
+	if (info->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			|| info->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		info->transactions += (ep->wMaxPacketSize >> 11) & 3;
+
+	if (!comp || comp[0] < LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE)
+		return;
+	info->ss = 1;
+	info->max_burst = comp[2];
+	if (info->type == LIBUSB_TRANSFER_TYPE_BULK)
+		info->max_streams = comp[3] & 0x1f;
+	else if (info->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		info->mult = comp[3] & 0x03;
+	info->bytes_per_interval = (uint16_t) (comp[4] | (comp[5] << 8));
+}
+
+/* get the transfer sizing of an endpoint in the active configuration. The
+ * endpoints are parsed once, from the first altsetting which uses each
+ * address, and kept until the configuration is changed or the device is
+ * reset or disconnected */
+int usbi_get_endpoint_info(struct libusb_device *dev, unsigned char endpoint,
+	struct usbi_endpoint_info *info)
+{
+	struct usbi_endpoint_info ep_info[32];
+	struct libusb_config_descriptor *config;
+	int iface_idx, altsetting_idx, ep_idx;
+	int r;
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->ep_info_valid) {
+		*info = dev->ep_info[USBI_EP_INDEX(endpoint)];
+		usbi_mutex_unlock(&dev->lock);
+		return info->present ? 0 : LIBUSB_ERROR_NOT_FOUND;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return r;
+
+	memset(ep_info, 0, sizeof(ep_info));
+	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
+		const struct libusb_interface *iface = &config->interface[iface_idx];
+
+		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
+				altsetting_idx++) {
+			const struct libusb_interface_descriptor *altsetting
+				= &iface->altsetting[altsetting_idx];
+
+			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
+				const struct libusb_endpoint_descriptor *ep =
+					&altsetting->endpoint[ep_idx];
+				int i = USBI_EP_INDEX(ep->bEndpointAddress);
+
+				if (!ep_info[i].present)
+					fill_endpoint_info(&ep_info[i], ep);
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+
+	usbi_mutex_lock(&dev->lock);
+	memcpy(dev->ep_info, ep_info, sizeof(ep_info));
+	dev->ep_info_valid = 1;
+	*info = dev->ep_info[USBI_EP_INDEX(endpoint)];
+	usbi_mutex_unlock(&dev->lock);
+	return info->present ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void clear_bos(struct libusb_bos_descriptor *bos)
+{
+	if (bos->usb_2_0_extension)
+		free((void *) bos->usb_2_0_extension);
+	if (bos->ss_usb_device_capability)
+		free((void *) bos->ss_usb_device_capability);
+	if (bos->extra)
+		free((void *) bos->extra);
+}
+
+static int parse_bos(struct libusb_context *ctx,
+	struct libusb_bos_descriptor *bos, unsigned char *buffer, int size)
+{
+	struct libusb_usb_2_0_extension_descriptor *usb_2_0_extension;
+	struct libusb_ss_usb_device_capability_descriptor *ss_cap;
+	struct usb_descriptor_header header;
+	unsigned char *extra;
+	int i;
+	int r;
+
+	usbi_parse_descriptor(buffer, "bbwb", bos, 0);
+	bos->usb_2_0_extension = NULL;
+	bos->ss_usb_device_capability = NULL;
+	bos->extra = NULL;
+	bos->extra_length = 0;
+
+	if (bos->bDescriptorType != LIBUSB_DT_BOS
+			|| bos->bLength < LIBUSB_DT_BOS_SIZE || bos->bLength > size) {
+		usbi_err(ctx, "invalid BOS descriptor");
+		return LIBUSB_ERROR_IO;
+	}
+	if (size > bos->wTotalLength)
+		size = bos->wTotalLength;
+	buffer += bos->bLength;
+	size -= bos->bLength;
+
+	for (i = 0; i < bos->bNumDeviceCaps; i++) {
+		if (size < LIBUSB_DT_DEVICE_CAPABILITY_SIZE) {
+			usbi_warn(ctx, "ran out of device capabilities (%d of %d)", i,
+				bos->bNumDeviceCaps);
+			break;
+		}
+
+		usbi_parse_descriptor(buffer, "bb", &header, 0);
+		if (header.bLength < LIBUSB_DT_DEVICE_CAPABILITY_SIZE
+				|| header.bLength > size) {
+			usbi_err(ctx, "invalid device capability length %d",
+				header.bLength);
+			r = LIBUSB_ERROR_IO;
+			goto err;
+		}
+		if (header.bDescriptorType != LIBUSB_DT_DEVICE_CAPABILITY) {
+			usbi_err(ctx, "unexpected descriptor %x (expected %x)",
+				header.bDescriptorType, LIBUSB_DT_DEVICE_CAPABILITY);
+			r = LIBUSB_ERROR_IO;
+			goto err;
+		}
+
+		if (buffer[2] == LIBUSB_BT_USB_2_0_EXTENSION
+				&& header.bLength >= LIBUSB_BT_USB_2_0_EXTENSION_SIZE
+				&& !bos->usb_2_0_extension) {
+			usb_2_0_extension = malloc(sizeof(*usb_2_0_extension));
+			if (!usb_2_0_extension) {
+				r = LIBUSB_ERROR_NO_MEM;
+				goto err;
+			}
+			usbi_parse_descriptor(buffer, "bbb", usb_2_0_extension, 0);
+			usb_2_0_extension->bmAttributes = buffer[3] | (buffer[4] << 8)
+				| (buffer[5] << 16) | ((uint32_t) buffer[6] << 24);
+			bos->usb_2_0_extension = usb_2_0_extension;
+		} else if (buffer[2] == LIBUSB_BT_SS_USB_DEVICE_CAPABILITY
+				&& header.bLength >= LIBUSB_BT_SS_USB_DEVICE_CAPABILITY_SIZE
+				&& !bos->ss_usb_device_capability) {
+			ss_cap = malloc(sizeof(*ss_cap));
+			if (!ss_cap) {
+				r = LIBUSB_ERROR_NO_MEM;
+				goto err;
+			}
+			usbi_parse_descriptor(buffer, "bbbbwbbw", ss_cap, 0);
+			bos->ss_usb_device_capability = ss_cap;
+		} else {
+			/* keep the capabilities we do not parse for the caller */
+			extra = realloc((void *) bos->extra,
+				bos->extra_length + header.bLength);
+			if (!extra) {
+				r = LIBUSB_ERROR_NO_MEM;
+				goto err;
+			}
+			memcpy(extra + bos->extra_length, buffer, header.bLength);
+			bos->extra = extra;
+			bos->extra_length += header.bLength;
+		}
+
+		buffer += header.bLength;
+		size -= header.bLength;
+	}
+
+	return 0;
+
+err:
+	clear_bos(bos);
+	return r;
+}
+
+/* fetch the raw BOS descriptor from the device. returns its length or a
+ * LIBUSB_ERROR code, with *buffer to be freed by the caller */
+static int fetch_bos(libusb_device_handle *dev_handle, unsigned char **buffer)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_device_descriptor desc;
+	unsigned char header[LIBUSB_DT_BOS_SIZE];
+	unsigned char *buf;
+	int length;
+	int r;
+
+	/* only USB 2.01 and later devices have one */
+	r = libusb_get_device_descriptor(dev_handle->dev, &desc);
+	if (r < 0)
+		return r;
+	if (desc.bcdUSB < 0x0201)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	r = libusb_get_descriptor(dev_handle, LIBUSB_DT_BOS, 0, header,
+		sizeof(header));
+	if (r == LIBUSB_ERROR_PIPE)
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (r < 0)
+		return r;
+	if (r < LIBUSB_DT_BOS_SIZE) {
+		usbi_err(ctx, "short BOS descriptor read %d/%d", r,
+			LIBUSB_DT_BOS_SIZE);
+		return LIBUSB_ERROR_IO;
+	}
+
+	length = header[2] | (header[3] << 8);
+	if (length < LIBUSB_DT_BOS_SIZE) {
+		usbi_err(ctx, "invalid BOS total length %d", length);
+		return LIBUSB_ERROR_IO;
+	}
+	buf = malloc(length);
+	if (!buf)
+		return LIBUSB_ERROR_NO_MEM;
+	r = libusb_get_descriptor(dev_handle, LIBUSB_DT_BOS, 0, buf, length);
+	if (r < 0) {
+		free(buf);
+		return r;
+	}
+
+	*buffer = buf;
+	return r;
+}
+
+/** \ingroup desc
+ * Get the Binary Device Object Store (BOS) descriptor of a device, which
+ * describes the capabilities of USB 2.01 and later devices, such as the
+ * speeds a SuperSpeed device supports and its link power management exit
+ * latencies.
+ *
+ * The first call for a device is a blocking function which sends requests to
+ * the device. The descriptor is then cached until the device is reset or
+ * disconnected, and later calls do not involve any requests.
+ *
+ * \param dev_handle a device handle
+ * \param bos output location for the BOS descriptor. Only valid if 0 was
+ * returned. Must be freed with libusb_free_bos_descriptor() after use.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the device has no BOS descriptor
+ * \returns another LIBUSB_ERROR code on error
+ */
+int API_EXPORTED libusb_get_bos_descriptor(libusb_device_handle *dev_handle,
+	struct libusb_bos_descriptor **bos)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	struct libusb_bos_descriptor *_bos;
+	unsigned char *buf = NULL;
+	unsigned char *cached;
+	int length = 0;
+	int r;
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->bos) {
+		buf = malloc(dev->bos_length);
+		if (buf) {
+			memcpy(buf, dev->bos, dev->bos_length);
+			length = dev->bos_length;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	if (!buf) {
+		r = fetch_bos(dev_handle, &buf);
+		if (r < 0)
+			return r;
+		length = r;
+
+		cached = malloc(length);
+		if (cached) {
+			memcpy(cached, buf, length);
+			usbi_mutex_lock(&dev->lock);
+			if (!dev->bos) {
+				dev->bos = cached;
+				dev->bos_length = length;
+				cached = NULL;
+			}
+			usbi_mutex_unlock(&dev->lock);
+			free(cached);
+		}
+	}
+
+	_bos = malloc(sizeof(*_bos));
+	if (!_bos) {
+		free(buf);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	r = parse_bos(HANDLE_CTX(dev_handle), _bos, buf, length);
+	free(buf);
+	if (r < 0) {
+		free(_bos);
+		return r;
+	}
+
+	*bos = _bos;
+	return 0;
+}
+
+/** \ingroup desc
+ * Free a BOS descriptor obtained from libusb_get_bos_descriptor(). It is safe
+ * to call this function with a NULL bos parameter, in which case the
+ * function simply returns.
+ *
+ * \param bos the BOS descriptor to free
+ */
+void API_EXPORTED libusb_free_bos_descriptor(struct libusb_bos_descriptor *bos)
+{
+	if (!bos)
+		return;
+
+	clear_bos(bos);
+	free(bos);
+}
+
+/* descriptor caches:
+ * each libusb_device keeps the raw string descriptors fetched through
+ * libusb_get_string_descriptor_ascii() and libusb_get_string_descriptor_utf8()
+ * along with the first language ID, so that repeated lookups cost no bus
+ * traffic, and likewise the raw BOS descriptor. These are dropped when the
+ * device is reset or disconnected, together with the endpoint sizing parsed
+ * from the active configuration, which is also dropped when the
+ * configuration is changed. */
+
+void usbi_clear_descriptor_cache(struct libusb_device *dev)
+{
+	struct usbi_string_desc *sdesc, *tmp;
+
+	usbi_mutex_lock(&dev->lock);
+	list_for_each_entry_safe(sdesc, tmp, &dev->string_cache, list,
+			struct usbi_string_desc) {
+		list_del(&sdesc->list);
+		free(sdesc);
+	}
+	dev->string_langid = -1;
+	free(dev->bos);
+	dev->bos = NULL;
+	dev->bos_length = 0;
+	dev->ep_info_valid = 0;
+	usbi_mutex_unlock(&dev->lock);
+}
+
+/* look up a cached descriptor. called with the device lock held */
+static struct usbi_string_desc *find_cached_string(struct libusb_device *dev,
+	uint8_t desc_index, uint16_t langid)
+{
+	struct usbi_string_desc *sdesc;
+
+	list_for_each_entry(sdesc, &dev->string_cache, list,
+			struct usbi_string_desc)
+		if (sdesc->desc_index == desc_index && sdesc->langid == langid)
+			return sdesc;
+
+	return NULL;
+}
+
+static void add_cached_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, const unsigned char *tbuf)
+{
+	struct usbi_string_desc *sdesc;
+
+	sdesc = malloc(sizeof(*sdesc) + tbuf[0]);
+	if (!sdesc)
+		return;
+
+	sdesc->desc_index = desc_index;
+	sdesc->langid = langid;
+	memcpy(sdesc->data, tbuf, tbuf[0]);
+
+	usbi_mutex_lock(&dev->lock);
+	if (find_cached_string(dev, desc_index, langid)) {
+		/* another thread got there first */
+		usbi_mutex_unlock(&dev->lock);
+		free(sdesc);
+		return;
+	}
+	list_add(&sdesc->list, &dev->string_cache);
+	usbi_mutex_unlock(&dev->lock);
+}
+
+/* retrieve the first language ID supported by the device */
+int usbi_get_string_langid(libusb_device_handle *dev_handle)
+{
+	struct libusb_device *dev = dev_handle->dev;
 	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
-	int r, si, di;
-	uint16_t langid;
+	int langid;
+	int r;
+
+	usbi_mutex_lock(&dev->lock);
+	langid = dev->string_langid;
+	usbi_mutex_unlock(&dev->lock);
+	if (langid >= 0)
+		return langid;
 
 	/* Asking for the zero'th index is special - it returns a string
 	 * descriptor that contains all the language IDs supported by the
 	 * device. Typically there aren't many - often only one. Language
 	 * IDs are 16 bit numbers, and they start at the third byte in the
-	 * descriptor. There's also no point in trying to read descriptor 0
-	 * with this function. See USB 2.0 specification section 9.6.7 for
-	 * more information.
+	 * descriptor. See USB 2.0 specification section 9.6.7 for more
+	 * information.
 	 */
-
-	if (desc_index == 0)
-		return LIBUSB_ERROR_INVALID_PARAM;
-
-	r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
+	r = libusb_get_string_descriptor(dev_handle, 0, 0, tbuf, sizeof(tbuf));
 	if (r < 0)
 		return r;
 
@@ -702,28 +1150,753 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 		return LIBUSB_ERROR_IO;
 
 	langid = tbuf[2] | (tbuf[3] << 8);
+	usbi_mutex_lock(&dev->lock);
+	dev->string_langid = langid;
+	usbi_mutex_unlock(&dev->lock);
+	return langid;
+}
+
+/* retrieve a raw string descriptor in the first language supported by the
+ * device into tbuf (255 bytes), going through the cache. returns the
+ * descriptor length */
+static int get_string_descriptor_cached(libusb_device_handle *dev_handle,
+	uint8_t desc_index, unsigned char *tbuf)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	struct usbi_string_desc *sdesc;
+	uint16_t langid;
+	int r;
+
+	r = usbi_get_string_langid(dev_handle);
+	if (r < 0)
+		return r;
+	langid = (uint16_t) r;
+
+	usbi_mutex_lock(&dev->lock);
+	sdesc = find_cached_string(dev, desc_index, langid);
+	if (sdesc) {
+		r = sdesc->data[0];
+		memcpy(tbuf, sdesc->data, r);
+	}
+	usbi_mutex_unlock(&dev->lock);
+	if (sdesc)
+		return r;
 
-	r = libusb_get_string_descriptor(dev, desc_index, langid, tbuf,
-		sizeof(tbuf));
+	r = libusb_get_string_descriptor(dev_handle, desc_index, langid, tbuf,
+		255);
 	if (r < 0)
 		return r;
 
-	if (tbuf[1] != LIBUSB_DT_STRING)
+	if (r < 2 || tbuf[1] != LIBUSB_DT_STRING)
 		return LIBUSB_ERROR_IO;
 
 	if (tbuf[0] > r)
 		return LIBUSB_ERROR_IO;
 
-	for (di = 0, si = 2; si < tbuf[0]; si += 2) {
+	add_cached_string(dev, desc_index, langid, tbuf);
+	return tbuf[0];
+}
+
+/* length of the longest prefix of the UTF-8 string s (of length len) that
+ * fits in max bytes without splitting a character */
+static int utf8_fit(const char *s, int len, int max)
+{
+	if (len <= max)
+		return len;
+
+	/* back up over continuation bytes */
+	while (max > 0 && (s[max] & 0xc0) == 0x80)
+		max--;
+	return max;
+}
+
+/* convert a string descriptor (UTF-16LE) to NUL-terminated UTF-8, with
+ * invalid surrogates replaced by U+FFFD. returns the string length */
+int usbi_string_descriptor_to_utf8(const unsigned char *desc, char *data,
+	int length)
+{
+	int si, di = 0;
+
+	if (length < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (si = 2; si + 1 < desc[0]; si += 2) {
+		uint32_t c = desc[si] | (desc[si + 1] << 8);
+		char utf8[4];
+		int n;
+
+		if (c >= 0xd800 && c <= 0xdbff && si + 3 < desc[0]) {
+			uint32_t c2 = desc[si + 2] | (desc[si + 3] << 8);
+			if (c2 >= 0xdc00 && c2 <= 0xdfff) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				si += 2;
+			}
+		}
+		if (c >= 0xd800 && c <= 0xdfff)
+			c = 0xfffd;
+
+		if (c < 0x80) {
+			utf8[0] = (char) c;
+			n = 1;
+		} else if (c < 0x800) {
+			utf8[0] = (char) (0xc0 | (c >> 6));
+			utf8[1] = (char) (0x80 | (c & 0x3f));
+			n = 2;
+		} else if (c < 0x10000) {
+			utf8[0] = (char) (0xe0 | (c >> 12));
+			utf8[1] = (char) (0x80 | ((c >> 6) & 0x3f));
+			utf8[2] = (char) (0x80 | (c & 0x3f));
+			n = 3;
+		} else {
+			utf8[0] = (char) (0xf0 | (c >> 18));
+			utf8[1] = (char) (0x80 | ((c >> 12) & 0x3f));
+			utf8[2] = (char) (0x80 | ((c >> 6) & 0x3f));
+			utf8[3] = (char) (0x80 | (c & 0x3f));
+			n = 4;
+		}
+
+		if (di + n > length - 1)
+			break;
+		memcpy(data + di, utf8, n);
+		di += n;
+	}
+
+	data[di] = 0;
+	return di;
+}
+
+/** \ingroup desc
+ * Retrieve a string descriptor as a NUL-terminated UTF-8 string.
+ *
+ * Uses the first language supported by the device. Strings and the language
+ * ID are cached per device, so repeated calls for the same string do not
+ * cause any bus traffic; the cache is dropped when the device is reset or
+ * disconnected. On Linux, the manufacturer, product and serial number
+ * strings are read from sysfs where available, without talking to the
+ * device at all.
+ *
+ * \param dev a device handle
+ * \param desc_index the index of the descriptor to retrieve
+ * \param data output buffer for the UTF-8 string. The string is truncated
+ * at a character boundary if it does not fit.
+ * \param length size of data buffer
+ * \returns number of bytes returned in data, excluding the NUL terminator,
+ * or LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_get_string_descriptor_utf8(libusb_device_handle *dev,
+	uint8_t desc_index, unsigned char *data, int length)
+{
+	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
+	char sbuf[4 * 127 + 1];
+	int r;
+
+	/* There's no point in trying to read descriptor 0 with this function,
+	 * as it holds the language IDs. */
+	if (desc_index == 0 || length < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_backend->get_string_descriptor_utf8) {
+		r = usbi_backend->get_string_descriptor_utf8(dev->dev, desc_index,
+			sbuf, sizeof(sbuf));
+		if (r >= 0) {
+			r = utf8_fit(sbuf, r, length - 1);
+			memcpy(data, sbuf, r);
+			data[r] = 0;
+			return r;
+		}
+		if (r != LIBUSB_ERROR_NOT_FOUND)
+			return r;
+	}
+
+	r = get_string_descriptor_cached(dev, desc_index, tbuf);
+	if (r < 0)
+		return r;
+
+	return usbi_string_descriptor_to_utf8(tbuf, (char *) data, length);
+}
+
+/** \ingroup desc
+ * Retrieve a string descriptor in C style ASCII.
+ *
+ * Wrapper around libusb_get_string_descriptor_utf8(), with every non-ASCII
+ * character replaced by '?'. Uses the first language supported by the
+ * device, and benefits from the same caching.
+ *
+ * \param dev a device handle
+ * \param desc_index the index of the descriptor to retrieve
+ * \param data output buffer for ASCII string descriptor
+ * \param length size of data buffer
+ * \returns number of bytes returned in data, or LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
+	uint8_t desc_index, unsigned char *data, int length)
+{
+	unsigned char sbuf[4 * 127 + 1];
+	int r, si, di;
+
+	if (desc_index == 0 || length < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = libusb_get_string_descriptor_utf8(dev, desc_index, sbuf,
+		sizeof(sbuf));
+	if (r < 0)
+		return r;
+
+	for (di = 0, si = 0; si < r; si++) {
 		if (di >= (length - 1))
 			break;
 
-		if (tbuf[si + 1]) /* high byte */
+		if (sbuf[si] < 0x80)
+			data[di++] = sbuf[si];
+		else if (sbuf[si] >= 0xc0) /* lead byte of a multibyte character */
 			data[di++] = '?';
-		else
-			data[di++] = tbuf[si];
 	}
 
 	data[di] = 0;
 	return di;
 }
+
+/* bulk descriptor fetch:
+ * requests are issued as asynchronous control transfers, interleaved across
+ * devices with at most max_per_device in flight to any one of them, so that
+ * a sweep over many devices takes about as long as the slowest device rather
+ * than the sum of all of them. String requests in the default language first
+ * need the device's language ID; unless the device already has it cached,
+ * it is fetched once per device, and any string requests for the device
+ * wait for it. Each device keeps its own queue of requests not yet issued,
+ * so that a completion only looks at the requests of its device, and a
+ * device with queued requests always has one in flight, whose completion
+ * will issue (or, once cancelled, fail) the next ones.
+ *
+ * Nothing here waits for the device: the batch advances from the transfer
+ * callbacks, run by whoever handles events. Completed requests are collected
+ * while the batch lock is held and their callbacks invoked once it has been
+ * released, so that a callback may cancel or free the batch. */
+
+#define FETCH_LANGID_UNKNOWN	-1
+#define FETCH_LANGID_PENDING	-2
+
+struct fetch_request {
+	struct libusb_descriptor_request *req;
+	struct fetch_device *fdev;
+	/* next request of the same device not yet issued, or, once completed,
+	 * the next completed request to deliver */
+	struct fetch_request *next;
+};
+
+struct fetch_device {
+	libusb_device_handle *dev_handle;
+	int in_flight;
+	/* language ID, FETCH_LANGID_* or a LIBUSB_ERROR code */
+	int langid;
+	/* requests not yet issued, in array order. tail is only used while
+	 * the queue is built */
+	struct fetch_request *head;
+	struct fetch_request **tail;
+};
+
+struct libusb_descriptor_fetch {
+	/* protects everything below that changes after submission */
+	usbi_mutex_t lock;
+	struct list_head transfers;
+	struct fetch_request *freqs;
+	int num_reqs;
+	struct fetch_device *fdevs;
+	int num_fdevs;
+	int max_per_device;
+	unsigned int timeout;
+	libusb_descriptor_cb_fn cb;
+	void *user_data;
+	int num_done;
+	int in_flight;
+	/* set once cancelled: the error requests not yet issued complete with */
+	int abort_error;
+	/* held by the application until libusb_free_descriptor_fetch(), and
+	 * by each thread while it invokes callbacks */
+	int refs;
+};
+
+/* requests completed while the batch lock was held */
+struct fetch_done {
+	struct fetch_request *head;
+	struct fetch_request **tail;
+};
+
+static int transfer_status_to_error(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return transfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* a string request in the device's first language, returned as UTF-8 */
+static int is_default_string_request(struct libusb_descriptor_request *req)
+{
+	return req->desc_type == LIBUSB_DT_STRING && req->desc_index != 0
+		&& req->langid == 0;
+}
+
+static void fetch_complete(struct libusb_descriptor_fetch *fetch,
+	struct fetch_done *done, struct fetch_request *freq, int status)
+{
+	freq->req->status = status;
+	freq->next = NULL;
+	*done->tail = freq;
+	done->tail = &freq->next;
+	fetch->num_done++;
+}
+
+static void fetch_destroy(struct libusb_descriptor_fetch *fetch)
+{
+	usbi_mutex_destroy(&fetch->lock);
+	free(fetch->freqs);
+	free(fetch->fdevs);
+	free(fetch);
+}
+
+/* release the batch lock, then invoke the callbacks of the requests in
+ * done. the reference held meanwhile keeps the batch alive should the
+ * application free it from one of the callbacks */
+static void fetch_deliver(struct libusb_descriptor_fetch *fetch,
+	struct fetch_done *done)
+{
+	struct fetch_request *freq, *next;
+	int refs;
+
+	if (!done->head) {
+		usbi_mutex_unlock(&fetch->lock);
+		return;
+	}
+	fetch->refs++;
+	usbi_mutex_unlock(&fetch->lock);
+
+	for (freq = done->head; freq; freq = next) {
+		next = freq->next;
+		if (fetch->cb)
+			fetch->cb(freq->req, fetch->user_data);
+	}
+
+	usbi_mutex_lock(&fetch->lock);
+	refs = --fetch->refs;
+	usbi_mutex_unlock(&fetch->lock);
+	if (refs == 0)
+		fetch_destroy(fetch);
+}
+
+static void fetch_schedule_device(struct libusb_descriptor_fetch *fetch,
+	struct fetch_device *fdev, struct fetch_done *done);
+
+struct fetch_transfer_ctx {
+	struct list_head list;
+	struct libusb_transfer *transfer;
+	struct libusb_descriptor_fetch *fetch;
+	/* NULL for a language ID fetch */
+	struct fetch_request *freq;
+	struct fetch_device *fdev;
+};
+
+static void LIBUSB_CALL fetch_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct fetch_transfer_ctx *tctx = transfer->user_data;
+	struct libusb_descriptor_fetch *fetch = tctx->fetch;
+	struct fetch_request *freq = tctx->freq;
+	struct fetch_device *fdev = tctx->fdev;
+	unsigned char *buf = libusb_control_transfer_get_data(transfer);
+	int r = transfer_status_to_error(transfer);
+	struct fetch_done done;
+
+	done.head = NULL;
+	done.tail = &done.head;
+
+	usbi_mutex_lock(&fetch->lock);
+	list_del(&tctx->list);
+	fdev->in_flight--;
+	fetch->in_flight--;
+
+	if (!freq) {
+		struct libusb_device *dev = fdev->dev_handle->dev;
+
+		if (r >= 0 && r < 4)
+			r = LIBUSB_ERROR_IO;
+		if (r >= 0) {
+			fdev->langid = buf[2] | (buf[3] << 8);
+			usbi_mutex_lock(&dev->lock);
+			dev->string_langid = fdev->langid;
+			usbi_mutex_unlock(&dev->lock);
+		} else {
+			fdev->langid = r;
+		}
+	} else if (r >= 0 && is_default_string_request(freq->req)) {
+		if (r < 2 || buf[1] != LIBUSB_DT_STRING || buf[0] > r) {
+			r = LIBUSB_ERROR_IO;
+		} else {
+			add_cached_string(fdev->dev_handle->dev, freq->req->desc_index,
+				(uint16_t) fdev->langid, buf);
+			r = usbi_string_descriptor_to_utf8(buf,
+				(char *) freq->req->data, freq->req->length);
+		}
+		fetch_complete(fetch, &done, freq, r);
+	} else {
+		/* string descriptors are always requested with a 255 byte
+		 * buffer, so may not fit the caller's */
+		if (r > freq->req->length)
+			r = freq->req->length;
+		if (r > 0)
+			memcpy(freq->req->data, buf, r);
+		fetch_complete(fetch, &done, freq, r);
+	}
+
+	libusb_free_transfer(transfer);
+	free(tctx);
+	fetch_schedule_device(fetch, fdev, &done);
+	fetch_deliver(fetch, &done);
+}
+
+static int fetch_submit(struct libusb_descriptor_fetch *fetch,
+	struct fetch_device *fdev, struct fetch_request *freq, uint8_t desc_type,
+	uint8_t desc_index, uint16_t langid, uint16_t length)
+{
+	struct libusb_transfer *transfer;
+	struct fetch_transfer_ctx *tctx;
+	unsigned char *buffer;
+	int r;
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* the per-transfer context shares an allocation with the buffer and is
+	 * freed by the callback */
+	buffer = malloc(sizeof(*tctx) + LIBUSB_CONTROL_SETUP_SIZE + length);
+	if (!buffer) {
+		libusb_free_transfer(transfer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	tctx = (struct fetch_transfer_ctx *) buffer;
+	tctx->transfer = transfer;
+	tctx->fetch = fetch;
+	tctx->freq = freq;
+	tctx->fdev = fdev;
+	buffer += sizeof(*tctx);
+
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, (uint16_t) ((desc_type << 8) | desc_index),
+		langid, length);
+	libusb_fill_control_transfer(transfer, fdev->dev_handle, buffer,
+		fetch_transfer_cb, tctx, fetch->timeout);
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		free(tctx);
+		libusb_free_transfer(transfer);
+		return r;
+	}
+
+	list_add_tail(&tctx->list, &fetch->transfers);
+	fdev->in_flight++;
+	fetch->in_flight++;
+	return 0;
+}
+
+/* try to satisfy a default-language string request without bus traffic */
+static int fetch_string_local(struct fetch_request *freq)
+{
+	struct libusb_descriptor_request *req = freq->req;
+	struct libusb_device *dev = req->dev_handle->dev;
+	struct usbi_string_desc *sdesc;
+	unsigned char tbuf[255];
+	char sbuf[4 * 127 + 1];
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	if (usbi_backend->get_string_descriptor_utf8) {
+		r = usbi_backend->get_string_descriptor_utf8(dev, req->desc_index,
+			sbuf, sizeof(sbuf));
+		if (r >= 0) {
+			r = utf8_fit(sbuf, r, req->length - 1);
+			memcpy(req->data, sbuf, r);
+			req->data[r] = 0;
+			return r;
+		}
+	}
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->string_langid >= 0) {
+		sdesc = find_cached_string(dev, req->desc_index,
+			(uint16_t) dev->string_langid);
+		if (sdesc) {
+			memcpy(tbuf, sdesc->data, sdesc->data[0]);
+			r = 0;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+	if (r < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return usbi_string_descriptor_to_utf8(tbuf, (char *) req->data,
+		req->length);
+}
+
+/* start as many of the pending requests of fdev as its limit allows, or
+ * fail them all once the batch has been cancelled. called with the batch
+ * lock held */
+static void fetch_schedule_device(struct libusb_descriptor_fetch *fetch,
+	struct fetch_device *fdev, struct fetch_done *done)
+{
+	struct fetch_request **link = &fdev->head;
+	struct fetch_request *freq;
+	int r;
+
+	while ((freq = *link)) {
+		struct libusb_descriptor_request *req = freq->req;
+		uint16_t langid = req->langid;
+		uint16_t length;
+
+		if (!fetch->abort_error && fdev->in_flight >= fetch->max_per_device)
+			break;
+
+		if (fetch->abort_error) {
+			*link = freq->next;
+			fetch_complete(fetch, done, freq, fetch->abort_error);
+			continue;
+		}
+
+		if (is_default_string_request(req)) {
+			if (fdev->langid == FETCH_LANGID_PENDING) {
+				/* leave it queued and move on to the next request */
+				link = &freq->next;
+				continue;
+			}
+			if (fdev->langid == FETCH_LANGID_UNKNOWN) {
+				r = fetch_submit(fetch, fdev, NULL, LIBUSB_DT_STRING, 0, 0,
+					255);
+				if (r == 0) {
+					fdev->langid = FETCH_LANGID_PENDING;
+					continue;
+				}
+				fdev->langid = r;
+			}
+			if (fdev->langid < 0) {
+				*link = freq->next;
+				fetch_complete(fetch, done, freq, fdev->langid);
+				continue;
+			}
+			langid = (uint16_t) fdev->langid;
+		}
+
+		*link = freq->next;
+		if (req->desc_type == LIBUSB_DT_STRING) {
+			/* Some devices choke on size > 255 */
+			length = 255;
+		} else {
+			length = (uint16_t) MIN(req->length, 0xffff);
+		}
+		r = fetch_submit(fetch, fdev, freq, req->desc_type, req->desc_index,
+			langid, length);
+		if (r < 0)
+			fetch_complete(fetch, done, freq, r);
+	}
+}
+
+/** \ingroup desc
+ * Start fetching many descriptors, from many devices, concurrently.
+ *
+ * Each request names an open device handle and a descriptor, and is issued
+ * as an asynchronous GET_DESCRIPTOR control transfer. Requests to different
+ * devices proceed in parallel, with at most max_per_device in flight to any
+ * one device; within a device, requests are issued in array order.
+ *
+ * This function does not wait for the devices. The requests complete as
+ * the application handles events (see \ref poll), and cb is invoked for
+ * each of them from there, exactly once, with its status field set. The
+ * exceptions are requests which complete without a transfer, because they
+ * can be answered from the string cache or their transfer could not be
+ * submitted: their callbacks are invoked before this function returns.
+ * Callbacks are not invoked with any libusbx lock held, and may call
+ * libusb_cancel_descriptor_fetch() or libusb_free_descriptor_fetch().
+ *
+ * A string descriptor request (type LIBUSB_DT_STRING, non-zero index) with
+ * a langid of 0 behaves like libusb_get_string_descriptor_utf8(): it uses
+ * the device's first language, returns a NUL-terminated UTF-8 string, and
+ * is answered from the per-device string cache where possible. All other
+ * requests return the raw descriptor.
+ *
+ * The per-request result is stored in the status field: the number of bytes
+ * returned (excluding the NUL terminator for UTF-8 strings) or a
+ * LIBUSB_ERROR code. The requests, their buffers and their device handles
+ * must remain valid until every request has completed.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param reqs array of requests
+ * \param num_reqs number of requests
+ * \param max_per_device maximum number of requests in flight to a single
+ * device. Values below 1 are treated as 1.
+ * \param cb function to call as each request completes, or NULL
+ * \param user_data user data to pass to cb
+ * \param timeout timeout (in milliseconds) for each individual request, or 0
+ * for unlimited
+ * \param fetch output location for the handle of the batch, to be freed with
+ * libusb_free_descriptor_fetch() once every request has completed
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if there are no requests or a request
+ * is malformed
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see libusb_cancel_descriptor_fetch()
+ */
+int API_EXPORTED libusb_submit_descriptor_fetch(libusb_context *ctx,
+	struct libusb_descriptor_request *reqs, int num_reqs, int max_per_device,
+	libusb_descriptor_cb_fn cb, void *user_data, unsigned int timeout,
+	struct libusb_descriptor_fetch **fetch)
+{
+	struct libusb_descriptor_fetch *f;
+	struct fetch_done done;
+	int i, j;
+
+	USBI_GET_CONTEXT(ctx);
+
+	if (num_reqs < 1 || !reqs || !fetch)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < num_reqs; i++) {
+		if (!reqs[i].dev_handle || !reqs[i].data || reqs[i].length < 1)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (HANDLE_CTX(reqs[i].dev_handle) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return LIBUSB_ERROR_NO_MEM;
+	f->freqs = calloc(num_reqs, sizeof(*f->freqs));
+	f->fdevs = calloc(num_reqs, sizeof(*f->fdevs));
+	if (!f->freqs || !f->fdevs) {
+		free(f->freqs);
+		free(f->fdevs);
+		free(f);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	usbi_mutex_init(&f->lock, NULL);
+	list_init(&f->transfers);
+	f->num_reqs = num_reqs;
+	f->max_per_device = max_per_device < 1 ? 1 : max_per_device;
+	f->timeout = timeout;
+	f->cb = cb;
+	f->user_data = user_data;
+	f->refs = 1;
+	done.head = NULL;
+	done.tail = &done.head;
+
+	/* the first transfer submitted may complete on another thread before
+	 * the others are */
+	usbi_mutex_lock(&f->lock);
+	for (i = 0; i < num_reqs; i++) {
+		struct fetch_device *fdev = NULL;
+
+		for (j = 0; j < f->num_fdevs; j++) {
+			if (f->fdevs[j].dev_handle == reqs[i].dev_handle) {
+				fdev = &f->fdevs[j];
+				break;
+			}
+		}
+		if (!fdev) {
+			struct libusb_device *dev = reqs[i].dev_handle->dev;
+
+			fdev = &f->fdevs[f->num_fdevs++];
+			fdev->dev_handle = reqs[i].dev_handle;
+			fdev->tail = &fdev->head;
+			usbi_mutex_lock(&dev->lock);
+			fdev->langid = dev->string_langid >= 0 ?
+				dev->string_langid : FETCH_LANGID_UNKNOWN;
+			usbi_mutex_unlock(&dev->lock);
+		}
+
+		f->freqs[i].req = &reqs[i];
+		f->freqs[i].fdev = fdev;
+
+		/* answer what we can without going to the device */
+		if (is_default_string_request(&reqs[i])) {
+			int local = fetch_string_local(&f->freqs[i]);
+			if (local >= 0) {
+				fetch_complete(f, &done, &f->freqs[i], local);
+				continue;
+			}
+		}
+		*fdev->tail = &f->freqs[i];
+		fdev->tail = &f->freqs[i].next;
+	}
+
+	for (i = 0; i < f->num_fdevs; i++)
+		fetch_schedule_device(f, &f->fdevs[i], &done);
+	*fetch = f;
+	fetch_deliver(f, &done);
+	return 0;
+}
+
+/** \ingroup desc
+ * Cancel the requests of a batch started with
+ * libusb_submit_descriptor_fetch() which have not completed yet.
+ *
+ * This function returns without waiting. The transfers in flight are
+ * cancelled, and the requests not yet issued are not issued any more; all
+ * of them complete with status LIBUSB_ERROR_INTERRUPTED, unless their
+ * result arrived first, as the application handles events. Their
+ * callbacks are invoked as usual.
+ *
+ * \param fetch the batch
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if every request has already completed
+ */
+int API_EXPORTED libusb_cancel_descriptor_fetch(
+	struct libusb_descriptor_fetch *fetch)
+{
+	struct fetch_transfer_ctx *tctx;
+	int r = 0;
+
+	usbi_mutex_lock(&fetch->lock);
+	if (fetch->num_done == fetch->num_reqs) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	} else if (!fetch->abort_error) {
+		fetch->abort_error = LIBUSB_ERROR_INTERRUPTED;
+		list_for_each_entry(tctx, &fetch->transfers, list,
+				struct fetch_transfer_ctx)
+			libusb_cancel_transfer(tctx->transfer);
+	}
+	usbi_mutex_unlock(&fetch->lock);
+	return r;
+}
+
+/** \ingroup desc
+ * Free a batch started with libusb_submit_descriptor_fetch().
+ *
+ * Call this once the callback has been invoked for every request of the
+ * batch, which may be from the last of these callbacks. To abandon a batch
+ * early, cancel it with libusb_cancel_descriptor_fetch() and free it once
+ * the remaining callbacks have been invoked.
+ *
+ * \param fetch the batch, or NULL
+ */
+void API_EXPORTED libusb_free_descriptor_fetch(
+	struct libusb_descriptor_fetch *fetch)
+{
+	int refs;
+
+	if (!fetch)
+		return;
+
+	usbi_mutex_lock(&fetch->lock);
+	refs = --fetch->refs;
+	usbi_mutex_unlock(&fetch->lock);
+	if (refs == 0)
+		fetch_destroy(fetch);
+}
@@ -34,6 +34,7 @@
 #include <sys/timerfd.h>
 #endif
 
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
 #include "libusbi.h"
 
 /**
@@ -1056,6 +1057,7 @@ int usbi_io_init(struct libusb_context *ctx)
 	usbi_mutex_init_recursive(&ctx->events_lock, NULL);
 	usbi_mutex_init(&ctx->event_waiters_lock, NULL);
 	usbi_cond_init(&ctx->event_waiters_cond, NULL);
+	usbi_mutex_init(&ctx->event_stats_lock, NULL);
 	list_init(&ctx->flying_transfers);
 	list_init(&ctx->pollfds);
 
@@ -1074,7 +1076,7 @@ int usbi_io_init(struct libusb_context *ctx)
 	ctx->timerfd = timerfd_create(usbi_backend->get_timerfd_clockid(),
 		TFD_NONBLOCK);
 	if (ctx->timerfd >= 0) {
-		usbi_dbg("using timerfd for timeouts");
+		usbi_dbg_ctx(ctx, "using timerfd for timeouts");
 		r = usbi_add_pollfd(ctx, ctx->timerfd, POLLIN);
 		if (r < 0) {
 			usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
@@ -1082,7 +1084,8 @@ int usbi_io_init(struct libusb_context *ctx)
 			goto err_close_pipe;
 		}
 	} else {
-		usbi_dbg("timerfd not available (code %d error %d)", ctx->timerfd, errno);
+		usbi_dbg_ctx(ctx, "timerfd not available (code %d error %d)",
+			ctx->timerfd, errno);
 		ctx->timerfd = -1;
 	}
 #endif
@@ -1099,6 +1102,7 @@ err:
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_mutex_destroy(&ctx->event_stats_lock);
 	return r;
 }
 
@@ -1119,6 +1123,7 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_mutex_destroy(&ctx->event_stats_lock);
 }
 
 static int calculate_timeout(struct usbi_transfer *transfer)
@@ -1273,6 +1278,90 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	free(itransfer);
 }
 
+uint64_t usbi_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** \ingroup asyncio
+ * Get the time at which a transfer was last submitted.
+ *
+ * Transfer timestamps are taken from the monotonic clock (CLOCK_MONOTONIC
+ * on POSIX systems), in nanoseconds, and are the same timebase as
+ * \ref trace "transfer trace" events. They are reset each time the transfer
+ * is submitted.
+ *
+ * \param transfer the transfer
+ * \returns the time at which libusb_submit_transfer() was called, or 0 if
+ * the transfer was never submitted
+ * \see libusb_get_transfer_reap_time(), libusb_get_transfer_callback_time()
+ */
+uint64_t API_EXPORTED libusb_get_transfer_submit_time(
+	struct libusb_transfer *transfer)
+{
+	return LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->submit_ns;
+}
+
+/** \ingroup asyncio
+ * Get the time at which the backend first reaped a completed request (on
+ * Linux, an URB) of a transfer since it was last submitted. Transfers that
+ * the backend splits into several requests complete when the last one is
+ * reaped; this is the time the first one was.
+ *
+ * \param transfer the transfer
+ * \returns the time in nanoseconds, see libusb_get_transfer_submit_time(),
+ * or 0 if nothing was reaped yet or the backend does not report reaps
+ */
+uint64_t API_EXPORTED libusb_get_transfer_reap_time(
+	struct libusb_transfer *transfer)
+{
+	return LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->first_reap_ns;
+}
+
+/** \ingroup asyncio
+ * Get the time at which the callback of a transfer was invoked, after it
+ * last completed. Within the callback, this is the time at which it
+ * started.
+ *
+ * \param transfer the transfer
+ * \returns the time in nanoseconds, see libusb_get_transfer_submit_time(),
+ * or 0 if the transfer has not completed since it was last submitted
+ */
+uint64_t API_EXPORTED libusb_get_transfer_callback_time(
+	struct libusb_transfer *transfer)
+{
+	return LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->callback_ns;
+}
+
+/** \ingroup asyncio
+ * Set the stream of a bulk transfer on a stream, which must be of type
+ * LIBUSB_TRANSFER_TYPE_BULK_STREAM. See libusb_alloc_streams().
+ *
+ * \param transfer the transfer
+ * \param stream_id the stream ID, from 1 to the number of streams allocated
+ * \see libusb_fill_bulk_stream_transfer()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->stream_id = stream_id;
+}
+
+/** \ingroup asyncio
+ * Get the stream of a bulk transfer on a stream.
+ *
+ * \param transfer the transfer
+ * \returns the stream ID, or 0 if none was set
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	return LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->stream_id;
+}
+
 /** \ingroup asyncio
  * Submit a transfer. This function will fire off the USB transfer and then
  * return immediately.
@@ -1297,6 +1386,9 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	usbi_mutex_lock(&itransfer->lock);
 	itransfer->transferred = 0;
 	itransfer->flags = 0;
+	itransfer->submit_ns = usbi_monotonic_ns();
+	itransfer->first_reap_ns = 0;
+	itransfer->callback_ns = 0;
 	r = calculate_timeout(itransfer);
 	if (r < 0) {
 		r = LIBUSB_ERROR_OTHER;
@@ -1304,8 +1396,14 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	}
 
 	first = add_to_flying_list(itransfer);
+	usbi_capture(ctx, itransfer, 'S', 0);
+	/* before the backend, so that it precedes the URB events */
+	usbi_trace(LIBUSB_TRACE_SUBMIT, itransfer, transfer->length, 0);
 	r = usbi_backend->submit_transfer(itransfer);
+	usbi_probe_transfer(transfer__submit, transfer, transfer->length, r, 0);
 	if (r) {
+		usbi_trace(LIBUSB_TRACE_SUBMIT_ERROR, itransfer, 0, r);
+		usbi_capture(ctx, itransfer, 'E', r);
 		usbi_mutex_lock(&ctx->flying_transfers_lock);
 		list_del(&itransfer->list);
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
@@ -1316,7 +1414,9 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 		 * rearm the timerfd with this transfer's timeout */
 		const struct itimerspec it = { {0, 0},
 			{ itransfer->timeout.tv_sec, itransfer->timeout.tv_usec * 1000 } };
-		usbi_dbg("arm timerfd for timeout in %dms (first in line)", transfer->timeout);
+		usbi_dbg_ctx(ctx,
+			"arm timerfd for timeout in %dms (first in line)",
+			transfer->timeout);
 		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
 		if (r < 0)
 			r = LIBUSB_ERROR_OTHER;
@@ -1353,15 +1453,18 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
 	int r;
 
-	usbi_dbg("");
+	usbi_dbg_ctx(TRANSFER_CTX(transfer), "");
 	usbi_mutex_lock(&itransfer->lock);
 	r = usbi_backend->cancel_transfer(itransfer);
+	usbi_trace(LIBUSB_TRACE_CANCEL, itransfer, 0, r);
+	usbi_probe_transfer(transfer__cancel, transfer, transfer->length, r, 0);
 	if (r < 0) {
 		if (r != LIBUSB_ERROR_NOT_FOUND)
 			usbi_err(TRANSFER_CTX(transfer),
 				"cancel transfer failed error %d", r);
 		else
-			usbi_dbg("cancel transfer failed error %d", r);
+			usbi_dbg_ctx(TRANSFER_CTX(transfer),
+				"cancel transfer failed error %d", r);
 
 		if (r == LIBUSB_ERROR_NO_DEVICE)
 			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
@@ -1379,7 +1482,7 @@ static int disarm_timerfd(struct libusb_context *ctx)
 	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
 	int r;
 
-	usbi_dbg("");
+	usbi_dbg_ctx(ctx, "");
 	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
 	if (r < 0)
 		return LIBUSB_ERROR_OTHER;
@@ -1410,7 +1513,8 @@ static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
 			int r;
 			const struct itimerspec it = { {0, 0},
 				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
-			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
+			usbi_dbg_ctx(ctx, "next timeout originally %dms",
+				USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
 			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
 			if (r < 0)
 				return LIBUSB_ERROR_OTHER;
@@ -1433,6 +1537,63 @@ static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
 }
 #endif
 
+static void histogram_add(struct libusb_latency_histogram *hist, uint64_t ns)
+{
+	uint64_t v = ns;
+	int bucket = 0;
+
+	while (v > 1 && bucket < LIBUSB_LATENCY_HISTOGRAM_BUCKETS - 1) {
+		v >>= 1;
+		bucket++;
+	}
+	hist->count++;
+	hist->total_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->buckets[bucket]++;
+}
+
+static void event_stats_add(struct libusb_context *ctx,
+	struct libusb_latency_histogram *hist, uint64_t ns)
+{
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	histogram_add(hist, ns);
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+}
+
+void usbi_event_stats_record_reap(struct libusb_context *ctx)
+{
+	uint64_t now = usbi_monotonic_ns();
+
+	/* a reap outside of event handling (e.g. while cancelling) has no
+	 * poll() to measure from */
+	if (ctx->events_ready_ns && now >= ctx->events_ready_ns)
+		event_stats_add(ctx, &ctx->event_stats.ready_to_reap,
+			now - ctx->events_ready_ns);
+}
+
+static void callback_finished(struct libusb_context *ctx,
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	libusb_transfer_cb_fn callback, uint64_t duration)
+{
+	libusb_slow_callback_fn slow_cb = NULL;
+	void *user_data = NULL;
+
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	if (ctx->event_stats_enabled)
+		histogram_add(&ctx->event_stats.callback, duration);
+	if (ctx->slow_callback_cb && duration > ctx->callback_budget_ns) {
+		ctx->event_stats.slow_callbacks++;
+		slow_cb = ctx->slow_callback_cb;
+		user_data = ctx->slow_callback_user_data;
+	}
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+
+	if (slow_cb)
+		slow_cb(ctx, dev_handle, endpoint, callback, duration,
+			user_data);
+}
+
 /* Handle completion of a transfer (completion might be an error condition).
  * This will invoke the user-supplied callback function, which may end up
  * freeing the transfer. Therefore you cannot use the transfer structure
@@ -1475,7 +1636,8 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
 			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
 		if (rqlen != itransfer->transferred) {
-			usbi_dbg("interpreting short transfer as error");
+			usbi_dbg_ctx(ctx,
+				"interpreting short transfer as error");
 			status = LIBUSB_TRANSFER_ERROR;
 		}
 	}
@@ -1483,9 +1645,29 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	flags = transfer->flags;
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
+	usbi_trace(LIBUSB_TRACE_COMPLETE, itransfer, itransfer->transferred,
+		status);
+	usbi_probe_transfer(transfer__complete, transfer,
+		itransfer->transferred, status, 0);
+	usbi_capture(ctx, itransfer, 'C', status);
+	itransfer->callback_ns = usbi_monotonic_ns();
+	usbi_dbg_ctx(ctx, "transfer %p has callback %p", transfer,
+		transfer->callback);
+	if (transfer->callback) {
+		if (usbi_atomic_load(&ctx->event_stats_enabled)
+				|| usbi_atomic_load(&ctx->slow_callback_cb)) {
+			libusb_device_handle *dev_handle = transfer->dev_handle;
+			unsigned char endpoint = transfer->endpoint;
+			libusb_transfer_cb_fn callback = transfer->callback;
+			uint64_t start = itransfer->callback_ns;
+
+			callback(transfer);
+			callback_finished(ctx, dev_handle, endpoint, callback,
+				usbi_monotonic_ns() - start);
+		} else {
+			transfer->callback(transfer);
+		}
+	}
 	/* transfer might have been freed by the above call, do not use from
 	 * this point. */
 	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
@@ -1506,7 +1688,8 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 {
 	/* if the URB was cancelled due to timeout, report timeout to the user */
 	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
-		usbi_dbg("detected timeout cancellation");
+		usbi_dbg_ctx(ITRANSFER_CTX(transfer),
+			"detected timeout cancellation");
 		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
 	}
 
@@ -1544,7 +1727,7 @@ int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
 	r = ctx->pollfd_modify;
 	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
 	if (r) {
-		usbi_dbg("someone else is modifying poll fds");
+		usbi_dbg_ctx(ctx, "someone else is modifying poll fds");
 		return 1;
 	}
 
@@ -1635,7 +1818,7 @@ int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
 	r = ctx->pollfd_modify;
 	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
 	if (r) {
-		usbi_dbg("someone else is modifying poll fds");
+		usbi_dbg_ctx(ctx, "someone else is modifying poll fds");
 		return 0;
 	}
 
@@ -1663,7 +1846,7 @@ int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 	r = ctx->pollfd_modify;
 	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
 	if (r) {
-		usbi_dbg("someone else is modifying poll fds");
+		usbi_dbg_ctx(ctx, "someone else is modifying poll fds");
 		return 1;
 	}
 
@@ -1767,6 +1950,9 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 	int r;
 
 	itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
+	usbi_trace(LIBUSB_TRACE_TIMEOUT, itransfer, 0, 0);
+	usbi_probe_transfer(transfer__timeout, transfer, transfer->length, 0,
+		0);
 	r = libusb_cancel_transfer(transfer);
 	if (r < 0)
 		usbi_warn(TRANSFER_CTX(transfer),
@@ -1852,7 +2038,8 @@ out:
 
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+static int poll_and_handle_events(struct libusb_context *ctx,
+	struct timeval *tv)
 {
 	int r;
 	struct usbi_pollfd *ipollfd;
@@ -1860,8 +2047,18 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	struct pollfd *fds;
 	int i = -1;
 	int timeout_ms;
-
+	int device_ops_fd;
+	int device_ops_ready = 0;
+	int stats = usbi_atomic_load(&ctx->event_stats_enabled);
+	uint64_t start = 0;
+
+	/* the device ops pipe is created and added to the poll set under
+	 * device_ops_lock, so holding it across taking pollfds_lock makes the
+	 * fd read here consistent with the poll set */
+	usbi_mutex_lock(&ctx->device_ops_lock);
 	usbi_mutex_lock(&ctx->pollfds_lock);
+	device_ops_fd = ctx->device_ops_pipe[0];
+	usbi_mutex_unlock(&ctx->device_ops_lock);
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
 		nfds++;
 
@@ -1888,9 +2085,17 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (tv->tv_usec % 1000)
 		timeout_ms++;
 
-	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
+	usbi_dbg_ctx(ctx, "poll() %d fds with timeout in %dms", nfds,
+		timeout_ms);
+	if (stats)
+		start = usbi_monotonic_ns();
 	r = usbi_poll(fds, nfds, timeout_ms);
-	usbi_dbg("poll() returned %d", r);
+	if (stats) {
+		ctx->events_ready_ns = usbi_monotonic_ns();
+		event_stats_add(ctx, &ctx->event_stats.poll_sleep,
+			ctx->events_ready_ns - start);
+	}
+	usbi_dbg_ctx(ctx, "poll() returned %d", r);
 	if (r == 0) {
 		free(fds);
 		return handle_timeouts(ctx);
@@ -1908,7 +2113,7 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		/* another thread wanted to interrupt event handling, and it succeeded!
 		 * handle any other events that cropped up at the same time, and
 		 * simply return */
-		usbi_dbg("caught a fish on the control pipe");
+		usbi_dbg_ctx(ctx, "caught a fish on the control pipe");
 
 		if (r == 1) {
 			r = 0;
@@ -1925,7 +2130,7 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (usbi_using_timerfd(ctx) && fds[1].revents) {
 		/* timerfd indicates that a timeout has expired */
 		int ret;
-		usbi_dbg("timerfd triggered");
+		usbi_dbg_ctx(ctx, "timerfd triggered");
 
 		ret = handle_timerfd_trigger(ctx);
 		if (ret < 0) {
@@ -1945,15 +2150,55 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	}
 #endif
 
-	r = usbi_backend->handle_events(ctx, fds, nfds, r);
-	if (r)
-		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	/* finished asynchronous device operations. their callbacks are run
+	 * after the backend has handled this round of events, as they may
+	 * close handles whose fds are still in the set */
+	if (device_ops_fd >= 0) {
+		for (i = 0; i < nfds; i++) {
+			if (fds[i].fd != device_ops_fd || !fds[i].revents)
+				continue;
+			/* prevent OS backend from trying to handle events on
+			 * it */
+			fds[i].revents = 0;
+			device_ops_ready = 1;
+			r--;
+			break;
+		}
+	}
+
+	if (r > 0) {
+		if (stats)
+			start = usbi_monotonic_ns();
+		r = usbi_backend->handle_events(ctx, fds, nfds, r);
+		if (stats)
+			event_stats_add(ctx,
+				&ctx->event_stats.backend_handle_events,
+				usbi_monotonic_ns() - start);
+		if (r)
+			usbi_err(ctx,
+				"backend handle_events failed with error %d", r);
+	}
+
+	if (device_ops_ready)
+		usbi_handle_device_op_completions(ctx);
 
 handled:
 	free(fds);
 	return r;
 }
 
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+
+	usbi_probe_ctx(handle__events__entry, ctx,
+		(int) (tv->tv_sec * 1000 + tv->tv_usec / 1000));
+	r = poll_and_handle_events(ctx, tv);
+	ctx->events_ready_ns = 0;
+	usbi_probe_ctx(handle__events__exit, ctx, r);
+	return r;
+}
+
 /* returns the smallest of:
  *  1. timeout of next URB
  *  2. user-supplied timeout
@@ -2024,7 +2269,7 @@ retry:
 	if (libusb_try_lock_events(ctx) == 0) {
 		if (completed == NULL || !*completed) {
 			/* we obtained the event lock: do our own event handling */
-			usbi_dbg("doing our own event handling");
+			usbi_dbg_ctx(ctx, "doing our own event handling");
 			r = handle_events(ctx, &poll_timeout);
 		}
 		libusb_unlock_events(ctx);
@@ -2042,11 +2287,12 @@ retry:
 		/* we hit a race: whoever was event handling earlier finished in the
 		 * time it took us to reach this point. try the cycle again. */
 		libusb_unlock_event_waiters(ctx);
-		usbi_dbg("event handler was active but went away, retrying");
+		usbi_dbg_ctx(ctx,
+			"event handler was active but went away, retrying");
 		goto retry;
 	}
 
-	usbi_dbg("another thread is doing event handling");
+	usbi_dbg_ctx(ctx, "another thread is doing event handling");
 	r = libusb_wait_for_event(ctx, &poll_timeout);
 
 already_done:
@@ -2127,6 +2373,42 @@ int API_EXPORTED libusb_handle_events_completed(libusb_context *ctx,
 	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
 }
 
+/* Stop a set of transfers which resubmit themselves until *stopping is set,
+ * and whose callbacks decrement *active as each one retires; lock protects
+ * both. The transfers still in flight are cancelled (NULL entries and idle
+ * transfers are skipped or fail harmlessly), then events are handled until
+ * *active drops to zero. Events are handled here rather than waited for, so
+ * that the caller need not know whether another thread handles them; it
+ * must not be called from a transfer callback of ctx. */
+void usbi_cancel_and_drain(struct libusb_context *ctx, usbi_mutex_t *lock,
+	int *stopping, const int *active, struct libusb_transfer **transfers,
+	int num_transfers)
+{
+	int done;
+	int i;
+
+	usbi_mutex_lock(lock);
+	*stopping = 1;
+	done = (*active == 0);
+	usbi_mutex_unlock(lock);
+
+	if (!done) {
+		for (i = 0; i < num_transfers; i++) {
+			if (transfers[i])
+				libusb_cancel_transfer(transfers[i]);
+		}
+	}
+
+	while (!done) {
+		struct timeval tv = { 0, 100000 };
+
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		usbi_mutex_lock(lock);
+		done = (*active == 0);
+		usbi_mutex_unlock(lock);
+	}
+}
+
 /** \ingroup poll
  * Handle any pending events by polling file descriptors, without checking if
  * any other threads are already doing so. Must be called with the event lock
@@ -2244,7 +2526,7 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 	if (list_empty(&ctx->flying_transfers)) {
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
+		usbi_dbg_ctx(ctx, "no URBs, no timeout!");
 		return 0;
 	}
 
@@ -2263,7 +2545,8 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 	if (!found) {
-		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
+		usbi_dbg_ctx(ctx, "no URB with timeout or all handled by OS; "
+			"no timeout!");
 		return 0;
 	}
 
@@ -2277,11 +2560,12 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
 	if (!timercmp(&cur_tv, next_timeout, <)) {
-		usbi_dbg("first timeout already expired");
+		usbi_dbg_ctx(ctx, "first timeout already expired");
 		timerclear(tv);
 	} else {
 		timersub(next_timeout, &cur_tv, tv);
-		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
+		usbi_dbg_ctx(ctx, "next timeout in %d.%06ds", tv->tv_sec,
+			tv->tv_usec);
 	}
 
 	return 1;
@@ -2327,7 +2611,7 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 	if (!ipollfd)
 		return LIBUSB_ERROR_NO_MEM;
 
-	usbi_dbg("add fd %d events %d", fd, events);
+	usbi_dbg_ctx(ctx, "add fd %d events %d", fd, events);
 	ipollfd->pollfd.fd = fd;
 	ipollfd->pollfd.events = events;
 	usbi_mutex_lock(&ctx->pollfds_lock);
@@ -2345,7 +2629,7 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 	struct usbi_pollfd *ipollfd;
 	int found = 0;
 
-	usbi_dbg("remove fd %d", fd);
+	usbi_dbg_ctx(ctx, "remove fd %d", fd);
 	usbi_mutex_lock(&ctx->pollfds_lock);
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
 		if (ipollfd->pollfd.fd == fd) {
@@ -2354,7 +2638,7 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 		}
 
 	if (!found) {
-		usbi_dbg("couldn't find fd %d to remove", fd);
+		usbi_dbg_ctx(ctx, "couldn't find fd %d to remove", fd);
 		usbi_mutex_unlock(&ctx->pollfds_lock);
 		return;
 	}
@@ -2422,9 +2706,11 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	struct usbi_transfer *cur;
 	struct usbi_transfer *to_cancel;
 
-	usbi_dbg("device %d.%d",
+	usbi_dbg_ctx(HANDLE_CTX(handle), "device %d.%d",
 		handle->dev->bus_number, handle->dev->device_address);
 
+	usbi_clear_descriptor_cache(handle->dev);
+
 	/* terminate all pending transfers with the LIBUSB_TRANSFER_NO_DEVICE
 	 * status code.
 	 *
@@ -2456,3 +2742,78 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	}
 
 }
+
+/** \ingroup poll
+ * Enable or disable collection of event loop statistics for a context.
+ *
+ * While enabled, event handling records how long it sleeps in poll(), how
+ * long the backend takes to handle the events poll() reported, how long
+ * each completed request waited between poll() returning and being reaped,
+ * and how long each transfer callback runs. This costs a few clock reads
+ * per event handling iteration and per callback.
+ *
+ * Enabling collection discards statistics collected so far.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param enable 1 to enable, 0 to disable
+ * \see libusb_get_event_stats()
+ */
+void API_EXPORTED libusb_event_stats_enable(libusb_context *ctx, int enable)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	if (enable && !ctx->event_stats_enabled) {
+		uint64_t slow_callbacks = ctx->event_stats.slow_callbacks;
+
+		memset(&ctx->event_stats, 0, sizeof(ctx->event_stats));
+		ctx->event_stats.slow_callbacks = slow_callbacks;
+	}
+	usbi_atomic_store(&ctx->event_stats_enabled, enable ? 1 : 0);
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+}
+
+/** \ingroup poll
+ * Retrieve the event loop statistics of a context. This may be called from
+ * any thread, while events are being handled.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ * \see libusb_event_stats_enable()
+ */
+int API_EXPORTED libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	*stats = ctx->event_stats;
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+	return 0;
+}
+
+/** \ingroup poll
+ * Set a callback to be notified of transfer callbacks which run for longer
+ * than a budget. A transfer callback that blocks holds up event handling
+ * for every other transfer of the context, so this helps to find the ones
+ * that starve other devices. Each such callback is also counted in the
+ * slow_callbacks field of struct libusb_event_stats.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param budget_us the budget, in microseconds
+ * \param cb the callback to invoke, or NULL to stop watching callbacks
+ * \param user_data user data to pass to cb
+ */
+void API_EXPORTED libusb_set_slow_callback_cb(libusb_context *ctx,
+	unsigned int budget_us, libusb_slow_callback_fn cb, void *user_data)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	ctx->callback_budget_ns = (uint64_t) budget_us * 1000;
+	ctx->slow_callback_user_data = user_data;
+	usbi_atomic_store(&ctx->slow_callback_cb, cb);
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+}
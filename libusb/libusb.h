@@ -222,6 +222,12 @@ enum libusb_descriptor_type {
 	/** Endpoint descriptor. See libusb_endpoint_descriptor. */
 	LIBUSB_DT_ENDPOINT = 0x05,
 
+	/** BOS descriptor. See libusb_bos_descriptor. */
+	LIBUSB_DT_BOS = 0x0f,
+
+	/** Device Capability descriptor, part of the BOS descriptor */
+	LIBUSB_DT_DEVICE_CAPABILITY = 0x10,
+
 	/** HID descriptor */
 	LIBUSB_DT_HID = 0x21,
 
@@ -233,6 +239,10 @@ enum libusb_descriptor_type {
 
 	/** Hub descriptor */
 	LIBUSB_DT_HUB = 0x29,
+
+	/** SuperSpeed Endpoint Companion descriptor. See
+	 * libusb_ss_endpoint_companion_descriptor. */
+	LIBUSB_DT_SS_ENDPOINT_COMPANION = 0x30,
 };
 
 /* Descriptor sizes per descriptor type */
@@ -242,6 +252,13 @@ enum libusb_descriptor_type {
 #define LIBUSB_DT_ENDPOINT_SIZE		7
 #define LIBUSB_DT_ENDPOINT_AUDIO_SIZE	9	/* Audio extension */
 #define LIBUSB_DT_HUB_NONVAR_SIZE		7
+#define LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE	6
+#define LIBUSB_DT_BOS_SIZE			5
+#define LIBUSB_DT_DEVICE_CAPABILITY_SIZE	3
+
+/* BOS device capability sizes per capability type */
+#define LIBUSB_BT_USB_2_0_EXTENSION_SIZE	7
+#define LIBUSB_BT_SS_USB_DEVICE_CAPABILITY_SIZE	10
 
 #define LIBUSB_ENDPOINT_ADDRESS_MASK	0x0f    /* in bEndpointAddress */
 #define LIBUSB_ENDPOINT_DIR_MASK		0x80
@@ -275,7 +292,12 @@ enum libusb_transfer_type {
 	LIBUSB_TRANSFER_TYPE_BULK = 2,
 
 	/** Interrupt endpoint */
-	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3
+	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3,
+
+	/** Bulk transfer on a stream of a SuperSpeed bulk endpoint, see
+	 * libusb_alloc_streams(). Only valid for transfers, never reported as
+	 * the type of an endpoint. */
+	LIBUSB_TRANSFER_TYPE_BULK_STREAM = 4
 };
 
 /** \ingroup misc
@@ -606,6 +628,154 @@ struct libusb_config_descriptor {
 	int extra_length;
 };
 
+/** \ingroup desc
+ * A structure representing the SuperSpeed Endpoint Companion descriptor,
+ * which follows each endpoint descriptor of a SuperSpeed device. This
+ * descriptor is documented in section 9.6.7 of the USB 3.0 specification.
+ * All multiple-byte fields are represented in host-endian format.
+ */
+struct libusb_ss_endpoint_companion_descriptor {
+	/** Size of this descriptor (in bytes) */
+	uint8_t  bLength;
+
+	/** Descriptor type. Will have value
+	 * \ref libusb_descriptor_type::LIBUSB_DT_SS_ENDPOINT_COMPANION
+	 * LIBUSB_DT_SS_ENDPOINT_COMPANION in this context. */
+	uint8_t  bDescriptorType;
+
+	/** The number of packets the endpoint can send or receive as part of a
+	 * burst, minus one: 0 means bursts of 1 packet, 15 of 16 packets. */
+	uint8_t  bMaxBurst;
+
+	/** For bulk endpoints, bits 0:4 hold MaxStreams, the log2 of the number
+	 * of streams supported. For isochronous endpoints, bits 0:1 hold Mult, the number of bursts
+	 * per service interval minus one. */
+	uint8_t  bmAttributes;
+
+	/** For periodic endpoints, the total number of bytes the endpoint
+	 * transfers every service interval. */
+	uint16_t wBytesPerInterval;
+};
+
+/** \ingroup desc
+ * Device capability types found in the BOS descriptor. */
+enum libusb_bos_type {
+	/** Wireless USB device capability */
+	LIBUSB_BT_WIRELESS_USB_DEVICE_CAPABILITY = 0x01,
+
+	/** USB 2.0 extension, see libusb_usb_2_0_extension_descriptor */
+	LIBUSB_BT_USB_2_0_EXTENSION = 0x02,
+
+	/** SuperSpeed USB device capability, see
+	 * libusb_ss_usb_device_capability_descriptor */
+	LIBUSB_BT_SS_USB_DEVICE_CAPABILITY = 0x03,
+
+	/** Container ID */
+	LIBUSB_BT_CONTAINER_ID = 0x04,
+};
+
+/** \ingroup desc
+ * A structure representing the USB 2.0 Extension descriptor. This
+ * descriptor is documented in section 9.6.2.1 of the USB 3.0 specification.
+ * All multiple-byte fields are represented in host-endian format.
+ */
+struct libusb_usb_2_0_extension_descriptor {
+	/** Size of this descriptor (in bytes) */
+	uint8_t  bLength;
+
+	/** Descriptor type. Will have value
+	 * \ref libusb_descriptor_type::LIBUSB_DT_DEVICE_CAPABILITY
+	 * LIBUSB_DT_DEVICE_CAPABILITY in this context. */
+	uint8_t  bDescriptorType;
+
+	/** Capability type. Will have value
+	 * \ref libusb_bos_type::LIBUSB_BT_USB_2_0_EXTENSION
+	 * LIBUSB_BT_USB_2_0_EXTENSION in this context. */
+	uint8_t  bDevCapabilityType;
+
+	/** Bitmap of supported features. Bit 1 is set if the device supports
+	 * Link Power Management. */
+	uint32_t bmAttributes;
+};
+
+/** \ingroup desc
+ * A structure representing the SuperSpeed USB Device Capability descriptor.
+ * This descriptor is documented in section 9.6.2.2 of the USB 3.0
+ * specification. All multiple-byte fields are represented in host-endian
+ * format.
+ */
+struct libusb_ss_usb_device_capability_descriptor {
+	/** Size of this descriptor (in bytes) */
+	uint8_t  bLength;
+
+	/** Descriptor type. Will have value
+	 * \ref libusb_descriptor_type::LIBUSB_DT_DEVICE_CAPABILITY
+	 * LIBUSB_DT_DEVICE_CAPABILITY in this context. */
+	uint8_t  bDescriptorType;
+
+	/** Capability type. Will have value
+	 * \ref libusb_bos_type::LIBUSB_BT_SS_USB_DEVICE_CAPABILITY
+	 * LIBUSB_BT_SS_USB_DEVICE_CAPABILITY in this context. */
+	uint8_t  bDevCapabilityType;
+
+	/** Bitmap of supported features. Bit 1 is set if the device supports
+	 * Latency Tolerance Messages. */
+	uint8_t  bmAttributes;
+
+	/** Bitmap of the speeds supported by the device: bit 0 low speed,
+	 * bit 1 full speed, bit 2 high speed, bit 3 SuperSpeed. */
+	uint16_t wSpeedSupported;
+
+	/** The lowest speed at which all the functionality of the device is
+	 * available, as a bit number of wSpeedSupported. */
+	uint8_t  bFunctionalitySupport;
+
+	/** U1 device exit latency, in microseconds */
+	uint8_t  bU1DevExitLat;
+
+	/** U2 device exit latency, in microseconds */
+	uint16_t wU2DevExitLat;
+};
+
+/** \ingroup desc
+ * A structure representing the Binary Device Object Store (BOS) descriptor.
+ * This descriptor is documented in section 9.6.2 of the USB 3.0
+ * specification. All multiple-byte fields are represented in host-endian
+ * format.
+ */
+struct libusb_bos_descriptor {
+	/** Size of this descriptor (in bytes) */
+	uint8_t  bLength;
+
+	/** Descriptor type. Will have value
+	 * \ref libusb_descriptor_type::LIBUSB_DT_BOS LIBUSB_DT_BOS
+	 * in this context. */
+	uint8_t  bDescriptorType;
+
+	/** Length of this descriptor and all of its device capabilities */
+	uint16_t wTotalLength;
+
+	/** The number of device capabilities */
+	uint8_t  bNumDeviceCaps;
+
+	/** The USB 2.0 extension capability, or NULL if the device does not
+	 * report one */
+	const struct libusb_usb_2_0_extension_descriptor *usb_2_0_extension;
+
+	/** The SuperSpeed USB device capability, or NULL if the device does not
+	 * report one */
+	const struct libusb_ss_usb_device_capability_descriptor
+		*ss_usb_device_capability;
+
+	/** Other device capabilities. If libusbx encounters capabilities it does
+	 * not parse, it will store their descriptors here, should you wish to
+	 * parse them. */
+	const unsigned char *extra;
+
+	/** Length of the other device capabilities, in bytes. */
+	int extra_length;
+};
+
 /** \ingroup asyncio
  * Setup packet for control transfers. */
 struct libusb_control_setup {
@@ -732,6 +902,66 @@ enum libusb_speed {
 	LIBUSB_SPEED_SUPER = 4,
 };
 
+/** \ingroup dev
+ * Runtime power management status of a device, see
+ * libusb_get_power_state(). */
+enum libusb_runtime_status {
+	/** The status is not known */
+	LIBUSB_RUNTIME_UNKNOWN = 0,
+
+	/** The device is active */
+	LIBUSB_RUNTIME_ACTIVE = 1,
+
+	/** The device is suspended */
+	LIBUSB_RUNTIME_SUSPENDED = 2,
+
+	/** The device is being suspended */
+	LIBUSB_RUNTIME_SUSPENDING = 3,
+
+	/** The device is being resumed */
+	LIBUSB_RUNTIME_RESUMING = 4,
+};
+
+/** \ingroup dev
+ * Runtime power management state of a device, see
+ * libusb_get_power_state(). */
+struct libusb_power_state {
+	/** 1 if the device may be suspended when idle, 0 if it is kept
+	 * awake */
+	int autosuspend;
+
+	/** Idle time before the device is suspended, in milliseconds */
+	int autosuspend_delay_ms;
+
+	/** Current status, a \ref libusb_runtime_status */
+	int runtime_status;
+
+	/** Handles keeping the device awake, see libusb_set_keep_awake() */
+	int awake_handles;
+
+	/** Time the device has spent active, in milliseconds */
+	uint64_t active_time_ms;
+
+	/** Time the device has spent suspended, in milliseconds */
+	uint64_t suspended_time_ms;
+
+	/** Estimate of the number of suspend periods, from the growth of
+	 * suspended_time_ms between calls to libusb_get_power_state(). It
+	 * is a lower bound: several periods between two calls count once */
+	uint64_t suspends_seen;
+};
+
+/** \ingroup dev
+ * Priority classes for dispatching transfer completions, see
+ * libusb_set_handle_priority() and libusb_set_endpoint_priority(). */
+enum libusb_priority {
+	/** Completions are dispatched in the order they are reaped (default) */
+	LIBUSB_PRIORITY_NORMAL = 0,
+
+	/** Completions are dispatched ahead of those of normal priority */
+	LIBUSB_PRIORITY_HIGH = 1,
+};
+
 /** \ingroup misc
  * Error codes. Most libusbx functions return 0 on success or one of these
  * codes on failure.
@@ -971,9 +1201,70 @@ enum usbi_log_level {
 	LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Log message categories. The verbosity of each category can be set
+ * separately with libusb_set_log_level(). */
+enum libusb_log_category {
+	/** Library and context setup, device enumeration and handles */
+	LIBUSB_LOG_CATEGORY_CORE = 0,
+
+	/** Transfers and event handling */
+	LIBUSB_LOG_CATEGORY_IO = 1,
+
+	/** Descriptor retrieval and parsing */
+	LIBUSB_LOG_CATEGORY_DESCRIPTOR = 2,
+
+	/** The operating system backend */
+	LIBUSB_LOG_CATEGORY_BACKEND = 3,
+};
+
+/** \ingroup lib
+ * A log message, as passed to a \ref libusb_log_cb. */
+struct libusb_log_message {
+	/** Monotonic clock time at which the message was logged, in
+	 * nanoseconds */
+	uint64_t timestamp;
+
+	/** OS thread ID of the thread that logged the message */
+	int thread;
+
+	/** The \ref usbi_log_level of the message */
+	int level;
+
+	/** The \ref libusb_log_category of the message */
+	int category;
+
+	/** Name of the library function that logged the message */
+	const char *function;
+
+	/** The message text, without a trailing newline */
+	const char *message;
+};
+
+/** \ingroup lib
+ * Log message callback, see libusb_set_log_cb(). The message and the
+ * strings it points to are only valid during the call.
+ *
+ * \param ctx the context the message was logged for
+ * \param message the message
+ * \param user_data user data passed to libusb_set_log_cb()
+ */
+typedef void (LIBUSB_CALL *libusb_log_cb)(libusb_context *ctx,
+	const struct libusb_log_message *message, void *user_data);
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+int LIBUSB_CALL libusb_set_log_level(libusb_context *ctx,
+	enum libusb_log_category category, int level);
+void LIBUSB_CALL libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
+	void *user_data);
+int LIBUSB_CALL libusb_set_enumeration_threads(libusb_context *ctx,
+	int num_threads);
+int LIBUSB_CALL libusb_set_descriptor_cache(libusb_context *ctx,
+	const char *path);
+int LIBUSB_CALL libusb_set_device_roots(libusb_context *ctx,
+	const char *usbfs_path, const char *sysfs_path);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
@@ -997,6 +1288,14 @@ int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t bConfigurationValue, struct libusb_config_descriptor **config);
 void LIBUSB_CALL libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config);
+int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(
+	libusb_context *ctx, const struct libusb_endpoint_descriptor *endpoint,
+	struct libusb_ss_endpoint_companion_descriptor **ep_comp);
+void LIBUSB_CALL libusb_free_ss_endpoint_companion_descriptor(
+	struct libusb_ss_endpoint_companion_descriptor *ep_comp);
+int LIBUSB_CALL libusb_get_bos_descriptor(libusb_device_handle *dev_handle,
+	struct libusb_bos_descriptor **bos);
+void LIBUSB_CALL libusb_free_bos_descriptor(struct libusb_bos_descriptor *bos);
 uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev);
 uint8_t LIBUSB_CALL libusb_get_port_number(libusb_device *dev);
 libusb_device * LIBUSB_CALL libusb_get_parent(libusb_device *dev);
@@ -1007,6 +1306,13 @@ int LIBUSB_CALL libusb_get_max_packet_size(libusb_device *dev,
 	unsigned char endpoint);
 int LIBUSB_CALL libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint);
+int LIBUSB_CALL libusb_get_endpoint_granularity(libusb_device *dev,
+	unsigned char endpoint);
+int LIBUSB_CALL libusb_get_power_state(libusb_device *dev,
+	struct libusb_power_state *state);
+int LIBUSB_CALL libusb_set_autosuspend(libusb_device *dev, int enable,
+	int delay_ms);
+void LIBUSB_CALL libusb_set_keep_awake(libusb_context *ctx, int enable);
 
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
@@ -1024,9 +1330,39 @@ libusb_device_handle * LIBUSB_CALL libusb_open_device_with_vid_pid(
 
 int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev,
 	int interface_number, int alternate_setting);
+
+/** \ingroup dev
+ * Completion callback for asynchronous device operations such as
+ * libusb_open_async(). Invoked from the event handling thread.
+ * \param dev_handle the device handle the operation was performed on; for
+ * libusb_open_async(), the new handle, or NULL if opening failed
+ * \param result 0 on success, or the LIBUSB_ERROR code the corresponding
+ * synchronous function would have returned
+ * \param user_data user data passed when the operation was queued
+ */
+typedef void (LIBUSB_CALL *libusb_device_op_cb_fn)(
+	libusb_device_handle *dev_handle, int result, void *user_data);
+
+int LIBUSB_CALL libusb_open_async(libusb_device *dev,
+	libusb_device_op_cb_fn cb, void *user_data);
+int LIBUSB_CALL libusb_claim_interface_async(libusb_device_handle *dev,
+	int interface_number, libusb_device_op_cb_fn cb, void *user_data);
+int LIBUSB_CALL libusb_set_configuration_async(libusb_device_handle *dev,
+	int configuration, libusb_device_op_cb_fn cb, void *user_data);
+int LIBUSB_CALL libusb_set_interface_alt_setting_async(
+	libusb_device_handle *dev, int interface_number, int alternate_setting,
+	libusb_device_op_cb_fn cb, void *user_data);
 int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev,
 	unsigned char endpoint);
 int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev);
+int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev,
+	unsigned char *endpoints, int num_endpoints);
+int LIBUSB_CALL libusb_set_handle_priority(libusb_device_handle *dev,
+	int priority);
+int LIBUSB_CALL libusb_set_endpoint_priority(libusb_device_handle *dev,
+	unsigned char endpoint, int priority);
 
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev,
 	int interface_number);
@@ -1111,6 +1447,16 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+uint64_t LIBUSB_CALL libusb_get_transfer_submit_time(
+	struct libusb_transfer *transfer);
+uint64_t LIBUSB_CALL libusb_get_transfer_reap_time(
+	struct libusb_transfer *transfer);
+uint64_t LIBUSB_CALL libusb_get_transfer_callback_time(
+	struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id);
+uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer);
 
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1185,6 +1531,32 @@ static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
 	transfer->callback = callback;
 }
 
+/** \ingroup asyncio
+ * Helper function to populate the required \ref libusb_transfer fields
+ * for a bulk transfer on a stream, see libusb_alloc_streams().
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param stream_id the stream ID, from 1 to the number of streams allocated
+ * \param buffer data buffer
+ * \param length length of data buffer
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ */
+static inline void libusb_fill_bulk_stream_transfer(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, uint32_t stream_id, unsigned char *buffer,
+	int length, libusb_transfer_cb_fn callback, void *user_data,
+	unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer,
+		length, callback, user_data, timeout);
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+	libusb_transfer_set_stream_id(transfer, stream_id);
+}
+
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for an interrupt transfer.
@@ -1393,6 +1765,56 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 
 int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length);
+int LIBUSB_CALL libusb_get_string_descriptor_utf8(libusb_device_handle *dev,
+	uint8_t desc_index, unsigned char *data, int length);
+
+/** \ingroup desc
+ * A single request for libusb_submit_descriptor_fetch().
+ */
+struct libusb_descriptor_request {
+	/** Handle of the device to fetch the descriptor from */
+	libusb_device_handle *dev_handle;
+
+	/** Descriptor type. See \ref libusb_descriptor_type. */
+	uint8_t desc_type;
+
+	/** Descriptor index */
+	uint8_t desc_index;
+
+	/** Language ID for string descriptors. 0 requests the device's first
+	 * language, with the result returned as a UTF-8 string. */
+	uint16_t langid;
+
+	/** Output buffer */
+	unsigned char *data;
+
+	/** Size of the output buffer */
+	int length;
+
+	/** Result: number of bytes returned in data, or a LIBUSB_ERROR code.
+	 * Set by libusbx before the completion callback is invoked. */
+	int status;
+};
+
+/** \ingroup desc
+ * Completion callback for libusb_submit_descriptor_fetch(), invoked once
+ * for each request as its result arrives.
+ * \param req the completed request
+ * \param user_data user data passed to libusb_submit_descriptor_fetch()
+ */
+typedef void (LIBUSB_CALL *libusb_descriptor_cb_fn)(
+	struct libusb_descriptor_request *req, void *user_data);
+
+struct libusb_descriptor_fetch;
+
+int LIBUSB_CALL libusb_submit_descriptor_fetch(libusb_context *ctx,
+	struct libusb_descriptor_request *reqs, int num_reqs, int max_per_device,
+	libusb_descriptor_cb_fn cb, void *user_data, unsigned int timeout,
+	struct libusb_descriptor_fetch **fetch);
+int LIBUSB_CALL libusb_cancel_descriptor_fetch(
+	struct libusb_descriptor_fetch *fetch);
+void LIBUSB_CALL libusb_free_descriptor_fetch(
+	struct libusb_descriptor_fetch *fetch);
 
 /* polling and timeouts */
 
@@ -1461,6 +1883,505 @@ void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
 
+/* tracing */
+
+/** \ingroup trace
+ * Magic bytes at the start of a trace file */
+#define LIBUSB_TRACE_MAGIC	"LIBUSBTR"
+
+/** \ingroup trace
+ * Trace file format version */
+#define LIBUSB_TRACE_VERSION	1
+
+/** \ingroup trace
+ * Trace event types. */
+enum libusb_trace_event_type {
+	/** Transfer being submitted, recorded before the backend submits any
+	 * URB. length is the requested length, status 0. */
+	LIBUSB_TRACE_SUBMIT = 1,
+
+	/** The backend submitted a URB (or OS-level request) for the transfer.
+	 * length is its buffer length, status 0 or a negative errno. */
+	LIBUSB_TRACE_URB_SUBMIT = 2,
+
+	/** The backend reaped a URB. length is its actual length, status its
+	 * OS status. */
+	LIBUSB_TRACE_URB_REAP = 3,
+
+	/** Transfer completed. length is the actual length, status a
+	 * \ref libusb_transfer_status. */
+	LIBUSB_TRACE_COMPLETE = 4,
+
+	/** Transfer cancellation requested. status is the result of the
+	 * cancel request. */
+	LIBUSB_TRACE_CANCEL = 5,
+
+	/** Transfer timed out, and is being cancelled */
+	LIBUSB_TRACE_TIMEOUT = 6,
+
+	/** Submission failed. status is the error returned by
+	 * libusb_submit_transfer(); no completion follows. */
+	LIBUSB_TRACE_SUBMIT_ERROR = 7,
+};
+
+/** \ingroup trace
+ * Header of a trace file written by libusb_trace_dump(). */
+struct libusb_trace_header {
+	/** LIBUSB_TRACE_MAGIC, without the terminating NUL */
+	char magic[8];
+
+	/** LIBUSB_TRACE_VERSION */
+	uint32_t version;
+
+	/** Size of each event record */
+	uint32_t event_size;
+
+	/** Number of event records following the header */
+	uint64_t num_events;
+};
+
+/** \ingroup trace
+ * A trace event record. */
+struct libusb_trace_event {
+	/** Monotonic clock timestamp, in nanoseconds */
+	uint64_t timestamp;
+
+	/** Identifies the transfer (its address in the traced process) */
+	uint64_t transfer;
+
+	/** OS thread ID of the thread that recorded the event */
+	uint32_t thread;
+
+	/** Length, meaning depends on type */
+	uint32_t length;
+
+	/** Status, meaning depends on type */
+	int32_t status;
+
+	/** A \ref libusb_trace_event_type */
+	uint8_t type;
+
+	/** Endpoint address of the transfer */
+	uint8_t endpoint;
+
+	/** A \ref libusb_transfer_type */
+	uint8_t transfer_type;
+
+	/** Reserved, zero */
+	uint8_t reserved;
+};
+
+int LIBUSB_CALL libusb_trace_enable(int ring_entries);
+int LIBUSB_CALL libusb_trace_dump(const char *path);
+
+/* packet capture */
+
+int LIBUSB_CALL libusb_capture_start(libusb_context *ctx, const char *path,
+	int snaplen, int queue_entries);
+int LIBUSB_CALL libusb_capture_stop(libusb_context *ctx);
+
+/* event loop statistics */
+
+/** \ingroup poll
+ * Number of buckets in a struct libusb_latency_histogram */
+#define LIBUSB_LATENCY_HISTOGRAM_BUCKETS	32
+
+/** \ingroup poll
+ * A histogram of durations. Bucket i counts durations in [2^i, 2^(i+1))
+ * nanoseconds; bucket 0 also counts zero durations and the last bucket
+ * also counts anything longer. */
+struct libusb_latency_histogram {
+	/** Number of samples */
+	uint64_t count;
+
+	/** Sum of all samples, in nanoseconds */
+	uint64_t total_ns;
+
+	/** Longest sample, in nanoseconds */
+	uint64_t max_ns;
+
+	/** Sample counts per bucket */
+	uint64_t buckets[LIBUSB_LATENCY_HISTOGRAM_BUCKETS];
+};
+
+/** \ingroup poll
+ * Event loop statistics of a context, see libusb_event_stats_enable(). */
+struct libusb_event_stats {
+	/** Time spent sleeping in poll() */
+	struct libusb_latency_histogram poll_sleep;
+
+	/** Time spent in the backend's event handling after each poll(),
+	 * including the transfer callbacks it invokes */
+	struct libusb_latency_histogram backend_handle_events;
+
+	/** Time from poll() returning to the backend reaping each completed
+	 * request. On backends which do not report reaps, this stays empty */
+	struct libusb_latency_histogram ready_to_reap;
+
+	/** Execution time of each transfer callback */
+	struct libusb_latency_histogram callback;
+
+	/** Number of callbacks which exceeded the budget set with
+	 * libusb_set_slow_callback_cb() */
+	uint64_t slow_callbacks;
+};
+
+/** \ingroup poll
+ * Callback invoked when a transfer callback ran for longer than the budget
+ * set with libusb_set_slow_callback_cb(). It is invoked from the event
+ * handling thread, right after the slow callback returned. The transfer
+ * may have been freed by then, so it is identified by the handle it was
+ * submitted on, its endpoint and its callback function; dev_handle may
+ * also have been closed, and must only be used for identification.
+ *
+ * \param ctx the context
+ * \param dev_handle the device handle of the transfer
+ * \param endpoint the endpoint address of the transfer
+ * \param callback the transfer callback which exceeded the budget
+ * \param duration_ns how long the callback ran, in nanoseconds
+ * \param user_data user data passed to libusb_set_slow_callback_cb()
+ */
+typedef void (LIBUSB_CALL *libusb_slow_callback_fn)(libusb_context *ctx,
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	libusb_transfer_cb_fn callback, uint64_t duration_ns, void *user_data);
+
+void LIBUSB_CALL libusb_event_stats_enable(libusb_context *ctx, int enable);
+int LIBUSB_CALL libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats);
+void LIBUSB_CALL libusb_set_slow_callback_cb(libusb_context *ctx,
+	unsigned int budget_us, libusb_slow_callback_fn cb, void *user_data);
+
+/* auto-tuned streams */
+
+struct libusb_stream;
+
+/** \ingroup stream
+ * Bounds for the tuning of a stream, see libusb_stream_start(). Fields left
+ * at 0 take their defaults. */
+struct libusb_stream_bounds {
+	/** Smallest transfer size in bytes */
+	int min_transfer_size;
+
+	/** Largest transfer size in bytes */
+	int max_transfer_size;
+
+	/** Fewest transfers in flight */
+	int min_queue_depth;
+
+	/** Most transfers in flight */
+	int max_queue_depth;
+};
+
+/** \ingroup stream
+ * Settings chosen by a stream and the measurements behind them, see
+ * libusb_stream_get_tuning(). */
+struct libusb_stream_tuning {
+	/** The device speed, a \ref libusb_speed */
+	int speed;
+
+	/** The maximum packet size of the endpoint */
+	int max_packet_size;
+
+	/** The largest request the backend submits to the kernel at once, or 0
+	 * if there is no such limit */
+	int urb_size;
+
+	/** Current transfer size in bytes */
+	int transfer_size;
+
+	/** Current number of transfers in flight */
+	int queue_depth;
+
+	/** 1 once the tuning has settled, 0 while it is still exploring */
+	int settled;
+
+	/** Number of changes made to the settings */
+	int adjustments;
+
+	/** 1 if most transfers of the last window came back short, i.e. the
+	 * device rather than the bus limits the rate */
+	int device_limited;
+
+	/** Throughput over the last window */
+	uint64_t bytes_per_second;
+
+	/** Mean interval between completions over the last window, in ns */
+	uint64_t mean_interval_ns;
+
+	/** Longest interval between completions over the last window, in ns */
+	uint64_t max_interval_ns;
+
+	/** Bytes received since the stream started */
+	uint64_t bytes;
+
+	/** The first error which stopped the stream, or 0 */
+	int error;
+};
+
+/** \ingroup stream
+ * Stream callback, called with the data of each completed transfer, see
+ * libusb_stream_start().
+ * \param stream the stream
+ * \param data the data received, only valid during the call
+ * \param length the length of the data
+ * \param user_data the user data given to libusb_stream_start()
+ */
+typedef void (LIBUSB_CALL *libusb_stream_cb)(struct libusb_stream *stream,
+	const unsigned char *data, int length, void *user_data);
+
+int LIBUSB_CALL libusb_stream_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, const struct libusb_stream_bounds *bounds,
+	libusb_stream_cb cb, void *user_data, struct libusb_stream **stream);
+void LIBUSB_CALL libusb_stream_get_tuning(struct libusb_stream *stream,
+	struct libusb_stream_tuning *tuning);
+int LIBUSB_CALL libusb_stream_stop(struct libusb_stream *stream);
+
+/* transfer buffers */
+
+/** \ingroup buffers
+ * Flags for libusb_alloc_buffer(). */
+enum libusb_buffer_flags {
+	/** Back the buffer with huge pages: hugetlb pages if the system has
+	 * some reserved, transparent huge pages otherwise. The length is
+	 * rounded up to a whole number of huge pages. */
+	LIBUSB_BUFFER_HUGEPAGES = 1 << 0,
+
+	/** Place the buffer on the NUMA node of the host controller the device
+	 * is attached to */
+	LIBUSB_BUFFER_NUMA_LOCAL = 1 << 1,
+};
+
+unsigned char * LIBUSB_CALL libusb_alloc_buffer(libusb_context *ctx,
+	libusb_device *dev, size_t length, int flags);
+void LIBUSB_CALL libusb_free_buffer(libusb_context *ctx,
+	unsigned char *buffer);
+
+/* recording to disk */
+
+struct libusb_recorder;
+
+/** \ingroup record
+ * Statistics of a recording, see libusb_record_get_stats(). */
+struct libusb_record_stats {
+	/** Bytes written to the file */
+	uint64_t bytes_written;
+
+	/** Number of transfers written */
+	uint64_t transfers;
+
+	/** Largest number of completed transfers waiting to be written */
+	uint64_t max_backlog;
+
+	/** 1 while the file is written with O_DIRECT, 0 otherwise */
+	int direct;
+
+	/** The first error which stopped the recording, or 0 */
+	int error;
+
+	/** The \ref libusb_transfer_status of the first transfer which failed,
+	 * or 0 */
+	int transfer_status;
+};
+
+int LIBUSB_CALL libusb_record_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, const char *path, int buffer_size,
+	int num_buffers, struct libusb_recorder **recorder);
+void LIBUSB_CALL libusb_record_get_stats(struct libusb_recorder *recorder,
+	struct libusb_record_stats *stats);
+int LIBUSB_CALL libusb_record_stop(struct libusb_recorder *recorder,
+	struct libusb_record_stats *stats);
+
+/* playback from files */
+
+struct libusb_player;
+
+/** \ingroup playback
+ * Statistics of a playback, see libusb_playback_get_stats(). */
+struct libusb_playback_stats {
+	/** Bytes sent to the device */
+	uint64_t bytes_sent;
+
+	/** Number of transfers completed */
+	uint64_t transfers;
+
+	/** Time from the start of the playback to the last completed transfer,
+	 * in nanoseconds */
+	uint64_t elapsed_ns;
+
+	/** Sustained throughput over the whole playback */
+	uint64_t bytes_per_second;
+
+	/** Lowest throughput over any 100 ms window, or 0 before the first
+	 * window completes */
+	uint64_t min_bytes_per_second;
+
+	/** Highest throughput over any 100 ms window */
+	uint64_t max_bytes_per_second;
+
+	/** 1 once no more transfers are in flight, 0 otherwise */
+	int finished;
+
+	/** The first error which stopped the playback, or 0 */
+	int error;
+
+	/** The \ref libusb_transfer_status of the first transfer which failed,
+	 * or 0 */
+	int transfer_status;
+};
+
+int LIBUSB_CALL libusb_playback_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, const char *path, int transfer_size,
+	int queue_depth, struct libusb_player **player);
+void LIBUSB_CALL libusb_playback_get_stats(struct libusb_player *player,
+	struct libusb_playback_stats *stats);
+int LIBUSB_CALL libusb_playback_stop(struct libusb_player *player,
+	struct libusb_playback_stats *stats);
+
+/* shared-memory stream rings */
+
+struct libusb_shm_ring;
+struct libusb_shm_ring_reader;
+
+/** \ingroup shmring
+ * Maximum number of readers attached to a stream ring at once */
+#define LIBUSB_SHM_RING_MAX_CONSUMERS	32
+
+/** \ingroup shmring
+ * Progress of a reader of a stream ring, see
+ * libusb_shm_ring_get_consumers() and libusb_shm_ring_get_reader_info(). */
+struct libusb_shm_ring_consumer {
+	/** Process ID of the reader */
+	int pid;
+
+	/** Sequence number of the next slot the reader will read */
+	uint64_t read_seq;
+
+	/** Number of slots published which the reader has not read yet */
+	uint64_t lag;
+
+	/** Number of slots overwritten before the reader could read them */
+	uint64_t dropped;
+};
+
+int LIBUSB_CALL libusb_shm_ring_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int slot_size, int num_slots, int num_transfers,
+	struct libusb_shm_ring **ring);
+int LIBUSB_CALL libusb_shm_ring_get_fd(struct libusb_shm_ring *ring);
+int LIBUSB_CALL libusb_shm_ring_get_consumers(struct libusb_shm_ring *ring,
+	struct libusb_shm_ring_consumer *consumers, int max_consumers);
+int LIBUSB_CALL libusb_shm_ring_stop(struct libusb_shm_ring *ring);
+int LIBUSB_CALL libusb_shm_ring_attach(int fd,
+	struct libusb_shm_ring_reader **reader);
+int LIBUSB_CALL libusb_shm_ring_read(struct libusb_shm_ring_reader *reader,
+	unsigned int timeout_ms, const unsigned char **data, int *length);
+int LIBUSB_CALL libusb_shm_ring_release(struct libusb_shm_ring_reader *reader);
+void LIBUSB_CALL libusb_shm_ring_get_reader_info(
+	struct libusb_shm_ring_reader *reader,
+	struct libusb_shm_ring_consumer *info);
+void LIBUSB_CALL libusb_shm_ring_detach(struct libusb_shm_ring_reader *reader);
+
+/* thread scheduling */
+
+/** \ingroup sched
+ * Most CPUs in a struct libusb_thread_sched or
+ * struct libusb_thread_sched_state */
+#define LIBUSB_SCHED_MAX_CPUS	256
+
+/** \ingroup sched
+ * CPU affinity and scheduling policy for threads, see
+ * libusb_set_thread_sched(). */
+struct libusb_thread_sched {
+	/** SCHED_FIFO priority to run at, or 0 to run under the normal
+	 * time-sharing policy (SCHED_OTHER), which also undoes an earlier
+	 * setting */
+	int fifo_priority;
+
+	/** Number of entries in cpus, or 0 to leave the CPU affinity alone */
+	int num_cpus;
+
+	/** CPUs the threads may run on */
+	int cpus[LIBUSB_SCHED_MAX_CPUS];
+};
+
+/** \ingroup sched
+ * CPU affinity and scheduling policy of a thread, as read back from the
+ * system. */
+struct libusb_thread_sched_state {
+	/** What the thread does, e.g. "device ops" */
+	char name[16];
+
+	/** Thread ID */
+	int tid;
+
+	/** 1 if the thread runs under SCHED_FIFO, 0 otherwise */
+	int fifo;
+
+	/** Real-time priority of the thread */
+	int priority;
+
+	/** Number of entries in cpus */
+	int num_cpus;
+
+	/** CPUs the thread may run on */
+	int cpus[LIBUSB_SCHED_MAX_CPUS];
+
+	/** Error from applying the last setting to the thread, or 0 */
+	int error;
+};
+
+int LIBUSB_CALL libusb_set_thread_sched(libusb_context *ctx,
+	const struct libusb_thread_sched *sched);
+int LIBUSB_CALL libusb_apply_thread_sched(libusb_context *ctx,
+	struct libusb_thread_sched_state *state);
+int LIBUSB_CALL libusb_get_thread_sched_state(libusb_context *ctx,
+	struct libusb_thread_sched_state *states, int max_states);
+int LIBUSB_CALL libusb_get_irq_cpus(libusb_device *dev, int *cpus,
+	int max_cpus);
+
+/* lock profiling */
+
+/** \ingroup misc
+ * Number of buckets in the histograms of struct libusb_lock_stats */
+#define LIBUSB_LOCK_STATS_BUCKETS	32
+
+/** \ingroup misc
+ * Statistics for one internal lock, as returned by libusb_get_lock_stats().
+ * Bucket i of a histogram counts durations in [2^i, 2^(i+1)) nanoseconds;
+ * bucket 0 also counts zero durations and the last bucket also counts
+ * anything longer. */
+struct libusb_lock_stats {
+	/** Expression naming the lock at the call site, e.g.
+	 * "&ctx->flying_transfers_lock" */
+	char name[64];
+
+	/** Call site, as file name and line, e.g. "io.c:1250". Each call site
+	 * that takes a lock has its own entry. */
+	char site[32];
+
+	/** Number of times the lock was acquired */
+	uint64_t acquisitions;
+
+	/** Number of acquisitions that had to wait for another thread */
+	uint64_t contended;
+
+	/** Total and longest time spent waiting for the lock, in nanoseconds */
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+
+	/** Total and longest time the lock was held, in nanoseconds */
+	uint64_t hold_ns;
+	uint64_t max_hold_ns;
+
+	/** Histogram of contended wait times */
+	uint64_t wait_histogram[LIBUSB_LOCK_STATS_BUCKETS];
+
+	/** Histogram of hold times */
+	uint64_t hold_histogram[LIBUSB_LOCK_STATS_BUCKETS];
+};
+
+int LIBUSB_CALL libusb_get_lock_stats(struct libusb_lock_stats *stats,
+	int max_stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,6 +43,54 @@
  */
 #define API_EXPORTED LIBUSB_CALL DEFAULT_VISIBILITY
 
+/* Atomic accesses. usbi_atomic_load() and usbi_atomic_store() are relaxed,
+ * for settings that are written under a lock but checked without it on hot
+ * paths. The lock-free structures (trace rings, capture queue, shared
+ * memory rings) pair usbi_atomic_load_acquire() with
+ * usbi_atomic_store_release(), and use the sequentially consistent
+ * accesses, fences, usbi_atomic_cas() (taking a pointer to the expected
+ * value, which it updates on failure) and usbi_atomic_add() (returning the
+ * new value) where they must.
+ *
+ * Without the builtins, loads and stores are plain accesses to fields that
+ * are also declared volatile, and fences are full barriers where the
+ * compiler offers them. CAS and add are then unavailable, and
+ * USBI_ATOMICS_SUPPORTED is 0 */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define USBI_ATOMICS_SUPPORTED	1
+#define usbi_atomic_load(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define usbi_atomic_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define usbi_atomic_load_acquire(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define usbi_atomic_store_release(p, v)	\
+	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define usbi_atomic_load_seq_cst(p)	__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define usbi_atomic_store_seq_cst(p, v)	\
+	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define usbi_atomic_cas(p, o, n)	__atomic_compare_exchange_n((p), (o), \
+	(n), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define usbi_atomic_add(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define usbi_atomic_fence_acquire()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define usbi_atomic_fence_release()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define usbi_atomic_fence()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define USBI_ATOMICS_SUPPORTED	0
+#define usbi_atomic_load(p)	(*(p))
+#define usbi_atomic_store(p, v)	(*(p) = (v))
+#define usbi_atomic_load_acquire(p)	(*(p))
+#define usbi_atomic_store_release(p, v)	(*(p) = (v))
+#define usbi_atomic_load_seq_cst(p)	(*(p))
+#define usbi_atomic_store_seq_cst(p, v)	(*(p) = (v))
+#if defined(__GNUC__)
+#define usbi_atomic_fence()	__sync_synchronize()
+#elif defined(_MSC_VER)
+#define usbi_atomic_fence()	MemoryBarrier()
+#else
+#define usbi_atomic_fence()	do { } while (0)
+#endif
+#define usbi_atomic_fence_acquire()	usbi_atomic_fence()
+#define usbi_atomic_fence_release()	usbi_atomic_fence()
+#endif
+
 #define DEVICE_DESC_LENGTH		18
 
 #define USB_MAXENDPOINTS	32
@@ -127,20 +175,50 @@ static inline void *usbi_reallocf(void *ptr, size_t size)
 
 #define TIMESPEC_IS_SET(ts) ((ts)->tv_sec != 0 || (ts)->tv_nsec != 0)
 
+/* each source file may set the category of its log messages by defining
+ * USBI_LOG_CATEGORY before including this header */
+#ifndef USBI_LOG_CATEGORY
+#define USBI_LOG_CATEGORY	LIBUSB_LOG_CATEGORY_CORE
+#endif
+#define USBI_LOG_CATEGORIES	4
+
 void usbi_log(struct libusb_context *ctx, enum usbi_log_level level,
-	const char *function, const char *format, ...);
+	enum libusb_log_category category, const char *function,
+	const char *format, ...);
 
 void usbi_log_v(struct libusb_context *ctx, enum usbi_log_level level,
-	const char *function, const char *format, va_list args);
+	enum libusb_log_category category, const char *function,
+	const char *format, va_list args);
 
 #if !defined(_MSC_VER) || _MSC_VER >= 1400
 
 #ifdef ENABLE_LOGGING
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__)
+#ifdef ENABLE_DEBUG_LOGGING
+/* messages logged before any context exists still go out */
+#define USBI_LOG_WITHOUT_CONTEXT	1
+#else
+#define USBI_LOG_WITHOUT_CONTEXT	0
+#endif
+
+/* the level is checked inline, so that the arguments of messages which are
+ * not wanted are never evaluated */
+#define _usbi_log(ctx, level, ...)					\
+	do {								\
+		struct libusb_context *usbi_log_ctx_ = (ctx);		\
+		if (!usbi_log_ctx_)					\
+			usbi_log_ctx_ = usbi_default_context;		\
+		if (usbi_log_ctx_ ? (level) <=				\
+				usbi_log_ctx_->log_levels[USBI_LOG_CATEGORY] \
+				: USBI_LOG_WITHOUT_CONTEXT)		\
+			usbi_log(usbi_log_ctx_, (level), USBI_LOG_CATEGORY,	\
+				__FUNCTION__, __VA_ARGS__);		\
+	} while (0)
 #define usbi_dbg(...) _usbi_log(NULL, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define usbi_dbg_ctx(ctx, ...) _usbi_log(ctx, LOG_LEVEL_DEBUG, __VA_ARGS__)
 #else
 #define _usbi_log(ctx, level, ...) do { (void)(ctx); } while(0)
 #define usbi_dbg(...) do {} while(0)
+#define usbi_dbg_ctx(ctx, ...) do { (void)(ctx); } while(0)
 #endif
 
 #define usbi_info(ctx, ...) _usbi_log(ctx, LOG_LEVEL_INFO, __VA_ARGS__)
@@ -154,7 +232,7 @@ void usbi_log_v(struct libusb_context *ctx, enum usbi_log_level level,
 {                             \
 	va_list args;             \
 	va_start (args, format);  \
-	usbi_log_v(ctxt, level, "", format, args); \
+	usbi_log_v(ctxt, level, USBI_LOG_CATEGORY, "", format, args); \
 	va_end(args);             \
 }
 #else
@@ -173,6 +251,9 @@ static inline void usbi_err( struct libusb_context *ctx, const char *format,
 
 static inline void usbi_dbg(const char *format, ...)
 	LOG_BODY(NULL,LOG_LEVEL_DEBUG)
+static inline void usbi_dbg_ctx(struct libusb_context *ctx,
+	const char *format, ...)
+	LOG_BODY(ctx,LOG_LEVEL_DEBUG)
 
 #endif /* !defined(_MSC_VER) || _MSC_VER >= 1400 */
 
@@ -218,10 +299,33 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp);
 
 extern struct libusb_context *usbi_default_context;
 
+/* maximum number of worker threads for asynchronous device operations */
+#define USBI_MAX_DEVICE_OP_THREADS	16
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
 
+	/* message verbosity per log category, checked inline by the logging
+	 * macros. messages are handed to a background writer (log_queue) which
+	 * passes them to log_cb, or prints them to stderr. log_lock serializes
+	 * the creation of log_queue, which is then published with
+	 * usbi_atomic_store_release() so that logging threads read it without
+	 * the lock, and protects log_cb and log_cb_user_data */
+	unsigned char log_levels[USBI_LOG_CATEGORIES];
+	struct usbi_log_queue *log_queue;
+	usbi_mutex_t log_lock;
+	libusb_log_cb log_cb;
+	void *log_cb_user_data;
+
+	/* number of threads the backend may use to initialize newly discovered
+	 * devices during enumeration. 0 or 1 means sequential */
+	int enum_threads;
+
+	/* file used by the backend to cache device descriptors across
+	 * processes, or NULL */
+	char *desc_cache_path;
+
 	/* internal control pipe, used for interrupting event handling when
 	 * something needs to modify poll fds. */
 	int ctrl_pipe[2];
@@ -271,6 +375,62 @@ struct libusb_context {
 	 * this timerfd is maintained to trigger on the next pending timeout */
 	int timerfd;
 #endif
+
+	/* worker pool for asynchronous device operations (libusb_open_async()
+	 * and friends). queued and running operations are on device_ops,
+	 * finished ones on device_ops_done. the pipe and threads are created on
+	 * first use; a byte is written to the pipe for each finished operation.
+	 * all protected by device_ops_lock */
+	struct list_head device_ops;
+	struct list_head device_ops_done;
+	usbi_mutex_t device_ops_lock;
+	usbi_cond_t device_ops_cond;
+	int device_ops_pipe[2];
+	int device_ops_threads;
+	int device_ops_idle;
+	int device_ops_exit;
+	usbi_thread_t device_ops_thread[USBI_MAX_DEVICE_OP_THREADS];
+
+	/* pcap capture state, allocated by the first libusb_capture_start() and
+	 * kept until the context is destroyed. capture_lock serializes starting
+	 * and stopping */
+	struct usbi_capture *capture;
+	usbi_mutex_t capture_lock;
+
+	/* event loop statistics, see libusb_event_stats_enable(). updated by
+	 * the event handling thread; event_stats_lock protects event_stats and
+	 * the slow callback settings. event_stats_enabled and slow_callback_cb
+	 * are also checked without the lock, with usbi_atomic_load() */
+	volatile int event_stats_enabled;
+	usbi_mutex_t event_stats_lock;
+	struct libusb_event_stats event_stats;
+	/* monotonic time at which the last poll() returned, in ns */
+	uint64_t events_ready_ns;
+	uint64_t callback_budget_ns;
+	libusb_slow_callback_fn volatile slow_callback_cb;
+	void *slow_callback_user_data;
+
+	/* transfer buffers from libusb_alloc_buffer(), see buffer.c. buffers
+	 * handed out are on buffers, freed ones kept for reuse on buffer_pool.
+	 * all protected by buffers_lock */
+	usbi_mutex_t buffers_lock;
+	struct list_head buffers;
+	struct list_head buffer_pool;
+	size_t buffer_pool_bytes;
+
+	/* scheduling of the threads libusbx runs for this context, see
+	 * sched.c. sched_threads lists the running ones; sched is applied to
+	 * them if sched_set. all protected by sched_lock */
+	usbi_mutex_t sched_lock;
+	struct list_head sched_threads;
+	struct libusb_thread_sched sched;
+	int sched_set;
+
+	/* disable autosuspend of devices while open */
+	int keep_awake;
+
+	/* backend-specific data, sized by usbi_os_backend.context_priv_size */
+	unsigned char os_priv[0];
 };
 
 #ifdef USBI_TIMERFD_AVAILABLE
@@ -279,9 +439,29 @@ struct libusb_context {
 #define usbi_using_timerfd(ctx) (0)
 #endif
 
+/* transfer sizing of an endpoint, from its endpoint descriptor and
+ * SuperSpeed endpoint companion */
+struct usbi_endpoint_info {
+	uint8_t present;
+	uint8_t type;
+	/* bits 0:10 of wMaxPacketSize */
+	uint16_t max_packet_size;
+	/* high speed periodic endpoints: transactions per microframe */
+	uint8_t transactions;
+	/* SuperSpeed: set if a companion was found, then bMaxBurst, Mult and
+	 * MaxStreams decoded from bmAttributes, and wBytesPerInterval */
+	uint8_t ss;
+	uint8_t max_burst;
+	uint8_t mult;
+	uint8_t max_streams;
+	uint16_t bytes_per_interval;
+};
+
+#define USBI_EP_INDEX(ep) (((ep) & 0x0f) | (((ep) & 0x80) >> 3))
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt and the descriptor caches, everything else
+	 * is finalized at initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
 
@@ -296,14 +476,59 @@ struct libusb_device {
 
 	struct list_head list;
 	unsigned long session_data;
+
+	/* string descriptors fetched so far (struct usbi_string_desc), and the
+	 * device's first language ID, or -1 if not yet known */
+	struct list_head string_cache;
+	int string_langid;
+
+	/* the raw BOS descriptor once fetched, and the transfer sizing of the
+	 * endpoints of the active configuration once parsed, indexed by
+	 * USBI_EP_INDEX() */
+	unsigned char *bos;
+	int bos_length;
+	int ep_info_valid;
+	struct usbi_endpoint_info ep_info[32];
+
+	/* runtime power management, protected by lock: suspended time at the
+	 * last libusb_get_power_state() ((uint64_t) -1 before the first), the
+	 * suspend periods estimated from it, the handles keeping the device
+	 * awake, and whether autosuspend is to be restored once they close,
+	 * which libusb_set_autosuspend() cancels */
+	uint64_t pm_suspended_time_ms;
+	uint64_t pm_suspends_seen;
+	int pm_awake_handles;
+	int pm_restore_autosuspend;
+
 	unsigned char os_priv[0];
 };
 
+/* a raw string descriptor in the cache of a libusb_device */
+struct usbi_string_desc {
+	struct list_head list;
+	uint16_t langid;
+	uint8_t desc_index;
+	unsigned char data[0];
+};
+
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces and serializes changes of the
+	 * priorities */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* set if opened with keep_awake, see libusb_set_keep_awake() */
+	int pinned_awake;
+
+	/* completion dispatch priority of the handle, and of its endpoints
+	 * indexed by USBI_EP_INDEX() as priority + 1, or 0 to use the handle's.
+	 * high_priority is set if any of them is LIBUSB_PRIORITY_HIGH. read
+	 * without the lock, with usbi_atomic_load(). see
+	 * libusb_set_endpoint_priority() */
+	volatile int priority;
+	volatile int ep_priority[32];
+	volatile int high_priority;
+
 	struct list_head list;
 	struct libusb_device *dev;
 	unsigned char os_priv[0];
@@ -332,6 +557,8 @@ struct usbi_transfer {
 	struct list_head list;
 	struct timeval timeout;
 	int transferred;
+	/* stream of a LIBUSB_TRANSFER_TYPE_BULK_STREAM transfer */
+	uint32_t stream_id;
 	uint8_t flags;
 
 	/* this lock is held during libusb_submit_transfer() and
@@ -342,6 +569,13 @@ struct usbi_transfer {
 	 * its completion (presumably there would be races within your OS backend
 	 * if this were possible). */
 	usbi_mutex_t lock;
+
+	/* monotonic timestamps in ns of the last submission, of the first
+	 * request reaped by the backend since and of the callback invocation.
+	 * see libusb_get_transfer_submit_time() */
+	uint64_t submit_ns;
+	uint64_t first_reap_ns;
+	uint64_t callback_ns;
 };
 
 enum usbi_transfer_flags {
@@ -399,11 +633,114 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle);
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
+void usbi_cancel_and_drain(struct libusb_context *ctx, usbi_mutex_t *lock,
+	int *stopping, const int *active, struct libusb_transfer **transfers,
+	int num_transfers);
 
 int usbi_parse_descriptor(unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
+void usbi_clear_descriptor_cache(struct libusb_device *dev);
+int usbi_get_endpoint_info(struct libusb_device *dev, unsigned char endpoint,
+	struct usbi_endpoint_info *info);
+
+/* transfer tracing, see trace.c */
+extern volatile int usbi_trace_enabled;
+void usbi_trace_event(enum libusb_trace_event_type type,
+	struct usbi_transfer *itransfer, uint32_t length, int32_t status);
+
+#define usbi_trace(type, itransfer, length, status)			\
+	do {								\
+		if (usbi_trace_enabled)					\
+			usbi_trace_event((type), (itransfer), (length), (status)); \
+	} while (0)
+
+/* USDT static probes (provider "libusb"), for perf, bpftrace and
+ * SystemTap. they cost a nop when no tracer is attached. transfer probes
+ * take (transfer, endpoint, length, status, urb index):
+ *   transfer__submit    after libusb_submit_transfer() has handed the
+ *                       transfer to the backend; status is its result
+ *   urb__submit         after each URB submission by the backend; status
+ *                       is 0 or a negative errno
+ *   urb__reap           for each URB reaped; length and status are the
+ *                       URB's (urb index is -1 for isochronous transfers)
+ *   transfer__complete  before the user callback; status is a
+ *                       libusb_transfer_status
+ *   transfer__cancel    after cancellation was requested; status is the
+ *                       backend result
+ *   transfer__timeout   when a transfer's timeout expires
+ * and event handling probes take (context, timeout in ms or result):
+ *   handle__events__entry, handle__events__exit
+ */
+#ifdef USBI_USDT_PROBES
+#include <sys/sdt.h>
+#define usbi_probe_transfer(name, transfer, length, status, urb_idx)	\
+	DTRACE_PROBE5(libusb, name, (transfer), (transfer)->endpoint,	\
+		(length), (status), (urb_idx))
+#define usbi_probe_ctx(name, ctx, arg)					\
+	DTRACE_PROBE2(libusb, name, (ctx), (arg))
+#else
+#define usbi_probe_transfer(name, transfer, length, status, urb_idx)	\
+	do { } while (0)
+#define usbi_probe_ctx(name, ctx, arg)	do { } while (0)
+#endif
+
+/* pcap capture, see capture.c */
+struct usbi_capture;
+void usbi_capture_transfer(struct usbi_capture *cap,
+	struct usbi_transfer *itransfer, char event, int status);
+void usbi_capture_exit(struct libusb_context *ctx);
+
+#define usbi_capture(ctx, itransfer, event, status)			\
+	do {								\
+		if ((ctx)->capture)					\
+			usbi_capture_transfer((ctx)->capture, (itransfer),	\
+				(event), (status));			\
+	} while (0)
+
+uint64_t usbi_monotonic_ns(void);
+
+/* backends call this as they reap each completed request of a transfer */
+#define usbi_transfer_reaped(itransfer)					\
+	do {								\
+		if (!(itransfer)->first_reap_ns)			\
+			(itransfer)->first_reap_ns = usbi_monotonic_ns();	\
+	} while (0)
+
+/* logging, see log.c */
+void usbi_log_init(struct libusb_context *ctx);
+void usbi_log_set_levels(struct libusb_context *ctx, int level);
+void usbi_log_exit(struct libusb_context *ctx);
+
+/* event loop statistics. backends call usbi_event_stats_reaped() as they
+ * reap each completed request, to measure the time since poll() returned */
+void usbi_event_stats_record_reap(struct libusb_context *ctx);
+
+#define usbi_event_stats_reaped(ctx)					\
+	do {								\
+		if (usbi_atomic_load(&(ctx)->event_stats_enabled))	\
+			usbi_event_stats_record_reap(ctx);		\
+	} while (0)
+
+/* transfer buffer pool, see buffer.c */
+void usbi_buffers_init(struct libusb_context *ctx);
+void usbi_buffers_exit(struct libusb_context *ctx);
+
+/* thread scheduling, see sched.c */
+void usbi_sched_init(struct libusb_context *ctx);
+void usbi_sched_exit(struct libusb_context *ctx);
+void usbi_sched_thread_start(struct libusb_context *ctx, const char *name);
+void usbi_sched_thread_stop(struct libusb_context *ctx);
+
+void usbi_device_ops_init(struct libusb_context *ctx);
+void usbi_device_ops_exit(struct libusb_context *ctx);
+void usbi_handle_device_op_completions(struct libusb_context *ctx);
+int usbi_get_endpoint_type(libusb_device *dev, unsigned char endpoint);
+int usbi_get_transfer_priority(struct libusb_transfer *transfer);
+int usbi_get_string_langid(libusb_device_handle *dev_handle);
+int usbi_string_descriptor_to_utf8(const unsigned char *desc, char *data,
+	int length);
 
 /* polling */
 
@@ -896,9 +1233,132 @@ struct usbi_os_backend {
 	/* FIXME: linux can't use this any more. if other OS's cannot either,
 	 * then remove this */
 	size_t add_iso_packet_size;
+
+	/* Number of bytes to reserve for per-context private backend data.
+	 * This private data area is accessible through the "os_priv" field of
+	 * struct libusb_context, and is zeroed before init() is called. */
+	size_t context_priv_size;
+
+	/* Largest request the backend submits to the kernel for a bulk
+	 * transfer, splitting larger transfers, or 0 if there is no such
+	 * limit. Streams round transfer sizes to a multiple of it. */
+	size_t max_bulk_urb_size;
+
+	/* Retrieve a string descriptor of a device as UTF-8, in the first
+	 * language supported by the device, without doing any I/O to the
+	 * device. Optional.
+	 *
+	 * This is for platforms that keep copies of the standard strings
+	 * (manufacturer, product, serial number). Write the NUL-terminated
+	 * string into data, which holds at least length bytes, truncating
+	 * if necessary.
+	 *
+	 * Return:
+	 * - The length of the string (excluding the NUL) on success
+	 * - LIBUSB_ERROR_NOT_FOUND if no copy of the string is available, in
+	 *   which case it will be read from the device
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_string_descriptor_utf8)(struct libusb_device *dev,
+		uint8_t desc_index, char *data, int length);
+
+	/* Get the NUMA node of the host controller a device is attached to.
+	 * Optional.
+	 *
+	 * Return:
+	 * - The node number on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the controller has no NUMA affinity
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_numa_node)(struct libusb_device *dev);
+
+	/* Get the CPUs which service the interrupts of the host controller a
+	 * device is attached to. Optional.
+	 *
+	 * Write up to max_cpus CPU numbers into cpus.
+	 *
+	 * Return:
+	 * - The number of CPUs, which may be more than max_cpus, on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the controller's interrupts could not be
+	 *   found
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_irq_cpus)(struct libusb_device *dev, int *cpus, int max_cpus);
+
+	/* Get the runtime power management state of a device. Optional.
+	 *
+	 * Fill in everything in state except suspends_seen and awake_handles,
+	 * which the core maintains.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_power_state)(struct libusb_device *dev,
+		struct libusb_power_state *state);
+
+	/* Allow (enable 1) or prevent (enable 0) runtime suspend of a device,
+	 * and set the idle delay before suspend unless delay_ms is negative.
+	 * Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_ACCESS if the process may not change the policy
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_autosuspend)(struct libusb_device *dev, int enable,
+		int delay_ms);
+
+	/* Allocate num_streams bulk streams on each of a set of SuperSpeed bulk
+	 * endpoints, whose interfaces are claimed. Optional.
+	 *
+	 * Return:
+	 * - The number of streams allocated, which may be fewer than
+	 *   num_streams, on success
+	 * - LIBUSB_ERROR_INVALID_PARAM if an endpoint does not support streams
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*alloc_streams)(struct libusb_device_handle *handle,
+		uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+
+	/* Free the bulk streams allocated on a set of endpoints. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*free_streams)(struct libusb_device_handle *handle,
+		unsigned char *endpoints, int num_endpoints);
+
+	/* Point a context at the directories devices are enumerated and
+	 * opened from. Optional.
+	 *
+	 * A NULL path selects the platform default for that directory. The
+	 * core guarantees that the context has no devices yet.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if a given directory is not usable
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_device_roots)(struct libusb_context *ctx,
+		const char *usbfs_path, const char *sysfs_path);
 };
 
-extern const struct usbi_os_backend * const usbi_backend;
+/* the test build of the library (see libusb/Makefile.am) lets test
+ * programs substitute a simulated backend */
+#ifdef USBI_TEST_BACKEND
+#define USBI_BACKEND_CONST
+void usbi_set_test_backend(const struct usbi_os_backend *backend);
+#else
+#define USBI_BACKEND_CONST	const
+#endif
+
+extern const struct usbi_os_backend * USBI_BACKEND_CONST usbi_backend;
 
 extern const struct usbi_os_backend linux_usbfs_backend;
 extern const struct usbi_os_backend darwin_backend;
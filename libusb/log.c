@@ -0,0 +1,424 @@
+/*
+ * Log message handling for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+
+/* Log messages are formatted by the thread that logs them, then queued to a
+ * per-context writer thread which prints them or passes them to the
+ * application's log callback, so that logging threads never block on
+ * output. The queue and writer are created when a context first enables
+ * logging. When the writer falls behind by LOG_QUEUE_ENTRIES messages,
+ * further debug and informational messages are dropped and the writer
+ * reports how many, while warnings and errors wait for room, except on the
+ * writer thread itself (i.e. from the log callback), which never waits for
+ * its own progress and drops them too. Messages logged without a context,
+ * or while no writer is running, are output synchronously. */
+
+/* maximum message length, including the terminating NUL. longer messages
+ * are truncated */
+#define LOG_MESSAGE_SIZE	512
+#define LOG_QUEUE_ENTRIES	512
+
+struct usbi_log_entry {
+	uint64_t timestamp;
+	/* time since the first context was created */
+	struct timeval elapsed;
+	int thread;
+	enum usbi_log_level level;
+	enum libusb_log_category category;
+	/* print with timestamp and thread ID */
+	int verbose;
+	const char *function;
+	char message[LOG_MESSAGE_SIZE];
+};
+
+struct usbi_log_queue {
+	struct libusb_context *ctx;
+	usbi_thread_t thread;
+	/* set by the writer before it delivers any message */
+	int writer_tid;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	usbi_cond_t space_cond;
+	int writer_waiting;
+	int producers_waiting;
+	int exit;
+	/* free-running indexes: entries[head % LOG_QUEUE_ENTRIES] is the
+	 * oldest queued message, tail - head the number of queued messages */
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+	struct usbi_log_entry entries[LOG_QUEUE_ENTRIES];
+};
+
+static struct timeval timestamp_origin = { 0, 0 };
+static int has_debug_header_been_displayed = 0;
+
+static void log_print(const struct usbi_log_entry *entry)
+{
+	const char *prefix;
+	char line[LOG_MESSAGE_SIZE + 128];
+
+	switch (entry->level) {
+	case LOG_LEVEL_INFO:
+		prefix = "info";
+		break;
+	case LOG_LEVEL_WARNING:
+		prefix = "warning";
+		break;
+	case LOG_LEVEL_ERROR:
+		prefix = "error";
+		break;
+	case LOG_LEVEL_DEBUG:
+		prefix = "debug";
+		break;
+	case LOG_LEVEL_NONE:
+		prefix = "";
+		break;
+	default:
+		prefix = "unknown";
+		break;
+	}
+
+	if (entry->verbose && !has_debug_header_been_displayed) {
+		has_debug_header_been_displayed = 1;
+		fprintf(stderr, "[timestamp] [threadID] facility level [function call] <message>\n");
+		fprintf(stderr, "--------------------------------------------------------------------------------\n");
+	}
+
+	/* one write per message, so that messages from several contexts do not
+	 * interleave */
+	if (entry->verbose)
+		snprintf(line, sizeof(line), "[%2d.%06d] [%08x] libusbx: %s [%s] %s\n",
+			(int)entry->elapsed.tv_sec, (int)entry->elapsed.tv_usec,
+			entry->thread, prefix, entry->function, entry->message);
+	else
+		snprintf(line, sizeof(line), "libusbx: %s [%s] %s\n",
+			prefix, entry->function, entry->message);
+	fputs(line, stderr);
+}
+
+static void log_deliver(struct libusb_context *ctx,
+	const struct usbi_log_entry *entry)
+{
+	struct libusb_log_message message;
+	libusb_log_cb cb = NULL;
+	void *user_data = NULL;
+
+	if (ctx) {
+		usbi_mutex_lock(&ctx->log_lock);
+		cb = ctx->log_cb;
+		user_data = ctx->log_cb_user_data;
+		usbi_mutex_unlock(&ctx->log_lock);
+	}
+
+	if (!cb) {
+		log_print(entry);
+		return;
+	}
+
+	message.timestamp = entry->timestamp;
+	message.thread = entry->thread;
+	message.level = entry->level;
+	message.category = entry->category;
+	message.function = entry->function;
+	message.message = entry->message;
+	cb(ctx, &message, user_data);
+}
+
+static void *log_writer(void *arg)
+{
+	struct usbi_log_queue *queue = arg;
+	struct usbi_log_entry dropped_entry;
+	unsigned int dropped;
+
+	usbi_sched_thread_start(queue->ctx, "log writer");
+	usbi_mutex_lock(&queue->lock);
+	queue->writer_tid = usbi_get_tid();
+	while (1) {
+		if (queue->dropped) {
+			dropped = queue->dropped;
+			queue->dropped = 0;
+			usbi_mutex_unlock(&queue->lock);
+
+			memset(&dropped_entry, 0, sizeof(dropped_entry));
+			dropped_entry.timestamp = usbi_monotonic_ns();
+			dropped_entry.thread = usbi_get_tid();
+			dropped_entry.level = LOG_LEVEL_WARNING;
+			dropped_entry.category = LIBUSB_LOG_CATEGORY_CORE;
+			dropped_entry.function = __FUNCTION__;
+			snprintf(dropped_entry.message, sizeof(dropped_entry.message),
+				"%u log messages dropped", dropped);
+			log_deliver(queue->ctx, &dropped_entry);
+
+			usbi_mutex_lock(&queue->lock);
+			continue;
+		}
+
+		if (queue->head == queue->tail) {
+			if (queue->exit)
+				break;
+			queue->writer_waiting = 1;
+			usbi_cond_wait(&queue->cond, &queue->lock);
+			queue->writer_waiting = 0;
+			continue;
+		}
+
+		/* producers do not reuse the slot until head moves past it */
+		usbi_mutex_unlock(&queue->lock);
+		log_deliver(queue->ctx,
+			&queue->entries[queue->head % LOG_QUEUE_ENTRIES]);
+		usbi_mutex_lock(&queue->lock);
+		queue->head++;
+		if (queue->producers_waiting)
+			usbi_cond_broadcast(&queue->space_cond);
+	}
+	usbi_mutex_unlock(&queue->lock);
+	usbi_sched_thread_stop(queue->ctx);
+
+	return NULL;
+}
+
+/* called with ctx->log_lock held */
+static void log_queue_start(struct libusb_context *ctx)
+{
+	struct usbi_log_queue *queue;
+
+	if (ctx->log_queue)
+		return;
+
+	queue = calloc(1, sizeof(*queue));
+	if (!queue)
+		return;
+
+	queue->ctx = ctx;
+	usbi_mutex_init(&queue->lock, NULL);
+	usbi_cond_init(&queue->cond, NULL);
+	usbi_cond_init(&queue->space_cond, NULL);
+	if (usbi_thread_create(&queue->thread, log_writer, queue) != 0) {
+		/* messages keep being output synchronously */
+		usbi_mutex_destroy(&queue->lock);
+		usbi_cond_destroy(&queue->cond);
+		usbi_cond_destroy(&queue->space_cond);
+		free(queue);
+		return;
+	}
+
+	/* logging threads pick the queue up without taking log_lock */
+	usbi_atomic_store_release(&ctx->log_queue, queue);
+}
+
+void usbi_log_init(struct libusb_context *ctx)
+{
+	if (!timestamp_origin.tv_sec)
+		usbi_gettimeofday(&timestamp_origin, NULL);
+
+	usbi_mutex_init(&ctx->log_lock, NULL);
+	usbi_log_set_levels(ctx, ctx->debug);
+}
+
+/* set the verbosity of all categories */
+void usbi_log_set_levels(struct libusb_context *ctx, int level)
+{
+	int i;
+
+	if (level < LOG_LEVEL_NONE)
+		level = LOG_LEVEL_NONE;
+	else if (level > LOG_LEVEL_DEBUG)
+		level = LOG_LEVEL_DEBUG;
+
+	usbi_mutex_lock(&ctx->log_lock);
+	if (level != LOG_LEVEL_NONE)
+		log_queue_start(ctx);
+	for (i = 0; i < USBI_LOG_CATEGORIES; i++)
+		ctx->log_levels[i] = (unsigned char) level;
+	usbi_mutex_unlock(&ctx->log_lock);
+}
+
+/* stop the writer once it has output all queued messages. called last when
+ * destroying a context, once no other thread can log to it */
+void usbi_log_exit(struct libusb_context *ctx)
+{
+	struct usbi_log_queue *queue;
+
+	usbi_mutex_lock(&ctx->log_lock);
+	queue = ctx->log_queue;
+	usbi_atomic_store(&ctx->log_queue, NULL);
+	usbi_mutex_unlock(&ctx->log_lock);
+
+	if (queue) {
+		usbi_mutex_lock(&queue->lock);
+		queue->exit = 1;
+		usbi_cond_signal(&queue->cond);
+		usbi_mutex_unlock(&queue->lock);
+		usbi_thread_join(queue->thread);
+
+		usbi_mutex_destroy(&queue->lock);
+		usbi_cond_destroy(&queue->cond);
+		usbi_cond_destroy(&queue->space_cond);
+		free(queue);
+	}
+
+	usbi_mutex_destroy(&ctx->log_lock);
+}
+
+void usbi_log_v(struct libusb_context *ctx, enum usbi_log_level level,
+	enum libusb_log_category category, const char *function,
+	const char *format, va_list args)
+{
+	struct usbi_log_queue *queue = NULL;
+	struct usbi_log_entry entry;
+	struct timeval now;
+	size_t size;
+
+	USBI_GET_CONTEXT(ctx);
+	if (ctx) {
+		if (level > ctx->log_levels[category])
+			return;
+		queue = usbi_atomic_load_acquire(&ctx->log_queue);
+	} else {
+#ifndef ENABLE_DEBUG_LOGGING
+		return;
+#endif
+	}
+
+	usbi_gettimeofday(&now, NULL);
+	if (now.tv_usec < timestamp_origin.tv_usec) {
+		now.tv_sec--;
+		now.tv_usec += 1000000;
+	}
+	now.tv_sec -= timestamp_origin.tv_sec;
+	now.tv_usec -= timestamp_origin.tv_usec;
+
+	entry.timestamp = usbi_monotonic_ns();
+	entry.elapsed = now;
+	entry.thread = usbi_get_tid();
+	entry.level = level;
+	entry.category = category;
+	entry.verbose = !ctx || ctx->log_levels[category] == LOG_LEVEL_DEBUG;
+	entry.function = function;
+	vsnprintf(entry.message, sizeof(entry.message), format, args);
+
+	if (!queue) {
+		log_deliver(ctx, &entry);
+		return;
+	}
+
+	/* the entry is complete before the queue lock is taken, which then only
+	 * covers copying the used part of it into the queue */
+	size = offsetof(struct usbi_log_entry, message)
+		+ strlen(entry.message) + 1;
+	usbi_mutex_lock(&queue->lock);
+	while (queue->tail - queue->head == LOG_QUEUE_ENTRIES
+			&& level <= LOG_LEVEL_WARNING
+			&& entry.thread != queue->writer_tid) {
+		queue->producers_waiting++;
+		usbi_cond_wait(&queue->space_cond, &queue->lock);
+		queue->producers_waiting--;
+	}
+	if (queue->tail - queue->head == LOG_QUEUE_ENTRIES) {
+		queue->dropped++;
+	} else {
+		memcpy(&queue->entries[queue->tail % LOG_QUEUE_ENTRIES], &entry,
+			size);
+		queue->tail++;
+		if (queue->writer_waiting)
+			usbi_cond_signal(&queue->cond);
+	}
+	usbi_mutex_unlock(&queue->lock);
+}
+
+void usbi_log(struct libusb_context *ctx, enum usbi_log_level level,
+	enum libusb_log_category category, const char *function,
+	const char *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	usbi_log_v(ctx, level, category, function, format, args);
+	va_end (args);
+}
+
+/** \ingroup lib
+ * Set the message verbosity of one category of log messages. This allows
+ * e.g. debug messages about descriptors to be enabled on a loaded system
+ * without the cost of logging every transfer. libusb_set_debug() sets the
+ * verbosity of all categories at once.
+ *
+ * As with libusb_set_debug(), this does nothing if the verbosity was fixed
+ * by the LIBUSB_DEBUG environment variable, or if libusbx was compiled with
+ * verbose debug message logging.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param category the \ref libusb_log_category to set
+ * \param level the \ref usbi_log_level to set
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if category or level is invalid
+ */
+int API_EXPORTED libusb_set_log_level(libusb_context *ctx,
+	enum libusb_log_category category, int level)
+{
+	USBI_GET_CONTEXT(ctx);
+	if ((int) category < 0 || category >= USBI_LOG_CATEGORIES
+			|| level < LOG_LEVEL_NONE || level > LOG_LEVEL_DEBUG)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (ctx->debug_fixed)
+		return 0;
+
+	usbi_mutex_lock(&ctx->log_lock);
+	if (level != LOG_LEVEL_NONE)
+		log_queue_start(ctx);
+	ctx->log_levels[category] = (unsigned char) level;
+	usbi_mutex_unlock(&ctx->log_lock);
+	return 0;
+}
+
+/** \ingroup lib
+ * Set a callback to receive the log messages of a context, instead of them
+ * being printed to stderr.
+ *
+ * The callback is invoked from a libusbx internal thread, in the order the
+ * messages were logged, so it may take its time without slowing down the
+ * threads that log. If it falls too far behind, debug and informational
+ * messages are dropped, and a warning with the number of dropped messages is
+ * passed on instead.
+ * libusbx functions may be called from the callback; when the queue is full,
+ * the messages they log are dropped as well, whatever their level.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param cb the callback, or NULL to print messages to stderr again
+ * \param user_data user data to pass to cb
+ */
+void API_EXPORTED libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
+	void *user_data)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->log_lock);
+	ctx->log_cb = cb;
+	ctx->log_cb_user_data = user_data;
+	usbi_mutex_unlock(&ctx->log_lock);
+}
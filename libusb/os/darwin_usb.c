@@ -46,6 +46,7 @@
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/IOCFPlugIn.h>
 
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_BACKEND
 #include "darwin_usb.h"
 
 /* async event thread */
@@ -0,0 +1,522 @@
+/*
+ * Persistent descriptor cache for the Linux usbfs backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libusb.h"
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_BACKEND
+#include "libusbi.h"
+#include "linux_usbfs.h"
+
+/* On kernels that let sysfs relate devices to usbfs nodes but do not expose
+ * the descriptors file, every enumeration has to open each usbfs node and
+ * read the descriptors from the device. This cache keeps the device
+ * descriptor and active configuration descriptor of each device in a file,
+ * so that short-lived processes can skip that I/O.
+ *
+ * File layout (host endian, all offsets from the start of the file):
+ *   struct cache_header
+ *   struct cache_entry[num_entries]
+ *   blob area of blob_size bytes: per entry, the device descriptor followed
+ *   by the active configuration descriptor (config_len bytes, may be 0)
+ *
+ * An entry is only used if the device is still the same one it was recorded
+ * for: same bus path, bus number and address, same inode and modification
+ * time of the sysfs device directory (which is recreated whenever a device
+ * is plugged in), and same active configuration. The blob hash guards
+ * against a corrupted file.
+ *
+ * The file is mapped read-only while an enumeration runs. If entries were
+ * added, the file is rewritten and atomically replaced. A new entry
+ * supersedes any older one for the same bus number and address, so the file
+ * holds at most one entry per possible address and cannot grow without
+ * bound. After a complete enumeration, entries whose bus number and address
+ * no present device has are pruned as well.
+ */
+
+#define CACHE_MAGIC "LIBUSBDC"
+#define CACHE_VERSION 1
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t num_entries;
+	uint32_t blob_size;
+};
+
+struct cache_entry {
+	char sysfs_dir[LINUX_DESC_CACHE_DIR_MAX];
+	uint64_t dir_ino;
+	int64_t dir_mtime_sec;
+	int64_t dir_mtime_nsec;
+	int32_t active_config;
+	uint32_t blob_offset;
+	uint32_t config_len;
+	uint32_t hash;
+	uint8_t busnum;
+	uint8_t devaddr;
+	uint8_t pad[6];
+};
+
+/* a new entry to write back */
+struct pending_entry {
+	struct cache_entry entry;
+	unsigned char *blob;
+};
+
+struct linux_desc_cache {
+	struct libusb_context *ctx;
+	char *path;
+
+	/* mapped file, NULL if there was no (valid) file */
+	unsigned char *map;
+	size_t map_len;
+	const struct cache_entry *entries;
+	uint32_t num_entries;
+	const unsigned char *blobs;
+
+	/* open-addressing index of entries by bus number and address */
+	int *index;
+	uint32_t index_mask;
+
+	/* per mapped entry, whether a new entry replaces it */
+	unsigned char *superseded;
+
+	/* new entries, and whether the file needs rewriting */
+	usbi_mutex_t lock;
+	struct pending_entry *pending;
+	int num_pending;
+	int pending_capacity;
+	int dirty;
+};
+
+/* FNV-1a */
+static uint32_t hash_blob(const unsigned char *data, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint32_t index_slot(struct linux_desc_cache *cache, uint8_t busnum,
+	uint8_t devaddr)
+{
+	return ((busnum << 8 | devaddr) * 2654435761u) & cache->index_mask;
+}
+
+static int key_matches(const struct cache_entry *entry,
+	const struct linux_desc_cache_key *key)
+{
+	return entry->busnum == key->busnum && entry->devaddr == key->devaddr
+		&& entry->dir_ino == key->dir_ino
+		&& entry->dir_mtime_sec == key->dir_mtime_sec
+		&& entry->dir_mtime_nsec == key->dir_mtime_nsec
+		&& entry->active_config == key->active_config
+		&& strncmp(entry->sysfs_dir, key->sysfs_dir,
+			LINUX_DESC_CACHE_DIR_MAX) == 0;
+}
+
+/* validate the mapped file and build the lookup index. on failure the file
+ * is simply ignored */
+static int load_map(struct linux_desc_cache *cache)
+{
+	const struct cache_header *hdr = (const struct cache_header *) cache->map;
+	size_t entries_len;
+	uint32_t i, size;
+
+	if (cache->map_len < sizeof(*hdr)
+			|| memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic))
+			|| hdr->version != CACHE_VERSION
+			|| hdr->entry_size != sizeof(struct cache_entry))
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	entries_len = (size_t) hdr->num_entries * sizeof(struct cache_entry);
+	if (cache->map_len < sizeof(*hdr) + entries_len + hdr->blob_size)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	cache->entries = (const struct cache_entry *) (cache->map + sizeof(*hdr));
+	cache->num_entries = hdr->num_entries;
+	cache->blobs = cache->map + sizeof(*hdr) + entries_len;
+
+	for (i = 0; i < cache->num_entries; i++) {
+		const struct cache_entry *entry = &cache->entries[i];
+		if ((uint64_t) entry->blob_offset + DEVICE_DESC_LENGTH
+				+ entry->config_len > hdr->blob_size)
+			return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	for (size = 16; size < 2 * cache->num_entries; size <<= 1)
+		;
+	cache->index = malloc(size * sizeof(*cache->index));
+	cache->superseded = calloc(cache->num_entries + 1, 1);
+	if (!cache->index || !cache->superseded)
+		return LIBUSB_ERROR_NO_MEM;
+	cache->index_mask = size - 1;
+	memset(cache->index, 0xff, size * sizeof(*cache->index));
+
+	for (i = 0; i < cache->num_entries; i++) {
+		uint32_t slot = index_slot(cache, cache->entries[i].busnum,
+			cache->entries[i].devaddr);
+		while (cache->index[slot] >= 0)
+			slot = (slot + 1) & cache->index_mask;
+		cache->index[slot] = (int) i;
+	}
+
+	return 0;
+}
+
+struct linux_desc_cache *linux_desc_cache_open(struct libusb_context *ctx,
+	const char *path)
+{
+	struct linux_desc_cache *cache;
+	struct stat statbuf;
+	void *map;
+	int fd;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->ctx = ctx;
+	cache->path = strdup(path);
+	if (!cache->path) {
+		free(cache);
+		return NULL;
+	}
+	usbi_mutex_init(&cache->lock, NULL);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			usbi_warn(ctx, "can't open descriptor cache %s, errno=%d",
+				path, errno);
+		cache->dirty = 1;
+		return cache;
+	}
+
+	if (fstat(fd, &statbuf) == 0 && statbuf.st_size > 0) {
+		map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			cache->map = map;
+			cache->map_len = statbuf.st_size;
+		}
+	}
+	close(fd);
+
+	if (!cache->map || load_map(cache) < 0) {
+		usbi_dbg_ctx(ctx, "ignoring descriptor cache %s", path);
+		free(cache->index);
+		free(cache->superseded);
+		cache->index = NULL;
+		cache->superseded = NULL;
+		cache->entries = NULL;
+		cache->num_entries = 0;
+		cache->dirty = 1;
+	} else {
+		usbi_dbg_ctx(ctx, "loaded %u entries from %s",
+			cache->num_entries, path);
+	}
+
+	return cache;
+}
+
+/* called with the lock held */
+static int add_pending(struct linux_desc_cache *cache,
+	const struct cache_entry *entry, unsigned char *blob)
+{
+	struct pending_entry *pending;
+	uint32_t slot;
+	int i;
+
+	if (cache->num_pending == cache->pending_capacity) {
+		int capacity = cache->pending_capacity ?
+			cache->pending_capacity * 2 : 64;
+		pending = realloc(cache->pending, capacity * sizeof(*pending));
+		if (!pending)
+			return LIBUSB_ERROR_NO_MEM;
+		cache->pending = pending;
+		cache->pending_capacity = capacity;
+	}
+
+	pending = &cache->pending[cache->num_pending++];
+	pending->entry = *entry;
+	pending->blob = blob;
+
+	if (cache->index) {
+		slot = index_slot(cache, entry->busnum, entry->devaddr);
+		while ((i = cache->index[slot]) >= 0) {
+			if (cache->entries[i].busnum == entry->busnum
+					&& cache->entries[i].devaddr == entry->devaddr)
+				cache->superseded[i] = 1;
+			slot = (slot + 1) & cache->index_mask;
+		}
+	}
+
+	return 0;
+}
+
+int linux_desc_cache_lookup(struct linux_desc_cache *cache,
+	const struct linux_desc_cache_key *key, const unsigned char **dev_desc,
+	const unsigned char **config, size_t *config_len)
+{
+	const struct cache_entry *entry = NULL;
+	const unsigned char *blob;
+	uint32_t slot;
+	int i;
+
+	if (!cache->index)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	slot = index_slot(cache, key->busnum, key->devaddr);
+	while ((i = cache->index[slot]) >= 0) {
+		if (key_matches(&cache->entries[i], key)) {
+			entry = &cache->entries[i];
+			break;
+		}
+		slot = (slot + 1) & cache->index_mask;
+	}
+	if (!entry)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	blob = cache->blobs + entry->blob_offset;
+	if (hash_blob(blob, DEVICE_DESC_LENGTH + entry->config_len)
+			!= entry->hash) {
+		usbi_warn(cache->ctx, "descriptor cache entry for %s is corrupt",
+			key->sysfs_dir);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	*dev_desc = blob;
+	*config = entry->config_len ? blob + DEVICE_DESC_LENGTH : NULL;
+	*config_len = entry->config_len;
+	return 0;
+}
+
+int linux_desc_cache_insert(struct linux_desc_cache *cache,
+	const struct linux_desc_cache_key *key, const unsigned char *dev_desc,
+	const unsigned char *config, size_t config_len)
+{
+	struct cache_entry entry;
+	unsigned char *blob;
+	int r;
+
+	if (strlen(key->sysfs_dir) >= LINUX_DESC_CACHE_DIR_MAX)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	blob = malloc(DEVICE_DESC_LENGTH + config_len);
+	if (!blob)
+		return LIBUSB_ERROR_NO_MEM;
+	memcpy(blob, dev_desc, DEVICE_DESC_LENGTH);
+	if (config_len)
+		memcpy(blob + DEVICE_DESC_LENGTH, config, config_len);
+
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.sysfs_dir, key->sysfs_dir);
+	entry.busnum = key->busnum;
+	entry.devaddr = key->devaddr;
+	entry.dir_ino = key->dir_ino;
+	entry.dir_mtime_sec = key->dir_mtime_sec;
+	entry.dir_mtime_nsec = key->dir_mtime_nsec;
+	entry.active_config = key->active_config;
+	entry.config_len = (uint32_t) config_len;
+	entry.hash = hash_blob(blob, DEVICE_DESC_LENGTH + config_len);
+
+	usbi_mutex_lock(&cache->lock);
+	r = add_pending(cache, &entry, blob);
+	cache->dirty = 1;
+	usbi_mutex_unlock(&cache->lock);
+
+	if (r < 0)
+		free(blob);
+	return r;
+}
+
+void linux_desc_cache_prune(struct linux_desc_cache *cache,
+	struct discovered_devs *discdevs)
+{
+	unsigned char *present;
+	uint32_t slot;
+	size_t i;
+	int j;
+
+	if (!cache->num_entries)
+		return;
+	present = calloc(cache->num_entries, 1);
+	if (!present)
+		return;
+
+	for (i = 0; i < discdevs->len; i++) {
+		struct libusb_device *dev = discdevs->devices[i];
+		slot = index_slot(cache, dev->bus_number, dev->device_address);
+		while ((j = cache->index[slot]) >= 0) {
+			if (cache->entries[j].busnum == dev->bus_number
+					&& cache->entries[j].devaddr == dev->device_address)
+				present[j] = 1;
+			slot = (slot + 1) & cache->index_mask;
+		}
+	}
+
+	usbi_mutex_lock(&cache->lock);
+	for (i = 0; i < cache->num_entries; i++) {
+		if (present[i] || cache->superseded[i])
+			continue;
+		cache->superseded[i] = 1;
+		cache->dirty = 1;
+	}
+	usbi_mutex_unlock(&cache->lock);
+	free(present);
+}
+
+static int write_entry(FILE *f, struct cache_entry entry,
+	uint32_t *blob_offset)
+{
+	entry.blob_offset = *blob_offset;
+	*blob_offset += DEVICE_DESC_LENGTH + entry.config_len;
+	return fwrite(&entry, sizeof(entry), 1, f) == 1 ? 0 : -1;
+}
+
+static int write_blob(FILE *f, const struct cache_entry *entry,
+	const unsigned char *blob)
+{
+	return fwrite(blob, DEVICE_DESC_LENGTH + entry->config_len, 1, f) == 1
+		? 0 : -1;
+}
+
+/* write the surviving mapped entries followed by the new ones */
+static int write_back(struct linux_desc_cache *cache)
+{
+	struct cache_header hdr;
+	char tmp_path[PATH_MAX];
+	uint32_t blob_offset = 0;
+	uint32_t i;
+	FILE *f;
+	int fd, j;
+
+	/* unique name, as several contexts, in this process or others, may
+	 * write back the same cache at once */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", cache->path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		usbi_warn(cache->ctx, "can't write descriptor cache %s, errno=%d",
+			cache->path, errno);
+		return LIBUSB_ERROR_IO;
+	}
+	/* mkstemp creates the file private, but the cache is meant to be
+	 * shared by processes of other users too */
+	fchmod(fd, 0644);
+	f = fdopen(fd, "wb");
+	if (!f) {
+		usbi_warn(cache->ctx, "can't write descriptor cache %s, errno=%d",
+			tmp_path, errno);
+		close(fd);
+		unlink(tmp_path);
+		return LIBUSB_ERROR_IO;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.entry_size = sizeof(struct cache_entry);
+	hdr.num_entries = cache->num_pending;
+	hdr.blob_size = 0;
+	for (i = 0; i < cache->num_entries; i++) {
+		if (cache->superseded[i])
+			continue;
+		hdr.num_entries++;
+		hdr.blob_size += DEVICE_DESC_LENGTH + cache->entries[i].config_len;
+	}
+	for (j = 0; j < cache->num_pending; j++)
+		hdr.blob_size += DEVICE_DESC_LENGTH
+			+ cache->pending[j].entry.config_len;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err;
+	for (i = 0; i < cache->num_entries; i++)
+		if (!cache->superseded[i]
+				&& write_entry(f, cache->entries[i], &blob_offset) < 0)
+			goto err;
+	for (j = 0; j < cache->num_pending; j++)
+		if (write_entry(f, cache->pending[j].entry, &blob_offset) < 0)
+			goto err;
+	for (i = 0; i < cache->num_entries; i++)
+		if (!cache->superseded[i] && write_blob(f, &cache->entries[i],
+				cache->blobs + cache->entries[i].blob_offset) < 0)
+			goto err;
+	for (j = 0; j < cache->num_pending; j++)
+		if (write_blob(f, &cache->pending[j].entry,
+				cache->pending[j].blob) < 0)
+			goto err;
+
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto err;
+	}
+
+	if (rename(tmp_path, cache->path) < 0) {
+		usbi_warn(cache->ctx, "can't replace descriptor cache %s, errno=%d",
+			cache->path, errno);
+		unlink(tmp_path);
+		return LIBUSB_ERROR_IO;
+	}
+
+	usbi_dbg_ctx(cache->ctx, "wrote %u entries to %s", hdr.num_entries,
+		cache->path);
+	return 0;
+
+err:
+	usbi_warn(cache->ctx, "error writing descriptor cache %s", tmp_path);
+	if (f)
+		fclose(f);
+	unlink(tmp_path);
+	return LIBUSB_ERROR_IO;
+}
+
+void linux_desc_cache_close(struct linux_desc_cache *cache)
+{
+	int i;
+
+	if (cache->dirty)
+		write_back(cache);
+
+	for (i = 0; i < cache->num_pending; i++)
+		free(cache->pending[i].blob);
+	free(cache->pending);
+	free(cache->index);
+	free(cache->superseded);
+	if (cache->map)
+		munmap(cache->map, cache->map_len);
+	usbi_mutex_destroy(&cache->lock);
+	free(cache->path);
+	free(cache);
+}
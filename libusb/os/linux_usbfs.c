@@ -23,7 +23,9 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +35,7 @@
 #include <sys/utsname.h>
 #include <unistd.h>
 
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_BACKEND
 #include "libusb.h"
 #include "libusbi.h"
 #include "linux_usbfs.h"
@@ -69,10 +72,15 @@
  * bus-endian. The kernel documentation says otherwise, but it is wrong.
  */
 
-static const char *usbfs_path = NULL;
-
-/* use usbdev*.* device names in /dev instead of the usbfs bus directories */
-static int usbdev_names = 0;
+/* sysfs and usbfs roots:
+ * by default the usbfs root is probed among /dev/bus/usb, /proc/bus/usb and
+ * /dev (usbdev*.* nodes), and sysfs is read from SYSFS_DEVICE_PATH. Each
+ * context keeps its own roots, which libusb_set_device_roots() can point at
+ * a different (e.g. synthetic) tree. Roots it is not given fall back to the
+ * LIBUSB_USBFS_PATH and LIBUSB_SYSFS_PATH environment variables, then to
+ * the defaults. A context without a usbfs root still initializes, so that
+ * it can be given one, but fails to enumerate until it has one.
+ */
 
 /* Linux 2.6.32 adds support for a bulk continuation URB flag. this basically
  * allows us to mark URBs as being part of a specific logical transfer when
@@ -101,15 +109,37 @@ static int supports_flag_zero_packet = -1;
  * systems. appropriate choice made at initialization time. */
 static clockid_t monotonic_clkid = -1;
 
-/* do we have a busnum to relate devices? this also implies that we can read
- * the active configuration through bConfigurationValue */
-static int sysfs_can_relate_devices = 0;
+/* maximum length of a configured sysfs or usbfs root, leaving room in a
+ * PATH_MAX buffer for the device and attribute names appended to it */
+#define ROOT_PATH_MAX 512
+
+struct linux_context_priv {
+	/* root of the usbfs device nodes, empty if none was found */
+	char usbfs_path[ROOT_PATH_MAX];
+
+	/* use usbdev*.* device names in usbfs_path instead of the usbfs bus
+	 * directories */
+	int usbdev_names;
+
+	/* directory holding the sysfs usb device entries */
+	char sysfs_path[ROOT_PATH_MAX];
 
-/* do we have a descriptors file? */
-static int sysfs_has_descriptors = 0;
+	/* do we have a busnum to relate devices? this also implies that we can
+	 * read the active configuration through bConfigurationValue */
+	int sysfs_can_relate_devices;
+
+	/* do we have a descriptors file? */
+	int sysfs_has_descriptors;
+
+	/* number of sysfs directory fds held by devices of this context.
+	 * protected by usb_devs_lock */
+	int sysfs_dir_fds;
+};
 
 struct linux_device_priv {
 	char *sysfs_dir;
+	/* fd of the sysfs_dir directory, or -1 to use full paths */
+	int sysfs_fd;
 	unsigned char *dev_descriptor;
 	unsigned char *config_descriptor;
 };
@@ -147,16 +177,28 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* libusb_priority class the completions are dispatched with */
+	int priority;
 };
 
+static struct linux_context_priv *_context_priv(struct libusb_context *ctx)
+{
+	return (struct linux_context_priv *) ctx->os_priv;
+}
+
 static void _get_usbfs_path(struct libusb_device *dev, char *path)
 {
-	if (usbdev_names)
+	struct linux_context_priv *cpriv = _context_priv(DEVICE_CTX(dev));
+
+	if (cpriv->usbdev_names)
 		snprintf(path, PATH_MAX, "%s/usbdev%d.%d",
-			usbfs_path, dev->bus_number, dev->device_address);
+			cpriv->usbfs_path, dev->bus_number,
+			dev->device_address);
 	else
 		snprintf(path, PATH_MAX, "%s/%03d/%03d",
-			usbfs_path, dev->bus_number, dev->device_address);
+			cpriv->usbfs_path, dev->bus_number,
+			dev->device_address);
 }
 
 static struct linux_device_priv *_device_priv(struct libusb_device *dev)
@@ -210,11 +252,45 @@ static int check_usb_vfs(const char *dirname)
 	return found;
 }
 
-static const char *find_usbfs_path(void)
+/* returns 1 if dirname holds usbdev*.* nodes */
+static int check_usbdev_names(const char *dirname)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int found = 0;
+
+	dir = opendir(dirname);
+	if (dir == NULL)
+		return 0;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (_is_usbdev_entry(entry, NULL, NULL)) {
+			/* found one; that's enough */
+			found = 1;
+			break;
+		}
+	}
+	closedir(dir);
+	return found;
+}
+
+static const char *find_usbfs_path(struct libusb_context *ctx,
+	const char *path, int *usbdev_names)
 {
-	const char *path = "/dev/bus/usb";
 	const char *ret = NULL;
 
+	*usbdev_names = 0;
+	if (path) {
+		/* an explicit root is used as-is; only its layout is probed */
+		if (check_usbdev_names(path))
+			*usbdev_names = 1;
+		else if (!check_usb_vfs(path))
+			return NULL;
+		usbi_dbg_ctx(ctx, "using usbfs at %s", path);
+		return path;
+	}
+
+	path = "/dev/bus/usb";
 	if (check_usb_vfs(path)) {
 		ret = path;
 	} else {
@@ -225,26 +301,15 @@ static const char *find_usbfs_path(void)
 
 	/* look for /dev/usbdev*.* if the normal places fail */
 	if (ret == NULL) {
-		struct dirent *entry;
-		DIR *dir;
-
 		path = "/dev";
-		dir = opendir(path);
-		if (dir != NULL) {
-			while ((entry = readdir(dir)) != NULL) {
-				if (_is_usbdev_entry(entry, NULL, NULL)) {
-					/* found one; that's enough */
-					ret = path;
-					usbdev_names = 1;
-					break;
-				}
-			}
-			closedir(dir);
+		if (check_usbdev_names(path)) {
+			ret = path;
+			*usbdev_names = 1;
 		}
 	}
 
 	if (ret != NULL)
-		usbi_dbg("found usbfs at %s", ret);
+		usbi_dbg_ctx(ctx, "found usbfs at %s", ret);
 
 	return ret;
 }
@@ -300,65 +365,69 @@ static int kernel_version_ge(int major, int minor, int sublevel)
 }
 
 /* Return 1 if filename exists inside dirname in sysfs.
-   SYSFS_DEVICE_PATH is assumed to be the beginning of the path. */
-static int sysfs_has_file(const char *dirname, const char *filename)
+   rootfd is an fd for the sysfs devices directory. */
+static int sysfs_has_file(int rootfd, const char *dirname,
+	const char *filename)
 {
 	struct stat statbuf;
 	char path[PATH_MAX];
 	int r;
 
-	snprintf(path, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH, dirname, filename);
-	r = stat(path, &statbuf);
+	snprintf(path, PATH_MAX, "%s/%s", dirname, filename);
+	r = fstatat(rootfd, path, &statbuf, 0);
 	if (r == 0 && S_ISREG(statbuf.st_mode))
 		return 1;
 
 	return 0;
 }
 
-static int op_init(struct libusb_context *ctx)
+/* find the usbfs root and check what the sysfs root offers. a NULL root
+ * falls back to its environment variable, then to the default */
+static int op_set_device_roots(struct libusb_context *ctx,
+	const char *usbfs_path, const char *sysfs_path)
 {
+	struct linux_context_priv *cpriv = _context_priv(ctx);
+	const char *path;
+	int usbdev_names;
 	struct stat statbuf;
 	int r;
 
-	usbfs_path = find_usbfs_path();
-	if (!usbfs_path) {
-		usbi_err(ctx, "could not find usbfs");
-		return LIBUSB_ERROR_OTHER;
+	if (!usbfs_path)
+		usbfs_path = getenv("LIBUSB_USBFS_PATH");
+	if (!sysfs_path)
+		sysfs_path = getenv("LIBUSB_SYSFS_PATH");
+	if (!sysfs_path)
+		sysfs_path = SYSFS_DEVICE_PATH;
+	if ((usbfs_path && strlen(usbfs_path) >= ROOT_PATH_MAX)
+			|| strlen(sysfs_path) >= ROOT_PATH_MAX) {
+		usbi_err(ctx, "usbfs or sysfs path too long");
+		return LIBUSB_ERROR_INVALID_PARAM;
 	}
 
-	if (monotonic_clkid == -1)
-		monotonic_clkid = find_monotonic_clock();
-
-	if (supports_flag_bulk_continuation == -1) {
-		/* bulk continuation URB flag available from Linux 2.6.32 */
-		supports_flag_bulk_continuation = kernel_version_ge(2,6,32);
-		if (supports_flag_bulk_continuation == -1) {
-			usbi_err(ctx, "error checking for bulk continuation support");
-			return LIBUSB_ERROR_OTHER;
-		}
+	path = find_usbfs_path(ctx, usbfs_path, &usbdev_names);
+	if (!path && usbfs_path) {
+		usbi_err(ctx, "no usbfs at %s", usbfs_path);
+		return LIBUSB_ERROR_NOT_FOUND;
 	}
-
-	if (supports_flag_bulk_continuation)
-		usbi_dbg("bulk continuation flag supported");
-
-	if (-1 == supports_flag_zero_packet) {
-		/* zero length packet URB flag fixed since Linux 2.6.31 */
-		supports_flag_zero_packet = kernel_version_ge(2,6,31);
-		if (-1 == supports_flag_zero_packet) {
-			usbi_err(ctx, "error checking for zero length packet support");
-			return LIBUSB_ERROR_OTHER;
-		}
+	if (path) {
+		strcpy(cpriv->usbfs_path, path);
+		cpriv->usbdev_names = usbdev_names;
+	} else {
+		usbi_dbg_ctx(ctx, "could not find usbfs");
+		cpriv->usbfs_path[0] = '\0';
+		cpriv->usbdev_names = 0;
 	}
+	strcpy(cpriv->sysfs_path, sysfs_path);
+	cpriv->sysfs_can_relate_devices = 0;
+	cpriv->sysfs_has_descriptors = 0;
 
-	if (supports_flag_zero_packet)
-		usbi_dbg("zero length packet flag supported");
-
-	r = stat(SYSFS_DEVICE_PATH, &statbuf);
+	r = stat(cpriv->sysfs_path, &statbuf);
 	if (r == 0 && S_ISDIR(statbuf.st_mode)) {
-		DIR *devices = opendir(SYSFS_DEVICE_PATH);
+		DIR *devices = opendir(cpriv->sysfs_path);
 		struct dirent *entry;
 
-		usbi_dbg("found usb devices in sysfs");
+		usbi_dbg_ctx(ctx, "found usb devices in sysfs at %s",
+			cpriv->sysfs_path);
 
 		if (!devices) {
 			usbi_err(ctx, "opendir devices failed errno=%d", errno);
@@ -368,7 +437,7 @@ static int op_init(struct libusb_context *ctx)
 		/* Make sure sysfs supports all the required files. If it
 		 * does not, then usbfs will be used instead.  Determine
 		 * this by looping through the directories in
-		 * SYSFS_DEVICE_PATH.  With the assumption that there will
+		 * sysfs_path.  With the assumption that there will
 		 * always be subdirectories of the name usbN (usb1, usb2,
 		 * etc) representing the root hubs, check the usbN
 		 * subdirectories to see if they have all the needed files.
@@ -388,36 +457,73 @@ static int op_init(struct libusb_context *ctx)
 				continue;
 
 			/* Check for the files libusbx needs from sysfs. */
-			has_busnum = sysfs_has_file(entry->d_name, "busnum");
-			has_devnum = sysfs_has_file(entry->d_name, "devnum");
-			has_descriptors = sysfs_has_file(entry->d_name, "descriptors");
-			has_configuration_value = sysfs_has_file(entry->d_name, "bConfigurationValue");
+			has_busnum = sysfs_has_file(dirfd(devices),
+				entry->d_name, "busnum");
+			has_devnum = sysfs_has_file(dirfd(devices),
+				entry->d_name, "devnum");
+			has_descriptors = sysfs_has_file(dirfd(devices),
+				entry->d_name, "descriptors");
+			has_configuration_value = sysfs_has_file(dirfd(devices),
+				entry->d_name, "bConfigurationValue");
 
 			if (has_busnum && has_devnum && has_configuration_value)
-				sysfs_can_relate_devices = 1;
+				cpriv->sysfs_can_relate_devices = 1;
 			if (has_descriptors)
-				sysfs_has_descriptors = 1;
+				cpriv->sysfs_has_descriptors = 1;
 
 			/* Only need to check until we've found ONE device which
 			   has all the attributes. */
-			if (sysfs_has_descriptors && sysfs_can_relate_devices)
+			if (cpriv->sysfs_has_descriptors
+					&& cpriv->sysfs_can_relate_devices)
 				break;
 		}
 		closedir(devices);
 
 		/* Only use sysfs descriptors if the rest of
 		   sysfs will work for libusb. */
-		if (!sysfs_can_relate_devices)
-			sysfs_has_descriptors = 0;
+		if (!cpriv->sysfs_can_relate_devices)
+			cpriv->sysfs_has_descriptors = 0;
 	} else {
-		usbi_dbg("sysfs usb info not available");
-		sysfs_has_descriptors = 0;
-		sysfs_can_relate_devices = 0;
+		usbi_dbg_ctx(ctx, "sysfs usb info not available");
+		cpriv->sysfs_has_descriptors = 0;
+		cpriv->sysfs_can_relate_devices = 0;
 	}
 
 	return 0;
 }
 
+static int op_init(struct libusb_context *ctx)
+{
+	if (monotonic_clkid == -1)
+		monotonic_clkid = find_monotonic_clock();
+
+	if (supports_flag_bulk_continuation == -1) {
+		/* bulk continuation URB flag available from Linux 2.6.32 */
+		supports_flag_bulk_continuation = kernel_version_ge(2,6,32);
+		if (supports_flag_bulk_continuation == -1) {
+			usbi_err(ctx, "error checking for bulk continuation support");
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+
+	if (supports_flag_bulk_continuation)
+		usbi_dbg_ctx(ctx, "bulk continuation flag supported");
+
+	if (-1 == supports_flag_zero_packet) {
+		/* zero length packet URB flag fixed since Linux 2.6.31 */
+		supports_flag_zero_packet = kernel_version_ge(2,6,31);
+		if (-1 == supports_flag_zero_packet) {
+			usbi_err(ctx, "error checking for zero length packet support");
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+
+	if (supports_flag_zero_packet)
+		usbi_dbg_ctx(ctx, "zero length packet flag supported");
+
+	return op_set_device_roots(ctx, NULL, NULL);
+}
+
 static int usbfs_get_device_descriptor(struct libusb_device *dev,
 	unsigned char *buffer)
 {
@@ -428,57 +534,193 @@ static int usbfs_get_device_descriptor(struct libusb_device *dev,
 	return 0;
 }
 
-static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
+/* sysfs attribute access:
+ * each device keeps an fd for its sysfs directory so that attributes can be
+ * opened with openat() instead of resolving the full path every time.
+ * Attributes are small, so they are read with a single read() into a stack
+ * buffer and parsed by hand. So as not to eat into the application's fd
+ * budget, a context holds at most SYSFS_DIR_FDS_MAX such directories;
+ * devices beyond that fall back to full paths (dirfd == -1). All of these
+ * fds are close-on-exec.
+ */
+
+#define SYSFS_DIR_FDS_MAX	64
+
+/* open attr of sysfs device devname, relative to dirfd if it is valid */
+static int open_sysfs_attr_at(struct libusb_context *ctx, int dirfd,
+	const char *devname, const char *attr)
 {
-	struct linux_device_priv *priv = _device_priv(dev);
 	char filename[PATH_MAX];
 	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s",
-		SYSFS_DEVICE_PATH, priv->sysfs_dir, attr);
-	fd = open(filename, O_RDONLY);
+	if (dirfd >= 0) {
+		fd = openat(dirfd, attr, O_RDONLY | O_CLOEXEC);
+	} else {
+		snprintf(filename, PATH_MAX, "%s/%s/%s",
+			_context_priv(ctx)->sysfs_path, devname, attr);
+		fd = open(filename, O_RDONLY | O_CLOEXEC);
+	}
 	if (fd < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"open %s failed ret=%d errno=%d", filename, fd, errno);
+		if (errno == ENOENT) {
+			/* File doesn't exist. Assume the device has been
+			   disconnected (see trac ticket #70). */
+			return LIBUSB_ERROR_NO_DEVICE;
+		}
+		usbi_err(ctx, "open %s/%s failed errno=%d", devname, attr,
+			errno);
 		return LIBUSB_ERROR_IO;
 	}
 
 	return fd;
 }
 
-/* Note only suitable for attributes which always read >= 0, < 0 is error */
-static int __read_sysfs_attr(struct libusb_context *ctx,
-	const char *devname, const char *attr)
+static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
 {
-	char filename[PATH_MAX];
-	FILE *f;
-	int r, value;
+	struct linux_device_priv *priv = _device_priv(dev);
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH,
-		 devname, attr);
-	f = fopen(filename, "r");
-	if (f == NULL) {
-		if (errno == ENOENT) {
-			/* File doesn't exist. Assume the device has been
-			   disconnected (see trac ticket #70). */
+	return open_sysfs_attr_at(DEVICE_CTX(dev), priv->sysfs_fd,
+		priv->sysfs_dir, attr);
+}
+
+/* read a whole (small) attribute into buf, which is NUL-terminated.
+ * returns the number of bytes read */
+static int read_sysfs_attr_at(struct libusb_context *ctx, int dirfd,
+	const char *devname, const char *attr, char *buf, size_t size)
+{
+	ssize_t r;
+	int fd;
+
+	fd = open_sysfs_attr_at(ctx, dirfd, devname, attr);
+	if (fd < 0)
+		return fd;
+
+	r = read(fd, buf, size - 1);
+	close(fd);
+	if (r < 0) {
+		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
-		}
-		usbi_err(ctx, "open %s failed errno=%d", filename, errno);
+		usbi_err(ctx, "read %s/%s failed errno=%d", devname, attr,
+			errno);
 		return LIBUSB_ERROR_IO;
 	}
 
-	r = fscanf(f, "%d", &value);
-	fclose(f);
-	if (r != 1) {
-		usbi_err(ctx, "fscanf %s returned %d, errno=%d", attr, r, errno);
+	buf[r] = 0;
+	return (int) r;
+}
+
+/* parse the leading decimal digits of an attribute value. parsing stops at
+ * the first non-digit, so a speed of "1.5" reads as 1. returns -1 if there
+ * are no digits or the value does not fit in an int */
+static int parse_sysfs_int(const char *buf)
+{
+	const char *p;
+	int value = 0;
+
+	for (p = buf; *p >= '0' && *p <= '9'; p++) {
+		if (value > (INT_MAX - 9) / 10)
+			return -1;
+		value = value * 10 + (*p - '0');
+	}
+
+	return p == buf ? -1 : value;
+}
+
+/* Note only suitable for attributes which always read >= 0, < 0 is error */
+static int read_sysfs_int_at(struct libusb_context *ctx, int dirfd,
+	const char *devname, const char *attr)
+{
+	char buf[16];
+	int r;
+
+	r = read_sysfs_attr_at(ctx, dirfd, devname, attr, buf, sizeof(buf));
+	if (r < 0)
+		return r;
+
+	r = parse_sysfs_int(buf);
+	if (r < 0) {
+		usbi_err(ctx, "couldn't parse %s '%s'", attr, buf);
 		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
 	}
-	if (value < 0) {
-		usbi_err(ctx, "%s contains a negative value", filename);
+
+	return r;
+}
+
+/* parse bConfigurationValue contents; empty means unconfigured */
+static int parse_sysfs_config(struct libusb_context *ctx, const char *buf,
+	int len, int *config)
+{
+	if (len == 0) {
+		usbi_dbg_ctx(ctx, "device unconfigured");
+		*config = -1;
+		return 0;
+	}
+
+	*config = parse_sysfs_int(buf);
+	if (*config < 0) {
+		usbi_err(ctx, "error converting '%s' to integer", buf);
 		return LIBUSB_ERROR_IO;
 	}
 
-	return value;
+	return 0;
+}
+
+#define SYSFS_ATTR_BUSNUM	(1 << 0)
+#define SYSFS_ATTR_DEVNUM	(1 << 1)
+#define SYSFS_ATTR_SPEED	(1 << 2)
+#define SYSFS_ATTR_CONFIG	(1 << 3)
+#define SYSFS_ATTR_ALL		0x0f
+
+struct sysfs_attrs {
+	int busnum;
+	int devnum;
+	/* in Mbps, -1 if not available */
+	int speed;
+	/* bConfigurationValue, -1 if unconfigured */
+	int config;
+};
+
+/* fetch the attributes selected by mask in a single call. busnum, devnum and
+ * bConfigurationValue are required if requested; speed is optional. fields
+ * not requested are set to -1. */
+static int sysfs_read_attrs(struct libusb_context *ctx, int dirfd,
+	const char *devname, int mask, struct sysfs_attrs *attrs)
+{
+	char buf[16];
+	int r;
+
+	attrs->busnum = attrs->devnum = attrs->speed = attrs->config = -1;
+
+	if (mask & SYSFS_ATTR_BUSNUM) {
+		attrs->busnum = read_sysfs_int_at(ctx, dirfd, devname,
+			"busnum");
+		if (attrs->busnum < 0)
+			return attrs->busnum;
+	}
+
+	if (mask & SYSFS_ATTR_DEVNUM) {
+		attrs->devnum = read_sysfs_int_at(ctx, dirfd, devname,
+			"devnum");
+		if (attrs->devnum < 0)
+			return attrs->devnum;
+	}
+
+	if (mask & SYSFS_ATTR_SPEED) {
+		attrs->speed = read_sysfs_int_at(ctx, dirfd, devname, "speed");
+		if (attrs->speed < 0)
+			attrs->speed = -1;
+	}
+
+	if (mask & SYSFS_ATTR_CONFIG) {
+		r = read_sysfs_attr_at(ctx, dirfd, devname,
+			"bConfigurationValue", buf, sizeof(buf));
+		if (r < 0)
+			return r;
+		r = parse_sysfs_config(ctx, buf, r, &attrs->config);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
 }
 
 static int sysfs_get_device_descriptor(struct libusb_device *dev,
@@ -510,7 +752,7 @@ static int sysfs_get_device_descriptor(struct libusb_device *dev,
 static int op_get_device_descriptor(struct libusb_device *dev,
 	unsigned char *buffer, int *host_endian)
 {
-	if (sysfs_has_descriptors) {
+	if (_context_priv(DEVICE_CTX(dev))->sysfs_has_descriptors) {
 		return sysfs_get_device_descriptor(dev, buffer);
 	} else {
 		*host_endian = 1;
@@ -518,6 +760,221 @@ static int op_get_device_descriptor(struct libusb_device *dev,
 	}
 }
 
+/* the kernel reads the manufacturer, product and serial number strings at
+ * enumeration time (in the first language, converted to UTF-8) and exposes
+ * them in sysfs. serve those from there; anything else is left to the core,
+ * which asks the device. */
+static int op_get_string_descriptor_utf8(struct libusb_device *dev,
+	uint8_t desc_index, char *data, int length)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	unsigned char desc[DEVICE_DESC_LENGTH];
+	const char *attr;
+	char buf[512];
+	int host_endian = 0;
+	int r;
+
+	if (!priv->sysfs_dir || length < 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	r = op_get_device_descriptor(dev, desc, &host_endian);
+	if (r < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* iManufacturer, iProduct and iSerialNumber */
+	if (desc_index == desc[14])
+		attr = "manufacturer";
+	else if (desc_index == desc[15])
+		attr = "product";
+	else if (desc_index == desc[16])
+		attr = "serial";
+	else
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* on any failure (including an attribute the kernel could not fill in)
+	 * let the core fall back to device I/O, which reports errors
+	 * properly */
+	r = read_sysfs_attr_at(DEVICE_CTX(dev), priv->sysfs_fd, priv->sysfs_dir,
+		attr, buf, sizeof(buf));
+	if (r < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (r > 0 && buf[r - 1] == '\n')
+		buf[--r] = 0;
+
+	if (r > length - 1)
+		r = length - 1;
+	memcpy(data, buf, r);
+	data[r] = 0;
+	return r;
+}
+
+/* attributes of the host controller (usually a PCI device) such as
+ * numa_node and irq are only found on its own sysfs directory, so walk up
+ * from the device's directory until one has the attribute. returns the
+ * directory, which the caller frees, or NULL */
+static char *find_controller_dir(struct libusb_device *dev, const char *attr)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	char path[PATH_MAX + 32];
+	char *real;
+	char *slash;
+
+	if (!priv->sysfs_dir)
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/%s",
+		_context_priv(DEVICE_CTX(dev))->sysfs_path, priv->sysfs_dir);
+	real = realpath(path, NULL);
+	if (!real)
+		return NULL;
+
+	while ((slash = strrchr(real, '/')) && slash != real) {
+		snprintf(path, sizeof(path), "%s/%s", real, attr);
+		if (access(path, F_OK) == 0)
+			return real;
+		*slash = 0;
+	}
+	free(real);
+	return NULL;
+}
+
+/* read a small integer file, returns -1 on failure */
+static int read_int_file(const char *path)
+{
+	char buf[16];
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return -1;
+	buf[r] = 0;
+	return atoi(buf);
+}
+
+static int op_get_numa_node(struct libusb_device *dev)
+{
+	char path[PATH_MAX + 16];
+	char *dir;
+	int node;
+
+	dir = find_controller_dir(dev, "numa_node");
+	if (!dir)
+		return LIBUSB_ERROR_NOT_FOUND;
+	snprintf(path, sizeof(path), "%s/numa_node", dir);
+	free(dir);
+
+	/* -1 if the platform has no NUMA affinity */
+	node = read_int_file(path);
+	return node >= 0 ? node : LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* add the CPUs of a cpu list such as "0-3,8" to a set */
+static void add_cpu_list(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+	long first, last, cpu;
+
+	while (*p) {
+		first = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (cpu = first; cpu <= last; cpu++) {
+			if (cpu >= 0 && cpu < CPU_SETSIZE)
+				CPU_SET(cpu, set);
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+}
+
+static void add_irq_cpus(int irq, cpu_set_t *set)
+{
+	static const char * const files[] = {
+		"effective_affinity_list", "smp_affinity_list"
+	};
+	char path[64];
+	char buf[512];
+	ssize_t r;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(path, sizeof(path), "/proc/irq/%d/%s", irq, files[i]);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		r = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (r <= 0)
+			continue;
+		buf[r] = 0;
+		add_cpu_list(buf, set);
+		return;
+	}
+}
+
+/* the controller's MSI interrupts if it uses them, its irq otherwise */
+static int op_get_irq_cpus(struct libusb_device *dev, int *cpus, int max_cpus)
+{
+	char path[PATH_MAX + 16];
+	struct dirent *entry;
+	cpu_set_t set;
+	char *dir;
+	DIR *msi;
+	int count = 0;
+	int found = 0;
+	int irq;
+	int cpu;
+
+	dir = find_controller_dir(dev, "irq");
+	if (!dir)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* the interrupts of a controller usually share CPUs, so collect them
+	 * in a set before truncating to max_cpus */
+	CPU_ZERO(&set);
+	snprintf(path, sizeof(path), "%s/msi_irqs", dir);
+	msi = opendir(path);
+	if (msi) {
+		while ((entry = readdir(msi))) {
+			if (!isdigit((unsigned char) entry->d_name[0]))
+				continue;
+			add_irq_cpus(atoi(entry->d_name), &set);
+			found = 1;
+		}
+		closedir(msi);
+	}
+	if (!found) {
+		snprintf(path, sizeof(path), "%s/irq", dir);
+		irq = read_int_file(path);
+		if (irq > 0) {
+			add_irq_cpus(irq, &set);
+			found = 1;
+		}
+	}
+	free(dir);
+
+	if (!found)
+		return LIBUSB_ERROR_NOT_FOUND;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		if (count < max_cpus)
+			cpus[count] = cpu;
+		count++;
+	}
+	return count;
+}
+
 static int usbfs_get_active_config_descriptor(struct libusb_device *dev,
 	unsigned char *buffer, size_t len)
 {
@@ -530,47 +987,168 @@ static int usbfs_get_active_config_descriptor(struct libusb_device *dev,
 	return 0;
 }
 
-/* read the bConfigurationValue for a device */
-static int sysfs_get_active_config(struct libusb_device *dev, int *config)
+/* runtime power management attributes live in the power/ subdirectory of
+ * the device. it is missing on kernels without CONFIG_PM, so a missing
+ * attribute only means the device is gone if its directory is too */
+static int open_power_attr(struct libusb_device *dev, const char *attr,
+	int flags)
 {
-	char *endptr;
-	char tmp[4] = {0, 0, 0, 0};
-	long num;
+	struct linux_device_priv *priv = _device_priv(dev);
+	const char *sysfs_path = _context_priv(DEVICE_CTX(dev))->sysfs_path;
+	char filename[PATH_MAX];
+	struct stat st;
 	int fd;
+
+	if (!priv->sysfs_dir)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (priv->sysfs_fd >= 0) {
+		snprintf(filename, PATH_MAX, "power/%s", attr);
+		fd = openat(priv->sysfs_fd, filename, flags | O_CLOEXEC);
+	} else {
+		snprintf(filename, PATH_MAX, "%s/%s/power/%s", sysfs_path,
+			priv->sysfs_dir, attr);
+		fd = open(filename, flags | O_CLOEXEC);
+	}
+	if (fd >= 0)
+		return fd;
+
+	switch (errno) {
+	case EACCES:
+	case EPERM:
+		return LIBUSB_ERROR_ACCESS;
+	case ENOENT:
+		/* the directory of a removed device loses its entries */
+		if (priv->sysfs_fd >= 0) {
+			if (fstatat(priv->sysfs_fd, "uevent", &st, 0) != 0)
+				return LIBUSB_ERROR_NO_DEVICE;
+		} else {
+			snprintf(filename, PATH_MAX, "%s/%s", sysfs_path,
+				priv->sysfs_dir);
+			if (stat(filename, &st) != 0)
+				return LIBUSB_ERROR_NO_DEVICE;
+		}
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int read_power_attr(struct libusb_device *dev, const char *attr,
+	char *buf, size_t size)
+{
 	ssize_t r;
+	int fd;
 
-	fd = _open_sysfs_attr(dev, "bConfigurationValue");
+	fd = open_power_attr(dev, attr, O_RDONLY);
 	if (fd < 0)
 		return fd;
+	r = read(fd, buf, size - 1);
+	close(fd);
+	if (r < 0)
+		return errno == ENODEV ? LIBUSB_ERROR_NO_DEVICE
+			: LIBUSB_ERROR_IO;
+	while (r > 0 && buf[r - 1] == '\n')
+		r--;
+	buf[r] = 0;
+	return (int) r;
+}
 
-	r = read(fd, tmp, sizeof(tmp));
+static int write_power_attr(struct libusb_device *dev, const char *attr,
+	const char *value)
+{
+	ssize_t r;
+	int fd;
+
+	fd = open_power_attr(dev, attr, O_WRONLY);
+	if (fd < 0)
+		return fd;
+	r = write(fd, value, strlen(value));
 	close(fd);
 	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev), 
-			"read bConfigurationValue failed ret=%d errno=%d", r, errno);
-		return LIBUSB_ERROR_IO;
-	} else if (r == 0) {
-		usbi_dbg("device unconfigured");
-		*config = -1;
-		return 0;
+		usbi_dbg_ctx(DEVICE_CTX(dev),
+			"write %s to power/%s failed errno=%d", value, attr,
+			errno);
+		switch (errno) {
+		case EACCES:
+		case EPERM:
+			return LIBUSB_ERROR_ACCESS;
+		case ENODEV:
+			return LIBUSB_ERROR_NO_DEVICE;
+		default:
+			return LIBUSB_ERROR_IO;
+		}
 	}
+	return 0;
+}
 
-	if (tmp[sizeof(tmp) - 1] != 0) {
-		usbi_err(DEVICE_CTX(dev), "not null-terminated?");
-		return LIBUSB_ERROR_IO;
-	} else if (tmp[0] == 0) {
-		usbi_err(DEVICE_CTX(dev), "no configuration value?");
-		return LIBUSB_ERROR_IO;
+static int op_get_power_state(struct libusb_device *dev,
+	struct libusb_power_state *state)
+{
+	static const char * const statuses[] = {
+		"", "active", "suspended", "suspending", "resuming"
+	};
+	char buf[32];
+	size_t i;
+	int r;
+
+	r = read_power_attr(dev, "control", buf, sizeof(buf));
+	if (r < 0)
+		return r;
+	state->autosuspend = (strcmp(buf, "auto") == 0);
+
+	/* the rest is missing on older kernels */
+	if (read_power_attr(dev, "autosuspend_delay_ms", buf, sizeof(buf)) > 0)
+		state->autosuspend_delay_ms = atoi(buf);
+	else if (read_power_attr(dev, "autosuspend", buf, sizeof(buf)) > 0)
+		state->autosuspend_delay_ms = atoi(buf) * 1000;
+
+	state->runtime_status = LIBUSB_RUNTIME_UNKNOWN;
+	if (read_power_attr(dev, "runtime_status", buf, sizeof(buf)) > 0) {
+		for (i = 1; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+			if (strcmp(buf, statuses[i]) == 0)
+				state->runtime_status = (int) i;
+		}
 	}
 
-	num = strtol(tmp, &endptr, 10);
-	if (endptr == tmp) {
-		usbi_err(DEVICE_CTX(dev), "error converting '%s' to integer", tmp);
-		return LIBUSB_ERROR_IO;
-	}
+	if (read_power_attr(dev, "runtime_active_time", buf, sizeof(buf)) > 0)
+		state->active_time_ms = strtoull(buf, NULL, 10);
+	if (read_power_attr(dev, "runtime_suspended_time", buf,
+			sizeof(buf)) > 0)
+		state->suspended_time_ms = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+static int op_set_autosuspend(struct libusb_device *dev, int enable,
+	int delay_ms)
+{
+	char buf[16];
+	int r;
+
+	/* set the delay first, so that enabling does not suspend the device
+	 * with the old one */
+	if (delay_ms >= 0) {
+		snprintf(buf, sizeof(buf), "%d", delay_ms);
+		r = write_power_attr(dev, "autosuspend_delay_ms", buf);
+		if (r < 0)
+			return r;
+	}
+	return write_power_attr(dev, "control", enable ? "auto" : "on");
+}
+
+/* read the bConfigurationValue for a device */
+static int sysfs_get_active_config(struct libusb_device *dev, int *config)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	char buf[16];
+	int r;
+
+	r = read_sysfs_attr_at(DEVICE_CTX(dev), priv->sysfs_fd, priv->sysfs_dir,
+		"bConfigurationValue", buf, sizeof(buf));
+	if (r < 0)
+		return r;
 
-	*config = (int) num;
-	return 0;
+	return parse_sysfs_config(DEVICE_CTX(dev), buf, r, config);
 }
 
 /* takes a usbfs/descriptors fd seeked to the start of a configuration, and
@@ -620,7 +1198,7 @@ static int sysfs_get_active_config_descriptor(struct libusb_device *dev,
 	if (config == -1)
 		return LIBUSB_ERROR_NOT_FOUND;
 
-	usbi_dbg("active configuration %d", config);
+	usbi_dbg_ctx(DEVICE_CTX(dev), "active configuration %d", config);
 
 	/* sysfs provides access to an in-memory copy of the device descriptor,
 	 * so we use that rather than keeping our own copy */
@@ -685,7 +1263,7 @@ static int sysfs_get_active_config_descriptor(struct libusb_device *dev,
 				fd, errno);
 			r = LIBUSB_ERROR_IO;
 		} else if (r == 0) {
-			usbi_dbg("device is unconfigured");
+			usbi_dbg_ctx(DEVICE_CTX(dev), "device is unconfigured");
 			r = LIBUSB_ERROR_NOT_FOUND;
 		} else if (r < len - sizeof(tmp)) {
 			usbi_err(DEVICE_CTX(dev), "short read %d/%d", r, len);
@@ -702,7 +1280,7 @@ static int sysfs_get_active_config_descriptor(struct libusb_device *dev,
 static int op_get_active_config_descriptor(struct libusb_device *dev,
 	unsigned char *buffer, size_t len, int *host_endian)
 {
-	if (sysfs_has_descriptors) {
+	if (_context_priv(DEVICE_CTX(dev))->sysfs_has_descriptors) {
 		return sysfs_get_active_config_descriptor(dev, buffer, len);
 	} else {
 		return usbfs_get_active_config_descriptor(dev, buffer, len);
@@ -849,42 +1427,154 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return active_config;
 }
 
+/* hold on to a sysfs directory fd for dev, if the context's budget for
+ * them allows it. on success the device owns *sysfs_fd and it is set to -1 */
+static void cache_sysfs_dir_fd(struct libusb_device *dev, int *sysfs_fd)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct linux_context_priv *cpriv = _context_priv(ctx);
+	int keep = 0;
+
+	if (*sysfs_fd < 0)
+		return;
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	if (cpriv->sysfs_dir_fds < SYSFS_DIR_FDS_MAX) {
+		cpriv->sysfs_dir_fds++;
+		keep = 1;
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	if (keep) {
+		_device_priv(dev)->sysfs_fd = *sysfs_fd;
+		*sysfs_fd = -1;
+	}
+}
+
+static void release_sysfs_dir_fd(struct libusb_device *dev)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct linux_device_priv *priv = _device_priv(dev);
+
+	if (priv->sysfs_fd < 0)
+		return;
+
+	close(priv->sysfs_fd);
+	priv->sysfs_fd = -1;
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	_context_priv(ctx)->sysfs_dir_fds--;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+}
+
+/* identify dev for the descriptor cache, using its sysfs directory */
+static int get_desc_cache_key(struct libusb_device *dev, int active_config,
+	struct linux_desc_cache_key *key)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	char path[PATH_MAX];
+	struct stat statbuf;
+	int r;
+
+	if (priv->sysfs_fd >= 0) {
+		r = fstat(priv->sysfs_fd, &statbuf);
+	} else {
+		snprintf(path, PATH_MAX, "%s/%s",
+			_context_priv(DEVICE_CTX(dev))->sysfs_path,
+			priv->sysfs_dir);
+		r = stat(path, &statbuf);
+	}
+	if (r < 0)
+		return LIBUSB_ERROR_IO;
+
+	key->sysfs_dir = priv->sysfs_dir;
+	key->busnum = dev->bus_number;
+	key->devaddr = dev->device_address;
+	key->dir_ino = statbuf.st_ino;
+	key->dir_mtime_sec = statbuf.st_mtim.tv_sec;
+	key->dir_mtime_nsec = statbuf.st_mtim.tv_nsec;
+	key->active_config = active_config;
+	return 0;
+}
+
+/* fill in the cached descriptors of dev from the descriptor cache */
+static int load_cached_descriptors(struct libusb_device *dev,
+	struct linux_desc_cache *cache, const struct linux_desc_cache_key *key)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	const unsigned char *dev_desc, *config;
+	size_t config_len;
+	int r;
+
+	r = linux_desc_cache_lookup(cache, key, &dev_desc, &config,
+		&config_len);
+	if (r < 0)
+		return r;
+
+	priv->dev_descriptor = malloc(DEVICE_DESC_LENGTH);
+	if (!priv->dev_descriptor)
+		return LIBUSB_ERROR_NO_MEM;
+	memcpy(priv->dev_descriptor, dev_desc, DEVICE_DESC_LENGTH);
+
+	if (config_len) {
+		priv->config_descriptor = malloc(config_len);
+		if (!priv->config_descriptor) {
+			free(priv->dev_descriptor);
+			priv->dev_descriptor = NULL;
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		memcpy(priv->config_descriptor, config, config_len);
+	}
+
+	dev->num_configurations = dev_desc[DEVICE_DESC_LENGTH - 1];
+	usbi_dbg_ctx(DEVICE_CTX(dev), "descriptors for %s loaded from cache",
+		key->sysfs_dir);
+	return 0;
+}
+
+/* attrs and sysfs_fd are only used when sysfs_dir is given. attrs must hold
+ * the speed, and also the active configuration if sysfs can relate devices
+ * but has no descriptors. the device may take ownership of *sysfs_fd, see
+ * cache_sysfs_dir_fd(). cache, if not NULL, is the descriptor cache to use
+ * for devices whose descriptors have to be read through usbfs */
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
-	uint8_t devaddr, const char *sysfs_dir)
+	uint8_t devaddr, const char *sysfs_dir, const struct sysfs_attrs *attrs,
+	int *sysfs_fd, struct linux_desc_cache *cache)
 {
+	struct linux_context_priv *cpriv = _context_priv(DEVICE_CTX(dev));
 	struct linux_device_priv *priv = _device_priv(dev);
+	struct linux_desc_cache_key key;
 	unsigned char *dev_buf;
 	char path[PATH_MAX];
-	int fd, speed;
+	int fd;
 	int active_config = 0;
 	int device_configured = 1;
+	int use_cache = 0;
 	ssize_t r;
 
 	dev->bus_number = busnum;
 	dev->device_address = devaddr;
+	priv->sysfs_fd = -1;
 
 	if (sysfs_dir) {
 		priv->sysfs_dir = malloc(strlen(sysfs_dir) + 1);
 		if (!priv->sysfs_dir)
 			return LIBUSB_ERROR_NO_MEM;
 		strcpy(priv->sysfs_dir, sysfs_dir);
-
-		/* Note speed can contain 1.5, in this case __read_sysfs_attr
-		   will stop parsing at the '.' and return 1 */
-		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
-		if (speed >= 0) {
-			switch (speed) {
-			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
-			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
-			case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
-			case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
-			default:
-				usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps", speed);
-			}
+		cache_sysfs_dir_fd(dev, sysfs_fd);
+
+		switch (attrs->speed) {
+		case    -1: break;
+		case     1: dev->speed = LIBUSB_SPEED_LOW; break;
+		case    12: dev->speed = LIBUSB_SPEED_FULL; break;
+		case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
+		case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
+		default:
+			usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps",
+				attrs->speed);
 		}
 	}
 
-	if (sysfs_has_descriptors)
+	if (cpriv->sysfs_has_descriptors)
 		return 0;
 
 	/* cache device descriptor in memory so that we can retrieve it later
@@ -893,12 +1583,19 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	priv->dev_descriptor = NULL;
 	priv->config_descriptor = NULL;
 
-	if (sysfs_can_relate_devices) {
-		int tmp = sysfs_get_active_config(dev, &active_config);
-		if (tmp < 0)
-			return tmp;
+	if (cpriv->sysfs_can_relate_devices) {
+		active_config = attrs->config;
 		if (active_config == -1)
 			device_configured = 0;
+
+		/* the active configuration is known without touching the
+		 * device, so the descriptor cache can be trusted */
+		if (cache && sysfs_dir
+				&& get_desc_cache_key(dev, active_config, &key) == 0) {
+			use_cache = 1;
+			if (load_cached_descriptors(dev, cache, &key) == 0)
+				return 0;
+		}
 	}
 
 	_get_usbfs_path(dev, path);
@@ -916,7 +1613,7 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		return LIBUSB_ERROR_IO;
 	}
 
-	if (!sysfs_can_relate_devices) {
+	if (!cpriv->sysfs_can_relate_devices) {
 		if (active_config == -1) {
 			/* if we only have read-only access to the device, we cannot
 			 * send a control message to determine the active config. just
@@ -940,7 +1637,8 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 				 * not support buggy devices in these circumstances.
 				 * stick to the specs: a configuration value of 0 means
 				 * unconfigured. */
-				usbi_dbg("active cfg 0? assuming unconfigured device");
+				usbi_dbg_ctx(DEVICE_CTX(dev), "active cfg 0? "
+					"assuming unconfigured device");
 				device_configured = 0;
 			}
 		}
@@ -981,16 +1679,28 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 
 	close(fd);
 	priv->dev_descriptor = dev_buf;
+
+	if (use_cache) {
+		size_t config_len = 0;
+		if (priv->config_descriptor)
+			config_len = priv->config_descriptor[2]
+				| priv->config_descriptor[3] << 8;
+		linux_desc_cache_insert(cache, &key, dev_buf,
+			priv->config_descriptor, config_len);
+	}
 	return 0;
 }
 
-static int enumerate_device(struct libusb_context *ctx,
-	struct discovered_devs **_discdevs, uint8_t busnum, uint8_t devaddr,
-	const char *sysfs_dir)
+/* look up the device at busnum/devaddr, allocating and initializing it if
+ * it is new. on success *_dev holds a reference that the caller must drop.
+ * sysfs_dir, attrs, sysfs_fd and cache are as for initialize_device().
+ * sysfs_fd, if valid, is consumed (cached by the device or closed) */
+static int find_or_init_device(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir, const struct sysfs_attrs *attrs,
+	int sysfs_fd, struct linux_desc_cache *cache,
+	struct libusb_device **_dev)
 {
-	struct discovered_devs *discdevs;
 	unsigned long session_id;
-	int need_unref = 0;
 	struct libusb_device *dev;
 	int r = 0;
 
@@ -998,38 +1708,68 @@ static int enumerate_device(struct libusb_context *ctx,
 	 * will be reused. instead we should add a simple sysfs attribute with
 	 * a session ID. */
 	session_id = busnum << 8 | devaddr;
-	usbi_dbg("busnum %d devaddr %d session_id %ld", busnum, devaddr,
-		session_id);
+	usbi_dbg_ctx(ctx, "busnum %d devaddr %d session_id %ld", busnum,
+		devaddr, session_id);
 
 	dev = usbi_get_device_by_session_id(ctx, session_id);
 	if (dev) {
-		usbi_dbg("using existing device for %d/%d (session %ld)",
-			busnum, devaddr, session_id);
+		usbi_dbg_ctx(ctx,
+			"using existing device for %d/%d (session %ld)", busnum,
+			devaddr, session_id);
+		libusb_ref_device(dev);
 	} else {
-		usbi_dbg("allocating new device for %d/%d (session %ld)",
-			busnum, devaddr, session_id);
+		usbi_dbg_ctx(ctx,
+			"allocating new device for %d/%d (session %ld)", busnum,
+			devaddr, session_id);
 		dev = usbi_alloc_device(ctx, session_id);
-		if (!dev)
-			return LIBUSB_ERROR_NO_MEM;
-		need_unref = 1;
-		r = initialize_device(dev, busnum, devaddr, sysfs_dir);
-		if (r < 0)
-			goto out;
-		r = usbi_sanitize_device(dev);
-		if (r < 0)
+		if (!dev) {
+			r = LIBUSB_ERROR_NO_MEM;
 			goto out;
+		}
+		r = initialize_device(dev, busnum, devaddr, sysfs_dir, attrs,
+			&sysfs_fd, cache);
+		if (r == 0)
+			r = usbi_sanitize_device(dev);
+		if (r < 0) {
+			libusb_unref_device(dev);
+			dev = NULL;
+		}
 	}
 
+out:
+	if (sysfs_fd >= 0)
+		close(sysfs_fd);
+	*_dev = dev;
+	return r;
+}
+
+/* append dev to *_discdevs and drop the caller's reference to it */
+static int append_device(struct discovered_devs **_discdevs,
+	struct libusb_device *dev)
+{
+	struct discovered_devs *discdevs;
+
 	discdevs = discovered_devs_append(*_discdevs, dev);
+	libusb_unref_device(dev);
 	if (!discdevs)
-		r = LIBUSB_ERROR_NO_MEM;
-	else
-		*_discdevs = discdevs;
+		return LIBUSB_ERROR_NO_MEM;
 
-out:
-	if (need_unref)
-		libusb_unref_device(dev);
-	return r;
+	*_discdevs = discdevs;
+	return 0;
+}
+
+static int enumerate_device(struct libusb_context *ctx,
+	struct discovered_devs **_discdevs, uint8_t busnum, uint8_t devaddr)
+{
+	struct libusb_device *dev;
+	int r;
+
+	r = find_or_init_device(ctx, busnum, devaddr, NULL, NULL, -1, NULL,
+		&dev);
+	if (r < 0)
+		return r;
+
+	return append_device(_discdevs, dev);
 }
 
 /* open a bus directory and adds all discovered devices to discdevs. on
@@ -1045,8 +1785,9 @@ static int usbfs_scan_busdir(struct libusb_context *ctx,
 	struct discovered_devs *discdevs = *_discdevs;
 	int r = LIBUSB_ERROR_IO;
 
-	snprintf(dirpath, PATH_MAX, "%s/%03d", usbfs_path, busnum);
-	usbi_dbg("%s", dirpath);
+	snprintf(dirpath, PATH_MAX, "%s/%03d", _context_priv(ctx)->usbfs_path,
+		busnum);
+	usbi_dbg_ctx(ctx, "%s", dirpath);
 	dir = opendir(dirpath);
 	if (!dir) {
 		usbi_err(ctx, "opendir '%s' failed, errno=%d", dirpath, errno);
@@ -1063,12 +1804,15 @@ static int usbfs_scan_busdir(struct libusb_context *ctx,
 
 		devaddr = atoi(entry->d_name);
 		if (devaddr == 0) {
-			usbi_dbg("unknown dir entry %s", entry->d_name);
+			usbi_dbg_ctx(ctx, "unknown dir entry %s",
+				entry->d_name);
 			continue;
 		}
 
-		if (enumerate_device(ctx, &discdevs, busnum, (uint8_t) devaddr, NULL)) {
-			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
+		if (enumerate_device(ctx, &discdevs, busnum,
+				(uint8_t) devaddr)) {
+			usbi_dbg_ctx(ctx, "failed to enumerate dir entry %s",
+				entry->d_name);
 			continue;
 		}
 
@@ -1084,8 +1828,9 @@ static int usbfs_scan_busdir(struct libusb_context *ctx,
 static int usbfs_get_device_list(struct libusb_context *ctx,
 	struct discovered_devs **_discdevs)
 {
+	struct linux_context_priv *cpriv = _context_priv(ctx);
 	struct dirent *entry;
-	DIR *buses = opendir(usbfs_path);
+	DIR *buses = opendir(cpriv->usbfs_path);
 	struct discovered_devs *discdevs = *_discdevs;
 	int r = 0;
 
@@ -1101,21 +1846,24 @@ static int usbfs_get_device_list(struct libusb_context *ctx,
 		if (entry->d_name[0] == '.')
 			continue;
 
-		if (usbdev_names) {
+		if (cpriv->usbdev_names) {
 			int devaddr;
 			if (!_is_usbdev_entry(entry, &busnum, &devaddr))
 				continue;
 
 			r = enumerate_device(ctx, &discdevs_new, busnum,
-				(uint8_t) devaddr, NULL);
+				(uint8_t) devaddr);
 			if (r < 0) {
-				usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
+				usbi_dbg_ctx(ctx,
+					"failed to enumerate dir entry %s",
+					entry->d_name);
 				continue;
 			}
 		} else {
 			busnum = atoi(entry->d_name);
 			if (busnum == 0) {
-				usbi_dbg("unknown dir entry %s", entry->d_name);
+				usbi_dbg_ctx(ctx, "unknown dir entry %s",
+					entry->d_name);
 				continue;
 			}
 
@@ -1133,28 +1881,44 @@ out:
 
 }
 
+/* rootfd is an fd for the sysfs devices directory, cache the descriptor
+ * cache or NULL. on success *_dev holds a reference to the device */
 static int sysfs_scan_device(struct libusb_context *ctx,
-	struct discovered_devs **_discdevs, const char *devname)
+	struct linux_desc_cache *cache, int rootfd, const char *devname,
+	struct libusb_device **_dev)
 {
-	int busnum;
-	int devaddr;
+	struct sysfs_attrs attrs;
+	int mask = SYSFS_ATTR_BUSNUM | SYSFS_ATTR_DEVNUM | SYSFS_ATTR_SPEED;
+	int dirfd;
+	int r;
 
-	usbi_dbg("scan %s", devname);
+	usbi_dbg_ctx(ctx, "scan %s", devname);
 
-	busnum = __read_sysfs_attr(ctx, devname, "busnum");
-	if (busnum < 0)
-		return busnum;
+	/* without the directory fd, attributes are read through full paths */
+	dirfd = openat(rootfd, devname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0 && errno == ENOENT)
+		return LIBUSB_ERROR_NO_DEVICE;
 
-	devaddr = __read_sysfs_attr(ctx, devname, "devnum");
-	if (devaddr < 0)
-		return devaddr;
+	if (!_context_priv(ctx)->sysfs_has_descriptors)
+		mask |= SYSFS_ATTR_CONFIG;
 
-	usbi_dbg("bus=%d dev=%d", busnum, devaddr);
-	if (busnum > 255 || devaddr > 255)
-		return LIBUSB_ERROR_INVALID_PARAM;
+	r = sysfs_read_attrs(ctx, dirfd, devname, mask, &attrs);
+	if (r < 0)
+		goto err;
+
+	usbi_dbg_ctx(ctx, "bus=%d dev=%d", attrs.busnum, attrs.devnum);
+	if (attrs.busnum > 255 || attrs.devnum > 255) {
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto err;
+	}
 
-	return enumerate_device(ctx, _discdevs, busnum & 0xff, devaddr & 0xff,
-		devname);
+	return find_or_init_device(ctx, attrs.busnum & 0xff,
+		attrs.devnum & 0xff, devname, &attrs, dirfd, cache, _dev);
+
+err:
+	if (dirfd >= 0)
+		close(dirfd);
+	return r;
 }
 
 static void sysfs_analyze_topology(struct discovered_devs *discdevs)
@@ -1225,11 +1989,160 @@ static void sysfs_analyze_topology(struct discovered_devs *discdevs)
 	}
 }
 
+static int sysfs_is_device_entry(const char *name)
+{
+	return (isdigit(name[0]) || !strncmp(name, "usb", 3))
+		&& !strchr(name, ':');
+}
+
+/* parallel enumeration:
+ * the names of all device entries are collected first, then a bounded pool
+ * of threads (including the caller) picks them off in turn and looks up or
+ * initializes each device. every result is stored in the slot of its entry,
+ * so the merge into discdevs afterwards follows directory order exactly as
+ * sequential enumeration would. */
+struct sysfs_scan_job {
+	char *devname;
+	struct libusb_device *dev;
+	int r;
+};
+
+struct sysfs_scan_pool {
+	struct libusb_context *ctx;
+	struct linux_desc_cache *cache;
+	int rootfd;
+	struct sysfs_scan_job *jobs;
+	int num_jobs;
+	int next_job;
+	usbi_mutex_t lock;
+};
+
+static void *sysfs_scan_worker(void *arg)
+{
+	struct sysfs_scan_pool *pool = arg;
+	struct sysfs_scan_job *job;
+
+	while (1) {
+		usbi_mutex_lock(&pool->lock);
+		job = pool->next_job < pool->num_jobs ?
+			&pool->jobs[pool->next_job++] : NULL;
+		usbi_mutex_unlock(&pool->lock);
+		if (!job)
+			break;
+
+		job->r = sysfs_scan_device(pool->ctx, pool->cache, pool->rootfd,
+			job->devname, &job->dev);
+	}
+
+	return NULL;
+}
+
+/* the pool threads other than the caller are the library's own, so the
+ * context's scheduling setting applies to them */
+static void *sysfs_scan_thread(void *arg)
+{
+	struct sysfs_scan_pool *pool = arg;
+
+	usbi_sched_thread_start(pool->ctx, "enumeration");
+	sysfs_scan_worker(pool);
+	usbi_sched_thread_stop(pool->ctx);
+	return NULL;
+}
+
+static int sysfs_scan_parallel(struct libusb_context *ctx,
+	struct linux_desc_cache *cache, DIR *devices, int max_threads,
+	struct discovered_devs **_discdevs)
+{
+	struct sysfs_scan_pool pool;
+	struct sysfs_scan_job *jobs = NULL, *new_jobs;
+	usbi_thread_t *threads;
+	struct dirent *entry;
+	int capacity = 0, num_jobs = 0, num_threads = 0;
+	int i, r = LIBUSB_ERROR_IO;
+
+	while ((entry = readdir(devices))) {
+		if (!sysfs_is_device_entry(entry->d_name))
+			continue;
+
+		if (num_jobs == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			new_jobs = realloc(jobs, capacity * sizeof(*jobs));
+			if (!new_jobs) {
+				r = LIBUSB_ERROR_NO_MEM;
+				goto out;
+			}
+			jobs = new_jobs;
+		}
+		jobs[num_jobs].devname = strdup(entry->d_name);
+		if (!jobs[num_jobs].devname) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		jobs[num_jobs].dev = NULL;
+		jobs[num_jobs].r = LIBUSB_ERROR_OTHER;
+		num_jobs++;
+	}
+
+	pool.ctx = ctx;
+	pool.cache = cache;
+	pool.rootfd = dirfd(devices);
+	pool.jobs = jobs;
+	pool.num_jobs = num_jobs;
+	pool.next_job = 0;
+	usbi_mutex_init(&pool.lock, NULL);
+
+	/* the calling thread is one of the workers */
+	if (max_threads > num_jobs)
+		max_threads = num_jobs;
+	threads = max_threads > 1 ? malloc((max_threads - 1) * sizeof(*threads))
+		: NULL;
+	if (threads) {
+		for (i = 0; i < max_threads - 1; i++) {
+			if (usbi_thread_create(&threads[i], sysfs_scan_thread,
+					&pool))
+				break;
+			num_threads++;
+		}
+	}
+	usbi_dbg_ctx(ctx, "initializing %d devices on %d threads", num_jobs,
+		num_threads + 1);
+
+	sysfs_scan_worker(&pool);
+	for (i = 0; i < num_threads; i++)
+		usbi_thread_join(threads[i]);
+	free(threads);
+	usbi_mutex_destroy(&pool.lock);
+
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].r < 0) {
+			usbi_dbg_ctx(ctx, "failed to enumerate dir entry %s",
+				jobs[i].devname);
+			continue;
+		}
+
+		/* once appending has failed, only drop the remaining
+		 * references */
+		if (r == LIBUSB_ERROR_NO_MEM)
+			libusb_unref_device(jobs[i].dev);
+		else
+			r = append_device(_discdevs, jobs[i].dev);
+	}
+
+out:
+	for (i = 0; i < num_jobs; i++)
+		free(jobs[i].devname);
+	free(jobs);
+	return r;
+}
+
 static int sysfs_get_device_list(struct libusb_context *ctx,
 	struct discovered_devs **_discdevs)
 {
+	struct linux_context_priv *cpriv = _context_priv(ctx);
 	struct discovered_devs *discdevs = *_discdevs;
-	DIR *devices = opendir(SYSFS_DEVICE_PATH);
+	DIR *devices = opendir(cpriv->sysfs_path);
+	struct linux_desc_cache *cache = NULL;
+	struct libusb_device *dev;
 	struct dirent *entry;
 	int r = LIBUSB_ERROR_IO;
 
@@ -1238,26 +2151,45 @@ static int sysfs_get_device_list(struct libusb_context *ctx,
 		return r;
 	}
 
-	while ((entry = readdir(devices))) {
-		struct discovered_devs *discdevs_new = discdevs;
+	/* the descriptor cache only helps when descriptors have to be read
+	 * from the devices themselves */
+	if (ctx->desc_cache_path && !cpriv->sysfs_has_descriptors)
+		cache = linux_desc_cache_open(ctx, ctx->desc_cache_path);
+
+	if (ctx->enum_threads > 1) {
+		r = sysfs_scan_parallel(ctx, cache, devices, ctx->enum_threads,
+			&discdevs);
+		goto out;
+	}
 
-		if ((!isdigit(entry->d_name[0]) && strncmp(entry->d_name, "usb", 3))
-				|| strchr(entry->d_name, ':'))
+	while ((entry = readdir(devices))) {
+		if (!sysfs_is_device_entry(entry->d_name))
 			continue;
 
-		if (sysfs_scan_device(ctx, &discdevs_new, entry->d_name)) {
-			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
+		if (sysfs_scan_device(ctx, cache, dirfd(devices), entry->d_name,
+				&dev)) {
+			usbi_dbg_ctx(ctx, "failed to enumerate dir entry %s",
+				entry->d_name);
 			continue;
 		}
 
-		r = 0;
-		discdevs = discdevs_new;
+		r = append_device(&discdevs, dev);
+		if (r < 0)
+			break;
 	}
 
+out:
+	if (cache) {
+		/* discdevs now holds every present device */
+		if (!r)
+			linux_desc_cache_prune(cache, discdevs);
+		linux_desc_cache_close(cache);
+	}
 	if (!r)
 		*_discdevs = discdevs;
 	closedir(devices);
-	sysfs_analyze_topology(discdevs);
+	if (!r)
+		sysfs_analyze_topology(discdevs);
 	return r;
 }
 
@@ -1272,9 +2204,13 @@ static int op_get_device_list(struct libusb_context *ctx,
 	 * as described in the "sysfs vs usbfs" comment at the top of this
 	 * file, sometimes we have sysfs but not enough information to
 	 * relate sysfs devices to usbfs nodes.  op_init() determines the
-	 * adequacy of sysfs and sets sysfs_can_relate_devices.
+	 * adequacy of sysfs and sets the context's sysfs_can_relate_devices.
 	 */
-	if (sysfs_can_relate_devices != 0)
+	if (!_context_priv(ctx)->usbfs_path[0]) {
+		usbi_err(ctx, "could not find usbfs");
+		return LIBUSB_ERROR_OTHER;
+	}
+	if (_context_priv(ctx)->sysfs_can_relate_devices != 0)
 		return sysfs_get_device_list(ctx, _discdevs);
 	else
 		return usbfs_get_device_list(ctx, _discdevs);
@@ -1286,7 +2222,7 @@ static int op_open(struct libusb_device_handle *handle)
 	char filename[PATH_MAX];
 
 	_get_usbfs_path(handle->dev, filename);
-	usbi_dbg("opening %s", filename);
+	usbi_dbg_ctx(HANDLE_CTX(handle), "opening %s", filename);
 	hpriv->fd = open(filename, O_RDWR);
 	if (hpriv->fd < 0) {
 		if (errno == EACCES) {
@@ -1320,7 +2256,7 @@ static int op_get_configuration(struct libusb_device_handle *handle,
 	int *config)
 {
 	int r;
-	if (sysfs_can_relate_devices != 1)
+	if (_context_priv(HANDLE_CTX(handle))->sysfs_can_relate_devices != 1)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 
 	r = sysfs_get_active_config(handle->dev, config);
@@ -1352,7 +2288,7 @@ static int op_set_configuration(struct libusb_device_handle *handle, int config)
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	if (!sysfs_has_descriptors) {
+	if (!_context_priv(HANDLE_CTX(handle))->sysfs_has_descriptors) {
 		/* update our cached active config descriptor */
 		if (config == -1) {
 			if (priv->config_descriptor) {
@@ -1448,6 +2384,56 @@ static int op_clear_halt(struct libusb_device_handle *handle,
 	return 0;
 }
 
+static int do_streams_ioctl(struct libusb_device_handle *handle, long req,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	int r, fd = _device_handle_priv(handle)->fd;
+	struct usbfs_streams *streams;
+
+	if (num_endpoints > 30) /* Max 15 in + 15 out eps */
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	streams = malloc(sizeof(struct usbfs_streams) + num_endpoints);
+	if (!streams)
+		return LIBUSB_ERROR_NO_MEM;
+
+	streams->num_streams = num_streams;
+	streams->num_eps = num_endpoints;
+	memcpy(streams->eps, endpoints, num_endpoints);
+
+	r = ioctl(fd, req, streams);
+
+	free(streams);
+
+	if (r < 0) {
+		if (errno == ENOTTY)
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		else if (errno == EINVAL)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		else if (errno == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		usbi_err(HANDLE_CTX(handle),
+			"streams ioctl failed error %d errno %d", r, errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return r;
+}
+
+static int op_alloc_streams(struct libusb_device_handle *handle,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	return do_streams_ioctl(handle, IOCTL_USBFS_ALLOC_STREAMS,
+		num_streams, endpoints, num_endpoints);
+}
+
+static int op_free_streams(struct libusb_device_handle *handle,
+	unsigned char *endpoints, int num_endpoints)
+{
+	return do_streams_ioctl(handle, IOCTL_USBFS_FREE_STREAMS, 0,
+		endpoints, num_endpoints);
+}
+
 static int op_reset_device(struct libusb_device_handle *handle)
 {
 	int fd = _device_handle_priv(handle)->fd;
@@ -1580,7 +2566,7 @@ static int op_attach_kernel_driver(struct libusb_device_handle *handle,
 static void op_destroy_device(struct libusb_device *dev)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	if (!sysfs_has_descriptors) {
+	if (!_context_priv(DEVICE_CTX(dev))->sysfs_has_descriptors) {
 		if (priv->dev_descriptor)
 			free(priv->dev_descriptor);
 		if (priv->config_descriptor)
@@ -1588,6 +2574,7 @@ static void op_destroy_device(struct libusb_device *dev)
 	}
 	if (priv->sysfs_dir)
 		free(priv->sysfs_dir);
+	release_sysfs_dir_fd(dev);
 }
 
 /* URBs are discarded in reverse order of submission to avoid races. */
@@ -1612,11 +2599,14 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 			continue;
 
 		if (EINVAL == errno) {
-			usbi_dbg("URB not found --> assuming ready to be reaped");
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "URB not found "
+				"--> assuming ready to be reaped");
 			if (i == (last_plus_one - 1))
 				ret = LIBUSB_ERROR_NOT_FOUND;
 		} else if (ENODEV == errno) {
-			usbi_dbg("Device not found for URB --> assuming ready to be reaped");
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "Device not "
+				"found for URB --> assuming ready to be "
+				"reaped");
 			ret = LIBUSB_ERROR_NO_DEVICE;
 		} else {
 			usbi_warn(TRANSFER_CTX(transfer),
@@ -1652,7 +2642,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urbs;
 	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
 		== LIBUSB_ENDPOINT_OUT;
-	int r;
+	int r, err;
 	int i;
 	size_t alloc_size;
 
@@ -1676,7 +2666,8 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		last_urb_partial = 1;
 		num_urbs++;
 	}
-	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
+	usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+		"need %d urbs for new transfer with length %d", num_urbs,
 		transfer->length);
 	alloc_size = num_urbs * sizeof(struct usbfs_urb);
 	urbs = malloc(alloc_size);
@@ -1695,6 +2686,9 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		urb->type = urb_type;
 		urb->endpoint = transfer->endpoint;
 		urb->buffer = transfer->buffer + (i * MAX_BULK_BUFFER_LENGTH);
+		/* every urb of a transfer on a stream goes to that stream */
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM)
+			urb->stream_id = itransfer->stream_id;
 		if (supports_flag_bulk_continuation && !is_out)
 			urb->flags = USBFS_URB_SHORT_NOT_OK;
 		if (i == num_urbs - 1 && last_urb_partial)
@@ -1713,19 +2707,27 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 			urb->flags |= USBFS_URB_ZERO_PACKET;
 
 		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+		/* the tracing below may clobber errno */
+		err = r < 0 ? errno : 0;
+		usbi_trace(LIBUSB_TRACE_URB_SUBMIT, itransfer,
+			urb->buffer_length, -err);
+		usbi_probe_transfer(urb__submit, transfer, urb->buffer_length,
+			-err, i);
 		if (r < 0) {
-			if (errno == ENODEV) {
+			if (err == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
 			} else {
 				usbi_err(TRANSFER_CTX(transfer),
-					"submiturb failed error %d errno=%d", r, errno);
+					"submiturb failed error %d errno=%d",
+					r, err);
 				r = LIBUSB_ERROR_IO;
 			}
 	
 			/* if the first URB submission fails, we can simply free up and
 			 * return failure immediately. */
 			if (i == 0) {
-				usbi_dbg("first URB failed, easy peasy");
+				usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+					"first URB failed, easy peasy");
 				free(urbs);
 				tpriv->urbs = NULL;
 				return r;
@@ -1747,7 +2749,8 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 			 * the final reap completes we can report error to the user,
 			 * or success if an earlier URB was completed successfully.
 			 */
-			tpriv->reap_action = EREMOTEIO == errno ? COMPLETED_EARLY : SUBMIT_FAILED;
+			tpriv->reap_action = EREMOTEIO == err ? COMPLETED_EARLY
+				: SUBMIT_FAILED;
 
 			/* The URBs we haven't submitted yet we count as already
 			 * retired. */
@@ -1759,7 +2762,8 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 
 			discard_urbs(itransfer, 0, i);
 
-			usbi_dbg("reporting successful submission but waiting for %d "
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "reporting "
+				"successful submission but waiting for %d "
 				"discards before reporting error", i);
 			return 0;
 		}
@@ -1805,7 +2809,8 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			this_urb_len += packet_len;
 		}
 	}
-	usbi_dbg("need %d 32k URBs for transfer", num_urbs);
+	usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "need %d 32k URBs for transfer",
+		num_urbs);
 
 	alloc_size = num_urbs * sizeof(*urbs);
 	urbs = malloc(alloc_size);
@@ -1872,19 +2877,27 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
 		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		/* the tracing below may clobber errno */
+		int err = r < 0 ? errno : 0;
+		usbi_trace(LIBUSB_TRACE_URB_SUBMIT, itransfer,
+			urbs[i]->buffer_length, -err);
+		usbi_probe_transfer(urb__submit, transfer,
+			urbs[i]->buffer_length, -err, i);
 		if (r < 0) {
-			if (errno == ENODEV) {
+			if (err == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
 			} else {
 				usbi_err(TRANSFER_CTX(transfer),
-					"submiturb failed error %d errno=%d", r, errno);
+					"submiturb failed error %d errno=%d",
+					r, err);
 				r = LIBUSB_ERROR_IO;
 			}
 
 			/* if the first URB submission fails, we can simply free up and
 			 * return failure immediately. */
 			if (i == 0) {
-				usbi_dbg("first URB failed, easy peasy");
+				usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+					"first URB failed, easy peasy");
 				free_iso_urbs(tpriv);
 				return r;
 			}
@@ -1909,7 +2922,8 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			tpriv->num_retired = num_urbs - i;
 			discard_urbs(itransfer, 0, i);
 
-			usbi_dbg("reporting successful submission but waiting for %d "
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "reporting "
+				"successful submission but waiting for %d "
 				"discards before reporting error", i);
 			return 0;
 		}
@@ -1926,7 +2940,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb *urb;
-	int r;
+	int r, err;
 
 	if (tpriv->urbs)
 		return LIBUSB_ERROR_BUSY;
@@ -1949,14 +2963,20 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	urb->buffer_length = transfer->length;
 
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	/* the tracing below may clobber errno */
+	err = r < 0 ? errno : 0;
+	usbi_trace(LIBUSB_TRACE_URB_SUBMIT, itransfer, urb->buffer_length,
+		-err);
+	usbi_probe_transfer(urb__submit, transfer, urb->buffer_length,
+		-err, 0);
 	if (r < 0) {
 		free(urb);
 		tpriv->urbs = NULL;
-		if (errno == ENODEV)
+		if (err == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
 		usbi_err(TRANSFER_CTX(transfer),
-			"submiturb failed error %d errno=%d", r, errno);
+			"submiturb failed error %d errno=%d", r, err);
 		return LIBUSB_ERROR_IO;
 	}
 	return 0;
@@ -1966,11 +2986,15 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	tpriv->priority = usbi_get_transfer_priority(transfer);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 		return submit_control_transfer(itransfer);
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		return submit_bulk_transfer(itransfer, USBFS_URB_TYPE_BULK);
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		return submit_bulk_transfer(itransfer, USBFS_URB_TYPE_INTERRUPT);
@@ -1991,6 +3015,7 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		if (tpriv->reap_action == ERROR)
 			break;
 		/* else, fall through */
@@ -2021,6 +3046,7 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		usbi_mutex_lock(&itransfer->lock);
 		if (tpriv->urbs)
@@ -2048,14 +3074,16 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	int urb_idx = urb - tpriv->urbs;
 
 	usbi_mutex_lock(&itransfer->lock);
-	usbi_dbg("handling completion status %d of bulk urb %d/%d", urb->status,
+	usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+		"handling completion status %d of bulk urb %d/%d", urb->status,
 		urb_idx + 1, tpriv->num_urbs);
 
 	tpriv->num_retired++;
 
 	if (tpriv->reap_action != NORMAL) {
 		/* cancelled, submit_fail, or completed early */
-		usbi_dbg("abnormal reap: urb status %d", urb->status);
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"abnormal reap: urb status %d", urb->status);
 
 		/* even though we're in the process of cancelling, it's possible that
 		 * we may receive some data in these URBs that we don't want to lose.
@@ -2075,9 +3103,13 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		 */
 		if (urb->actual_length > 0) {
 			unsigned char *target = transfer->buffer + itransfer->transferred;
-			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+				"received %d bytes of surplus data",
+				urb->actual_length);
 			if (urb->buffer != target) {
-				usbi_dbg("moving surplus data from offset %d to offset %d",
+				usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+					"moving surplus data from offset %d "
+					"to offset %d",
 					(unsigned char *) urb->buffer - transfer->buffer,
 					target - transfer->buffer);
 				memmove(target, urb->buffer, urb->actual_length);
@@ -2086,7 +3118,8 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		}
 
 		if (tpriv->num_retired == tpriv->num_urbs) {
-			usbi_dbg("abnormal reap: last URB handled, reporting");
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+				"abnormal reap: last URB handled, reporting");
 			if (tpriv->reap_action != COMPLETED_EARLY &&
 			    tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
 				tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
@@ -2110,17 +3143,19 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		break;
 	case -ENODEV:
 	case -ESHUTDOWN:
-		usbi_dbg("device removed");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "device removed");
 		tpriv->reap_status = LIBUSB_TRANSFER_NO_DEVICE;
 		goto cancel_remaining;
 	case -EPIPE:
-		usbi_dbg("detected endpoint stall");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"detected endpoint stall");
 		if (tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
 			tpriv->reap_status = LIBUSB_TRANSFER_STALL;
 		goto cancel_remaining;
 	case -EOVERFLOW:
 		/* overflow can only ever occur in the last urb */
-		usbi_dbg("overflow, actual_length=%d", urb->actual_length);
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"overflow, actual_length=%d", urb->actual_length);
 		if (tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
 			tpriv->reap_status = LIBUSB_TRANSFER_OVERFLOW;
 		goto completed;
@@ -2129,7 +3164,8 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	case -EILSEQ:
 	case -ECOMM:
 	case -ENOSR:
-		usbi_dbg("low level error %d", urb->status);
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "low level error %d",
+			urb->status);
 		tpriv->reap_action = ERROR;
 		goto cancel_remaining;
 	default:
@@ -2142,10 +3178,12 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	/* if we're the last urb or we got less data than requested then we're
 	 * done */
 	if (urb_idx == tpriv->num_urbs - 1) {
-		usbi_dbg("last URB in transfer --> complete!");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"last URB in transfer --> complete!");
 		goto completed;
 	} else if (urb->actual_length < urb->buffer_length) {
-		usbi_dbg("short transfer %d/%d --> complete!",
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"short transfer %d/%d --> complete!",
 			urb->actual_length, urb->buffer_length);
 		if (tpriv->reap_action == NORMAL)
 			tpriv->reap_action = COMPLETED_EARLY;
@@ -2200,7 +3238,8 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 		return LIBUSB_ERROR_NOT_FOUND;
 	}
 
-	usbi_dbg("handling completion status %d of iso urb %d/%d", urb->status,
+	usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+		"handling completion status %d of iso urb %d/%d", urb->status,
 		urb_idx, num_urbs);
 
 	/* copy isochronous results back in */
@@ -2218,15 +3257,18 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 			break;
 		case -ENODEV:
 		case -ESHUTDOWN:
-			usbi_dbg("device removed");
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+				"device removed");
 			lib_desc->status = LIBUSB_TRANSFER_NO_DEVICE;
 			break;
 		case -EPIPE:
-			usbi_dbg("detected endpoint stall");
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+				"detected endpoint stall");
 			lib_desc->status = LIBUSB_TRANSFER_STALL;
 			break;
 		case -EOVERFLOW:
-			usbi_dbg("overflow error");
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+				"overflow error");
 			lib_desc->status = LIBUSB_TRANSFER_OVERFLOW;
 			break;
 		case -ETIME:
@@ -2235,7 +3277,8 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 		case -ECOMM:
 		case -ENOSR:
 		case -EXDEV:
-			usbi_dbg("low-level USB error %d", urb_desc->status);
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+				"low-level USB error %d", urb_desc->status);
 			lib_desc->status = LIBUSB_TRANSFER_ERROR;
 			break;
 		default:
@@ -2250,10 +3293,12 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	tpriv->num_retired++;
 
 	if (tpriv->reap_action != NORMAL) { /* cancelled or submit_fail */
-		usbi_dbg("CANCEL: urb status %d", urb->status);
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "CANCEL: urb status %d",
+			urb->status);
 
 		if (tpriv->num_retired == num_urbs) {
-			usbi_dbg("CANCEL: last URB handled, reporting");
+			usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+				"CANCEL: last URB handled, reporting");
 			free_iso_urbs(tpriv);
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
@@ -2274,7 +3319,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	case -ECONNRESET:
 		break;
 	case -ESHUTDOWN:
-		usbi_dbg("device removed");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "device removed");
 		status = LIBUSB_TRANSFER_NO_DEVICE;
 		break;
 	default:
@@ -2286,7 +3331,8 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 	/* if we're the last urb then we're done */
 	if (urb_idx == num_urbs) {
-		usbi_dbg("last URB in transfer --> complete!");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"last URB in transfer --> complete!");
 		free_iso_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
@@ -2304,7 +3350,8 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 	int status;
 
 	usbi_mutex_lock(&itransfer->lock);
-	usbi_dbg("handling completion status %d", urb->status);
+	usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "handling completion status %d",
+		urb->status);
 
 	itransfer->transferred += urb->actual_length;
 
@@ -2327,15 +3374,17 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	case -ENODEV:
 	case -ESHUTDOWN:
-		usbi_dbg("device removed");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer), "device removed");
 		status = LIBUSB_TRANSFER_NO_DEVICE;
 		break;
 	case -EPIPE:
-		usbi_dbg("unsupported control request");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"unsupported control request");
 		status = LIBUSB_TRANSFER_STALL;
 		break;
 	case -EOVERFLOW:
-		usbi_dbg("control overflow error");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"control overflow error");
 		status = LIBUSB_TRANSFER_OVERFLOW;
 		break;
 	case -ETIME:
@@ -2343,7 +3392,8 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 	case -EILSEQ:
 	case -ECOMM:
 	case -ENOSR:
-		usbi_dbg("low-level bus error occurred");
+		usbi_dbg_ctx(ITRANSFER_CTX(itransfer),
+			"low-level bus error occurred");
 		status = LIBUSB_TRANSFER_ERROR;
 		break;
 	default:
@@ -2359,13 +3409,15 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
-static int reap_for_handle(struct libusb_device_handle *handle)
+/* reap one completed URB of a handle. returns 0, 1 if none was left, or a
+ * LIBUSB_ERROR code */
+static int reap_urb(struct libusb_device_handle *handle,
+	struct usbfs_urb **urb_out)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
 	int r;
 	struct usbfs_urb *urb;
 	struct usbi_transfer *itransfer;
-	struct libusb_transfer *transfer;
 
 	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
 	if (r == -1 && errno == EAGAIN)
@@ -2380,15 +3432,37 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 
 	itransfer = urb->usercontext;
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
-	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
-		urb->actual_length);
+	usbi_event_stats_reaped(HANDLE_CTX(handle));
+	usbi_transfer_reaped(itransfer);
+	usbi_dbg_ctx(HANDLE_CTX(handle), "urb type=%d status=%d transferred=%d",
+		urb->type, urb->status, urb->actual_length);
+	usbi_trace(LIBUSB_TRACE_URB_REAP, itransfer, urb->actual_length,
+		urb->status);
+	usbi_probe_transfer(urb__reap,
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer),
+		urb->actual_length, urb->status,
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->type
+			== LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? -1 :
+		(int) (urb - ((struct linux_transfer_priv *)
+			usbi_transfer_get_os_priv(itransfer))->urbs));
+
+	*urb_out = urb;
+	return 0;
+}
+
+static int dispatch_urb(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb)
+{
+	struct usbi_transfer *itransfer = urb->usercontext;
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		return handle_iso_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		return handle_bulk_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
@@ -2400,12 +3474,120 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* completions are reaped from all the ready handles before any is
+ * dispatched, into a queue per priority class. high priority completions
+ * are dispatched first, but at most HIGH_PRIORITY_BURST in a row while
+ * normal ones wait, and before each normal one the handles with high
+ * priority endpoints are reaped again, so that their completions do not
+ * wait behind the callbacks of a flood of normal ones. at most REAP_MAX
+ * URBs are reaped per call; the rest stay with the kernel and keep the
+ * handles' fds ready for the next call. */
+#define REAP_MAX		128
+#define HIGH_PRIORITY_BURST	8
+/* high priority handles rechecked between normal priority dispatches */
+#define HIGH_PRIORITY_POLL_MAX	16
+
+struct reap_queue {
+	struct {
+		struct libusb_device_handle *handle;
+		struct usbfs_urb *urb;
+	} entries[REAP_MAX];
+	int head;
+	int tail;
+};
+
+struct reap_queues {
+	struct reap_queue high;
+	struct reap_queue normal;
+	int reaped;
+	/* the handles with a high priority, collected on first use in a pass
+	 * (num_high is -1 before) */
+	struct pollfd high_fds[HIGH_PRIORITY_POLL_MAX];
+	struct libusb_device_handle *high_handles[HIGH_PRIORITY_POLL_MAX];
+	int num_high;
+};
+
+/* reap the completed URBs of a handle into the queues until none is left
+ * or REAP_MAX were reaped. returns 0 or a LIBUSB_ERROR code */
+static int drain_handle(struct libusb_device_handle *handle,
+	struct reap_queues *q)
+{
+	struct linux_transfer_priv *tpriv;
+	struct reap_queue *queue;
+	struct usbfs_urb *urb;
+	int r;
+
+	while (q->reaped < REAP_MAX) {
+		r = reap_urb(handle, &urb);
+		if (r == 1)
+			return 0;
+		else if (r < 0)
+			return r;
+
+		tpriv = usbi_transfer_get_os_priv(
+			(struct usbi_transfer *) urb->usercontext);
+		queue = tpriv->priority == LIBUSB_PRIORITY_HIGH ? &q->high
+			: &q->normal;
+		queue->entries[queue->tail].handle = handle;
+		queue->entries[queue->tail].urb = urb;
+		queue->tail++;
+		q->reaped++;
+	}
+	return 0;
+}
+
+/* reap again the high priority handles which have completions, so that
+ * those which arrived while normal callbacks ran go first. one poll() finds
+ * them, rather than a reap attempt on each handle */
+static void drain_high_priority(struct libusb_context *ctx,
+	struct reap_queues *q)
+{
+	struct libusb_device_handle *handle;
+	int i;
+
+	if (q->num_high < 0) {
+		q->num_high = 0;
+		list_for_each_entry(handle, &ctx->open_devs, list,
+				struct libusb_device_handle) {
+			if (q->num_high == HIGH_PRIORITY_POLL_MAX)
+				break;
+			if (!usbi_atomic_load(&handle->high_priority))
+				continue;
+			q->high_fds[q->num_high].fd =
+				_device_handle_priv(handle)->fd;
+			q->high_fds[q->num_high].events = POLLOUT;
+			q->high_handles[q->num_high] = handle;
+			q->num_high++;
+		}
+	}
+
+	if (!q->num_high || q->reaped >= REAP_MAX)
+		return;
+	if (poll(q->high_fds, q->num_high, 0) <= 0)
+		return;
+	for (i = 0; i < q->num_high; i++) {
+		/* errors are left to the next pass */
+		if ((q->high_fds[i].revents & (POLLOUT | POLLERR)) == POLLOUT)
+			drain_handle(q->high_handles[i], q);
+	}
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
-	int r;
+	struct reap_queues queues;
+	struct reap_queues *q = &queues;
+	struct reap_queue *queue;
+	int high_burst = 0;
+	int r = 0;
+	int ret = 0;
 	unsigned int i = 0;
 
+	q->high.head = q->high.tail = 0;
+	q->normal.head = q->normal.tail = 0;
+	q->reaped = 0;
+	q->num_high = -1;
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
@@ -2428,17 +3610,40 @@ static int op_handle_events(struct libusb_context *ctx,
 			continue;
 		}
 
-		r = reap_for_handle(handle);
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
+		r = drain_handle(handle, q);
+		if (r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
-		else if (r < 0)
-			goto out;
+		else if (r < 0) {
+			/* still dispatch what was reaped */
+			ret = r;
+			break;
+		}
+	}
+
+	while (q->high.head < q->high.tail || q->normal.head < q->normal.tail) {
+		if (q->high.head < q->high.tail
+				&& (high_burst < HIGH_PRIORITY_BURST
+				|| q->normal.head == q->normal.tail)) {
+			queue = &q->high;
+			high_burst++;
+		} else {
+			drain_high_priority(ctx, q);
+			if (q->high.head < q->high.tail
+					&& high_burst < HIGH_PRIORITY_BURST)
+				continue;
+			queue = &q->normal;
+			high_burst = 0;
+		}
+
+		r = dispatch_urb(queue->entries[queue->head].handle,
+			queue->entries[queue->head].urb);
+		queue->head++;
+		if (r < 0 && !ret)
+			ret = r;
 	}
 
-	r = 0;
-out:
 	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return ret;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -2503,4 +3708,14 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
 	.transfer_priv_size = sizeof(struct linux_transfer_priv),
 	.add_iso_packet_size = 0,
+	.context_priv_size = sizeof(struct linux_context_priv),
+	.max_bulk_urb_size = MAX_BULK_BUFFER_LENGTH,
+	.get_string_descriptor_utf8 = op_get_string_descriptor_utf8,
+	.get_numa_node = op_get_numa_node,
+	.get_irq_cpus = op_get_irq_cpus,
+	.get_power_state = op_get_power_state,
+	.set_autosuspend = op_set_autosuspend,
+	.alloc_streams = op_alloc_streams,
+	.free_streams = op_free_streams,
+	.set_device_roots = op_set_device_roots,
 };
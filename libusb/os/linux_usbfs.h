@@ -92,7 +92,10 @@ struct usbfs_urb {
 	int buffer_length;
 	int actual_length;
 	int start_frame;
-	int number_of_packets;
+	union {
+		int number_of_packets;	/* only used for isochronous */
+		unsigned int stream_id;	/* only used with bulk streams */
+	};
 	int error_count;
 	unsigned int signr;
 	void *usercontext;
@@ -111,6 +114,12 @@ struct usbfs_ioctl {
 	void *data;	/* param buffer (in, or out) */
 };
 
+struct usbfs_streams {
+	unsigned int num_streams;	/* not used by FREE_STREAMS */
+	unsigned int num_eps;
+	unsigned char eps[0];
+};
+
 struct usbfs_hub_portinfo {
 	unsigned char numports;
 	unsigned char port[127];	/* port to device num mapping */
@@ -135,5 +144,39 @@ struct usbfs_hub_portinfo {
 #define IOCTL_USBFS_CLEAR_HALT	_IOR('U', 21, unsigned int)
 #define IOCTL_USBFS_DISCONNECT	_IO('U', 22)
 #define IOCTL_USBFS_CONNECT	_IO('U', 23)
+#define IOCTL_USBFS_ALLOC_STREAMS	_IOR('U', 28, struct usbfs_streams)
+#define IOCTL_USBFS_FREE_STREAMS	_IOR('U', 29, struct usbfs_streams)
+
+/* persistent descriptor cache, see linux_desc_cache.c */
+
+/* longest bus path (sysfs directory name) that can be cached, including
+ * the terminating NUL */
+#define LINUX_DESC_CACHE_DIR_MAX	32
+
+struct linux_desc_cache;
+struct discovered_devs;
+
+/* identity of a device as recorded in the cache */
+struct linux_desc_cache_key {
+	const char *sysfs_dir;
+	uint8_t busnum;
+	uint8_t devaddr;
+	uint64_t dir_ino;
+	int64_t dir_mtime_sec;
+	int64_t dir_mtime_nsec;
+	int active_config;
+};
+
+struct linux_desc_cache *linux_desc_cache_open(struct libusb_context *ctx,
+	const char *path);
+int linux_desc_cache_lookup(struct linux_desc_cache *cache,
+	const struct linux_desc_cache_key *key, const unsigned char **dev_desc,
+	const unsigned char **config, size_t *config_len);
+int linux_desc_cache_insert(struct linux_desc_cache *cache,
+	const struct linux_desc_cache_key *key, const unsigned char *dev_desc,
+	const unsigned char *config, size_t config_len);
+void linux_desc_cache_prune(struct linux_desc_cache *cache,
+	struct discovered_devs *discdevs);
+void linux_desc_cache_close(struct linux_desc_cache *cache);
 
 #endif
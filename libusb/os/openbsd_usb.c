@@ -29,6 +29,7 @@
 #include <dev/usb/usb.h>
 
 #include "libusb.h"
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_BACKEND
 #include "libusbi.h"
 
 struct device_priv {
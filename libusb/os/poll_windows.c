@@ -45,6 +45,7 @@
 #include <stdlib.h>
 #include <io.h>
 
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_BACKEND
 #include <libusbi.h>
 
 // Uncomment to debug the polling layer
@@ -19,9 +19,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <config.h>
+
 #if defined(__linux__) || defined(__OpenBSD__)
 # if defined(__linux__)
-#  define _GNU_SOURCE
+#  ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#  endif
 # else
 #  define _BSD_SOURCE
 # endif
@@ -35,6 +39,17 @@
 
 #include "threads_posix.h"
 
+#ifdef USBI_LOCK_PROFILING
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+#endif
+
 int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
 {
 	int err;
@@ -60,6 +75,17 @@ finish:
 	return err;
 }
 
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+	void *arg)
+{
+	return pthread_create(thread, NULL, start, arg);
+}
+
+int usbi_thread_join(usbi_thread_t thread)
+{
+	return pthread_join(thread, NULL);
+}
+
 int usbi_get_tid(void)
 {
 	int ret = -1;
@@ -78,3 +104,292 @@ int usbi_get_tid(void)
 /* TODO: NetBSD thread ID support */
 	return ret;
 }
+
+#ifdef USBI_LOCK_PROFILING
+
+/* call sites, not locks */
+#define LOCK_PROF_MAX_LOCKS	512
+/* locks a thread can hold at once and still have their hold time measured */
+#define LOCK_PROF_MAX_HELD	16
+
+struct usbi_lock_stats {
+	struct libusb_lock_stats s;
+};
+
+struct held_lock {
+	pthread_mutex_t *mutex;
+	struct usbi_lock_stats *stats;
+	uint64_t since;
+};
+
+/* the table only grows; entries are updated with atomics */
+static pthread_mutex_t lock_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usbi_lock_stats lock_stats[LOCK_PROF_MAX_LOCKS];
+static int num_lock_stats = 0;
+
+static __thread struct held_lock held_locks[LOCK_PROF_MAX_HELD];
+static __thread int num_held_locks = 0;
+
+static uint64_t lock_prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct usbi_lock_stats *lock_prof_lookup(const char *expr,
+	const char *file, int line)
+{
+	char name[sizeof(lock_stats[0].s.name)];
+	char where[sizeof(lock_stats[0].s.site)];
+	const char *p;
+	int i;
+
+	/* the whole expression, e.g. "&ctx->flying_transfers_lock", and the
+	 * file name without its directory */
+	snprintf(name, sizeof(name), "%s", expr);
+	p = strrchr(file, '/');
+	snprintf(where, sizeof(where), "%s:%d", p ? p + 1 : file, line);
+
+	pthread_mutex_lock(&lock_stats_lock);
+	for (i = 0; i < num_lock_stats; i++) {
+		if (strcmp(lock_stats[i].s.site, where) == 0
+				&& strcmp(lock_stats[i].s.name, name) == 0)
+			break;
+	}
+	if (i == num_lock_stats) {
+		/* when the table is full, the last entry collects the rest */
+		if (i < LOCK_PROF_MAX_LOCKS - 1) {
+			strcpy(lock_stats[i].s.name, name);
+			strcpy(lock_stats[i].s.site, where);
+		} else {
+			i = LOCK_PROF_MAX_LOCKS - 1;
+			strcpy(lock_stats[i].s.name, "(other)");
+			lock_stats[i].s.site[0] = 0;
+		}
+		if (i == num_lock_stats)
+			num_lock_stats++;
+	}
+	pthread_mutex_unlock(&lock_stats_lock);
+
+	return &lock_stats[i];
+}
+
+static struct usbi_lock_stats *lock_prof_site(const char *expr,
+	const char *file, int line, struct usbi_lock_stats **site)
+{
+	struct usbi_lock_stats *stats = __atomic_load_n(site, __ATOMIC_ACQUIRE);
+
+	if (!stats) {
+		stats = lock_prof_lookup(expr, file, line);
+		__atomic_store_n(site, stats, __ATOMIC_RELEASE);
+	}
+	return stats;
+}
+
+static int lock_prof_bucket(uint64_t ns)
+{
+	int bucket = 0;
+
+	while (ns > 1 && bucket < LIBUSB_LOCK_STATS_BUCKETS - 1) {
+		ns >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void lock_prof_max(uint64_t *max, uint64_t value)
+{
+	uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (value > cur && !__atomic_compare_exchange_n(max, &cur, value,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void lock_prof_acquired(pthread_mutex_t *mutex,
+	struct usbi_lock_stats *stats, uint64_t now)
+{
+	__atomic_fetch_add(&stats->s.acquisitions, 1, __ATOMIC_RELAXED);
+	if (num_held_locks < LOCK_PROF_MAX_HELD) {
+		held_locks[num_held_locks].mutex = mutex;
+		held_locks[num_held_locks].stats = stats;
+		held_locks[num_held_locks].since = now;
+		num_held_locks++;
+	}
+}
+
+/* record the hold time of the most recent acquisition of mutex by this
+ * thread. returns its slot, or -1 if it was not being tracked */
+static int lock_prof_released(pthread_mutex_t *mutex, uint64_t now)
+{
+	struct usbi_lock_stats *stats;
+	uint64_t held;
+	int i;
+
+	for (i = num_held_locks - 1; i >= 0; i--) {
+		if (held_locks[i].mutex == mutex)
+			break;
+	}
+	if (i < 0)
+		return -1;
+
+	stats = held_locks[i].stats;
+	held = now - held_locks[i].since;
+	__atomic_fetch_add(&stats->s.hold_ns, held, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->s.hold_histogram[lock_prof_bucket(held)], 1,
+		__ATOMIC_RELAXED);
+	lock_prof_max(&stats->s.max_hold_ns, held);
+	return i;
+}
+
+static void lock_prof_forget(int slot)
+{
+	num_held_locks--;
+	memmove(&held_locks[slot], &held_locks[slot + 1],
+		(num_held_locks - slot) * sizeof(held_locks[0]));
+}
+
+int usbi_profiled_mutex_lock(pthread_mutex_t *mutex, const char *name,
+	const char *file, int line, struct usbi_lock_stats **site)
+{
+	struct usbi_lock_stats *stats = lock_prof_site(name, file, line, site);
+	uint64_t start, now, wait;
+	int r;
+
+	r = pthread_mutex_trylock(mutex);
+	if (r == 0) {
+		lock_prof_acquired(mutex, stats, lock_prof_now());
+		return 0;
+	} else if (r != EBUSY) {
+		return r;
+	}
+
+	start = lock_prof_now();
+	r = pthread_mutex_lock(mutex);
+	if (r != 0)
+		return r;
+	now = lock_prof_now();
+	wait = now - start;
+
+	__atomic_fetch_add(&stats->s.contended, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->s.wait_ns, wait, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->s.wait_histogram[lock_prof_bucket(wait)], 1,
+		__ATOMIC_RELAXED);
+	lock_prof_max(&stats->s.max_wait_ns, wait);
+	lock_prof_acquired(mutex, stats, now);
+	return 0;
+}
+
+int usbi_profiled_mutex_trylock(pthread_mutex_t *mutex, const char *name,
+	const char *file, int line, struct usbi_lock_stats **site)
+{
+	struct usbi_lock_stats *stats = lock_prof_site(name, file, line, site);
+	int r;
+
+	/* a failed trylock does not wait, so it is not counted as contention */
+	r = pthread_mutex_trylock(mutex);
+	if (r == 0)
+		lock_prof_acquired(mutex, stats, lock_prof_now());
+	return r;
+}
+
+int usbi_profiled_mutex_unlock(pthread_mutex_t *mutex)
+{
+	int slot = lock_prof_released(mutex, lock_prof_now());
+
+	if (slot >= 0)
+		lock_prof_forget(slot);
+	return pthread_mutex_unlock(mutex);
+}
+
+/* time spent in a condition wait does not count as holding the mutex */
+int usbi_profiled_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	int slot = lock_prof_released(mutex, lock_prof_now());
+	int r;
+
+	r = pthread_cond_wait(cond, mutex);
+	if (slot >= 0)
+		held_locks[slot].since = lock_prof_now();
+	return r;
+}
+
+int usbi_profiled_cond_timedwait(pthread_cond_t *cond,
+	pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+	int slot = lock_prof_released(mutex, lock_prof_now());
+	int r;
+
+	r = pthread_cond_timedwait(cond, mutex, abstime);
+	if (slot >= 0)
+		held_locks[slot].since = lock_prof_now();
+	return r;
+}
+
+int usbi_lock_stats_get(struct libusb_lock_stats *stats, int max_stats)
+{
+	int i, n;
+
+	pthread_mutex_lock(&lock_stats_lock);
+	n = num_lock_stats < max_stats ? num_lock_stats : max_stats;
+	for (i = 0; i < n; i++)
+		memcpy(&stats[i], &lock_stats[i].s, sizeof(stats[i]));
+	pthread_mutex_unlock(&lock_stats_lock);
+
+	return n;
+}
+
+/* upper bound of the bucket holding the given percentile of a histogram */
+static uint64_t lock_prof_percentile(const uint64_t *histogram, int percent)
+{
+	uint64_t total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < LIBUSB_LOCK_STATS_BUCKETS; i++)
+		total += histogram[i];
+	if (!total)
+		return 0;
+	for (i = 0; i < LIBUSB_LOCK_STATS_BUCKETS - 1; i++) {
+		seen += histogram[i];
+		if (seen * 100 >= total * percent)
+			break;
+	}
+	return (uint64_t) 2 << i;
+}
+
+void usbi_lock_stats_dump(void)
+{
+	struct libusb_lock_stats *stats;
+	int i, n;
+
+	stats = malloc(LOCK_PROF_MAX_LOCKS * sizeof(*stats));
+	if (!stats)
+		return;
+	n = usbi_lock_stats_get(stats, LOCK_PROF_MAX_LOCKS);
+	fprintf(stderr, "libusb: lock statistics (times in ns, percentiles are "
+		"bucket upper bounds)\n");
+	fprintf(stderr, "%-32s %-24s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+		"lock", "site", "acquired", "contended", "avg wait", "p99 wait",
+		"max wait", "avg hold", "p99 hold", "max hold");
+	for (i = 0; i < n; i++) {
+		struct libusb_lock_stats *s = &stats[i];
+
+		fprintf(stderr, "%-32s %-24s %10llu %10llu %10llu %10llu %10llu "
+			"%10llu %10llu %10llu\n", s->name, s->site,
+			(unsigned long long) s->acquisitions,
+			(unsigned long long) s->contended,
+			(unsigned long long) (s->contended ?
+				s->wait_ns / s->contended : 0),
+			(unsigned long long) lock_prof_percentile(s->wait_histogram, 99),
+			(unsigned long long) s->max_wait_ns,
+			(unsigned long long) (s->acquisitions ?
+				s->hold_ns / s->acquisitions : 0),
+			(unsigned long long) lock_prof_percentile(s->hold_histogram, 99),
+			(unsigned long long) s->max_hold_ns);
+	}
+	free(stats);
+}
+
+#endif /* USBI_LOCK_PROFILING */
@@ -25,26 +25,68 @@
 
 #define usbi_mutex_static_t		pthread_mutex_t
 #define USBI_MUTEX_INITIALIZER		PTHREAD_MUTEX_INITIALIZER
-#define usbi_mutex_static_lock		pthread_mutex_lock
-#define usbi_mutex_static_unlock	pthread_mutex_unlock
 
 #define usbi_mutex_t			pthread_mutex_t
 #define usbi_mutex_init			pthread_mutex_init
-#define usbi_mutex_lock			pthread_mutex_lock
-#define usbi_mutex_unlock		pthread_mutex_unlock
-#define usbi_mutex_trylock		pthread_mutex_trylock
 #define usbi_mutex_destroy		pthread_mutex_destroy
 
 #define usbi_cond_t			pthread_cond_t
 #define usbi_cond_init			pthread_cond_init
+
+#ifdef USBI_LOCK_PROFILING
+/* Instrumented build (--enable-lock-profiling): every lock operation goes
+ * through threads_posix.c, which records acquisitions, contention, wait and
+ * hold times. Statistics are kept per call site, keyed on the expression
+ * naming the mutex together with the file and line, as many different
+ * locks share a member name (e.g. dev_handle->lock and dev->lock). Each call
+ * site caches its entry in a static pointer. */
+struct usbi_lock_stats;
+
+int usbi_profiled_mutex_lock(pthread_mutex_t *mutex, const char *name,
+	const char *file, int line, struct usbi_lock_stats **site);
+int usbi_profiled_mutex_trylock(pthread_mutex_t *mutex, const char *name,
+	const char *file, int line, struct usbi_lock_stats **site);
+int usbi_profiled_mutex_unlock(pthread_mutex_t *mutex);
+int usbi_profiled_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int usbi_profiled_cond_timedwait(pthread_cond_t *cond,
+	pthread_mutex_t *mutex, const struct timespec *abstime);
+
+#define usbi_profiled_site(fn, mutex)	__extension__ ({		\
+	static struct usbi_lock_stats *usbi_lock_site_;			\
+	fn((mutex), #mutex, __FILE__, __LINE__, &usbi_lock_site_); })
+
+#define usbi_mutex_static_lock(m)	usbi_profiled_site(usbi_profiled_mutex_lock, m)
+#define usbi_mutex_static_unlock	usbi_profiled_mutex_unlock
+#define usbi_mutex_lock(m)		usbi_profiled_site(usbi_profiled_mutex_lock, m)
+#define usbi_mutex_unlock		usbi_profiled_mutex_unlock
+#define usbi_mutex_trylock(m)		usbi_profiled_site(usbi_profiled_mutex_trylock, m)
+#define usbi_cond_wait			usbi_profiled_cond_wait
+#define usbi_cond_timedwait		usbi_profiled_cond_timedwait
+
+struct libusb_lock_stats;
+int usbi_lock_stats_get(struct libusb_lock_stats *stats, int max_stats);
+void usbi_lock_stats_dump(void);
+#else
+#define usbi_mutex_static_lock		pthread_mutex_lock
+#define usbi_mutex_static_unlock	pthread_mutex_unlock
+#define usbi_mutex_lock			pthread_mutex_lock
+#define usbi_mutex_unlock		pthread_mutex_unlock
+#define usbi_mutex_trylock		pthread_mutex_trylock
 #define usbi_cond_wait			pthread_cond_wait
 #define usbi_cond_timedwait		pthread_cond_timedwait
+#endif
 #define usbi_cond_broadcast		pthread_cond_broadcast
 #define usbi_cond_destroy		pthread_cond_destroy
 #define usbi_cond_signal		pthread_cond_signal
 
+#define usbi_thread_t			pthread_t
+
 extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
 
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+	void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+
 int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -22,6 +22,7 @@
 #include <objbase.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 #include "libusbi.h"
 
@@ -215,6 +216,40 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 	return usbi_cond_intwait(cond, mutex, millis);
 }
 
+struct usbi_thread_start {
+	void *(*start)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI usbi_thread_trampoline(LPVOID param) {
+	struct usbi_thread_start ts = *(struct usbi_thread_start *)param;
+	free(param);
+	ts.start(ts.arg);
+	return 0;
+}
+
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+					   void *arg) {
+	struct usbi_thread_start *ts;
+	if(!thread || !start) return ((errno=EINVAL));
+	ts = (struct usbi_thread_start *)malloc(sizeof(*ts));
+	if(!ts) return ((errno=ENOMEM));
+	ts->start = start;
+	ts->arg = arg;
+	*thread = CreateThread(NULL, 0, usbi_thread_trampoline, ts, 0, NULL);
+	if(!*thread) {
+		free(ts);
+		return ((errno=EAGAIN));
+	}
+	return 0;
+}
+int usbi_thread_join(usbi_thread_t thread) {
+	if(WaitForSingleObject(thread, INFINITE) != WAIT_OBJECT_0)
+		return ((errno=EINVAL));
+	CloseHandle(thread);
+	return 0;
+}
+
 int usbi_get_tid(void) {
 	return GetCurrentThreadId();
 }
@@ -82,6 +82,12 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_cond_broadcast(usbi_cond_t *cond);
 int usbi_cond_signal(usbi_cond_t *cond);
 
+#define usbi_thread_t HANDLE
+
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+	void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+
 int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_WINDOWS_H */
@@ -34,6 +34,7 @@
 #include <objbase.h>
 #include <winioctl.h>
 
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_BACKEND
 #include <libusbi.h>
 #include "poll_windows.h"
 #include "windows_usb.h"
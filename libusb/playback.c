@@ -0,0 +1,406 @@
+/*
+ * Playback of memory-mapped files to bulk endpoints for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define PLAYBACK_SUPPORTED	1
+#else
+#define PLAYBACK_SUPPORTED	0
+#endif
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
+#include "libusbi.h"
+
+/**
+ * @defgroup playback Playback from files
+ * libusbx can send the contents of a file to a bulk OUT endpoint, e.g. to
+ * replay a stream recorded with libusb_record_start() into a device under
+ * test.
+ *
+ * The file is mapped into memory, and the transfers point straight into
+ * the mapping, so the data is neither read() nor copied in user space.
+ * A configurable number of transfers is kept in flight; each completed
+ * transfer is refilled with the next chunk of the file and resubmitted
+ * from its callback. The kernel is asked to read ahead of the transfers in
+ * flight, and to drop the pages behind them.
+ *
+ * As with any asynchronous transfer, the application must handle events
+ * during playback. The playback is finished once
+ * libusb_playback_get_stats() reports it; libusb_playback_stop() then
+ * frees it.
+ */
+
+#define PLAYBACK_DEFAULT_TRANSFER	(256 * 1024)
+#define PLAYBACK_DEFAULT_DEPTH		8
+/* how far ahead of the transfers in flight to read ahead, in transfers */
+#define PLAYBACK_READAHEAD		8
+/* interval over which the minimum and maximum rates are measured */
+#define PLAYBACK_RATE_WINDOW_NS		100000000ULL
+
+struct libusb_player {
+	libusb_device_handle *dev_handle;
+	struct libusb_transfer **transfers;
+	int num_transfers;
+	int transfer_size;
+	unsigned char *map;
+	size_t size;
+	size_t page_size;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+	/* offset of the next chunk to submit */
+	size_t offset;
+	/* the mapping is dropped up to here */
+	size_t released;
+	/* transfers in flight */
+	int active;
+	int stopping;
+	uint64_t start_ns;
+	uint64_t window_start_ns;
+	uint64_t window_bytes;
+	struct libusb_playback_stats stats;
+};
+
+#if PLAYBACK_SUPPORTED
+
+static size_t page_down(struct libusb_player *player, size_t offset)
+{
+	return offset & ~(player->page_size - 1);
+}
+
+/* called with the lock held. returns 0 if there is nothing left to send */
+static int fill_next_chunk(struct libusb_player *player,
+	struct libusb_transfer *transfer)
+{
+	size_t length;
+	size_t ahead, ahead_end;
+
+	if (player->stopping || player->offset >= player->size)
+		return 0;
+
+	length = MIN((size_t) player->transfer_size,
+		player->size - player->offset);
+	transfer->buffer = player->map + player->offset;
+	transfer->length = (int) length;
+	player->offset += length;
+
+	/* read ahead of the data in flight */
+	ahead = page_down(player, player->offset + (size_t) player->transfer_size
+		* player->num_transfers);
+	ahead_end = MIN(ahead + (size_t) player->transfer_size
+		* PLAYBACK_READAHEAD, player->size);
+	if (ahead < ahead_end)
+		madvise(player->map + ahead, ahead_end - ahead, MADV_WILLNEED);
+
+	return 1;
+}
+
+/* called with the lock held, as each transfer completes. drop the pages
+ * which all transfers in flight are past; transfers complete in order on
+ * an endpoint */
+static void release_sent(struct libusb_player *player,
+	struct libusb_transfer *transfer)
+{
+	size_t done = page_down(player,
+		(size_t) (transfer->buffer - player->map) + transfer->length);
+
+	if (done > player->released) {
+		madvise(player->map + player->released, done - player->released,
+			MADV_DONTNEED);
+		player->released = done;
+	}
+}
+
+static void update_rates(struct libusb_player *player, uint64_t now,
+	int length)
+{
+	uint64_t elapsed = now - player->window_start_ns;
+	uint64_t rate;
+
+	player->window_bytes += length;
+	if (elapsed < PLAYBACK_RATE_WINDOW_NS)
+		return;
+
+	rate = player->window_bytes * 1000000000ULL / elapsed;
+	if (!player->stats.min_bytes_per_second
+			|| rate < player->stats.min_bytes_per_second)
+		player->stats.min_bytes_per_second = rate;
+	if (rate > player->stats.max_bytes_per_second)
+		player->stats.max_bytes_per_second = rate;
+	player->window_start_ns = now;
+	player->window_bytes = 0;
+}
+
+static void LIBUSB_CALL playback_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_player *player = transfer->user_data;
+	uint64_t now = usbi_monotonic_ns();
+	int r;
+
+	usbi_mutex_lock(&player->lock);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		player->stats.bytes_sent += transfer->actual_length;
+		player->stats.transfers++;
+		player->stats.elapsed_ns = now - player->start_ns;
+		update_rates(player, now, transfer->actual_length);
+		release_sent(player, transfer);
+	} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		if (!player->stats.transfer_status)
+			player->stats.transfer_status = transfer->status;
+		if (!player->stats.error)
+			player->stats.error = LIBUSB_ERROR_IO;
+		player->stopping = 1;
+	}
+
+	/* resubmit under the lock, so that libusb_playback_stop() sees every
+	 * transfer it needs to cancel */
+	if (fill_next_chunk(player, transfer)) {
+		r = libusb_submit_transfer(transfer);
+		if (r == 0)
+			goto out;
+		if (!player->stats.error)
+			player->stats.error = r;
+		player->stopping = 1;
+	}
+	if (--player->active == 0)
+		player->stats.finished = 1;
+out:
+	usbi_mutex_unlock(&player->lock);
+}
+
+static void free_player(struct libusb_player *player)
+{
+	int i;
+
+	if (player->transfers) {
+		for (i = 0; i < player->num_transfers; i++)
+			libusb_free_transfer(player->transfers[i]);
+		free(player->transfers);
+	}
+	if (player->map)
+		munmap(player->map, player->size);
+	usbi_mutex_destroy(&player->lock);
+	free(player);
+}
+
+#endif /* PLAYBACK_SUPPORTED */
+
+/** \ingroup playback
+ * Start sending the contents of a file to a bulk OUT endpoint.
+ *
+ * \param dev_handle a handle for the device, with the interface of the
+ * endpoint claimed
+ * \param endpoint the address of the bulk OUT endpoint
+ * \param path the file to send
+ * \param transfer_size the length of each transfer in bytes, or 0 for the
+ * default of 256 KiB. The last transfer carries what is left of the file.
+ * \param queue_depth the number of transfers to keep in flight, or 0 for
+ * the default of 8
+ * \param player output location for the playback
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not a bulk OUT
+ * endpoint, the file is empty or a parameter is out of range
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_IO if the file could not be opened or mapped
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without playback support
+ * \returns another LIBUSB_ERROR code if the transfers could not be submitted
+ */
+int API_EXPORTED libusb_playback_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, const char *path, int transfer_size,
+	int queue_depth, struct libusb_player **player)
+{
+#if PLAYBACK_SUPPORTED
+	struct libusb_context *ctx;
+	struct libusb_player *p;
+	struct stat st;
+	int fd;
+	int i;
+	int r;
+
+	if (!dev_handle || !path || !player
+			|| (endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_OUT
+			|| transfer_size < 0 || transfer_size > (1 << 28)
+			|| queue_depth < 0 || queue_depth > 1024)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ctx = HANDLE_CTX(dev_handle);
+
+	r = usbi_get_endpoint_type(dev_handle->dev, endpoint);
+	if (r < 0)
+		return r;
+	if (r != LIBUSB_TRANSFER_TYPE_BULK)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return LIBUSB_ERROR_NO_MEM;
+	p->dev_handle = dev_handle;
+	p->transfer_size = transfer_size ? transfer_size
+		: PLAYBACK_DEFAULT_TRANSFER;
+	p->num_transfers = queue_depth ? queue_depth : PLAYBACK_DEFAULT_DEPTH;
+	p->page_size = (size_t) sysconf(_SC_PAGESIZE);
+	usbi_mutex_init(&p->lock, NULL);
+
+	p->transfers = calloc(p->num_transfers, sizeof(*p->transfers));
+	if (!p->transfers) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_free;
+	}
+	for (i = 0; i < p->num_transfers; i++) {
+		p->transfers[i] = libusb_alloc_transfer(0);
+		if (!p->transfers[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto err_free;
+		}
+		libusb_fill_bulk_transfer(p->transfers[i], dev_handle, endpoint,
+			NULL, 0, playback_transfer_cb, p, 0);
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		usbi_err(ctx, "can't open %s, errno=%d", path, errno);
+		r = LIBUSB_ERROR_IO;
+		goto err_free;
+	}
+	if (fstat(fd, &st) != 0) {
+		usbi_err(ctx, "can't stat %s, errno=%d", path, errno);
+		close(fd);
+		r = LIBUSB_ERROR_IO;
+		goto err_free;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto err_free;
+	}
+	p->size = (size_t) st.st_size;
+	/* the kernel copies OUT data from the mapping, which it never writes */
+	p->map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->map == MAP_FAILED) {
+		usbi_err(ctx, "can't map %s, errno=%d", path, errno);
+		p->map = NULL;
+		r = LIBUSB_ERROR_IO;
+		goto err_free;
+	}
+	madvise(p->map, p->size, MADV_SEQUENTIAL);
+	usbi_dbg_ctx(HANDLE_CTX(dev_handle),
+		"playing %s (%lu bytes) to endpoint %02x, %d x %d bytes", path,
+		(unsigned long) p->size, endpoint, p->num_transfers,
+		p->transfer_size);
+
+	usbi_mutex_lock(&p->lock);
+	p->start_ns = p->window_start_ns = usbi_monotonic_ns();
+	r = 0;
+	for (i = 0; i < p->num_transfers; i++) {
+		if (!fill_next_chunk(p, p->transfers[i]))
+			break;
+		r = libusb_submit_transfer(p->transfers[i]);
+		if (r < 0) {
+			p->stats.error = r;
+			p->stopping = 1;
+			break;
+		}
+		p->active++;
+	}
+	if (p->active == 0)
+		p->stats.finished = 1;
+	usbi_mutex_unlock(&p->lock);
+
+	if (r < 0) {
+		libusb_playback_stop(p, NULL);
+		return r;
+	}
+
+	*player = p;
+	return 0;
+
+err_free:
+	free_player(p);
+	return r;
+#else
+	(void) dev_handle;
+	(void) endpoint;
+	(void) path;
+	(void) transfer_size;
+	(void) queue_depth;
+	(void) player;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup playback
+ * Get the statistics of a playback. The finished field tells whether the
+ * whole file was sent, or the playback stopped on an error.
+ *
+ * \param player the playback
+ * \param stats output location for the statistics
+ */
+void API_EXPORTED libusb_playback_get_stats(struct libusb_player *player,
+	struct libusb_playback_stats *stats)
+{
+	usbi_mutex_lock(&player->lock);
+	*stats = player->stats;
+	if (stats->elapsed_ns)
+		stats->bytes_per_second =
+			stats->bytes_sent * 1000000000ULL / stats->elapsed_ns;
+	usbi_mutex_unlock(&player->lock);
+}
+
+/** \ingroup playback
+ * Stop a playback and free it. Data already queued to the device may or may
+ * not have been sent: the transfers in flight are cancelled, and
+ * libusb_playback_stop() returns once their cancellation has completed,
+ * handling the events of the device's context itself meanwhile. It must not
+ * be called from a transfer callback of that context.
+ *
+ * \param player the playback
+ * \param stats output location for the final statistics, or NULL
+ * \returns 0 on success
+ * \returns the first error that stopped the playback early
+ */
+int API_EXPORTED libusb_playback_stop(struct libusb_player *player,
+	struct libusb_playback_stats *stats)
+{
+#if PLAYBACK_SUPPORTED
+	int r;
+
+	usbi_cancel_and_drain(HANDLE_CTX(player->dev_handle), &player->lock,
+		&player->stopping, &player->active, player->transfers,
+		player->num_transfers);
+
+	if (stats)
+		libusb_playback_get_stats(player, stats);
+	r = player->stats.error;
+	free_player(player);
+	return r;
+#else
+	(void) player;
+	(void) stats;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
@@ -0,0 +1,509 @@
+/*
+ * Recording of endpoint data to disk for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define RECORD_SUPPORTED	1
+#else
+#define RECORD_SUPPORTED	0
+#endif
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
+#include "libusbi.h"
+
+/**
+ * @defgroup record Recording to disk
+ * libusbx can stream the data of an IN endpoint straight to a file. This is
+ * meant for devices that produce a continuous bulk or isochronous stream,
+ * at rates where copying the data out of transfer buffers and through the
+ * application costs too much.
+ *
+ * A recorder keeps a set of page-aligned transfer buffers submitted on the
+ * endpoint. Each completed buffer is handed to a writer thread, which
+ * writes it from the transfer buffer itself, and only resubmits the buffer
+ * once the write has completed. Where the operating system supports it
+ * (O_DIRECT on Linux), the file is written bypassing the page cache.
+ * O_DIRECT writes must be aligned to the file system block size: a short
+ * transfer whose length is not a multiple of 4096 bytes, e.g. at the end
+ * of a stream or an isochronous transfer with short packets, moves the
+ * rest of the recording to cached writes.
+ *
+ * Completed transfers are reported by the event handling of the device's
+ * context, so as with any asynchronous transfer, the application must
+ * handle events while recording.
+ */
+
+/* O_DIRECT alignment of buffers, lengths and file offsets */
+#define RECORD_ALIGNMENT	4096
+#define RECORD_DEFAULT_BUFFER	(1024 * 1024)
+#define RECORD_DEFAULT_BUFFERS	8
+
+struct libusb_recorder {
+	libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	int fd;
+	usbi_thread_t writer;
+	struct libusb_transfer **transfers;
+	int num_transfers;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	/* completed transfers waiting to be written, oldest at ready_head */
+	struct libusb_transfer **ready;
+	int ready_head;
+	int ready_count;
+	/* transfers which are submitted or waiting to be written */
+	int active;
+	/* no more resubmissions: the recorder is stopping or failed */
+	int stopping;
+	int writer_exit;
+	int direct;
+	uint64_t offset;
+	struct libusb_record_stats stats;
+};
+
+#if RECORD_SUPPORTED
+
+/* called with the recorder lock held */
+static void record_fail(struct libusb_recorder *rec, int error)
+{
+	if (!rec->stats.error)
+		rec->stats.error = error;
+	rec->stopping = 1;
+}
+
+static void LIBUSB_CALL record_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_recorder *rec = transfer->user_data;
+
+	/* data received while stopping is still written */
+	usbi_mutex_lock(&rec->lock);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		rec->ready[(rec->ready_head + rec->ready_count)
+			% rec->num_transfers] = transfer;
+		rec->ready_count++;
+		if ((uint64_t) rec->ready_count > rec->stats.max_backlog)
+			rec->stats.max_backlog = rec->ready_count;
+		usbi_cond_signal(&rec->cond);
+	} else {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+			if (!rec->stats.transfer_status)
+				rec->stats.transfer_status = transfer->status;
+			record_fail(rec, LIBUSB_ERROR_IO);
+		}
+		rec->active--;
+	}
+	usbi_mutex_unlock(&rec->lock);
+}
+
+/* move the data of short isochronous packets together, so that the
+ * buffer can be written in one go. returns the data length */
+static int compact_iso_transfer(struct libusb_transfer *transfer)
+{
+	int length = 0;
+	int offset = 0;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *packet =
+			&transfer->iso_packet_desc[i];
+
+		if (packet->status == LIBUSB_TRANSFER_COMPLETED) {
+			if (length != offset)
+				memmove(transfer->buffer + length,
+					transfer->buffer + offset, packet->actual_length);
+			length += packet->actual_length;
+		}
+		offset += packet->length;
+	}
+	return length;
+}
+
+static int record_write(struct libusb_recorder *rec, const unsigned char *data,
+	int length)
+{
+	ssize_t r;
+
+#ifdef O_DIRECT
+	if (rec->direct && (length % RECORD_ALIGNMENT)) {
+		int flags = fcntl(rec->fd, F_GETFL);
+
+		/* from here on, neither the length nor the offset is aligned */
+		usbi_dbg_ctx(HANDLE_CTX(rec->dev_handle),
+			"unaligned length %d, leaving O_DIRECT", length);
+		if (flags != -1)
+			fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT);
+		rec->direct = 0;
+	}
+#endif
+
+	while (length > 0) {
+		r = pwrite(rec->fd, data, length, (off_t) rec->offset);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			usbi_err(HANDLE_CTX(rec->dev_handle),
+				"write failed, errno=%d", errno);
+			return LIBUSB_ERROR_IO;
+		}
+		data += r;
+		length -= (int) r;
+		rec->offset += r;
+	}
+	return 0;
+}
+
+static void *record_writer(void *arg)
+{
+	struct libusb_recorder *rec = arg;
+	struct libusb_transfer *transfer;
+	int length;
+	int r;
+
+	usbi_sched_thread_start(HANDLE_CTX(rec->dev_handle), "recorder");
+	usbi_mutex_lock(&rec->lock);
+	while (1) {
+		if (!rec->ready_count) {
+			if (rec->writer_exit)
+				break;
+			usbi_cond_wait(&rec->cond, &rec->lock);
+			continue;
+		}
+
+		transfer = rec->ready[rec->ready_head];
+		rec->ready_head = (rec->ready_head + 1) % rec->num_transfers;
+		rec->ready_count--;
+		usbi_mutex_unlock(&rec->lock);
+
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+			length = compact_iso_transfer(transfer);
+		else
+			length = transfer->actual_length;
+
+		/* the file offset is only touched by this thread */
+		r = record_write(rec, transfer->buffer, length);
+
+		usbi_mutex_lock(&rec->lock);
+		if (r == 0) {
+			rec->stats.bytes_written += length;
+			rec->stats.transfers++;
+			rec->stats.direct = rec->direct;
+		} else {
+			record_fail(rec, r);
+		}
+
+		/* submitting under the lock guarantees that libusb_record_stop()
+		 * either sees the transfer in flight or stops its resubmission */
+		if (!rec->stopping) {
+			r = libusb_submit_transfer(transfer);
+			if (r == 0)
+				continue;
+			record_fail(rec, r);
+		}
+		rec->active--;
+	}
+	usbi_mutex_unlock(&rec->lock);
+	usbi_sched_thread_stop(HANDLE_CTX(rec->dev_handle));
+
+	return NULL;
+}
+
+static void free_recorder(struct libusb_recorder *rec)
+{
+	int i;
+
+	for (i = 0; i < rec->num_transfers; i++) {
+		if (!rec->transfers[i])
+			continue;
+		libusb_free_buffer(HANDLE_CTX(rec->dev_handle),
+			rec->transfers[i]->buffer);
+		libusb_free_transfer(rec->transfers[i]);
+	}
+	free(rec->transfers);
+	free(rec->ready);
+	usbi_mutex_destroy(&rec->lock);
+	usbi_cond_destroy(&rec->cond);
+	free(rec);
+}
+
+static int open_record_file(struct libusb_recorder *rec, const char *path)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+#ifdef O_DIRECT
+	rec->fd = open(path, flags | O_DIRECT, 0666);
+	if (rec->fd >= 0) {
+		rec->direct = 1;
+		return 0;
+	}
+	/* e.g. tmpfs does not support O_DIRECT */
+	if (errno != EINVAL)
+		return LIBUSB_ERROR_IO;
+#endif
+	rec->fd = open(path, flags, 0666);
+	if (rec->fd < 0)
+		return LIBUSB_ERROR_IO;
+	rec->direct = 0;
+	return 0;
+}
+
+#endif /* RECORD_SUPPORTED */
+
+/** \ingroup record
+ * Start recording the data of an IN endpoint to a file.
+ *
+ * The endpoint must be a bulk, interrupt or isochronous IN endpoint of a
+ * claimed interface. Recording continues until libusb_record_stop() is
+ * called, or until a transfer or write fails.
+ *
+ * \param dev_handle a handle for the device to record from
+ * \param endpoint the address of the endpoint to record
+ * \param path the file to write, which is replaced if it exists
+ * \param buffer_size size of each transfer buffer in bytes, or 0 for the
+ * default of 1 MiB. It is rounded up to a multiple of 4096 bytes, and for
+ * isochronous endpoints down to a whole number of packets.
+ * \param num_buffers number of transfer buffers, or 0 for the default of 8
+ * \param recorder output location for the recorder
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an IN endpoint
+ * or a parameter is out of range
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_IO if the file could not be created
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without recording support
+ * \returns another LIBUSB_ERROR code if the transfers could not be submitted
+ */
+int API_EXPORTED libusb_record_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, const char *path, int buffer_size,
+	int num_buffers, struct libusb_recorder **recorder)
+{
+#if RECORD_SUPPORTED
+	struct libusb_context *ctx;
+	struct libusb_recorder *rec;
+	int type;
+	int num_iso_packets = 0;
+	int max_packet = 0;
+	size_t length;
+	int i;
+	int r;
+
+	if (!dev_handle || !path || !recorder
+			|| !(endpoint & LIBUSB_ENDPOINT_IN)
+			|| buffer_size < 0 || buffer_size > (1 << 28)
+			|| num_buffers < 0 || num_buffers > 1024)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ctx = HANDLE_CTX(dev_handle);
+
+	type = usbi_get_endpoint_type(dev_handle->dev, endpoint);
+	if (type < 0)
+		return type;
+	if (type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (buffer_size == 0)
+		buffer_size = RECORD_DEFAULT_BUFFER;
+	if (num_buffers == 0)
+		num_buffers = RECORD_DEFAULT_BUFFERS;
+	length = ((size_t) buffer_size + RECORD_ALIGNMENT - 1)
+		& ~((size_t) RECORD_ALIGNMENT - 1);
+
+	if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		max_packet = libusb_get_max_iso_packet_size(dev_handle->dev,
+			endpoint);
+		if (max_packet <= 0)
+			return max_packet < 0 ? max_packet : LIBUSB_ERROR_OTHER;
+		num_iso_packets = (int) (length / max_packet);
+		if (num_iso_packets == 0)
+			num_iso_packets = 1;
+		/* prefer a whole number of packets that is also aligned */
+		for (i = num_iso_packets; i > 0; i--) {
+			if (((size_t) i * max_packet) % RECORD_ALIGNMENT == 0) {
+				num_iso_packets = i;
+				break;
+			}
+		}
+		length = (size_t) num_iso_packets * max_packet;
+	}
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return LIBUSB_ERROR_NO_MEM;
+	rec->dev_handle = dev_handle;
+	rec->endpoint = endpoint;
+	rec->fd = -1;
+	rec->num_transfers = num_buffers;
+	usbi_mutex_init(&rec->lock, NULL);
+	usbi_cond_init(&rec->cond, NULL);
+
+	rec->transfers = calloc(num_buffers, sizeof(*rec->transfers));
+	rec->ready = calloc(num_buffers, sizeof(*rec->ready));
+	if (!rec->transfers || !rec->ready) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_free;
+	}
+
+	for (i = 0; i < num_buffers; i++) {
+		struct libusb_transfer *transfer;
+		unsigned char *buffer;
+
+		/* page aligned, as O_DIRECT needs */
+		buffer = libusb_alloc_buffer(ctx, dev_handle->dev, length,
+			LIBUSB_BUFFER_NUMA_LOCAL);
+		if (!buffer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto err_free;
+		}
+		transfer = libusb_alloc_transfer(num_iso_packets);
+		if (!transfer) {
+			libusb_free_buffer(ctx, buffer);
+			r = LIBUSB_ERROR_NO_MEM;
+			goto err_free;
+		}
+		rec->transfers[i] = transfer;
+
+		if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			libusb_fill_iso_transfer(transfer, dev_handle, endpoint,
+				buffer, (int) length, num_iso_packets,
+				record_transfer_cb, rec, 0);
+			libusb_set_iso_packet_lengths(transfer, max_packet);
+		} else if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+			libusb_fill_interrupt_transfer(transfer, dev_handle,
+				endpoint, buffer, (int) length, record_transfer_cb,
+				rec, 0);
+		} else {
+			libusb_fill_bulk_transfer(transfer, dev_handle, endpoint,
+				buffer, (int) length, record_transfer_cb, rec, 0);
+		}
+	}
+
+	r = open_record_file(rec, path);
+	if (r < 0) {
+		usbi_err(ctx, "can't create %s, errno=%d", path, errno);
+		goto err_free;
+	}
+	rec->stats.direct = rec->direct;
+	usbi_dbg_ctx(ctx, "recording endpoint %02x to %s, %d x %d bytes%s",
+		endpoint, path, num_buffers, (int) length,
+		rec->direct ? ", O_DIRECT" : "");
+
+	if (usbi_thread_create(&rec->writer, record_writer, rec) != 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err_close;
+	}
+
+	usbi_mutex_lock(&rec->lock);
+	for (i = 0; i < num_buffers; i++) {
+		r = libusb_submit_transfer(rec->transfers[i]);
+		if (r < 0)
+			break;
+		rec->active++;
+	}
+	usbi_mutex_unlock(&rec->lock);
+
+	if (r < 0) {
+		libusb_record_stop(rec, NULL);
+		return r;
+	}
+
+	*recorder = rec;
+	return 0;
+
+err_close:
+	close(rec->fd);
+err_free:
+	free_recorder(rec);
+	return r;
+#else
+	(void) dev_handle;
+	(void) endpoint;
+	(void) path;
+	(void) buffer_size;
+	(void) num_buffers;
+	(void) recorder;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup record
+ * Get the statistics of a recording in progress.
+ *
+ * \param recorder the recorder
+ * \param stats output location for the statistics
+ */
+void API_EXPORTED libusb_record_get_stats(struct libusb_recorder *recorder,
+	struct libusb_record_stats *stats)
+{
+	usbi_mutex_lock(&recorder->lock);
+	*stats = recorder->stats;
+	usbi_mutex_unlock(&recorder->lock);
+}
+
+/** \ingroup record
+ * Stop recording, close the file and free the recorder. Data still in
+ * flight from the device is abandoned, but everything already received is
+ * in the file when this returns: the transfers in flight are cancelled,
+ * handling the events of the device's context until they have been, and
+ * the writer thread is then left to drain its queue. It must not be called
+ * from a transfer callback of that context.
+ *
+ * \param recorder the recorder
+ * \param stats output location for the final statistics, or NULL
+ * \returns 0 on success
+ * \returns the first error that stopped the recording early, or
+ * LIBUSB_ERROR_IO if the file could not be closed
+ */
+int API_EXPORTED libusb_record_stop(struct libusb_recorder *recorder,
+	struct libusb_record_stats *stats)
+{
+#if RECORD_SUPPORTED
+	struct libusb_recorder *rec = recorder;
+	int r;
+
+	/* transfers which are being written are resubmitted by nobody, and
+	 * the writer drops them out of active as it goes */
+	usbi_cancel_and_drain(HANDLE_CTX(rec->dev_handle), &rec->lock,
+		&rec->stopping, &rec->active, rec->transfers, rec->num_transfers);
+
+	usbi_mutex_lock(&rec->lock);
+	rec->writer_exit = 1;
+	usbi_cond_signal(&rec->cond);
+	usbi_mutex_unlock(&rec->lock);
+	usbi_thread_join(rec->writer);
+
+	r = rec->stats.error;
+	if (close(rec->fd) != 0 && !r)
+		r = LIBUSB_ERROR_IO;
+	if (stats)
+		*stats = rec->stats;
+	free_recorder(rec);
+	return r;
+#else
+	(void) recorder;
+	(void) stats;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
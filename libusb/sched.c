@@ -0,0 +1,337 @@
+/*
+ * CPU affinity and scheduling of event handling threads for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef OS_LINUX
+#include <sched.h>
+#define SCHED_SUPPORTED	1
+#else
+#define SCHED_SUPPORTED	0
+#endif
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_CORE
+#include "libusbi.h"
+
+/**
+ * @defgroup sched Thread scheduling
+ * On a shared host, completion latency jitter often comes from the thread
+ * handling events being migrated between CPUs or preempted by other work.
+ * libusbx can pin threads to a set of CPUs and run them under the SCHED_FIFO
+ * real-time policy.
+ *
+ * libusb_set_thread_sched() applies a setting to the threads libusbx itself
+ * runs for a context (device operation workers, parallel enumeration
+ * workers, the log writer, and the writers of captures and recordings),
+ * including those started later.
+ * libusb_apply_thread_sched() applies the same setting to the calling
+ * thread, which is meant for the application thread that handles events.
+ * libusb_get_irq_cpus() finds the CPUs which service the interrupts of a
+ * device's host controller, for applications which want to handle events
+ * where the completions are signalled.
+ *
+ * What was actually applied, as read back from the system, is reported by
+ * libusb_get_thread_sched_state() and libusb_apply_thread_sched(). Running
+ * under SCHED_FIFO needs CAP_SYS_NICE or an RLIMIT_RTPRIO allowance.
+ *
+ * Thread scheduling is only supported on Linux.
+ */
+
+struct usbi_sched_thread {
+	struct list_head list;
+	struct libusb_thread_sched_state state;
+};
+
+#if SCHED_SUPPORTED
+
+static int errno_to_libusb(int err)
+{
+	switch (err) {
+	case EPERM:
+		return LIBUSB_ERROR_ACCESS;
+	case EINVAL:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	case ESRCH:
+		return LIBUSB_ERROR_NOT_FOUND;
+	default:
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+/* read back what a thread runs with */
+static void read_sched_state(int tid, struct libusb_thread_sched_state *state)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int policy;
+	int cpu;
+
+	policy = sched_getscheduler(tid);
+	state->fifo = (policy == SCHED_FIFO);
+	state->priority = 0;
+	if (sched_getparam(tid, &param) == 0)
+		state->priority = param.sched_priority;
+
+	state->num_cpus = 0;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(tid, sizeof(set), &set) != 0)
+		return;
+	for (cpu = 0; cpu < CPU_SETSIZE
+			&& state->num_cpus < LIBUSB_SCHED_MAX_CPUS; cpu++) {
+		if (CPU_ISSET(cpu, &set))
+			state->cpus[state->num_cpus++] = cpu;
+	}
+}
+
+static void apply_sched(int tid, const struct libusb_thread_sched *sched,
+	struct libusb_thread_sched_state *state)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int i;
+
+	state->error = 0;
+	if (sched->num_cpus > 0) {
+		CPU_ZERO(&set);
+		for (i = 0; i < sched->num_cpus; i++)
+			CPU_SET(sched->cpus[i], &set);
+		if (sched_setaffinity(tid, sizeof(set), &set) != 0)
+			state->error = errno_to_libusb(errno);
+	}
+
+	/* priority 0 returns the thread to the normal time-sharing policy,
+	 * which undoes an earlier setting */
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = sched->fifo_priority;
+	if (sched_setscheduler(tid, sched->fifo_priority > 0 ? SCHED_FIFO
+			: SCHED_OTHER, &param) != 0 && !state->error)
+		state->error = errno_to_libusb(errno);
+
+	read_sched_state(tid, state);
+}
+
+#endif /* SCHED_SUPPORTED */
+
+void usbi_sched_init(struct libusb_context *ctx)
+{
+	usbi_mutex_init(&ctx->sched_lock, NULL);
+	list_init(&ctx->sched_threads);
+}
+
+void usbi_sched_exit(struct libusb_context *ctx)
+{
+	struct usbi_sched_thread *t, *tmp;
+
+	list_for_each_entry_safe(t, tmp, &ctx->sched_threads, list,
+			struct usbi_sched_thread)
+		free(t);
+	usbi_mutex_destroy(&ctx->sched_lock);
+}
+
+/* called by each thread libusbx runs for a context as it starts, to have the
+ * context's setting applied to it. name is at most 15 characters */
+void usbi_sched_thread_start(struct libusb_context *ctx, const char *name)
+{
+	struct usbi_sched_thread *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return;
+	strncpy(t->state.name, name, sizeof(t->state.name) - 1);
+	t->state.tid = usbi_get_tid();
+
+	usbi_mutex_lock(&ctx->sched_lock);
+#if SCHED_SUPPORTED
+	if (ctx->sched_set)
+		apply_sched(t->state.tid, &ctx->sched, &t->state);
+	else
+		read_sched_state(t->state.tid, &t->state);
+#endif
+	list_add_tail(&t->list, &ctx->sched_threads);
+	usbi_mutex_unlock(&ctx->sched_lock);
+}
+
+/* called by the same threads before they exit */
+void usbi_sched_thread_stop(struct libusb_context *ctx)
+{
+	struct usbi_sched_thread *t;
+	int tid = usbi_get_tid();
+
+	usbi_mutex_lock(&ctx->sched_lock);
+	list_for_each_entry(t, &ctx->sched_threads, list,
+			struct usbi_sched_thread) {
+		if (t->state.tid == tid) {
+			list_del(&t->list);
+			free(t);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&ctx->sched_lock);
+}
+
+/** \ingroup sched
+ * Set the CPU affinity and scheduling policy of the threads libusbx runs
+ * for a context. The setting applies to the threads running now and to
+ * those started later. It does not apply to application threads, including
+ * those handling events; see libusb_apply_thread_sched().
+ *
+ * \param ctx the context, or NULL for the default context
+ * \param sched the setting
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the setting is out of range
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without thread scheduling
+ * \returns the error of the first thread the setting could not be applied
+ * to, e.g. LIBUSB_ERROR_ACCESS without the privilege to use SCHED_FIFO.
+ * The setting is kept all the same, and the state of each thread is
+ * reported by libusb_get_thread_sched_state().
+ */
+int API_EXPORTED libusb_set_thread_sched(libusb_context *ctx,
+	const struct libusb_thread_sched *sched)
+{
+#if SCHED_SUPPORTED
+	struct usbi_sched_thread *t;
+	int r = 0;
+	int i;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!sched || sched->num_cpus < 0
+			|| sched->num_cpus > LIBUSB_SCHED_MAX_CPUS
+			|| sched->fifo_priority < 0
+			|| sched->fifo_priority > sched_get_priority_max(SCHED_FIFO))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < sched->num_cpus; i++) {
+		if (sched->cpus[i] < 0 || sched->cpus[i] >= CPU_SETSIZE)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_lock(&ctx->sched_lock);
+	ctx->sched = *sched;
+	ctx->sched_set = 1;
+	list_for_each_entry(t, &ctx->sched_threads, list,
+			struct usbi_sched_thread) {
+		apply_sched(t->state.tid, sched, &t->state);
+		if (t->state.error && !r)
+			r = t->state.error;
+	}
+	usbi_mutex_unlock(&ctx->sched_lock);
+
+	usbi_dbg_ctx(ctx, "%d cpus, fifo priority %d: %d", sched->num_cpus,
+		sched->fifo_priority, r);
+	return r;
+#else
+	(void) ctx;
+	(void) sched;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup sched
+ * Apply the setting given to libusb_set_thread_sched() to the calling
+ * thread, typically the application thread which handles events.
+ *
+ * \param ctx the context, or NULL for the default context
+ * \param state output location for what the thread now runs with, or NULL
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no setting was given to the context
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without thread scheduling
+ * \returns another LIBUSB_ERROR code if the setting could not be applied,
+ * e.g. LIBUSB_ERROR_ACCESS without the privilege to use SCHED_FIFO
+ */
+int API_EXPORTED libusb_apply_thread_sched(libusb_context *ctx,
+	struct libusb_thread_sched_state *state)
+{
+#if SCHED_SUPPORTED
+	struct libusb_thread_sched_state applied;
+	struct libusb_thread_sched sched;
+
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->sched_lock);
+	if (!ctx->sched_set) {
+		usbi_mutex_unlock(&ctx->sched_lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	sched = ctx->sched;
+	usbi_mutex_unlock(&ctx->sched_lock);
+
+	memset(&applied, 0, sizeof(applied));
+	strcpy(applied.name, "application");
+	applied.tid = usbi_get_tid();
+	apply_sched(applied.tid, &sched, &applied);
+	if (state)
+		*state = applied;
+	return applied.error;
+#else
+	(void) ctx;
+	(void) state;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup sched
+ * Get the CPU affinity and scheduling policy of the threads libusbx runs for
+ * a context, as read back from the system.
+ *
+ * \param ctx the context, or NULL for the default context
+ * \param states output array, which may be NULL if max_states is 0
+ * \param max_states number of entries in the output array
+ * \returns the number of threads, which may be more than max_states
+ * \returns LIBUSB_ERROR_INVALID_PARAM if states is NULL while max_states is
+ * not 0, or max_states is negative
+ */
+int API_EXPORTED libusb_get_thread_sched_state(libusb_context *ctx,
+	struct libusb_thread_sched_state *states, int max_states)
+{
+	struct usbi_sched_thread *t;
+	int count = 0;
+
+	USBI_GET_CONTEXT(ctx);
+	if (max_states < 0 || (!states && max_states > 0))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	usbi_mutex_lock(&ctx->sched_lock);
+	list_for_each_entry(t, &ctx->sched_threads, list,
+			struct usbi_sched_thread) {
+		if (count < max_states)
+			states[count] = t->state;
+		count++;
+	}
+	usbi_mutex_unlock(&ctx->sched_lock);
+	return count;
+}
+
+/** \ingroup sched
+ * Get the CPUs which service the interrupts of the host controller a device
+ * is attached to. Pass them to libusb_set_thread_sched() to handle events
+ * on the CPUs where completions are signalled.
+ *
+ * \param dev the device
+ * \param cpus output array of CPU numbers
+ * \param max_cpus number of entries in the output array
+ * \returns the number of CPUs, which may be more than max_cpus
+ * \returns LIBUSB_ERROR_NOT_FOUND if the controller or its interrupts
+ * could not be found
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms which do not report this
+ */
+int API_EXPORTED libusb_get_irq_cpus(libusb_device *dev, int *cpus,
+	int max_cpus)
+{
+	if (!usbi_backend->get_irq_cpus)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->get_irq_cpus(dev, cpus, max_cpus);
+}
@@ -0,0 +1,935 @@
+/*
+ * Shared-memory stream rings for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(OS_LINUX)
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#endif
+#if defined(OS_LINUX) && defined(__NR_memfd_create) && defined(__NR_futex)
+#define SHM_RING_SUPPORTED	1
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#else
+#define SHM_RING_SUPPORTED	0
+#endif
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
+#include "libusbi.h"
+
+/**
+ * @defgroup shmring Shared-memory stream rings
+ * A stream ring lets several processes on the same host consume the data of
+ * one IN endpoint, e.g. a recorder, a live monitor and an analysis tool,
+ * without one of them reading the device and copying the data to the
+ * others.
+ *
+ * The process that owns the device starts a ring on a bulk or interrupt
+ * IN endpoint with libusb_shm_ring_start(). The ring lives in an anonymous
+ * shared memory file (a memfd), and the transfers read straight into its
+ * slots. Each completed transfer is published to the readers and its
+ * transfer resubmitted into the next free slot, so as with any
+ * asynchronous transfer, the owner must handle events while the ring runs.
+ *
+ * Other processes receive the file descriptor from libusb_shm_ring_get_fd(),
+ * either over a UNIX socket (SCM_RIGHTS) or by opening
+ * /proc/<pid>/fd/<fd> of the owner, and attach with libusb_shm_ring_attach().
+ * Readers map the ring read-only, apart from a separate area holding their
+ * progress, and access the data in place: no libusb context or device
+ * access is needed to read a ring. The owner keeps its own copy of the
+ * ring's geometry and never trusts what readers can write. A reader blocked
+ * in libusb_shm_ring_read() sleeps on a futex in the shared memory, which
+ * the owner only wakes when a reader is waiting.
+ *
+ * The owner never waits for readers. A reader that falls more than a ring's
+ * worth of slots behind has the oldest data overwritten under it: it skips
+ * to the oldest data still available and counts the slots it lost as
+ * dropped. The lag of each reader is visible to the owner through
+ * libusb_shm_ring_get_consumers().
+ *
+ * Stream rings are only supported on Linux.
+ */
+
+#define SHM_RING_MAGIC			0x55534252	/* "USBR" */
+#define SHM_RING_VERSION		3
+#define SHM_RING_DEFAULT_SLOT_SIZE	(64 * 1024)
+#define SHM_RING_DEFAULT_SLOTS		64
+#define SHM_RING_DEFAULT_TRANSFERS	4
+#define SHM_RING_SLOT_ALIGNMENT		64
+
+/* The file starts with the header, written only by the owner. It is
+ * followed, each at a page boundary, by the consumer area, which readers map
+ * read-write to claim an entry and report their progress, then by the slot
+ * descriptors and the slot data. Readers map everything but the consumer
+ * area read-only. */
+
+struct shm_ring_consumer {
+	uint32_t in_use;
+	/* process of the reader, 0 until it has attached */
+	uint32_t pid;
+	/* start time of that process, in clock ticks since boot, which tells
+	 * it apart from a later process reusing the pid */
+	uint64_t start_time;
+	/* sequence number of the next slot the reader will read */
+	uint64_t read_seq;
+	uint64_t dropped;
+};
+
+struct shm_ring_consumers {
+	/* readers sleeping on the header's futex */
+	uint32_t waiters;
+	uint32_t reserved;
+	struct shm_ring_consumer entries[LIBUSB_SHM_RING_MAX_CONSUMERS];
+};
+
+struct shm_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t slot_stride;
+	uint32_t num_slots;
+	/* slots which transfers are reading into, ahead of write_seq */
+	uint32_t in_flight;
+	/* offsets from the start of the file */
+	uint64_t consumers_offset;
+	uint64_t slots_offset;
+	uint64_t data_offset;
+	uint64_t total_size;
+
+	/* number of slots published so far */
+	uint64_t write_seq;
+	/* bumped on every publication, readers wait on it */
+	uint32_t futex;
+	uint32_t closed;
+};
+
+struct shm_ring_slot {
+	/* sequence number + 1 of the data held, 0 while being filled */
+	uint64_t seq;
+	uint32_t length;
+	int32_t status;
+};
+
+struct libusb_shm_ring {
+	libusb_device_handle *dev_handle;
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	struct shm_ring_header *header;
+	struct shm_ring_consumers *consumers;
+	struct shm_ring_slot *slots;
+	unsigned char *data;
+	/* the geometry, never read back from the shared memory */
+	uint32_t slot_size;
+	uint32_t slot_stride;
+	uint32_t num_slots;
+	struct libusb_transfer **transfers;
+	int num_transfers;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+	/* sequence number of the next slot to publish */
+	uint64_t next_seq;
+	/* transfers in flight */
+	int active;
+	int stopping;
+	int error;
+};
+
+struct libusb_shm_ring_reader {
+	const struct shm_ring_header *header;
+	unsigned char *map;
+	size_t map_size;
+	struct shm_ring_consumers *consumers;
+	size_t consumers_size;
+	const struct shm_ring_slot *slots;
+	const unsigned char *data;
+	/* the geometry, checked once on attach */
+	uint32_t slot_stride;
+	uint32_t num_slots;
+	uint32_t available;
+	struct shm_ring_consumer *consumer;
+	uint64_t next_seq;
+	uint64_t dropped;
+	int holding;
+};
+
+#if SHM_RING_SUPPORTED
+
+static int futex_wait(const uint32_t *addr, uint32_t val,
+	const struct timespec *ts)
+{
+	return (int) syscall(__NR_futex, addr, FUTEX_WAIT, val, ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr)
+{
+	syscall(__NR_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static void wake_readers(struct libusb_shm_ring *ring)
+{
+	usbi_atomic_add(&ring->header->futex, 1);
+	if (usbi_atomic_load_seq_cst(&ring->consumers->waiters))
+		futex_wake(&ring->header->futex);
+}
+
+static size_t round_up(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/* the start time of a process (field 22 of /proc/<pid>/stat), or 0 if it
+ * cannot be read */
+static uint64_t process_start_time(pid_t pid)
+{
+	char path[32];
+	char buf[512];
+	char *p;
+	ssize_t r;
+	int field;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+	buf[r] = '\0';
+
+	/* the command name in field 2 may contain spaces and parentheses, so
+	 * count the fields from the last closing parenthesis */
+	p = strrchr(buf, ')');
+	for (field = 2; p && field < 22; field++)
+		p = strchr(p + 1, ' ');
+	return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+/* called with the lock held: point a transfer at the next free slot */
+static int submit_next_slot(struct libusb_shm_ring *ring,
+	struct libusb_transfer *transfer, uint64_t seq)
+{
+	uint32_t index = (uint32_t) (seq % ring->num_slots);
+
+	/* invalidate the slot before the device writes into it, so readers
+	 * still holding the old data notice */
+	usbi_atomic_store_release(&ring->slots[index].seq, 0);
+	transfer->buffer = ring->data + (size_t) index * ring->slot_stride;
+	transfer->length = (int) ring->slot_size;
+	return libusb_submit_transfer(transfer);
+}
+
+static void LIBUSB_CALL shm_ring_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_shm_ring *ring = transfer->user_data;
+	struct shm_ring_slot *slot;
+	uint64_t seq;
+	int r;
+
+	usbi_mutex_lock(&ring->lock);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		/* transfers on an endpoint complete in the order they were
+		 * submitted, so this is the slot at next_seq */
+		seq = ring->next_seq++;
+		slot = &ring->slots[seq % ring->num_slots];
+		slot->length = (uint32_t) transfer->actual_length;
+		slot->status = transfer->status;
+		usbi_atomic_store_release(&slot->seq, seq + 1);
+		usbi_atomic_store_release(&ring->header->write_seq, seq + 1);
+		wake_readers(ring);
+	} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		usbi_dbg_ctx(TRANSFER_CTX(transfer),
+			"transfer failed with status %d, stopping ring",
+			transfer->status);
+		if (!ring->error)
+			ring->error = LIBUSB_ERROR_IO;
+		ring->stopping = 1;
+	}
+
+	if (!ring->stopping) {
+		r = submit_next_slot(ring, transfer,
+			ring->next_seq + ring->num_transfers - 1);
+		if (r == 0)
+			goto out;
+		if (!ring->error)
+			ring->error = r;
+		ring->stopping = 1;
+	}
+	ring->active--;
+out:
+	usbi_mutex_unlock(&ring->lock);
+}
+
+static void free_ring(struct libusb_shm_ring *ring)
+{
+	int i;
+
+	if (ring->transfers) {
+		for (i = 0; i < ring->num_transfers; i++)
+			libusb_free_transfer(ring->transfers[i]);
+		free(ring->transfers);
+	}
+	if (ring->map)
+		munmap(ring->map, ring->map_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	usbi_mutex_destroy(&ring->lock);
+	free(ring);
+}
+
+static int create_ring_file(struct libusb_shm_ring *ring, uint32_t slot_size,
+	uint32_t num_slots, uint32_t in_flight)
+{
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	size_t consumers_offset = round_up(sizeof(struct shm_ring_header),
+		page_size);
+	size_t slots_offset = consumers_offset
+		+ round_up(sizeof(struct shm_ring_consumers), page_size);
+	size_t stride = round_up(slot_size, SHM_RING_SLOT_ALIGNMENT);
+	size_t data_offset = slots_offset
+		+ round_up(num_slots * sizeof(struct shm_ring_slot), page_size);
+	size_t total = data_offset + stride * num_slots;
+	struct shm_ring_header *header;
+
+	ring->fd = (int) syscall(__NR_memfd_create, "libusb-ring",
+		MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (ring->fd < 0)
+		return LIBUSB_ERROR_OTHER;
+	if (ftruncate(ring->fd, (off_t) total) != 0)
+		return LIBUSB_ERROR_NO_MEM;
+	/* readers may rely on the size never changing under their mapping */
+#ifdef F_ADD_SEALS
+	fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+	ring->map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED,
+		ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	ring->map_size = total;
+	ring->slot_size = slot_size;
+	ring->slot_stride = (uint32_t) stride;
+	ring->num_slots = num_slots;
+	ring->consumers = (struct shm_ring_consumers *)
+		(ring->map + consumers_offset);
+	ring->slots = (struct shm_ring_slot *) (ring->map + slots_offset);
+	ring->data = ring->map + data_offset;
+
+	header = (struct shm_ring_header *) ring->map;
+	header->version = SHM_RING_VERSION;
+	header->slot_size = slot_size;
+	header->slot_stride = (uint32_t) stride;
+	header->num_slots = num_slots;
+	header->in_flight = in_flight;
+	header->consumers_offset = consumers_offset;
+	header->slots_offset = slots_offset;
+	header->data_offset = data_offset;
+	header->total_size = total;
+	/* readers check the magic, so write it last */
+	usbi_atomic_store_release(&header->magic, SHM_RING_MAGIC);
+
+	ring->header = header;
+	return 0;
+}
+
+#endif /* SHM_RING_SUPPORTED */
+
+/** \ingroup shmring
+ * Start streaming an IN endpoint into a shared-memory ring.
+ *
+ * \param dev_handle a handle for the device, with the interface of the
+ * endpoint claimed
+ * \param endpoint the address of a bulk or interrupt IN endpoint
+ * \param slot_size the size of each slot, which is also the length of each
+ * transfer, or 0 for the default of 64 KiB
+ * \param num_slots the number of slots in the ring, or 0 for the default
+ * of 64
+ * \param num_transfers the number of transfers to keep in flight, or 0 for
+ * the default of 4. It must be lower than the number of slots; the slots
+ * being read into are not available to readers.
+ * \param ring output location for the ring
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not a bulk or
+ * interrupt IN endpoint, or a parameter is out of range
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NO_MEM if the ring could not be allocated
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without stream rings
+ * \returns another LIBUSB_ERROR code if the transfers could not be submitted
+ */
+int API_EXPORTED libusb_shm_ring_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int slot_size, int num_slots, int num_transfers,
+	struct libusb_shm_ring **ring)
+{
+#if SHM_RING_SUPPORTED
+	struct libusb_context *ctx;
+	struct libusb_shm_ring *rg;
+	int type;
+	int i;
+	int r;
+
+	if (!dev_handle || !ring || !(endpoint & LIBUSB_ENDPOINT_IN)
+			|| slot_size < 0 || slot_size > (1 << 28)
+			|| num_slots < 0 || num_slots > 65536
+			|| num_transfers < 0 || num_transfers > 1024)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ctx = HANDLE_CTX(dev_handle);
+
+	if (!slot_size)
+		slot_size = SHM_RING_DEFAULT_SLOT_SIZE;
+	if (!num_slots)
+		num_slots = SHM_RING_DEFAULT_SLOTS;
+	if (!num_transfers)
+		num_transfers = SHM_RING_DEFAULT_TRANSFERS;
+	if (num_transfers >= num_slots)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	type = usbi_get_endpoint_type(dev_handle->dev, endpoint);
+	if (type < 0)
+		return type;
+	if (type != LIBUSB_TRANSFER_TYPE_BULK
+			&& type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	rg = calloc(1, sizeof(*rg));
+	if (!rg)
+		return LIBUSB_ERROR_NO_MEM;
+	rg->dev_handle = dev_handle;
+	rg->fd = -1;
+	rg->num_transfers = num_transfers;
+	usbi_mutex_init(&rg->lock, NULL);
+
+	rg->transfers = calloc(num_transfers, sizeof(*rg->transfers));
+	if (!rg->transfers) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_free;
+	}
+	for (i = 0; i < num_transfers; i++) {
+		rg->transfers[i] = libusb_alloc_transfer(0);
+		if (!rg->transfers[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto err_free;
+		}
+		if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+			libusb_fill_interrupt_transfer(rg->transfers[i], dev_handle,
+				endpoint, NULL, 0, shm_ring_transfer_cb, rg, 0);
+		else
+			libusb_fill_bulk_transfer(rg->transfers[i], dev_handle,
+				endpoint, NULL, 0, shm_ring_transfer_cb, rg, 0);
+	}
+
+	r = create_ring_file(rg, (uint32_t) slot_size, (uint32_t) num_slots,
+		(uint32_t) num_transfers);
+	if (r < 0) {
+		usbi_err(ctx, "can't create ring, errno=%d", errno);
+		goto err_free;
+	}
+	usbi_dbg_ctx(HANDLE_CTX(dev_handle),
+		"ring on endpoint %02x, %d slots of %d bytes, %d transfers",
+		endpoint, num_slots, slot_size, num_transfers);
+
+	usbi_mutex_lock(&rg->lock);
+	for (i = 0; i < num_transfers; i++) {
+		r = submit_next_slot(rg, rg->transfers[i], (uint64_t) i);
+		if (r < 0) {
+			rg->error = r;
+			rg->stopping = 1;
+			break;
+		}
+		rg->active++;
+	}
+	usbi_mutex_unlock(&rg->lock);
+
+	if (r < 0) {
+		libusb_shm_ring_stop(rg);
+		return r;
+	}
+
+	*ring = rg;
+	return 0;
+
+err_free:
+	free_ring(rg);
+	return r;
+#else
+	(void) dev_handle;
+	(void) endpoint;
+	(void) slot_size;
+	(void) num_slots;
+	(void) num_transfers;
+	(void) ring;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup shmring
+ * Get the file descriptor of a ring's shared memory, to pass to the
+ * processes which read it. The descriptor remains owned by the ring and is
+ * closed by libusb_shm_ring_stop().
+ *
+ * \param ring the ring
+ * \returns the file descriptor
+ */
+int API_EXPORTED libusb_shm_ring_get_fd(struct libusb_shm_ring *ring)
+{
+#if SHM_RING_SUPPORTED
+	return ring->fd;
+#else
+	(void) ring;
+	return -1;
+#endif
+}
+
+#if SHM_RING_SUPPORTED
+/* whether the reader of an entry in use is still there. readers can write
+ * anything into their entry, so the owner takes nothing from it but the
+ * identity of a process, and asks the kernel whether that process still
+ * runs. a bogus entry can at worst be kept or freed wrongly */
+static int consumer_alive(struct shm_ring_consumer *c)
+{
+	uint32_t pid = usbi_atomic_load_acquire(&c->pid);
+	uint64_t start_time = usbi_atomic_load(&c->start_time);
+	uint64_t now;
+
+	/* the reader is still attaching */
+	if (pid == 0)
+		return 1;
+	/* kill() would take it for a process group */
+	if (pid > INT32_MAX)
+		return 0;
+	if (kill((pid_t) pid, 0) != 0 && errno == ESRCH)
+		return 0;
+	/* the pid may belong to another process by now */
+	now = process_start_time((pid_t) pid);
+	return !start_time || !now || now == start_time;
+}
+#endif
+
+/** \ingroup shmring
+ * Get the progress of the readers attached to a ring. Entries left behind
+ * by readers which exited without detaching are freed.
+ *
+ * \param ring the ring
+ * \param consumers output array
+ * \param max_consumers number of entries in the output array
+ * \returns the number of readers attached, which may be more than
+ * max_consumers
+ */
+int API_EXPORTED libusb_shm_ring_get_consumers(struct libusb_shm_ring *ring,
+	struct libusb_shm_ring_consumer *consumers, int max_consumers)
+{
+#if SHM_RING_SUPPORTED
+	uint64_t write_seq = usbi_atomic_load_acquire(&ring->header->write_seq);
+	int count = 0;
+	int i;
+
+	for (i = 0; i < LIBUSB_SHM_RING_MAX_CONSUMERS; i++) {
+		struct shm_ring_consumer *c = &ring->consumers->entries[i];
+		uint32_t in_use = 1;
+		uint64_t read_seq;
+
+		if (!usbi_atomic_load_acquire(&c->in_use))
+			continue;
+		if (!consumer_alive(c)) {
+			/* the next reader of the entry must not be taken for
+			 * this one before it has written its own pid */
+			usbi_atomic_store(&c->pid, 0);
+			usbi_atomic_cas(&c->in_use, &in_use, 0);
+			continue;
+		}
+		if (count < max_consumers) {
+			read_seq = usbi_atomic_load_acquire(&c->read_seq);
+			consumers[count].pid = (int) c->pid;
+			consumers[count].read_seq = read_seq;
+			consumers[count].lag = write_seq > read_seq
+				? write_seq - read_seq : 0;
+			consumers[count].dropped =
+				usbi_atomic_load_acquire(&c->dropped);
+		}
+		count++;
+	}
+	return count;
+#else
+	(void) ring;
+	(void) consumers;
+	(void) max_consumers;
+	return 0;
+#endif
+}
+
+/** \ingroup shmring
+ * Stop a ring and free it. The transfers in flight are cancelled, handling
+ * the events of the device's context until they have been, so no slot is
+ * written after this returns. Readers then see the end of the stream once
+ * they have read the data already published, and their mappings remain
+ * valid until they detach. It must not be called from a transfer callback
+ * of the device's context.
+ *
+ * \param ring the ring
+ * \returns 0 on success
+ * \returns the first error that stopped the ring early
+ */
+int API_EXPORTED libusb_shm_ring_stop(struct libusb_shm_ring *ring)
+{
+#if SHM_RING_SUPPORTED
+	int r;
+
+	usbi_cancel_and_drain(HANDLE_CTX(ring->dev_handle), &ring->lock,
+		&ring->stopping, &ring->active, ring->transfers,
+		ring->num_transfers);
+
+	usbi_atomic_store_release(&ring->header->closed, 1);
+	wake_readers(ring);
+
+	r = ring->error;
+	free_ring(ring);
+	return r;
+#else
+	(void) ring;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup shmring
+ * Attach to a ring started by another process, or by this one. The reader
+ * starts at the most recent data published; earlier data is not read.
+ * The file descriptor is not used after this returns, and may be closed.
+ *
+ * The reader keeps its entry in the ring's consumer table until it is
+ * detached or its process exits, after which the owner frees the entry
+ * the next time it calls libusb_shm_ring_get_consumers().
+ *
+ * \param fd a file descriptor of the ring, see libusb_shm_ring_get_fd()
+ * \param reader output location for the reader
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if fd is not a ring
+ * \returns LIBUSB_ERROR_BUSY if the ring has the maximum number of readers
+ * \returns LIBUSB_ERROR_NO_MEM if the ring could not be mapped
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without stream rings
+ */
+int API_EXPORTED libusb_shm_ring_attach(int fd,
+	struct libusb_shm_ring_reader **reader)
+{
+#if SHM_RING_SUPPORTED
+	struct libusb_shm_ring_reader *rd;
+	const struct shm_ring_header *header;
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	size_t consumers_offset = round_up(sizeof(struct shm_ring_header),
+		page_size);
+	size_t consumers_size = round_up(sizeof(struct shm_ring_consumers),
+		page_size);
+	struct stat st;
+	int i;
+
+	if (fd < 0 || !reader)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (fstat(fd, &st) != 0
+			|| (size_t) st.st_size < consumers_offset + consumers_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	rd = calloc(1, sizeof(*rd));
+	if (!rd)
+		return LIBUSB_ERROR_NO_MEM;
+	rd->map_size = (size_t) st.st_size;
+	rd->map = mmap(NULL, rd->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (rd->map == MAP_FAILED) {
+		free(rd);
+		return errno == ENOMEM ? LIBUSB_ERROR_NO_MEM
+			: LIBUSB_ERROR_INVALID_PARAM;
+	}
+	header = (const struct shm_ring_header *) rd->map;
+	rd->header = header;
+
+	/* the file is sealed against resizing, so once the geometry matches
+	 * its size, every slot lies within the mapping */
+	if (usbi_atomic_load_acquire(&header->magic) != SHM_RING_MAGIC
+			|| header->version != SHM_RING_VERSION
+			|| header->total_size != rd->map_size
+			|| header->consumers_offset != consumers_offset
+			|| header->slots_offset != consumers_offset + consumers_size
+			|| header->num_slots == 0
+			|| header->in_flight >= header->num_slots
+			|| header->slot_stride < header->slot_size
+			|| header->data_offset < header->slots_offset
+				+ (uint64_t) header->num_slots
+				* sizeof(struct shm_ring_slot)
+			|| header->data_offset > rd->map_size
+			|| (rd->map_size - header->data_offset)
+				/ header->num_slots < header->slot_stride) {
+		munmap(rd->map, rd->map_size);
+		free(rd);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	rd->slot_stride = header->slot_stride;
+	rd->num_slots = header->num_slots;
+	rd->available = header->num_slots - header->in_flight;
+	rd->slots = (const struct shm_ring_slot *)
+		(rd->map + header->slots_offset);
+	rd->data = rd->map + header->data_offset;
+
+	rd->consumers_size = consumers_size;
+	rd->consumers = mmap(NULL, consumers_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, (off_t) consumers_offset);
+	if (rd->consumers == MAP_FAILED) {
+		munmap(rd->map, rd->map_size);
+		free(rd);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < LIBUSB_SHM_RING_MAX_CONSUMERS; i++) {
+		uint32_t in_use = 0;
+
+		if (usbi_atomic_cas(&rd->consumers->entries[i].in_use, &in_use,
+				1)) {
+			rd->consumer = &rd->consumers->entries[i];
+			break;
+		}
+	}
+	if (!rd->consumer) {
+		libusb_shm_ring_detach(rd);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	rd->next_seq = usbi_atomic_load_acquire(&header->write_seq);
+	rd->consumer->dropped = 0;
+	usbi_atomic_store(&rd->consumer->read_seq, rd->next_seq);
+	usbi_atomic_store(&rd->consumer->start_time,
+		process_start_time(getpid()));
+	/* the owner takes the entry for a reader once the pid is set */
+	usbi_atomic_store_release(&rd->consumer->pid, (uint32_t) getpid());
+
+	*reader = rd;
+	return 0;
+#else
+	(void) fd;
+	(void) reader;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup shmring
+ * Wait for the next slot of data. The data is read in place in the ring,
+ * and must be handed back with libusb_shm_ring_release() before the next
+ * call.
+ *
+ * \param reader the reader
+ * \param timeout_ms how long to wait for data in milliseconds, or 0 to wait
+ * for ever
+ * \param data output location for the data
+ * \param length output location for the length of the data
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_TIMEOUT if no data arrived in time
+ * \returns LIBUSB_ERROR_NO_DEVICE if the ring was stopped and all the data
+ * it published has been read, or has been overwritten
+ * \returns LIBUSB_ERROR_BUSY if the previous slot has not been released
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without stream rings
+ */
+int API_EXPORTED libusb_shm_ring_read(struct libusb_shm_ring_reader *reader,
+	unsigned int timeout_ms, const unsigned char **data, int *length)
+{
+#if SHM_RING_SUPPORTED
+	const struct shm_ring_header *header = reader->header;
+	uint32_t num_slots = reader->num_slots;
+	uint32_t available = reader->available;
+	struct timespec deadline;
+	struct timespec ts;
+
+	if (reader->holding)
+		return LIBUSB_ERROR_BUSY;
+	if (timeout_ms) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	while (1) {
+		uint64_t next = reader->next_seq;
+		const struct shm_ring_slot *slot = &reader->slots[next % num_slots];
+		uint64_t write_seq;
+		uint32_t futex;
+
+		if (usbi_atomic_load_acquire(&slot->seq) == next + 1) {
+			*data = reader->data + (size_t) (next % num_slots)
+				* reader->slot_stride;
+			*length = (int) slot->length;
+			reader->holding = 1;
+			return 0;
+		}
+
+		write_seq = usbi_atomic_load_acquire(&header->write_seq);
+		if (write_seq > next) {
+			/* the slot has been refilled: skip to the oldest data
+			 * which has not been */
+			uint64_t oldest = write_seq > available
+				? write_seq - available : 0;
+
+			if (oldest <= next)
+				oldest = next + 1;
+			reader->dropped += oldest - next;
+			reader->next_seq = oldest;
+			usbi_atomic_store_release(&reader->consumer->dropped,
+				reader->dropped);
+			usbi_atomic_store_release(&reader->consumer->read_seq,
+				oldest);
+			continue;
+		}
+		if (usbi_atomic_load_acquire(&header->closed))
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		/* sample the futex, then check again for data published in
+		 * between, which FUTEX_WAIT would otherwise miss */
+		futex = usbi_atomic_load_seq_cst(&header->futex);
+		usbi_atomic_add(&reader->consumers->waiters, 1);
+		if (usbi_atomic_load_acquire(&header->write_seq) > next
+				|| usbi_atomic_load_acquire(&header->closed)) {
+			usbi_atomic_add(&reader->consumers->waiters, -1);
+			continue;
+		}
+
+		if (timeout_ms) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec = deadline.tv_sec - ts.tv_sec;
+			ts.tv_nsec = deadline.tv_nsec - ts.tv_nsec;
+			if (ts.tv_nsec < 0) {
+				ts.tv_sec--;
+				ts.tv_nsec += 1000000000L;
+			}
+			if (ts.tv_sec < 0) {
+				usbi_atomic_add(&reader->consumers->waiters,
+					-1);
+				return LIBUSB_ERROR_TIMEOUT;
+			}
+		}
+		futex_wait(&header->futex, futex, timeout_ms ? &ts : NULL);
+		usbi_atomic_add(&reader->consumers->waiters, -1);
+	}
+#else
+	(void) reader;
+	(void) timeout_ms;
+	(void) data;
+	(void) length;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup shmring
+ * Hand back the slot returned by libusb_shm_ring_read(). The owner of the
+ * ring does not wait for readers, so if the reader fell behind, the slot
+ * may have been refilled while the data was being used; this is reported
+ * here, and the data must then be discarded.
+ *
+ * \param reader the reader
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_OVERFLOW if the data was overwritten while it was
+ * being read
+ */
+int API_EXPORTED libusb_shm_ring_release(struct libusb_shm_ring_reader *reader)
+{
+#if SHM_RING_SUPPORTED
+	uint64_t next = reader->next_seq;
+	const struct shm_ring_slot *slot =
+		&reader->slots[next % reader->num_slots];
+	int r = 0;
+
+	if (!reader->holding)
+		return 0;
+	reader->holding = 0;
+
+	/* order the reads of the data before the check of the slot */
+	usbi_atomic_fence_acquire();
+	if (usbi_atomic_load(&slot->seq) != next + 1) {
+		reader->dropped++;
+		usbi_atomic_store_release(&reader->consumer->dropped,
+			reader->dropped);
+		r = LIBUSB_ERROR_OVERFLOW;
+	}
+	reader->next_seq = next + 1;
+	usbi_atomic_store_release(&reader->consumer->read_seq, next + 1);
+	return r;
+#else
+	(void) reader;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup shmring
+ * Get the progress of a reader.
+ *
+ * \param reader the reader
+ * \param info output location for the progress
+ */
+void API_EXPORTED libusb_shm_ring_get_reader_info(
+	struct libusb_shm_ring_reader *reader,
+	struct libusb_shm_ring_consumer *info)
+{
+#if SHM_RING_SUPPORTED
+	uint64_t write_seq =
+		usbi_atomic_load_acquire(&reader->header->write_seq);
+
+	info->pid = (int) reader->consumer->pid;
+	info->read_seq = reader->next_seq;
+	info->lag = write_seq > reader->next_seq
+		? write_seq - reader->next_seq : 0;
+	info->dropped = reader->dropped;
+#else
+	(void) reader;
+	memset(info, 0, sizeof(*info));
+#endif
+}
+
+/** \ingroup shmring
+ * Detach from a ring and free the reader.
+ *
+ * \param reader the reader
+ */
+void API_EXPORTED libusb_shm_ring_detach(struct libusb_shm_ring_reader *reader)
+{
+#if SHM_RING_SUPPORTED
+	if (reader->consumer) {
+		usbi_atomic_store(&reader->consumer->pid, 0);
+		usbi_atomic_store_release(&reader->consumer->in_use, 0);
+	}
+	munmap(reader->consumers, reader->consumers_size);
+	munmap(reader->map, reader->map_size);
+	free(reader);
+#else
+	(void) reader;
+#endif
+}
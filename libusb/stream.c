@@ -0,0 +1,561 @@
+/*
+ * Auto-tuned streaming from IN endpoints for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
+#include "libusbi.h"
+
+/**
+ * @defgroup stream Auto-tuned streams
+ * The best transfer size and number of transfers in flight for streaming
+ * from an endpoint depend on the device, its speed and the kernel. Too few
+ * or too small transfers leave the bus idle between them; too many or too
+ * large ones waste memory and add latency.
+ *
+ * A stream keeps transfers in flight on a bulk or interrupt IN endpoint
+ * and hands each completed one to a callback, while it tunes the queue
+ * depth and transfer size within bounds given by the caller. The starting
+ * point follows from the device speed, the endpoint's maximum packet size
+ * and the largest request the backend submits to the kernel at once (the
+ * URB size on Linux, which transfer sizes are rounded to). From there,
+ * the stream measures the throughput over successive windows of about
+ * 200 ms and doubles the queue depth, then the transfer size, for as long
+ * as each step pays off, backing off the step that did not.
+ *
+ * Once settled, the stream keeps watching the intervals between
+ * completions: an interval much longer than the mean means the queue ran
+ * dry and the bus went idle, and deepens the queue. A lasting drop in
+ * throughput restarts the tuning. Streams whose transfers mostly come back
+ * short are limited by the device rather than the bus, and are not given
+ * larger transfers, which would only add latency.
+ *
+ * The settings chosen and the measurements behind them are reported by
+ * libusb_stream_get_tuning(). Transfer buffers come from
+ * libusb_alloc_buffer(), so those released as the size changes are reused.
+ * As with any asynchronous transfer, the application must handle events
+ * while the stream runs.
+ */
+
+#define STREAM_WINDOW_NS		200000000ULL
+#define STREAM_WINDOW_MIN_COMPLETIONS	8
+#define STREAM_DEFAULT_MIN_DEPTH	2
+#define STREAM_DEFAULT_MAX_DEPTH	64
+#define STREAM_DEFAULT_MAX_SIZE		(4 * 1024 * 1024)
+#define STREAM_INITIAL_DEPTH		4
+/* initial transfer size, in milliseconds of data at the bus rate */
+#define STREAM_INITIAL_MS		1
+/* improvement in throughput needed to keep a step, in percent */
+#define STREAM_GAIN_PERCENT		5
+/* drop in throughput which restarts the tuning, in percent */
+#define STREAM_DROP_PERCENT		30
+/* a completion interval this many times the mean means the queue ran dry */
+#define STREAM_GAP_FACTOR		4
+
+enum stream_phase {
+	TUNE_DEPTH,
+	TUNE_SIZE,
+	TUNE_SETTLED,
+};
+
+struct libusb_stream {
+	libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	int type;
+	libusb_stream_cb cb;
+	void *user_data;
+	struct libusb_stream_bounds bounds;
+	/* transfer sizes are multiples of this */
+	int granule;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+	/* bounds.max_queue_depth entries, allocated as the queue grows */
+	struct libusb_transfer **transfers;
+	unsigned char *busy;
+	int active;
+	int stopping;
+
+	enum stream_phase phase;
+	uint64_t best_rate;
+	int best_size;
+	int best_depth;
+
+	uint64_t window_start_ns;
+	uint64_t window_bytes;
+	uint64_t window_completions;
+	uint64_t window_short;
+	uint64_t last_completion_ns;
+	uint64_t interval_sum_ns;
+	uint64_t interval_max_ns;
+
+	struct libusb_stream_tuning tuning;
+};
+
+/* typical sustained rate of a bus, in bytes per second */
+static uint64_t bus_rate(int speed)
+{
+	switch (speed) {
+	case LIBUSB_SPEED_LOW:
+		return 187500;
+	case LIBUSB_SPEED_FULL:
+		/* 19 64-byte packets per frame */
+		return 19 * 64 * 1000;
+	case LIBUSB_SPEED_SUPER:
+		return 400000000;
+	case LIBUSB_SPEED_HIGH:
+	default:
+		/* 13 512-byte packets per microframe */
+		return 13 * 512 * 8000;
+	}
+}
+
+/* round a transfer size to the granule, within bounds */
+static int clamp_size(struct libusb_stream *stream, uint64_t size)
+{
+	const struct libusb_stream_bounds *b = &stream->bounds;
+
+	size = (size + stream->granule - 1) / stream->granule * stream->granule;
+	while (size > (uint64_t) b->max_transfer_size && size > stream->granule)
+		size -= stream->granule;
+	if (size < (uint64_t) b->min_transfer_size)
+		size = b->min_transfer_size;
+	return (int) size;
+}
+
+static int clamp_depth(struct libusb_stream *stream, int depth)
+{
+	if (depth < stream->bounds.min_queue_depth)
+		return stream->bounds.min_queue_depth;
+	if (depth > stream->bounds.max_queue_depth)
+		return stream->bounds.max_queue_depth;
+	return depth;
+}
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer);
+
+/* called with the lock held. (re)submit the transfer in slot i, giving it a
+ * buffer of the current size */
+static int submit_slot(struct libusb_stream *stream, int i)
+{
+	struct libusb_context *ctx = HANDLE_CTX(stream->dev_handle);
+	struct libusb_transfer *transfer = stream->transfers[i];
+	int size = stream->tuning.transfer_size;
+	int r;
+
+	if (!transfer) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			return LIBUSB_ERROR_NO_MEM;
+		transfer->dev_handle = stream->dev_handle;
+		transfer->endpoint = stream->endpoint;
+		transfer->type = (unsigned char) stream->type;
+		transfer->callback = stream_transfer_cb;
+		transfer->user_data = stream;
+		stream->transfers[i] = transfer;
+	}
+	if (transfer->length != size) {
+		libusb_free_buffer(ctx, transfer->buffer);
+		transfer->length = 0;
+		transfer->buffer = libusb_alloc_buffer(ctx, stream->dev_handle->dev,
+			size, LIBUSB_BUFFER_NUMA_LOCAL);
+		if (!transfer->buffer)
+			return LIBUSB_ERROR_NO_MEM;
+		transfer->length = size;
+	}
+
+	r = libusb_submit_transfer(transfer);
+	if (r == 0 && !stream->busy[i]) {
+		stream->busy[i] = 1;
+		stream->active++;
+	}
+	return r;
+}
+
+static void stream_fail(struct libusb_stream *stream, int error)
+{
+	if (!stream->tuning.error)
+		stream->tuning.error = error;
+	stream->stopping = 1;
+}
+
+/* called with the lock held: bring the number of transfers in flight up to
+ * the queue depth */
+static void fill_queue(struct libusb_stream *stream)
+{
+	int r;
+	int i;
+
+	for (i = 0; i < stream->tuning.queue_depth && !stream->stopping; i++) {
+		if (stream->busy[i])
+			continue;
+		r = submit_slot(stream, i);
+		if (r < 0)
+			stream_fail(stream, r);
+	}
+}
+
+static void set_config(struct libusb_stream *stream, int size, int depth)
+{
+	if (size == stream->tuning.transfer_size
+			&& depth == stream->tuning.queue_depth)
+		return;
+	usbi_dbg_ctx(HANDLE_CTX(stream->dev_handle),
+		"endpoint %02x: %d x %d bytes -> %d x %d bytes",
+		stream->endpoint, stream->tuning.queue_depth,
+		stream->tuning.transfer_size, depth, size);
+	stream->tuning.transfer_size = size;
+	stream->tuning.queue_depth = depth;
+	stream->tuning.adjustments++;
+}
+
+/* move on from a step that did not pay off, starting again from the best
+ * settings seen */
+static void next_phase(struct libusb_stream *stream, int device_limited)
+{
+	int size = stream->best_size;
+	int depth = stream->best_depth;
+
+	if (stream->phase == TUNE_DEPTH && !device_limited) {
+		stream->phase = TUNE_SIZE;
+		size = clamp_size(stream, (uint64_t) size * 2);
+		if (size == stream->best_size)
+			stream->phase = TUNE_SETTLED;
+	} else {
+		stream->phase = TUNE_SETTLED;
+	}
+	set_config(stream, size, depth);
+}
+
+/* called with the lock held at the end of each measurement window */
+static void tune(struct libusb_stream *stream, uint64_t now)
+{
+	struct libusb_stream_tuning *t = &stream->tuning;
+	uint64_t elapsed = now - stream->window_start_ns;
+	uint64_t rate = stream->window_bytes * 1000000000ULL / elapsed;
+	uint64_t mean = 0;
+	int device_limited = stream->window_short * 2
+		> stream->window_completions;
+	int starved;
+	int size;
+	int depth;
+
+	if (stream->window_completions > 1)
+		mean = stream->interval_sum_ns / (stream->window_completions - 1);
+	starved = mean && stream->interval_max_ns > mean * STREAM_GAP_FACTOR;
+
+	t->bytes_per_second = rate;
+	t->mean_interval_ns = mean;
+	t->max_interval_ns = stream->interval_max_ns;
+	t->device_limited = device_limited;
+
+	if (stream->phase != TUNE_SETTLED) {
+		if (rate * 100 > stream->best_rate * (100 + STREAM_GAIN_PERCENT)) {
+			/* the last step paid off: take another */
+			stream->best_rate = rate;
+			stream->best_size = t->transfer_size;
+			stream->best_depth = t->queue_depth;
+			size = t->transfer_size;
+			depth = t->queue_depth;
+			if (stream->phase == TUNE_DEPTH)
+				depth = clamp_depth(stream, depth * 2);
+			else if (!device_limited)
+				size = clamp_size(stream, (uint64_t) size * 2);
+			if (size == t->transfer_size && depth == t->queue_depth)
+				next_phase(stream, device_limited);
+			else
+				set_config(stream, size, depth);
+		} else {
+			next_phase(stream, device_limited);
+		}
+	} else if (starved && t->queue_depth < stream->bounds.max_queue_depth) {
+		/* the queue ran dry, leaving the bus idle */
+		set_config(stream, t->transfer_size,
+			clamp_depth(stream, t->queue_depth * 2));
+		stream->best_depth = t->queue_depth;
+	} else if (!device_limited && rate * 100
+			< stream->best_rate * (100 - STREAM_DROP_PERCENT)) {
+		usbi_dbg_ctx(HANDLE_CTX(stream->dev_handle),
+			"endpoint %02x: throughput dropped, retuning",
+			stream->endpoint);
+		stream->phase = TUNE_DEPTH;
+		stream->best_rate = 0;
+	}
+	t->settled = (stream->phase == TUNE_SETTLED);
+
+	stream->window_start_ns = now;
+	stream->window_bytes = 0;
+	stream->window_completions = 0;
+	stream->window_short = 0;
+	stream->interval_sum_ns = 0;
+	stream->interval_max_ns = 0;
+}
+
+static int slot_of(struct libusb_stream *stream,
+	struct libusb_transfer *transfer)
+{
+	int i;
+
+	for (i = 0; i < stream->bounds.max_queue_depth; i++) {
+		if (stream->transfers[i] == transfer)
+			return i;
+	}
+	return -1;
+}
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_stream *stream = transfer->user_data;
+	uint64_t now = usbi_monotonic_ns();
+	int i;
+	int r;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && !stream->stopping)
+		stream->cb(stream, transfer->buffer, transfer->actual_length,
+			stream->user_data);
+
+	usbi_mutex_lock(&stream->lock);
+	i = slot_of(stream, transfer);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		stream->tuning.bytes += transfer->actual_length;
+		stream->window_bytes += transfer->actual_length;
+		stream->window_completions++;
+		if (transfer->actual_length < transfer->length)
+			stream->window_short++;
+		if (stream->last_completion_ns) {
+			uint64_t interval = now - stream->last_completion_ns;
+
+			stream->interval_sum_ns += interval;
+			if (interval > stream->interval_max_ns)
+				stream->interval_max_ns = interval;
+		}
+		stream->last_completion_ns = now;
+
+		if (now - stream->window_start_ns >= STREAM_WINDOW_NS
+				&& stream->window_completions
+				>= STREAM_WINDOW_MIN_COMPLETIONS)
+			tune(stream, now);
+	} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		usbi_dbg_ctx(TRANSFER_CTX(transfer),
+			"transfer failed with status %d, stopping stream",
+			transfer->status);
+		stream_fail(stream, LIBUSB_ERROR_IO);
+	}
+
+	/* transfers beyond a reduced queue depth are retired */
+	if (!stream->stopping && i < stream->tuning.queue_depth) {
+		r = submit_slot(stream, i);
+		if (r < 0)
+			stream_fail(stream, r);
+		else
+			fill_queue(stream);
+		if (r == 0)
+			goto out;
+	}
+	stream->busy[i] = 0;
+	stream->active--;
+out:
+	usbi_mutex_unlock(&stream->lock);
+}
+
+static void free_stream(struct libusb_stream *stream)
+{
+	struct libusb_context *ctx = HANDLE_CTX(stream->dev_handle);
+	int i;
+
+	if (stream->transfers) {
+		for (i = 0; i < stream->bounds.max_queue_depth; i++) {
+			if (!stream->transfers[i])
+				continue;
+			libusb_free_buffer(ctx, stream->transfers[i]->buffer);
+			libusb_free_transfer(stream->transfers[i]);
+		}
+		free(stream->transfers);
+	}
+	free(stream->busy);
+	usbi_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/** \ingroup stream
+ * Start an auto-tuned stream from a bulk or interrupt IN endpoint.
+ *
+ * \param dev_handle a handle for the device, with the interface of the
+ * endpoint claimed
+ * \param endpoint the address of the endpoint
+ * \param bounds the range of transfer sizes and queue depths to tune
+ * within, or NULL for the defaults. Zero fields also take the defaults: a
+ * transfer size between the maximum packet size and 4 MiB, and between 2
+ * and 64 transfers in flight.
+ * \param cb the function called with the data of each completed transfer,
+ * from the thread handling events. The data is only valid during the call.
+ * \param user_data passed to the callback
+ * \param stream output location for the stream
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not a bulk or
+ * interrupt IN endpoint, or the bounds are inconsistent
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if the transfers could not be submitted
+ */
+int API_EXPORTED libusb_stream_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, const struct libusb_stream_bounds *bounds,
+	libusb_stream_cb cb, void *user_data, struct libusb_stream **stream)
+{
+	struct libusb_stream *s;
+	struct libusb_stream_bounds *b;
+	int max_packet;
+	int type;
+	int r;
+
+	if (!dev_handle || !cb || !stream || !(endpoint & LIBUSB_ENDPOINT_IN))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	type = usbi_get_endpoint_type(dev_handle->dev, endpoint);
+	if (type < 0)
+		return type;
+	if (type != LIBUSB_TRANSFER_TYPE_BULK
+			&& type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	max_packet = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+	if (max_packet <= 0)
+		return max_packet < 0 ? max_packet : LIBUSB_ERROR_OTHER;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return LIBUSB_ERROR_NO_MEM;
+	s->dev_handle = dev_handle;
+	s->endpoint = endpoint;
+	s->type = type;
+	s->cb = cb;
+	s->user_data = user_data;
+	usbi_mutex_init(&s->lock, NULL);
+
+	b = &s->bounds;
+	if (bounds)
+		*b = *bounds;
+	if (!b->min_transfer_size)
+		b->min_transfer_size = max_packet;
+	if (!b->max_transfer_size)
+		b->max_transfer_size = STREAM_DEFAULT_MAX_SIZE;
+	if (!b->min_queue_depth)
+		b->min_queue_depth = STREAM_DEFAULT_MIN_DEPTH;
+	if (!b->max_queue_depth)
+		b->max_queue_depth = STREAM_DEFAULT_MAX_DEPTH;
+	if (b->min_transfer_size < 0 || b->max_transfer_size < b->min_transfer_size
+			|| b->min_queue_depth < 1
+			|| b->max_queue_depth < b->min_queue_depth
+			|| b->max_queue_depth > 1024) {
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto err_free;
+	}
+
+	/* whole packets, so that IN transfers cannot overflow, whole bursts on
+	 * SuperSpeed, and whole backend requests once transfers are large
+	 * enough to be split */
+	s->tuning.speed = libusb_get_device_speed(dev_handle->dev);
+	s->tuning.max_packet_size = max_packet;
+	s->tuning.urb_size = (int) usbi_backend->max_bulk_urb_size;
+	s->granule = libusb_get_endpoint_granularity(dev_handle->dev, endpoint);
+	if (s->granule <= 0)
+		s->granule = max_packet;
+	if (s->tuning.urb_size && s->tuning.urb_size % s->granule == 0
+			&& bus_rate(s->tuning.speed) / 1000 * STREAM_INITIAL_MS
+			>= (uint64_t) s->tuning.urb_size)
+		s->granule = s->tuning.urb_size;
+	s->tuning.transfer_size = clamp_size(s,
+		bus_rate(s->tuning.speed) / 1000 * STREAM_INITIAL_MS);
+	s->tuning.queue_depth = clamp_depth(s, STREAM_INITIAL_DEPTH);
+	s->best_size = s->tuning.transfer_size;
+	s->best_depth = s->tuning.queue_depth;
+	s->phase = TUNE_DEPTH;
+
+	s->transfers = calloc(b->max_queue_depth, sizeof(*s->transfers));
+	s->busy = calloc(b->max_queue_depth, 1);
+	if (!s->transfers || !s->busy) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_free;
+	}
+
+	usbi_dbg_ctx(HANDLE_CTX(dev_handle),
+		"stream on endpoint %02x, speed %d, max packet %d, urb %d: "
+		"%d x %d bytes", endpoint, s->tuning.speed, max_packet,
+		s->tuning.urb_size, s->tuning.queue_depth, s->tuning.transfer_size);
+
+	usbi_mutex_lock(&s->lock);
+	s->window_start_ns = usbi_monotonic_ns();
+	fill_queue(s);
+	r = s->tuning.error;
+	usbi_mutex_unlock(&s->lock);
+
+	if (r < 0) {
+		libusb_stream_stop(s);
+		return r;
+	}
+
+	*stream = s;
+	return 0;
+
+err_free:
+	free_stream(s);
+	return r;
+}
+
+/** \ingroup stream
+ * Get the settings a stream has chosen, and the measurements of the last
+ * window that led to them.
+ *
+ * \param stream the stream
+ * \param tuning output location for the settings
+ */
+void API_EXPORTED libusb_stream_get_tuning(struct libusb_stream *stream,
+	struct libusb_stream_tuning *tuning)
+{
+	usbi_mutex_lock(&stream->lock);
+	*tuning = stream->tuning;
+	usbi_mutex_unlock(&stream->lock);
+}
+
+/** \ingroup stream
+ * Stop a stream and free it. The transfers in flight are cancelled, handling
+ * the events of the device's context until they have been, and data they
+ * complete with meanwhile is discarded rather than passed to the callback.
+ * It must not be called from the stream's callback, nor from any other
+ * transfer callback of that context.
+ *
+ * \param stream the stream
+ * \returns 0 on success
+ * \returns the first error that stopped the stream early
+ */
+int API_EXPORTED libusb_stream_stop(struct libusb_stream *stream)
+{
+	int r;
+
+	/* transfers parked by the tuner are not in flight, and cancelling
+	 * them fails harmlessly */
+	usbi_cancel_and_drain(HANDLE_CTX(stream->dev_handle), &stream->lock,
+		&stream->stopping, &stream->active, stream->transfers,
+		stream->bounds.max_queue_depth);
+
+	r = stream->tuning.error;
+	free_stream(stream);
+	return r;
+}
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
 #include "libusbi.h"
 
 /**
@@ -37,7 +38,8 @@ static void LIBUSB_CALL ctrl_transfer_cb(struct libusb_transfer *transfer)
 {
 	int *completed = transfer->user_data;
 	*completed = 1;
-	usbi_dbg("actual_length=%d", transfer->actual_length);
+	usbi_dbg_ctx(TRANSFER_CTX(transfer), "actual_length=%d",
+		transfer->actual_length);
 	/* caller interprets result and frees transfer */
 }
 
@@ -153,7 +155,8 @@ static void LIBUSB_CALL bulk_transfer_cb(struct libusb_transfer *transfer)
 {
 	int *completed = transfer->user_data;
 	*completed = 1;
-	usbi_dbg("actual_length=%d", transfer->actual_length);
+	usbi_dbg_ctx(TRANSFER_CTX(transfer), "actual_length=%d",
+		transfer->actual_length);
 	/* caller interprets results and frees transfer */
 }
 
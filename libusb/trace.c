@@ -0,0 +1,327 @@
+/*
+ * Binary transfer tracing for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USBI_LOG_CATEGORY LIBUSB_LOG_CATEGORY_IO
+#include "libusbi.h"
+
+/**
+ * @defgroup trace Transfer tracing
+ * libusbx can record a compact binary trace of transfer activity: transfer
+ * submission, each URB (or OS-level request) submitted and reaped by the
+ * backend, completion, cancellation and timeout. Each event is timestamped
+ * with the monotonic clock and carries the transfer, endpoint, length and
+ * status.
+ *
+ * Events are written into per-thread ring buffers without taking any lock,
+ * so tracing is cheap enough to leave enabled in production; when rings
+ * wrap, the oldest events are overwritten. The ring of a thread that exits
+ * is kept, so that its events can still be dumped, until another thread
+ * takes it over. libusb_trace_dump() merges the
+ * rings of all threads into a file made up of a struct libusb_trace_header
+ * followed by struct libusb_trace_event records in timestamp order, in host
+ * byte order.
+ *
+ * Tracing is process-wide: it covers all contexts.
+ */
+
+#if defined(_MSC_VER)
+#define TRACE_TLS	__declspec(thread)
+#else
+#define TRACE_TLS	__thread
+#endif
+
+#if defined(THREADS_POSIX)
+#include <pthread.h>
+#elif defined(OS_WINDOWS) || defined(OS_WINCE)
+/* without thread-specific data destructors, a ring holds a handle of its
+ * thread instead, through which trace_get_ring() notices that it exited */
+#define TRACE_THREAD_HANDLES
+#endif
+
+#define TRACE_MIN_RING_ENTRIES	64
+
+/* a ring slot, guarded by a sequence lock: while event number n is being
+ * written to it, seq is 2n + 1, and once it is complete, 2n + 2. a reader
+ * that sees the same even value before and after copying the event got an
+ * intact copy of the event that value stands for */
+struct trace_slot {
+	volatile uint64_t seq;
+	struct libusb_trace_event event;
+};
+
+/* the ring head and slot sequence numbers are written by the owner thread
+ * only, and read by libusb_trace_dump() */
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t tid;
+	/* whether a live thread records into the ring. protected by
+	 * trace_lock */
+	int in_use;
+#if defined(TRACE_THREAD_HANDLES)
+	/* the thread recording into the ring, or NULL if its handle could not
+	 * be obtained, in which case the ring is never reused */
+	HANDLE thread;
+#endif
+	/* total number of events written; the ring holds the last
+	 * trace_ring_entries of them */
+	volatile uint64_t head;
+	struct trace_slot slots[0];
+};
+
+volatile int usbi_trace_enabled = 0;
+
+/* protects the list of rings and the ring size */
+static usbi_mutex_static_t trace_lock = USBI_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings = NULL;
+/* power of two. fixed once the first ring has been allocated */
+static unsigned int trace_ring_entries = 0;
+
+static TRACE_TLS struct trace_ring *thread_ring = NULL;
+
+#if defined(THREADS_POSIX)
+/* hands the ring of an exiting thread back for reuse */
+static pthread_key_t trace_ring_key;
+static int trace_ring_key_valid = 0;
+
+static void trace_release_ring(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	usbi_mutex_static_lock(&trace_lock);
+	ring->in_use = 0;
+	usbi_mutex_static_unlock(&trace_lock);
+}
+#endif
+
+/* take over the ring of a thread that has exited, or allocate a new one.
+ * the events of the previous owner stay in a reused ring until they are
+ * overwritten */
+static struct trace_ring *trace_get_ring(void)
+{
+	struct trace_ring *ring;
+
+	usbi_mutex_static_lock(&trace_lock);
+	for (ring = trace_rings; ring; ring = ring->next) {
+#if defined(TRACE_THREAD_HANDLES)
+		if (ring->in_use && ring->thread && WaitForSingleObject(
+				ring->thread, 0) == WAIT_OBJECT_0) {
+			CloseHandle(ring->thread);
+			ring->thread = NULL;
+			ring->in_use = 0;
+		}
+#endif
+		if (!ring->in_use)
+			break;
+	}
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring)
+			+ trace_ring_entries * sizeof(struct trace_slot));
+		if (ring) {
+			ring->next = trace_rings;
+			trace_rings = ring;
+		}
+	}
+	if (ring) {
+		ring->tid = (uint32_t) usbi_get_tid();
+		ring->in_use = 1;
+#if defined(TRACE_THREAD_HANDLES)
+		if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+				GetCurrentProcess(), &ring->thread, SYNCHRONIZE,
+				FALSE, 0))
+			ring->thread = NULL;
+#endif
+	}
+#if defined(THREADS_POSIX)
+	if (!trace_ring_key_valid)
+		trace_ring_key_valid = pthread_key_create(&trace_ring_key,
+			trace_release_ring) == 0;
+	if (ring && trace_ring_key_valid)
+		pthread_setspecific(trace_ring_key, ring);
+#endif
+	usbi_mutex_static_unlock(&trace_lock);
+
+	thread_ring = ring;
+	return ring;
+}
+
+void usbi_trace_event(enum libusb_trace_event_type type,
+	struct usbi_transfer *itransfer, uint32_t length, int32_t status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct trace_ring *ring = thread_ring;
+	struct trace_slot *slot;
+	struct libusb_trace_event *event;
+	struct timespec ts;
+	uint64_t head;
+
+	if (!ring) {
+		ring = trace_get_ring();
+		if (!ring)
+			return;
+	}
+
+	usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts);
+
+	head = ring->head;
+	slot = &ring->slots[head & (trace_ring_entries - 1)];
+	event = &slot->event;
+	usbi_atomic_store(&slot->seq, 2 * head + 1);
+	usbi_atomic_fence_release();
+	event->timestamp = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	event->transfer = (uint64_t) (uintptr_t) transfer;
+	event->thread = ring->tid;
+	event->length = length;
+	event->status = status;
+	event->type = (uint8_t) type;
+	event->endpoint = transfer->endpoint;
+	event->transfer_type = transfer->type;
+	event->reserved = 0;
+	usbi_atomic_store_release(&slot->seq, 2 * head + 2);
+	usbi_atomic_store_release(&ring->head, head + 1);
+}
+
+/** \ingroup trace
+ * Enable or disable transfer tracing.
+ *
+ * The size of the per-thread rings is fixed by the first call that enables
+ * tracing; later calls only re-enable recording. Disabling tracing keeps the
+ * recorded events, so they can still be dumped.
+ *
+ * \param ring_entries number of events each thread's ring holds (rounded
+ * up to a power of two), or 0 to disable tracing
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if ring_entries is negative or too
+ * large
+ */
+int API_EXPORTED libusb_trace_enable(int ring_entries)
+{
+	unsigned int entries = TRACE_MIN_RING_ENTRIES;
+
+	if (ring_entries < 0 || ring_entries > (1 << 24))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (ring_entries == 0) {
+		usbi_trace_enabled = 0;
+		return 0;
+	}
+
+	while (entries < (unsigned int) ring_entries)
+		entries <<= 1;
+
+	usbi_mutex_static_lock(&trace_lock);
+	if (!trace_rings)
+		trace_ring_entries = entries;
+	usbi_mutex_static_unlock(&trace_lock);
+
+	usbi_trace_enabled = 1;
+	return 0;
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct libusb_trace_event *ea = a;
+	const struct libusb_trace_event *eb = b;
+
+	if (ea->timestamp != eb->timestamp)
+		return ea->timestamp < eb->timestamp ? -1 : 1;
+	return 0;
+}
+
+/** \ingroup trace
+ * Write the events currently held in the trace rings to a file.
+ *
+ * This may be called while tracing is active. Events that are overwritten
+ * while the rings are being copied are left out.
+ *
+ * \param path the file to write, which is replaced if it exists
+ * \returns the number of events written
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_IO if the file could not be written
+ */
+int API_EXPORTED libusb_trace_dump(const char *path)
+{
+	struct libusb_trace_header header;
+	struct libusb_trace_event *events;
+	struct trace_ring *ring;
+	size_t num_events = 0;
+	size_t max_events = 0;
+	FILE *f;
+	int r = 0;
+
+	usbi_mutex_static_lock(&trace_lock);
+	for (ring = trace_rings; ring; ring = ring->next)
+		max_events += trace_ring_entries;
+
+	events = malloc(max_events ? max_events * sizeof(*events) : 1);
+	if (!events) {
+		usbi_mutex_static_unlock(&trace_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (ring = trace_rings; ring; ring = ring->next) {
+		uint64_t head = usbi_atomic_load_acquire(&ring->head);
+		uint64_t first = head > trace_ring_entries ?
+			head - trace_ring_entries : 0;
+		uint64_t i;
+
+		for (i = first; i < head; i++) {
+			struct trace_slot *slot =
+				&ring->slots[i & (trace_ring_entries - 1)];
+			uint64_t seq = usbi_atomic_load_acquire(&slot->seq);
+
+			/* skip events being written or already overwritten */
+			if (seq != 2 * i + 2)
+				continue;
+			events[num_events] = slot->event;
+			usbi_atomic_fence_acquire();
+			if (usbi_atomic_load(&slot->seq) == seq)
+				num_events++;
+		}
+	}
+	usbi_mutex_static_unlock(&trace_lock);
+
+	qsort(events, num_events, sizeof(*events), compare_events);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LIBUSB_TRACE_MAGIC, sizeof(header.magic));
+	header.version = LIBUSB_TRACE_VERSION;
+	header.event_size = sizeof(struct libusb_trace_event);
+	header.num_events = num_events;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		free(events);
+		return LIBUSB_ERROR_IO;
+	}
+	if (fwrite(&header, sizeof(header), 1, f) != 1
+			|| (num_events && fwrite(events, sizeof(*events), num_events, f)
+				!= num_events))
+		r = LIBUSB_ERROR_IO;
+	if (fclose(f) != 0)
+		r = LIBUSB_ERROR_IO;
+	free(events);
+
+	return r < 0 ? r : (int) num_events;
+}
@@ -115,6 +115,42 @@ SOURCE=..\libusb\sync.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\libusb\stream.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\sched.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\buffer.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\shmring.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\playback.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\record.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\log.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\capture.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\trace.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\libusb\os\threads_windows.c
 # End Source File
 # Begin Source File